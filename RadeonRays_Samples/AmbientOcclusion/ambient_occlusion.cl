@@ -37,19 +37,19 @@ void GenerateCameraRays(
     // Get hold of the pixel
     const int gid = get_global_id(0);
     
-    float2 pixelPos = (float2)(gid % output_width, gid / output_width);
+    float2 pixelPos = make_float2(gid % output_width, gid / output_width);
 
     // Convert to world space position
     float2 ndc = 2.0f * (pixelPos + 0.5f) * camera_params->screen_dims.zw - 1.0f;
 
-    float4 homogeneous = matrix_mul_vector4(camera_params->view_proj_inv, (float4)(ndc * (float2)(1.0f, -1.0f), 0.0f, 1.0f));
+    float4 homogeneous = matrix_mul_vector4(camera_params->view_proj_inv, make_float4(ndc.x, -ndc.y, 0.0f, 1.0f));
     homogeneous.xyz /= homogeneous.w; // projection divide
     
 
     // Create the camera ray
     Ray ray;
 
-    ray.d = (float4)(normalize(homogeneous.xyz - camera_params->eye.xyz), 0.0f);
+    ray.d = make_float4_from_float3(normalize(homogeneous.xyz - camera_params->eye.xyz), 0.0f);
     ray.o = camera_params->eye;
     ray.o.w = 100000.f;
     ray.extra.x = 0xffffffff;
@@ -89,7 +89,7 @@ void ShadePrimaryRays(
         // Miss
         if (hit.shapeid == INVALID_IDX)
         {
-            output[pixel_id] = (float4)(0.0f, 0.0f, 0.0f, 1.0f);
+            output[pixel_id] = make_float4(0.0f, 0.0f, 0.0f, 1.0f);
             return;
         }
 
@@ -103,14 +103,14 @@ void ShadePrimaryRays(
         float3 normal = (1.0f - hit.uvwt.x - hit.uvwt.y) * v0.normal + hit.uvwt.x * v1.normal + hit.uvwt.y * v2.normal;
 
         // Write color to output buffer
-        color_buffer[pixel_id] = (float4)(color, 1.0f);
+        color_buffer[pixel_id] = make_float4_from_float3(color, 1.0f);
 
         Sampler sampler;
         Sampler_Init(&sampler, gid + frame_no);
 
         //Get location index
         int ray_idx = atomic_add(ao_rays_counter, ao_rays_per_frame);
-        if (ray_idx + ao_rays_per_frame < *max_output_rays)
+        if (ray_idx + ao_rays_per_frame <= (int)*max_output_rays)
         {
             for (int a = 0; a < ao_rays_per_frame; ++a)
             {
@@ -118,8 +118,8 @@ void ShadePrimaryRays(
                 float3 dir = Sample_MapToHemisphere(sample, normal, 0.f);
 
                 Ray ray;
-                ray.o = (float4)(pos + normal * 0.001f, 100.f);
-                ray.d = (float4)(dir, 0.f);
+                ray.o = make_float4_from_float3(pos + normal * 0.001f, 100.f);
+                ray.d = make_float4_from_float3(dir, 0.f);
                 ray.extra.x = 0xffffffff;
                 ray.extra.y = 0xffffffff;
                 ray.padding.x = pixel_id;
@@ -129,33 +129,36 @@ void ShadePrimaryRays(
     }
 }
 
+// One work item per hit: ShadePrimaryRays writes the rays of a hit as one
+// run of ao_rays_per_frame rays, the work item reduces the run and adds it to
+// the pixel once. No two work items touch the same pixel and the sum does not
+// depend on the order work items run in, so no atomics are needed.
 KERNEL
 void ProcessAO(
     GLOBAL Ray* restrict input_rays,
     GLOBAL int const* restrict hit_results,
     int intersection_count,
+    int ao_rays_per_frame,
     GLOBAL float4* restrict color_buffer,
     GLOBAL float4* restrict output
 )
 {
-    // Get hold of the pixel
+    // Get hold of the run
     const int gid = get_global_id(0);
-    const int pixel_id = input_rays[gid].padding.x;
+    const int first = gid * ao_rays_per_frame;
 
-    const int hit = hit_results[gid];
-    if (gid < intersection_count)
+    if (first < intersection_count)
     {
-        // Miss
-        if (hit == -1)
-        {
-            output[pixel_id] += color_buffer[pixel_id];
-            return;
-        }
-        else
-        {
-            output[pixel_id] += (float4)(0.0f, 0.0f, 0.0f, 1.0f);
-            return;
-        }
+        const int pixel_id = input_rays[first].padding.x;
+
+        // Misses add the color, hits (0, 0, 0, 1). The color has w = 1, so
+        // the run adds misses times the color and one w per ray.
+        int misses = 0;
+        for (int a = 0; a < ao_rays_per_frame; ++a)
+            misses += hit_results[first + a] == MISS_MARKER ? 1 : 0;
+
+        const float4 color = color_buffer[pixel_id];
+        output[pixel_id] += make_float4(color.x * misses, color.y * misses, color.z * misses, (float)ao_rays_per_frame);
     }
 }
 
@@ -3,15 +3,23 @@
 #include "math/matrix.h"
 #include "math/mathutils.h"
 #include "utils.h"
+#include "backend.h"
 #include "tiny_obj_loader.h"
 #include "scene.h"
 #include "radeon_rays_cl.h"
+#include "cpu_ao_kernels.h"
+#include "cpu_hybrid_split.h"
+#include "cpu_intersector.h"
+#include "cpu_parallel.h"
 
 #include "CLWProgram.h"
 
 #include "OpenImageIO/imageio.h"
 
 #include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
 
 using namespace RadeonRays;
 using namespace tinyobj;
@@ -31,6 +39,26 @@ void GenCameraRays(CLWContext context, CLWProgram program, CLWBuffer<Params> cam
     context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, genkernel);
 }
 
+// Buffers of one frame in flight. The device runs frames in order on its one
+// queue, but the host queues the next frames up to their shading before it
+// waits for the AO ray count of the oldest one, so the device always has work
+// queued behind that read. Only the opencl backend gains from this, see
+// RayTracer::IsQueued; host tracers wait for that queued work before they
+// trace, so they run one frame at a time.
+struct FrameSlot
+{
+    CLWBuffer<ray>          primary_rays;
+    CLWBuffer<Intersection> primary_hits;
+    CLWBuffer<ray>          ao_rays;
+    CLWBuffer<int>          ao_hits;
+    CLWBuffer<uint32_t>     ao_rays_counter;
+    CLWBuffer<float4>       color;
+    int                     primary_ray_count;
+    uint32_t                ao_rays_count;
+    // Read of ao_rays_counter into ao_rays_count, queued after ShadePrimaryRays
+    CLWEvent                count_read;
+};
+
 void SaveImage(const std::string &fname, float *data, int w, int h)
 {
     OIIO_NAMESPACE_USING;
@@ -54,32 +82,77 @@ int main(int argc, char* argv[])
 {
     try
     {
-        if (argc != 2)
+        // -hybrid traces part of every frame on the CPU, see Cpu::HybridSplit.
+        // -inflight sets how many frames are queued at once, see FrameSlot.
+        // Each one has its own ray and hit buffers, so it is off by default.
+        // -platform and -device pick the OpenCL device, a CPU runtime works
+        // in place of a GPU.
+        bool hybrid = false;
+        int frames_in_flight = 1;
+        BackendOptions backend_options;
+        backend_options.platform_index = 1;
+        bool valid_args = argc >= 2;
+        for (int a = 2; a < argc && valid_args; ++a)
+        {
+            if (strcmp(argv[a], "-hybrid") == 0)
+                hybrid = true;
+            else if (strcmp(argv[a], "-inflight") == 0 && a + 1 < argc)
+                frames_in_flight = atoi(argv[++a]);
+            else
+                valid_args = ParseBackendOption(argc, argv, a, backend_options);
+        }
+        if (!valid_args || atoi(argv[1]) < 1 || frames_in_flight < 1 || frames_in_flight > 3)
         {
-            std::cerr << "Usage: " << argv[0] << " <rays_per_frame_per_hit>" << std::endl;
+            std::cerr << "Usage: " << argv[0] << " <rays_per_frame_per_hit> [-hybrid] [-inflight 1|2|3] "
+                << GetBackendUsage() << std::endl;
             return -1;
         }
+        // The split is balanced on the device time of every frame, which
+        // needs the frames one at a time
+        if (hybrid)
+            frames_in_flight = 1;
 
-        CLWContext context = InitCLW(1, 0);
+        CLWContext context = InitCLW(backend_options.platform_index, backend_options.device_index);
         std::cout << "CLW done" << std::endl;
 
-        IntersectionApi* intersection_api = InitIntersectorApi(context);
 
         Scene scene;
         scene.loadFile("../../Resources/Sponza/sponza.obj");
         //scene.loadFile("../../Resources/orig.obj");
 
-        UploadSceneToIntersector(scene, intersection_api);
         CLWBuffer<::Shape> shapes_buffer;
         CLWBuffer<Vertex> vertex_buffer;
         CLWBuffer<uint32_t> index_buffer;
         BuildSceneBuffers(context, scene, shapes_buffer, vertex_buffer, index_buffer);
 
-        intersection_api->Commit();
+        std::unique_ptr<RayTracer> tracer = CreateRayTracer(backend_options, context, scene);
+        if (!tracer)
+            return -1;
+        if (frames_in_flight > 1 && !tracer->IsQueued())
+        {
+            std::cout << "-inflight needs the opencl backend, " << GetBackendName(backend_options.backend)
+                << " runs one frame at a time" << std::endl;
+            frames_in_flight = 1;
+        }
 
         int ao_rays_per_frame_per_hit = atoi(argv[1]);
         int w = 1920;
         int h = 1080;
+
+        // The CPU side runs the same kernels, built as C++, on the pool
+        // threads while the main thread drives the device
+        Cpu::Intersector cpu_intersector;
+        std::unique_ptr<Cpu::AoKernelRenderer> cpu_renderer;
+        Cpu::AoKernelTimes cpu_times;
+        if (hybrid)
+        {
+            cpu_intersector.AttachScene(scene);
+            cpu_intersector.Commit(Cpu::BvhBuildOptions());
+            cpu_renderer.reset(new Cpu::AoKernelRenderer(scene, Cpu::GetSponzaCamera(), w, h, ao_rays_per_frame_per_hit));
+        }
+        Cpu::HybridSplit split(h, hybrid ? 0.5f : 1.f, hybrid ? 8 : 0);
+        double device_total_ms = 0.0;
+        double cpu_total_ms = 0.0;
         int ao_rays_per_frame = w * h * ao_rays_per_frame_per_hit;
         int initial_rays_count = w * h; // 1 ray per pixel
 
@@ -97,91 +170,155 @@ int main(int argc, char* argv[])
         std::string options("-cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I .");
         CLWProgram program = CLWProgram::CreateFromFile("ambient_occlusion.cl", options.c_str(), context);
 
-        CLWBuffer<ray> primary_rays_buffer = context.CreateBuffer<ray>(initial_rays_count, CL_MEM_READ_WRITE);
-        CLWBuffer<Intersection> primary_intersection_buffer = context.CreateBuffer<Intersection>(initial_rays_count, CL_MEM_READ_WRITE);
-
-        CLWBuffer<ray> ao_rays_buffer = context.CreateBuffer<ray>(ao_rays_per_frame, CL_MEM_READ_WRITE);
-        CLWBuffer<int> ao_hit_result = context.CreateBuffer<int>(ao_rays_per_frame, CL_MEM_READ_WRITE);
-        CLWBuffer<Intersection> ao_intersection_buffer = context.CreateBuffer<Intersection>(ao_rays_per_frame, CL_MEM_READ_WRITE);
+        std::vector<FrameSlot> slots(frames_in_flight);
+        for (FrameSlot &slot : slots)
+        {
+            slot.primary_rays = context.CreateBuffer<ray>(initial_rays_count, CL_MEM_READ_WRITE);
+            slot.primary_hits = context.CreateBuffer<Intersection>(initial_rays_count, CL_MEM_READ_WRITE);
+            slot.ao_rays = context.CreateBuffer<ray>(ao_rays_per_frame, CL_MEM_READ_WRITE);
+            slot.ao_hits = context.CreateBuffer<int>(ao_rays_per_frame, CL_MEM_READ_WRITE);
+            slot.ao_rays_counter = context.CreateBuffer<uint32_t>(1, CL_MEM_READ_WRITE);
+            slot.color = context.CreateBuffer<float4>(w*h, CL_MEM_READ_WRITE);
+            slot.primary_ray_count = 0;
+            slot.ao_rays_count = 0;
+        }
         CLWBuffer<uint32_t> max_ao_rays = context.CreateBuffer<uint32_t>(1, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &ao_rays_per_frame);
-        CLWBuffer<uint32_t> ao_rays_counter = context.CreateBuffer<uint32_t>(1, CL_MEM_READ_WRITE);
 
         CLWBuffer<float4> output_buffer = context.CreateBuffer<float4>(w*h, CL_MEM_READ_WRITE);
 
         CLWBuffer<Params> camera_params_buffer = context.CreateBuffer<Params>(1, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &camera_params);
 
-        CLWBuffer<float4> color_buffer = context.CreateBuffer<float4>(w*h, CL_MEM_READ_WRITE);
-
         //Clear output buffer
         context.FillBuffer<float4>(0, output_buffer, float4(), output_buffer.GetElementCount());
 
 
-        Buffer *ray_buffer = CreateFromOpenClBuffer(intersection_api, primary_rays_buffer);
-        Buffer *isect_buffer = CreateFromOpenClBuffer(intersection_api, primary_intersection_buffer);
-        Buffer *ao_ray_buffer = CreateFromOpenClBuffer(intersection_api, ao_rays_buffer);
-        Buffer *ao_isect_buffer = CreateFromOpenClBuffer(intersection_api, ao_intersection_buffer);
-        Buffer *ao_hit_result_buffer = CreateFromOpenClBuffer(intersection_api, ao_hit_result);
 
         int frame_count = 100;
         std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
         start = std::chrono::high_resolution_clock::now();
 
-        for (int a = 0; a < frame_count; ++a)
+        // Iteration a queues frame a up to its shading and then traces and
+        // accumulates frame a - frames_in_flight + 1
+        for (int a = 0; a < frame_count + frames_in_flight - 1; ++a)
         {
-            context.FillBuffer<uint32_t>(0, ao_rays_counter, 0, 1);
+            const int device_rows = split.GetDeviceRows();
+            const int device_rays = device_rows * w;
 
-            //Gen camera rays
-            GenCameraRays(context, program, camera_params_buffer, primary_rays_buffer, w, h);
-
-            //Run intersector
-            intersection_api->QueryIntersection(ray_buffer, initial_rays_count, isect_buffer, nullptr, nullptr);
+            double cpu_ms = 0.0;
+            Cpu::TaskGroup cpu_group;
+            if (a < frame_count && split.GetCpuRows() > 0)
+            {
+                cpu_group.Run([&]()
+                {
+                    auto cpu_start = std::chrono::high_resolution_clock::now();
+                    cpu_renderer->RenderRows(cpu_intersector, a, device_rows, split.GetCpuRows(), cpu_times);
+                    cpu_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - cpu_start).count();
+                });
+            }
 
+            auto device_start = std::chrono::high_resolution_clock::now();
+            if (a < frame_count)
             {
-                //Shade and generate new rays
-                CLWKernel kernel = program.GetKernel("ShadePrimaryRays");
-                int argid = 0;
-                kernel.SetArg(argid++, shapes_buffer);
-                kernel.SetArg(argid++, vertex_buffer);
-                kernel.SetArg(argid++, index_buffer);
-                kernel.SetArg(argid++, ao_rays_buffer);
-                kernel.SetArg(argid++, primary_rays_buffer);
-                kernel.SetArg(argid++, primary_intersection_buffer);
-                kernel.SetArg(argid++, (cl_int)primary_intersection_buffer.GetElementCount());
-                kernel.SetArg(argid++, output_buffer);
-                kernel.SetArg(argid++, color_buffer);
-                kernel.SetArg(argid++, ao_rays_counter);
-                kernel.SetArg(argid++, max_ao_rays);
-                kernel.SetArg(argid++, ao_rays_per_frame_per_hit);
-                kernel.SetArg(argid++, a);
-
-                int globalsize = primary_rays_buffer.GetElementCount();
-                context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+                FrameSlot &slot = slots[a % frames_in_flight];
+                slot.primary_ray_count = device_rays;
+                if (device_rays > 0)
+                {
+                    context.FillBuffer<uint32_t>(0, slot.ao_rays_counter, 0, 1);
+
+                    //Gen camera rays, for the device rows only
+                    GenCameraRays(context, program, camera_params_buffer, slot.primary_rays, w, device_rows);
+
+                    //Run intersector
+                    tracer->QueryIntersection(slot.primary_rays, device_rays, slot.primary_hits);
+
+                    {
+                        //Shade and generate new rays
+                        CLWKernel kernel = program.GetKernel("ShadePrimaryRays");
+                        int argid = 0;
+                        kernel.SetArg(argid++, shapes_buffer);
+                        kernel.SetArg(argid++, vertex_buffer);
+                        kernel.SetArg(argid++, index_buffer);
+                        kernel.SetArg(argid++, slot.ao_rays);
+                        kernel.SetArg(argid++, slot.primary_rays);
+                        kernel.SetArg(argid++, slot.primary_hits);
+                        kernel.SetArg(argid++, (cl_int)device_rays);
+                        kernel.SetArg(argid++, output_buffer);
+                        kernel.SetArg(argid++, slot.color);
+                        kernel.SetArg(argid++, slot.ao_rays_counter);
+                        kernel.SetArg(argid++, max_ao_rays);
+                        kernel.SetArg(argid++, ao_rays_per_frame_per_hit);
+                        kernel.SetArg(argid++, a);
+
+                        int globalsize = device_rays;
+                        context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+                    }
+
+                    // Waited for once the frame is traced
+                    slot.count_read = context.ReadBuffer<uint32_t>(0, slot.ao_rays_counter, &slot.ao_rays_count, 1);
+                }
             }
 
-            //Trace AO rays
-            uint32_t ao_rays_count;
-            context.ReadBuffer<uint32_t>(0, ao_rays_counter, &ao_rays_count, 1).Wait();
-            //intersection_api->QueryIntersection(ao_ray_buffer, ao_rays_count, ao_isect_buffer, nullptr, nullptr);
-            intersection_api->QueryOcclusion(ao_ray_buffer, ao_rays_count, ao_hit_result_buffer, nullptr, nullptr);
-            //Process AO
+            const int traced = a - (frames_in_flight - 1);
+            if (traced >= 0 && slots[traced % frames_in_flight].primary_ray_count > 0)
             {
-                CLWKernel kernel = program.GetKernel("ProcessAO");
-                int argid = 0;
-                kernel.SetArg(argid++, ao_rays_buffer);
-                kernel.SetArg(argid++, ao_hit_result);
-                kernel.SetArg(argid++, ao_rays_count);
-                kernel.SetArg(argid++, color_buffer);
-                kernel.SetArg(argid++, output_buffer);
-
-                int globalsize = ao_rays_count;
-                context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+                FrameSlot &slot = slots[traced % frames_in_flight];
+
+                //Trace AO rays
+                slot.count_read.Wait();
+                uint32_t ao_rays_count = slot.ao_rays_count;
+                tracer->QueryOcclusion(slot.ao_rays, ao_rays_count, slot.ao_hits);
+                //Process AO
+                {
+                    CLWKernel kernel = program.GetKernel("ProcessAO");
+                    int argid = 0;
+                    kernel.SetArg(argid++, slot.ao_rays);
+                    kernel.SetArg(argid++, slot.ao_hits);
+                    kernel.SetArg(argid++, ao_rays_count);
+                    kernel.SetArg(argid++, ao_rays_per_frame_per_hit);
+                    kernel.SetArg(argid++, slot.color);
+                    kernel.SetArg(argid++, output_buffer);
+
+                    // A work item per hit
+                    int globalsize = ao_rays_count / ao_rays_per_frame_per_hit;
+                    context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+                }
+
+                // Device time is only needed to balance the split
+                if (hybrid)
+                    context.Finish(0);
             }
+            double device_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - device_start).count();
+
+            cpu_group.Wait();
+            split.Update(device_ms, cpu_ms);
+            device_total_ms += device_ms;
+            cpu_total_ms += cpu_ms;
         }
 
         end = std::chrono::high_resolution_clock::now();
         double elapsed_s = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.;
         std::cout << frame_count << " frames, " << initial_rays_count << " primary rays, " << ao_rays_per_frame << " indirect rays - " << elapsed_s << " s" << std::endl;
         std::cout << "fps: " << (frame_count / elapsed_s) << ", " << (((initial_rays_count + ao_rays_per_frame) * frame_count) / (elapsed_s)) / 1e6 << " MRays/s" << std::endl;
+        if (hybrid)
+        {
+            std::cout << "Hybrid: device " << device_total_ms / frame_count << " ms, cpu " << cpu_total_ms / frame_count
+                << " ms per frame, device share settled at " << split.GetDeviceShare() << " (" << split.GetDeviceRows()
+                << " of " << h << " rows)" << std::endl;
+
+            // The CPU sums go into the device output buffer, both count the
+            // frames they traced a pixel in, so Resolve averages either way
+            const Cpu::AccumBuffer &cpu_output = cpu_renderer->GetOutput();
+            float4 *output;
+            context.MapBuffer(0, output_buffer, CL_MAP_READ | CL_MAP_WRITE, &output).Wait();
+            for (size_t i = 0; i < cpu_output.size(); ++i)
+            {
+                output[i].x += cpu_output[i].r;
+                output[i].y += cpu_output[i].g;
+                output[i].z += cpu_output[i].b;
+                output[i].w += cpu_output[i].a;
+            }
+            context.UnmapBuffer(0, output_buffer, output).Wait();
+        }
 
 
         //Resolve image
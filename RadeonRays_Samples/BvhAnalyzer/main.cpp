@@ -0,0 +1,342 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "OpenImageIO/imageio.h"
+
+#include "scene.h"
+#include "cpu_bvh.h"
+#include "cpu_bvh_analysis.h"
+#include "cpu_intersector.h"
+#include "cpu_parallel.h"
+#include "cpu_workload.h"
+
+using namespace Cpu;
+
+static double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void SaveImage(const std::string &fname, float *data, int w, int h)
+{
+    OIIO_NAMESPACE_USING;
+
+    std::unique_ptr<ImageOutput> out{ ImageOutput::create(fname) };
+
+    if (!out)
+    {
+        throw std::runtime_error("Can't create image file on disk");
+    }
+
+    auto fmt = TypeDesc::FLOAT;
+    ImageSpec spec(w, h, 4, fmt);
+
+    out->open(fname, spec);
+    out->write_image(fmt, data);
+    out->close();
+}
+
+// Average and worst case work per ray
+static void PrintTraversalStats(const char *name, const std::vector<TraversalStats> &stats)
+{
+    double nodes = 0.0, triangles = 0.0, boxes = 0.0;
+    uint32_t max_nodes = 0, max_triangles = 0;
+    for (auto &s : stats)
+    {
+        nodes += s.nodes;
+        triangles += s.triangles;
+        boxes += s.boxes;
+        max_nodes = std::max(max_nodes, s.nodes);
+        max_triangles = std::max(max_triangles, s.triangles);
+    }
+
+    double count = (double)std::max<size_t>(stats.size(), 1);
+    std::cout << std::left << std::setw(10) << name << std::right << std::setw(10) << stats.size()
+        << std::fixed << std::setprecision(2) << std::setw(12) << nodes / count << std::setw(12) << max_nodes
+        << std::setw(12) << triangles / count << std::setw(12) << max_triangles << std::setw(12) << boxes / count
+        << std::endl;
+}
+
+// Share of the rays of every workload by work done, in power of two buckets
+static void PrintTraversalHistograms(TraversalMetric metric, const char *const names[],
+    const std::vector<TraversalStats> *const stats[], int workload_count)
+{
+    std::vector<std::vector<uint32_t>> buckets(workload_count);
+    size_t bucket_count = 0;
+    for (int i = 0; i < workload_count; ++i)
+    {
+        BuildTraversalHistogram(stats[i]->data(), stats[i]->size(), metric, buckets[i]);
+        bucket_count = std::max(bucket_count, buckets[i].size());
+    }
+
+    std::cout << std::endl << std::left << std::setw(16) << (std::string(GetTraversalMetricName(metric)) + "/ray")
+        << std::right;
+    for (int i = 0; i < workload_count; ++i)
+        std::cout << std::setw(10) << (std::string(names[i]) + " %");
+    std::cout << std::endl;
+
+    for (size_t b = 0; b < bucket_count; ++b)
+    {
+        std::string range = b == 0 ? "0" : b == 1 ? "1" : std::to_string(1u << (b - 1)) + "-" + std::to_string((1u << b) - 1);
+        std::cout << std::left << std::setw(16) << range << std::right << std::fixed << std::setprecision(2);
+        for (int i = 0; i < workload_count; ++i)
+        {
+            uint32_t rays = b < buckets[i].size() ? buckets[i][b] : 0;
+            std::cout << std::setw(10) << 100.0 * rays / std::max<size_t>(stats[i]->size(), 1);
+        }
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string scene_file = "../../Resources/Sponza/sponza.obj";
+    uint32_t object_count = 100;
+    BvhBuildOptions options;
+    uint32_t optimize_passes = 0;
+    bool end_point_overlap = true;
+    int ao_rays_per_hit = 4;
+    int light_count = 3;
+    int w = 1920;
+    int h = 1080;
+    std::string heatmap_file;
+    TraversalMetric metric = TraversalMetric::kNodes;
+    // Stats depend on the mode, see TraversalStats
+    TraversalMode mode = TraversalMode::kSingleRay;
+
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "-scene") == 0 && a + 1 < argc)
+        {
+            scene_file = argv[++a];
+            continue;
+        }
+        if (strcmp(argv[a], "-objects") == 0 && a + 1 < argc)
+        {
+            object_count = (uint32_t)atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-quality") == 0 && a + 1 < argc)
+        {
+            if (!ParseBuildQuality(argv[++a], options.quality))
+            {
+                std::cerr << "Unknown build quality: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-format") == 0 && a + 1 < argc)
+        {
+            if (!ParseNodeFormat(argv[++a], options.node_format))
+            {
+                std::cerr << "Unknown node format: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-leaf") == 0 && a + 1 < argc)
+        {
+            options.max_leaf_size = (uint32_t)atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-budget") == 0 && a + 1 < argc)
+        {
+            options.duplication_budget = (float)atof(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-optimize") == 0 && a + 1 < argc)
+        {
+            optimize_passes = (uint32_t)atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-no-epo") == 0)
+        {
+            end_point_overlap = false;
+            continue;
+        }
+        if (strcmp(argv[a], "-ao") == 0 && a + 1 < argc)
+        {
+            ao_rays_per_hit = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-lights") == 0 && a + 1 < argc)
+        {
+            light_count = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-heatmap") == 0 && a + 1 < argc)
+        {
+            heatmap_file = argv[++a];
+            continue;
+        }
+        if (strcmp(argv[a], "-stream") == 0)
+        {
+            mode = TraversalMode::kStream;
+            continue;
+        }
+        if (strcmp(argv[a], "-metric") == 0 && a + 1 < argc)
+        {
+            if (!ParseTraversalMetric(argv[++a], metric))
+            {
+                std::cerr << "Unknown traversal metric: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-size") == 0 && a + 2 < argc)
+        {
+            w = atoi(argv[++a]);
+            h = atoi(argv[++a]);
+            continue;
+        }
+
+        std::cerr << "Usage: " << argv[0] << " [-scene <file.obj>|procedural] [-objects <sphere count>]"
+            " [-quality fast|balanced|high|spatial] [-format full|quantized] [-leaf <max leaf size>]"
+            " [-budget <spatial split duplicates per triangle>] [-optimize <passes>] [-no-epo]"
+            " [-ao <rays per hit>] [-lights <count>] [-size <w> <h>] [-metric nodes|triangles|boxes]"
+            " [-stream] [-heatmap <image file>]" << std::endl;
+        return -1;
+    }
+
+    Scene scene;
+    Camera camera;
+    if (scene_file == "procedural")
+    {
+        BuildProceduralScene(scene, object_count, 1);
+        camera = GetProceduralCamera();
+    }
+    else
+    {
+        if (!scene.loadFile(scene_file.c_str()))
+        {
+            std::cerr << "Can't load " << scene_file << std::endl;
+            return -1;
+        }
+        camera = GetSponzaCamera();
+    }
+
+    Intersector intersector;
+    intersector.AttachScene(scene);
+    std::cout << "Scene: " << scene_file << ", " << intersector.GetTriangleCount() << " triangles, "
+        << GetWorkerCount() << " threads" << std::endl;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    intersector.Commit(options);
+    double build_ms = ElapsedMs(start);
+    std::cout << "Build: " << GetBuildQualityName(options.quality) << ", " << GetNodeFormatName(options.node_format)
+        << " nodes, " << std::fixed << std::setprecision(2) << build_ms << " ms" << std::endl;
+
+    if (optimize_passes > 0)
+    {
+        BvhOptimizeOptions optimize_options;
+        optimize_options.max_iterations = optimize_passes;
+        BvhOptimizeResult result = intersector.Optimize(optimize_options);
+        std::cout << "Optimize: " << result.iterations << " passes, " << result.elapsed_ms << " ms" << std::endl;
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    BvhAnalysis analysis;
+    AnalyzeBvh(intersector.GetBvh(), intersector.GetPositions(), intersector.GetIndices(), end_point_overlap, analysis);
+    double analysis_ms = ElapsedMs(start);
+
+    std::cout << std::endl << "SAH cost:          " << analysis.sah_cost << std::endl;
+    if (analysis.end_point_overlap >= 0.0)
+        std::cout << "End-point overlap: " << analysis.end_point_overlap << std::endl;
+    std::cout << "Nodes:             " << analysis.node_count << ", " << analysis.leaf_count << " leaves, "
+        << intersector.GetNodeMemorySize() / 1024 << " KB" << std::endl;
+    std::cout << "References:        " << analysis.reference_count << ", "
+        << (double)analysis.reference_count / std::max(analysis.triangle_count, 1u) << " per triangle" << std::endl;
+    std::cout << "Leaf depth:        " << analysis.min_leaf_depth << " min, " << analysis.avg_leaf_depth << " avg, "
+        << analysis.max_leaf_depth << " max" << std::endl;
+    std::cout << "Analysis:          " << analysis_ms << " ms" << std::endl;
+
+    std::cout << std::endl << std::setw(10) << "leaf size" << std::setw(10) << "leaves" << std::setw(10) << "%" << std::endl;
+    for (size_t size = 0; size < analysis.leaf_sizes.size(); ++size)
+    {
+        if (analysis.leaf_sizes[size] == 0)
+            continue;
+        std::cout << std::setw(10) << size << std::setw(10) << analysis.leaf_sizes[size]
+            << std::setw(10) << 100.0 * analysis.leaf_sizes[size] / analysis.leaf_count << std::endl;
+    }
+
+    std::cout << std::endl << std::setw(10) << "level" << std::setw(10) << "nodes" << std::setw(10) << "leaves"
+        << std::setw(18) << "sibling overlap" << std::endl;
+    for (size_t level = 0; level < analysis.levels.size(); ++level)
+    {
+        const BvhLevelStats &stats = analysis.levels[level];
+        std::cout << std::setw(10) << level << std::setw(10) << stats.nodes << std::setw(10) << stats.leaves
+            << std::setw(18) << std::setprecision(4) << stats.sibling_overlap << std::endl;
+    }
+
+    // Replays the sample workloads and counts what every ray touches
+    RayBuffer primary_rays;
+    HitBuffer primary_hits;
+    RayBuffer ao_rays;
+    RayBuffer shadow_rays;
+    BufferVector<int32_t> occlusion_hits;
+    std::vector<TraversalStats> primary_stats;
+    std::vector<TraversalStats> ao_stats;
+    std::vector<TraversalStats> shadow_stats;
+    std::vector<Vec3> lights = GetPointLights(light_count);
+
+    std::cout << std::endl << "Rays: " << w << "x" << h << ", " << ao_rays_per_hit << " ao rays per hit, "
+        << light_count << " point lights, " << (mode == TraversalMode::kStream ? "stream" : "single ray")
+        << " traversal" << std::endl;
+    std::cout << std::left << std::setw(10) << "workload" << std::right << std::setw(10) << "rays"
+        << std::setw(12) << "nodes/ray" << std::setw(12) << "max nodes" << std::setw(12) << "tris/ray"
+        << std::setw(12) << "max tris" << std::setw(12) << "boxes/ray" << std::endl;
+
+    GenerateCameraRays(camera, w, h, primary_rays);
+    primary_hits.resize(primary_rays.size());
+    primary_stats.resize(primary_rays.size());
+    intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data(), primary_stats.data(), mode);
+    PrintTraversalStats("primary", primary_stats);
+
+    GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, 0, ao_rays);
+    occlusion_hits.resize(ao_rays.size());
+    ao_stats.resize(ao_rays.size());
+    intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), occlusion_hits.data(), ao_stats.data(), mode);
+    PrintTraversalStats("ao", ao_stats);
+
+    GenerateShadowRays(scene, primary_rays, primary_hits, lights, 0, shadow_rays);
+    occlusion_hits.resize(shadow_rays.size());
+    shadow_stats.resize(shadow_rays.size());
+    intersector.QueryOcclusion(shadow_rays.data(), shadow_rays.size(), occlusion_hits.data(), shadow_stats.data(), mode);
+    PrintTraversalStats("shadow", shadow_stats);
+
+    const char *const names[] = { "primary", "ao", "shadow" };
+    const std::vector<TraversalStats> *const workloads[] = { &primary_stats, &ao_stats, &shadow_stats };
+    PrintTraversalHistograms(metric, names, workloads, 3);
+
+    if (!heatmap_file.empty())
+    {
+        // Work of all three workloads summed per pixel
+        std::vector<TraversalStats> pixels((size_t)w * h, TraversalStats{ 0, 0, 0 });
+        AccumulatePixelStats(primary_rays.data(), primary_stats.data(), primary_rays.size(), pixels);
+        AccumulatePixelStats(ao_rays.data(), ao_stats.data(), ao_rays.size(), pixels);
+        AccumulatePixelStats(shadow_rays.data(), shadow_stats.data(), shadow_rays.size(), pixels);
+
+        std::vector<float> image;
+        uint32_t top = MakeTraversalHeatmap(pixels, metric, 0.99f, image);
+        try
+        {
+            SaveImage(heatmap_file, image.data(), w, h);
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+        std::cout << std::endl << "Heatmap: " << heatmap_file << ", red is " << top << " " << GetTraversalMetricName(metric)
+            << " per pixel or more" << std::endl;
+    }
+
+    return 0;
+}
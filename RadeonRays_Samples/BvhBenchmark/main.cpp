@@ -0,0 +1,1547 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "scene.h"
+#include "cpu_ao_kernels.h"
+#include "cpu_buffer.h"
+#include "cpu_bvh.h"
+#include "cpu_frame_pipeline.h"
+#include "cpu_instanced_intersector.h"
+#include "cpu_intersector.h"
+#include "cpu_numa.h"
+#include "cpu_parallel.h"
+#include "cpu_ray_sort.h"
+#include "cpu_compact_ray.h"
+#include "cpu_double_buffered_intersector.h"
+#include "cpu_workload.h"
+
+using namespace Cpu;
+
+static double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Heap allocations of the process, for the -arena check. The array and
+// sized forms are replaced too, so every allocation is counted and every
+// release goes back to malloc.
+static std::atomic<uint64_t> g_heap_allocations(0);
+
+void *operator new(size_t size)
+{
+    g_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *data = malloc(size ? size : 1))
+        return data;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *data) noexcept
+{
+    free(data);
+}
+
+void operator delete(void *data, size_t) noexcept
+{
+    free(data);
+}
+
+void operator delete[](void *data) noexcept
+{
+    free(data);
+}
+
+void operator delete[](void *data, size_t) noexcept
+{
+    free(data);
+}
+
+// Heap allocations plus the large buffers AllocateBuffer maps directly
+static uint64_t GetAllocationCount()
+{
+    BufferStats stats = GetBufferStats();
+    return g_heap_allocations.load(std::memory_order_relaxed) + stats.small_pages + stats.transparent +
+        stats.explicit_pages;
+}
+
+struct FrameTimes
+{
+    double primary_ms = 0.0;
+    double ao_ms = 0.0;
+    double shadow_ms = 0.0;
+    double accum_ms = 0.0;
+    size_t ao_ray_count = 0;
+    size_t shadow_ray_count = 0;
+};
+
+// Kept across frames, replaced to place the pages anew
+struct FrameBuffers
+{
+    HitBuffer               primary_hits;
+    RayBuffer               ao_rays;
+    RayBuffer               shadow_rays;
+    BufferVector<int32_t>   occlusion_hits;
+    AccumBuffer             ao_accum;
+};
+
+static FrameBuffers g_frame_buffers;
+
+// Primary rays, then occlusion for AO rays as in the AmbientOcclusion sample
+// and for shadow rays as in the ShadowsPointLight sample
+template <typename IntersectorType>
+static void TraceFrame(const IntersectorType &intersector, const Scene &scene, const RayBuffer &primary_rays,
+    int ao_rays_per_hit, const std::vector<Vec3> &lights, int frame, FrameTimes &times)
+{
+    HitBuffer &primary_hits = g_frame_buffers.primary_hits;
+    RayBuffer &ao_rays = g_frame_buffers.ao_rays;
+    RayBuffer &shadow_rays = g_frame_buffers.shadow_rays;
+    BufferVector<int32_t> &occlusion_hits = g_frame_buffers.occlusion_hits;
+    AccumBuffer &ao_accum = g_frame_buffers.ao_accum;
+
+    if (ao_accum.size() != primary_rays.size())
+    {
+        ao_accum.resize(primary_rays.size());
+        ParallelFor(0, ao_accum.size(), 4096, [&](size_t begin, size_t end)
+        {
+            memset(&ao_accum[begin], 0, (end - begin) * sizeof(Rgba));
+        });
+    }
+
+    primary_hits.resize(primary_rays.size());
+    auto start = std::chrono::high_resolution_clock::now();
+    intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+    times.primary_ms += ElapsedMs(start);
+
+    GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, ao_rays);
+    occlusion_hits.resize(ao_rays.size());
+    start = std::chrono::high_resolution_clock::now();
+    intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), occlusion_hits.data());
+    times.ao_ms += ElapsedMs(start);
+    times.ao_ray_count += ao_rays.size();
+    start = std::chrono::high_resolution_clock::now();
+    AccumulateAo(ao_rays, occlusion_hits.data(), ao_rays_per_hit, ao_accum);
+    times.accum_ms += ElapsedMs(start);
+
+    GenerateShadowRays(scene, primary_rays, primary_hits, lights, frame, shadow_rays);
+    occlusion_hits.resize(shadow_rays.size());
+    start = std::chrono::high_resolution_clock::now();
+    intersector.QueryOcclusion(shadow_rays.data(), shadow_rays.size(), occlusion_hits.data());
+    times.shadow_ms += ElapsedMs(start);
+    times.shadow_ray_count += shadow_rays.size();
+}
+
+// The frame of TraceFrame with every stage buffer created for the frame, as
+// a CPU run of the samples would: from arena when given, which the caller
+// resets after every frame, from the heap otherwise. Rays per hit vary with
+// the frame so the buffer sizes do too.
+template <typename IntersectorType>
+static void TraceTransientFrame(const IntersectorType &intersector, const Scene &scene, const Camera &camera, int w,
+    int h, int max_rays_per_hit, const std::vector<Vec3> &lights, int frame, TraversalMode traversal, FrameArena *arena,
+    AccumBuffer &ao_accum)
+{
+    RayBuffer primary_rays{ BufferAllocator<Ray>(arena) };
+    GenerateCameraRays(camera, w, h, primary_rays);
+    HitBuffer primary_hits(primary_rays.size(), BufferAllocator<Intersection>(arena));
+    intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data(), nullptr, traversal);
+
+    const int rays_per_hit = 1 + frame % max_rays_per_hit;
+    RayBuffer ao_rays{ BufferAllocator<Ray>(arena) };
+    GenerateAoRays(scene, primary_rays, primary_hits, rays_per_hit, frame, ao_rays);
+    BufferVector<int32_t> ao_hits(ao_rays.size(), BufferAllocator<int32_t>(arena));
+    intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), ao_hits.data(), nullptr, traversal);
+    AccumulateAo(ao_rays, ao_hits.data(), rays_per_hit, ao_accum);
+
+    RayBuffer shadow_rays{ BufferAllocator<Ray>(arena) };
+    GenerateShadowRays(scene, primary_rays, primary_hits, lights, frame, shadow_rays);
+    BufferVector<int32_t> shadow_hits(shadow_rays.size(), BufferAllocator<int32_t>(arena));
+    intersector.QueryOcclusion(shadow_rays.data(), shadow_rays.size(), shadow_hits.data(), nullptr, traversal);
+}
+
+// User space dTLB load misses of this process and of the threads it starts
+// afterwards. Unavailable where the PMU does not expose the event, as in
+// most virtual machines.
+class TlbMissCounter
+{
+public:
+    TlbMissCounter()
+        : fd_(-1)
+    {
+#if defined(__linux__)
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~TlbMissCounter()
+    {
+#if defined(__linux__)
+        if (fd_ >= 0)
+            close(fd_);
+#endif
+    }
+
+    bool IsAvailable() const { return fd_ >= 0; }
+
+    void Start()
+    {
+#if defined(__linux__)
+        if (fd_ < 0)
+            return;
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    uint64_t Stop()
+    {
+        uint64_t count = 0;
+#if defined(__linux__)
+        if (fd_ < 0)
+            return 0;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_, &count, sizeof(count)) != sizeof(count))
+            count = 0;
+#endif
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
+// Minor page faults of the process so far
+static uint64_t GetPageFaults()
+{
+#if defined(__linux__)
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return (uint64_t)usage.ru_minflt;
+#endif
+    return 0;
+}
+
+// Memory of the process in transparent and hugetlbfs huge pages
+static size_t GetHugePageBytes()
+{
+    size_t kb = 0;
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file)
+        return 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        size_t value;
+        if (sscanf(line, "AnonHugePages: %zu kB", &value) == 1 || sscanf(line, "Private_Hugetlb: %zu kB", &value) == 1)
+            kb += value;
+    }
+    fclose(file);
+#endif
+    return kb * 1024;
+}
+
+// Busy time of every pool worker over the stats period, the last row is the
+// main thread while it helps out
+static void PrintWorkerStats(const ThreadPool &pool)
+{
+    std::vector<WorkerStats> stats;
+    pool.GetWorkerStats(stats);
+    double seconds = pool.GetStatsSeconds();
+    std::cout << std::left << std::setw(10) << "worker" << std::right << std::setw(10) << "tasks"
+        << std::setw(10) << "steals" << std::setw(10) << "busy %" << std::endl;
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        std::cout << std::left << std::setw(10) << (i + 1 < stats.size() ? std::to_string(i) : std::string("main"))
+            << std::right << std::setw(10) << stats[i].tasks << std::setw(10) << stats[i].steals
+            << std::fixed << std::setprecision(1) << std::setw(10) << 100.0 * stats[i].busy_seconds / seconds << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string scene_file = "../../Resources/Sponza/sponza.obj";
+    uint32_t object_count = 100;
+    std::vector<BvhBuildQuality> qualities = { BvhBuildQuality::kFast, BvhBuildQuality::kBalanced, BvhBuildQuality::kHigh, BvhBuildQuality::kSpatial };
+    std::vector<BvhNodeFormat> formats = { BvhNodeFormat::kFull };
+    std::vector<BvhLeafFormat> leaf_formats = { BvhLeafFormat::kBlocks };
+    int ao_rays_per_hit = 4;
+    int light_count = 3;
+    float duplication_budget = BvhBuildOptions().duplication_budget;
+    int frame_count = 4;
+    int w = 1920;
+    int h = 1080;
+    int animate_frames = 0;
+    uint32_t optimize_passes = 0;
+    double optimize_ms = 0.0;
+    float rebuild_threshold = 1.5f;
+    int instanced_frames = 0;
+    int kernel_frames = 0;
+    int tile_frames = 0;
+    int queue_frames = 0;
+    int pipeline_frames = 0;
+    int sort_frames = 0;
+    int compact_frames = 0;
+    int arena_frames = 0;
+    int background_frames = 0;
+    bool compare_stream = false;
+    bool print_workers = false;
+    std::vector<NumaPlacement> placements;
+    std::vector<HugePageMode> page_modes;
+    unsigned thread_count = 0;
+
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "-scene") == 0 && a + 1 < argc)
+        {
+            scene_file = argv[++a];
+            continue;
+        }
+        if (strcmp(argv[a], "-objects") == 0 && a + 1 < argc)
+        {
+            object_count = (uint32_t)atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-quality") == 0 && a + 1 < argc)
+        {
+            BvhBuildQuality quality;
+            if (!ParseBuildQuality(argv[++a], quality))
+            {
+                std::cerr << "Unknown build quality: " << argv[a] << std::endl;
+                return -1;
+            }
+            qualities = { quality };
+            continue;
+        }
+        if (strcmp(argv[a], "-format") == 0 && a + 1 < argc)
+        {
+            BvhNodeFormat format;
+            if (strcmp(argv[++a], "all") == 0)
+                formats = { BvhNodeFormat::kFull, BvhNodeFormat::kQuantized };
+            else if (ParseNodeFormat(argv[a], format))
+                formats = { format };
+            else
+            {
+                std::cerr << "Unknown node format: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-leaves") == 0 && a + 1 < argc)
+        {
+            BvhLeafFormat format;
+            if (strcmp(argv[++a], "all") == 0)
+                leaf_formats = { BvhLeafFormat::kIndexed, BvhLeafFormat::kBlocks };
+            else if (ParseLeafFormat(argv[a], format))
+                leaf_formats = { format };
+            else
+            {
+                std::cerr << "Unknown leaf format: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-budget") == 0 && a + 1 < argc)
+        {
+            duplication_budget = (float)atof(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-ao") == 0 && a + 1 < argc)
+        {
+            ao_rays_per_hit = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-lights") == 0 && a + 1 < argc)
+        {
+            light_count = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-frames") == 0 && a + 1 < argc)
+        {
+            frame_count = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-animate") == 0 && a + 1 < argc)
+        {
+            animate_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-rebuild") == 0 && a + 1 < argc)
+        {
+            rebuild_threshold = (float)atof(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-stream") == 0)
+        {
+            compare_stream = true;
+            continue;
+        }
+        if (strcmp(argv[a], "-instanced") == 0 && a + 1 < argc)
+        {
+            instanced_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-kernels") == 0 && a + 1 < argc)
+        {
+            kernel_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-tiles") == 0 && a + 1 < argc)
+        {
+            tile_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-queues") == 0 && a + 1 < argc)
+        {
+            queue_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-pipeline") == 0 && a + 1 < argc)
+        {
+            pipeline_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-sort") == 0 && a + 1 < argc)
+        {
+            sort_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-compact") == 0 && a + 1 < argc)
+        {
+            compact_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-arena") == 0 && a + 1 < argc)
+        {
+            arena_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-background") == 0 && a + 1 < argc)
+        {
+            background_frames = atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-optimize") == 0 && a + 1 < argc)
+        {
+            optimize_passes = (uint32_t)atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-optimize-ms") == 0 && a + 1 < argc)
+        {
+            optimize_ms = atof(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-threads") == 0 && a + 1 < argc)
+        {
+            thread_count = (unsigned)atoi(argv[++a]);
+            continue;
+        }
+        if (strcmp(argv[a], "-numa") == 0 && a + 1 < argc)
+        {
+            NumaPlacement placement;
+            if (strcmp(argv[++a], "all") == 0)
+                placements = { NumaPlacement::kLocal, NumaPlacement::kInterleave, NumaPlacement::kReplicate };
+            else if (ParseNumaPlacement(argv[a], placement))
+                placements = { placement };
+            else
+            {
+                std::cerr << "Unknown NUMA placement: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-hugepages") == 0 && a + 1 < argc)
+        {
+            HugePageMode mode;
+            if (strcmp(argv[++a], "all") == 0)
+                page_modes = { HugePageMode::kOff, HugePageMode::kTransparent, HugePageMode::kExplicit };
+            else if (ParseHugePageMode(argv[a], mode))
+                page_modes = { mode };
+            else
+            {
+                std::cerr << "Unknown huge page mode: " << argv[a] << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[a], "-workers") == 0)
+        {
+            print_workers = true;
+            continue;
+        }
+        if (strcmp(argv[a], "-size") == 0 && a + 2 < argc)
+        {
+            w = atoi(argv[++a]);
+            h = atoi(argv[++a]);
+            continue;
+        }
+
+        std::cerr << "Usage: " << argv[0] << " [-scene <file.obj>|procedural] [-objects <sphere count>]"
+            " [-quality fast|balanced|high|spatial] [-format full|quantized|all] [-leaves indexed|blocks|all]"
+            " [-budget <spatial split duplicates per triangle>] [-ao <rays per hit>] [-lights <count>]"
+            " [-frames <count>] [-size <w> <h>] [-animate <frames> [-rebuild <sah ratio>]]"
+            " [-optimize <passes> [-optimize-ms <budget per frame>]] [-instanced <frames>] [-stream] [-kernels <frames>]"
+            " [-tiles <frames>] [-queues <frames>] [-pipeline <frames>] [-sort <frames>] [-compact <frames>] [-arena <frames>] [-background <frames>]"
+            " [-threads <count>] [-workers] [-numa local|interleave|replicate|all]"
+            " [-hugepages off|transparent|explicit|all]" << std::endl;
+        return -1;
+    }
+
+    if (thread_count > 0)
+        ThreadPool::SetSharedWorkerCount(thread_count);
+
+    Scene scene;
+    Camera camera;
+    if (scene_file == "procedural")
+    {
+        BuildProceduralScene(scene, object_count, 1);
+        camera = GetProceduralCamera();
+    }
+    else
+    {
+        if (!scene.loadFile(scene_file.c_str()))
+        {
+            std::cerr << "Can't load " << scene_file << std::endl;
+            return -1;
+        }
+        camera = GetSponzaCamera();
+    }
+
+    Intersector intersector;
+    intersector.AttachScene(scene);
+    std::cout << "Scene: " << scene_file << ", " << intersector.GetTriangleCount() << " triangles, "
+        << GetWorkerCount() << " threads" << std::endl;
+    std::cout << "Frames: " << frame_count << " at " << w << "x" << h << ", " << ao_rays_per_hit << " ao rays per hit, "
+        << light_count << " point lights" << std::endl;
+
+    RayBuffer primary_rays;
+    std::vector<Vec3> lights = GetPointLights(light_count);
+    GenerateCameraRays(camera, w, h, primary_rays);
+
+    std::cout << std::left << std::setw(10) << "quality" << std::setw(11) << "format" << std::setw(9) << "leaves" << std::right
+        << std::setw(12) << "build ms" << std::setw(10) << "nodes" << std::setw(10) << "refs" << std::setw(10) << "node KB"
+        << std::setw(10) << "leaf KB"
+        << std::setw(8) << "depth" << std::setw(10) << "SAH" << std::setw(14) << "primary MR/s" << std::setw(10) << "ao MR/s"
+        << std::setw(14) << "shadow MR/s" << std::setw(12) << "frame ms" << std::endl;
+
+    ThreadPool::Get().ResetWorkerStats();
+    for (auto quality : qualities)
+    {
+        for (auto format : formats)
+        {
+            for (auto leaf_format : leaf_formats)
+            {
+                BvhBuildOptions options;
+                options.quality = quality;
+                options.node_format = format;
+                options.leaf_format = leaf_format;
+                options.duplication_budget = duplication_budget;
+
+                auto start = std::chrono::high_resolution_clock::now();
+                intersector.Commit(options);
+                double build_ms = ElapsedMs(start);
+
+                FrameTimes times;
+                for (int frame = 0; frame < frame_count; ++frame)
+                    TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, frame, times);
+
+                const Bvh &bvh = intersector.GetBvh();
+                double primary_mrays = (double)primary_rays.size() * frame_count / (times.primary_ms * 1e3);
+                double ao_mrays = (double)times.ao_ray_count / (times.ao_ms * 1e3);
+                double shadow_mrays = (double)times.shadow_ray_count / (times.shadow_ms * 1e3);
+                std::cout << std::left << std::setw(10) << GetBuildQualityName(quality) << std::setw(11) << GetNodeFormatName(format)
+                    << std::setw(9) << GetLeafFormatName(leaf_format)
+                    << std::right << std::fixed << std::setprecision(2) << std::setw(12) << build_ms
+                    << std::setw(10) << bvh.nodes_.size() << std::setw(10) << bvh.prim_indices_.size()
+                    << std::setw(10) << intersector.GetNodeMemorySize() / 1024
+                    << std::setw(10) << intersector.GetLeafMemorySize() / 1024 << std::setw(8) << bvh.GetMaxDepth()
+                    << std::setw(10) << bvh.GetSahCost() << std::setw(14) << primary_mrays << std::setw(10) << ao_mrays
+                    << std::setw(14) << shadow_mrays
+                    << std::setw(12) << (times.primary_ms + times.ao_ms + times.shadow_ms) / frame_count << std::endl;
+            }
+        }
+    }
+
+    if (print_workers)
+    {
+        std::cout << std::endl << "Workers over all builds and frames above" << std::endl;
+        PrintWorkerStats(ThreadPool::Get());
+    }
+
+    if (optimize_passes > 0)
+    {
+        // Treelet passes between frames, as a renderer would polish a fast build
+        std::cout << std::endl << "Optimized: up to " << optimize_passes << " passes, one per frame";
+        if (optimize_ms > 0.0)
+            std::cout << ", " << optimize_ms << " ms each";
+        std::cout << std::endl << std::left << std::setw(10) << "quality" << std::right
+            << std::setw(12) << "build ms" << std::setw(14) << "optimize ms" << std::setw(8) << "passes"
+            << std::setw(12) << "SAH before" << std::setw(12) << "SAH after"
+            << std::setw(14) << "first frame" << std::setw(14) << "last frame" << std::endl;
+
+        for (auto quality : qualities)
+        {
+            BvhBuildOptions options;
+            options.quality = quality;
+            options.node_format = formats.back();
+            options.leaf_format = leaf_formats.back();
+            options.duplication_budget = duplication_budget;
+
+            auto start = std::chrono::high_resolution_clock::now();
+            intersector.Commit(options);
+            double build_ms = ElapsedMs(start);
+
+            BvhOptimizeOptions optimize_options;
+            optimize_options.max_iterations = 1;
+            optimize_options.time_budget_ms = optimize_ms;
+
+            float sah_before = intersector.GetBvh().GetSahCost();
+            double total_optimize_ms = 0.0, first_frame_ms = 0.0, last_frame_ms = 0.0;
+            uint32_t passes = 0;
+            bool converged = false;
+            for (int frame = 0; frame < std::max(frame_count, 1); ++frame)
+            {
+                FrameTimes times;
+                TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, frame, times);
+                last_frame_ms = times.primary_ms + times.ao_ms + times.shadow_ms;
+                if (frame == 0)
+                    first_frame_ms = last_frame_ms;
+
+                if (passes < optimize_passes && !converged)
+                {
+                    BvhOptimizeResult result = intersector.Optimize(optimize_options);
+                    total_optimize_ms += result.elapsed_ms;
+                    converged = result.converged;
+                    ++passes;
+                }
+            }
+
+            std::cout << std::left << std::setw(10) << GetBuildQualityName(quality) << std::right << std::fixed
+                << std::setprecision(2) << std::setw(12) << build_ms << std::setw(14) << total_optimize_ms
+                << std::setw(8) << passes << std::setw(12) << sah_before << std::setw(12) << intersector.GetBvh().GetSahCost()
+                << std::setw(14) << first_frame_ms << std::setw(14) << last_frame_ms << std::endl;
+        }
+    }
+
+    if (compare_stream)
+    {
+        // Secondary rays one at a time depth first, then as breadth first streams
+        std::cout << std::endl << "Stream traversal: " << frame_count << " frames of ao and shadow rays" << std::endl;
+        std::cout << std::left << std::setw(10) << "quality" << std::right
+            << std::setw(16) << "single ao MR/s" << std::setw(16) << "stream ao MR/s"
+            << std::setw(20) << "single shadow MR/s" << std::setw(20) << "stream shadow MR/s" << std::endl;
+
+        HitBuffer primary_hits(primary_rays.size());
+        RayBuffer ao_rays, shadow_rays;
+        BufferVector<int32_t> occlusion_hits;
+        for (auto quality : qualities)
+        {
+            BvhBuildOptions options;
+            options.quality = quality;
+            options.node_format = formats.back();
+            options.leaf_format = leaf_formats.back();
+            options.duplication_budget = duplication_budget;
+            intersector.Commit(options);
+
+            double ms[2][2] = {};
+            size_t ray_counts[2] = {};
+            for (int frame = 0; frame < std::max(frame_count, 1); ++frame)
+            {
+                intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+                GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, ao_rays);
+                GenerateShadowRays(scene, primary_rays, primary_hits, lights, frame, shadow_rays);
+                ray_counts[0] += ao_rays.size();
+                ray_counts[1] += shadow_rays.size();
+
+                for (int workload = 0; workload < 2; ++workload)
+                {
+                    const RayBuffer &rays = workload == 0 ? ao_rays : shadow_rays;
+                    occlusion_hits.resize(rays.size());
+                    for (int mode = 0; mode < 2; ++mode)
+                    {
+                        auto start = std::chrono::high_resolution_clock::now();
+                        intersector.QueryOcclusion(rays.data(), rays.size(), occlusion_hits.data(), nullptr,
+                            mode == 0 ? TraversalMode::kSingleRay : TraversalMode::kStream);
+                        ms[workload][mode] += ElapsedMs(start);
+                    }
+                }
+            }
+
+            std::cout << std::left << std::setw(10) << GetBuildQualityName(quality) << std::right << std::fixed
+                << std::setprecision(2) << std::setw(16) << ray_counts[0] / (ms[0][0] * 1e3)
+                << std::setw(16) << ray_counts[0] / (ms[0][1] * 1e3) << std::setw(20) << ray_counts[1] / (ms[1][0] * 1e3)
+                << std::setw(20) << ray_counts[1] / (ms[1][1] * 1e3) << std::endl;
+        }
+    }
+
+    if (sort_frames > 0)
+    {
+        // Occlusion of the secondary rays as emitted against sorting them by
+        // direction octant and origin first. The sort pays for itself when
+        // sorting, the query of the sorted rays and scattering the results
+        // back take less than the query of the unsorted rays.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        std::cout << std::endl << "Ray sorting: " << sort_frames << " frames, " << GetBuildQualityName(options.quality)
+            << " build, ms per frame" << std::endl;
+        std::cout << std::left << std::setw(10) << "rays" << std::setw(8) << "mode" << std::right
+            << std::setw(6) << "bits" << std::setw(12) << "unsorted" << std::setw(10) << "sort" << std::setw(10) << "query"
+            << std::setw(10) << "scatter" << std::setw(10) << "speedup" << std::setw(8) << "pays" << std::setw(8) << "match"
+            << std::endl;
+
+        HitBuffer primary_hits(primary_rays.size());
+        RayBuffer rays;
+        BufferVector<int32_t> unsorted_hits, sorted_hits, scattered_hits;
+        intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+
+        for (int workload = 0; workload < 2; ++workload)
+        {
+            for (int mode = 0; mode < 2; ++mode)
+            {
+                const TraversalMode traversal = mode == 0 ? TraversalMode::kSingleRay : TraversalMode::kStream;
+                for (int origin_bits : { 6, 9 })
+                {
+                    RaySorter sorter(origin_bits);
+                    double unsorted_ms = 0.0, sort_ms = 0.0, query_ms = 0.0, scatter_ms = 0.0;
+                    bool match = true;
+                    for (int frame = 0; frame < sort_frames; ++frame)
+                    {
+                        if (workload == 0)
+                            GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, rays);
+                        else
+                            GenerateShadowRays(scene, primary_rays, primary_hits, lights, frame, rays);
+                        unsorted_hits.resize(rays.size());
+                        sorted_hits.resize(rays.size());
+                        scattered_hits.resize(rays.size());
+
+                        auto start = std::chrono::high_resolution_clock::now();
+                        intersector.QueryOcclusion(rays.data(), rays.size(), unsorted_hits.data(), nullptr, traversal);
+                        unsorted_ms += ElapsedMs(start);
+
+                        start = std::chrono::high_resolution_clock::now();
+                        sorter.Sort(rays.data(), rays.size());
+                        sort_ms += ElapsedMs(start);
+                        start = std::chrono::high_resolution_clock::now();
+                        intersector.QueryOcclusion(sorter.GetRays(), sorter.GetRayCount(), sorted_hits.data(), nullptr,
+                            traversal);
+                        query_ms += ElapsedMs(start);
+                        start = std::chrono::high_resolution_clock::now();
+                        sorter.Scatter(sorted_hits.data(), scattered_hits.data());
+                        scatter_ms += ElapsedMs(start);
+
+                        match = match && memcmp(unsorted_hits.data(), scattered_hits.data(),
+                            unsorted_hits.size() * sizeof(int32_t)) == 0;
+                    }
+
+                    const double sorted_ms = sort_ms + query_ms + scatter_ms;
+                    std::cout << std::left << std::setw(10) << (workload == 0 ? "ao" : "shadow")
+                        << std::setw(8) << (mode == 0 ? "single" : "stream") << std::right << std::setw(6) << origin_bits
+                        << std::fixed << std::setprecision(2) << std::setw(12) << unsorted_ms / sort_frames
+                        << std::setw(10) << sort_ms / sort_frames << std::setw(10) << query_ms / sort_frames
+                        << std::setw(10) << scatter_ms / sort_frames << std::setw(10) << unsorted_ms / sorted_ms
+                        << std::setw(8) << (sorted_ms < unsorted_ms ? "yes" : "no")
+                        << std::setw(8) << (match ? "yes" : "no") << std::endl;
+                }
+            }
+        }
+    }
+
+    if (compact_frames > 0)
+    {
+        // The same queries with 48 byte rays and 32 byte hits against 24 byte
+        // rays and 16 byte hits. Compacting would happen where rays are
+        // generated, it is timed apart from the query. Octahedral directions
+        // are slightly off, so a few grazing rays may change their result;
+        // agree is the share of rays with the same hit or occlusion.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        std::cout << std::endl << "Compact rays: " << compact_frames << " frames, " << GetBuildQualityName(options.quality)
+            << " build, ms per frame" << std::endl;
+        std::cout << std::left << std::setw(10) << "rays" << std::setw(11) << "query" << std::setw(8) << "mode"
+            << std::right << std::setw(10) << "full" << std::setw(10) << "compact" << std::setw(10) << "speedup"
+            << std::setw(10) << "pack" << std::setw(10) << "full MB" << std::setw(10) << "comp MB" << std::setw(10) << "agree %"
+            << std::endl;
+
+        HitBuffer primary_hits(primary_rays.size());
+        intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+
+        RayBuffer rays;
+        HitBuffer hits;
+        BufferVector<int32_t> occlusion_hits, compact_occlusion_hits;
+        BufferVector<CompactRay> compact_rays;
+        BufferVector<CompactHit> compact_hits;
+        BufferVector<float> distances;
+        const char *workload_names[] = { "primary", "ao", "shadow", "shadow" };
+        const char *query_names[] = { "closest", "occlusion", "occlusion", "distance" };
+        for (int workload = 0; workload < 4; ++workload)
+        {
+            for (int mode = 0; mode < 2; ++mode)
+            {
+                const TraversalMode traversal = mode == 0 ? TraversalMode::kSingleRay : TraversalMode::kStream;
+                const bool closest = workload == 0 || workload == 3;
+                double full_ms = 0.0, compact_ms = 0.0, pack_ms = 0.0;
+                size_t ray_count = 0, agree = 0;
+                for (int frame = 0; frame < compact_frames; ++frame)
+                {
+                    if (workload == 0)
+                        rays = primary_rays;
+                    else if (workload == 1)
+                        GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, rays);
+                    else
+                        GenerateShadowRays(scene, primary_rays, primary_hits, lights, frame, rays);
+                    const size_t count = rays.size();
+                    ray_count += count;
+                    hits.resize(count);
+                    occlusion_hits.resize(count);
+                    compact_rays.resize(count);
+                    compact_hits.resize(count);
+                    compact_occlusion_hits.resize(count);
+                    distances.resize(count);
+
+                    auto start = std::chrono::high_resolution_clock::now();
+                    if (closest)
+                        intersector.QueryIntersection(rays.data(), count, hits.data(), nullptr, traversal);
+                    else
+                        intersector.QueryOcclusion(rays.data(), count, occlusion_hits.data(), nullptr, traversal);
+                    full_ms += ElapsedMs(start);
+
+                    start = std::chrono::high_resolution_clock::now();
+                    Compact(rays.data(), count, compact_rays.data());
+                    pack_ms += ElapsedMs(start);
+
+                    start = std::chrono::high_resolution_clock::now();
+                    if (workload == 0)
+                        intersector.QueryIntersection(compact_rays.data(), count, compact_hits.data(), traversal);
+                    else if (workload == 3)
+                        intersector.QueryDistance(compact_rays.data(), count, distances.data(), traversal);
+                    else
+                        intersector.QueryOcclusion(compact_rays.data(), count, compact_occlusion_hits.data(), traversal);
+                    compact_ms += ElapsedMs(start);
+
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        if (workload == 0)
+                            agree += hits[i].primid == compact_hits[i].primid && hits[i].shapeid == compact_hits[i].shapeid;
+                        else if (workload == 3)
+                            agree += (hits[i].primid != kInvalidId) == (distances[i] != kMissDistance);
+                        else
+                            agree += occlusion_hits[i] == compact_occlusion_hits[i];
+                    }
+                }
+
+                // Rays read and results written per frame
+                const size_t frame_rays = ray_count / compact_frames;
+                const size_t full_bytes = frame_rays * (sizeof(Ray) + (closest ? sizeof(Intersection) : sizeof(int32_t)));
+                const size_t compact_result = workload == 0 ? sizeof(CompactHit) : workload == 3 ? sizeof(float) : sizeof(int32_t);
+                const size_t compact_bytes = frame_rays * (sizeof(CompactRay) + compact_result);
+                std::cout << std::left << std::setw(10) << workload_names[workload] << std::setw(11) << query_names[workload]
+                    << std::setw(8) << (mode == 0 ? "single" : "stream") << std::right << std::fixed << std::setprecision(2)
+                    << std::setw(10) << full_ms / compact_frames << std::setw(10) << compact_ms / compact_frames
+                    << std::setw(10) << full_ms / compact_ms << std::setw(10) << pack_ms / compact_frames
+                    << std::setw(10) << full_bytes / 1e6 << std::setw(10) << compact_bytes / 1e6
+                    << std::setw(10) << 100.0 * agree / std::max<size_t>(ray_count, 1) << std::endl;
+            }
+        }
+    }
+
+    if (arena_frames > 0)
+    {
+        // Stage buffers created every frame, from the heap against from a
+        // FrameArena reset between frames. The first frames cover every
+        // rays per hit count once so the arena has seen the largest frame;
+        // after them an arena frame should not allocate at all.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        const int warmup_frames = std::max(ao_rays_per_hit, 1);
+        std::cout << std::endl << "Frame arena: " << arena_frames << " frames after " << warmup_frames
+            << " warm-up frames, 1 to " << ao_rays_per_hit << " AO rays per hit" << std::endl;
+        std::cout << std::left << std::setw(10) << "buffers" << std::setw(8) << "mode" << std::right
+            << std::setw(10) << "ms" << std::setw(14) << "allocs/frame" << std::setw(12) << "arena MB"
+            << std::setw(10) << "blocks" << std::endl;
+
+        AccumBuffer accum(primary_rays.size());
+        bool arena_allocates = false;
+        for (int use_arena = 0; use_arena < 2; ++use_arena)
+        {
+            for (int mode = 0; mode < 2; ++mode)
+            {
+                const TraversalMode traversal = mode == 0 ? TraversalMode::kSingleRay : TraversalMode::kStream;
+                FrameArena arena;
+                FrameArena *frame_arena = use_arena ? &arena : nullptr;
+                double ms = 0.0;
+                uint64_t allocations = 0;
+                for (int frame = 0; frame < warmup_frames + arena_frames; ++frame)
+                {
+                    const uint64_t allocations_before = GetAllocationCount();
+                    auto start = std::chrono::high_resolution_clock::now();
+                    TraceTransientFrame(intersector, scene, camera, w, h, std::max(ao_rays_per_hit, 1), lights, frame,
+                        traversal, frame_arena, accum);
+                    // After the frame, so the blocks the last warm-up frame
+                    // grew into are merged within the warm-up
+                    arena.Reset();
+                    if (frame < warmup_frames)
+                        continue;
+                    ms += ElapsedMs(start);
+                    allocations += GetAllocationCount() - allocations_before;
+                }
+                arena_allocates = arena_allocates || (use_arena && allocations > 0);
+
+                std::cout << std::left << std::setw(10) << (use_arena ? "arena" : "heap")
+                    << std::setw(8) << (mode == 0 ? "single" : "stream") << std::right << std::fixed
+                    << std::setprecision(2) << std::setw(10) << ms / arena_frames
+                    << std::setw(14) << (double)allocations / arena_frames
+                    << std::setw(12) << arena.GetCapacity() / 1e6 << std::setw(10) << arena.GetBlockAllocationCount()
+                    << std::endl;
+            }
+        }
+        std::cout << "Steady state arena frames allocate: " << (arena_allocates ? "yes" : "no") << std::endl;
+    }
+
+    if (instanced_frames > 0)
+    {
+        // Rigid motion: one object moves every frame. The flat hierarchy has to
+        // be rebuilt for it, the two-level one only rebuilds its top level.
+        // Shading reads rest pose vertices, the offsets are too small to
+        // matter for timing.
+        InstancedIntersector instanced;
+        instanced.AttachScene(scene);
+        int32_t moving = scene.meshes_.size() > 1 ? 1 : 0;
+
+        std::cout << std::endl << "Instanced: " << instanced.GetMeshCount() << " meshes, mesh " << moving << " moves for "
+            << instanced_frames << " frames" << std::endl;
+        std::cout << std::left << std::setw(10) << "quality" << std::right
+            << std::setw(16) << "flat build ms" << std::setw(16) << "two-level ms" << std::setw(14) << "top level ms"
+            << std::setw(16) << "flat trace ms" << std::setw(20) << "two-level trace ms" << std::endl;
+
+        for (auto quality : qualities)
+        {
+            BvhBuildOptions options;
+            options.quality = quality;
+            options.node_format = formats.back();
+            options.leaf_format = leaf_formats.back();
+            options.duplication_budget = duplication_budget;
+
+            auto start = std::chrono::high_resolution_clock::now();
+            intersector.Commit(options);
+            double flat_build_ms = ElapsedMs(start);
+
+            start = std::chrono::high_resolution_clock::now();
+            instanced.Commit(options);
+            double instanced_build_ms = ElapsedMs(start);
+
+            const Bvh &moving_level = instanced.GetBottomLevel(moving).GetBvh();
+            Vec3 extent = moving_level.nodes_.empty() ? Vec3() : moving_level.nodes_[0].bounds.Extent();
+
+            double top_level_ms = 0.0;
+            FrameTimes flat_times, instanced_times;
+            for (int frame = 1; frame <= instanced_frames; ++frame)
+            {
+                instanced.SetTransform(moving, Transform::Translation(extent * (0.1f * std::sin(0.5f * frame))));
+                start = std::chrono::high_resolution_clock::now();
+                instanced.CommitTransforms();
+                top_level_ms += ElapsedMs(start);
+
+                TraceFrame(instanced, scene, primary_rays, ao_rays_per_hit, lights, frame, instanced_times);
+                TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, frame, flat_times);
+            }
+            instanced.SetTransform(moving, Transform());
+
+            std::cout << std::left << std::setw(10) << GetBuildQualityName(quality) << std::right << std::fixed
+                << std::setprecision(2) << std::setw(16) << flat_build_ms << std::setw(16) << instanced_build_ms
+                << std::setw(14) << top_level_ms / instanced_frames
+                << std::setw(16) << (flat_times.primary_ms + flat_times.ao_ms + flat_times.shadow_ms) / instanced_frames
+                << std::setw(20) << (instanced_times.primary_ms + instanced_times.ao_ms + instanced_times.shadow_ms) / instanced_frames
+                << std::endl;
+        }
+    }
+
+    if (kernel_frames > 0)
+    {
+        // The AmbientOcclusion sample with its kernels built as C++ next to
+        // the hand written ports of cpu_workload.cpp, scalar and SIMD, on the
+        // same hierarchy
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        AoKernelRenderer renderer(scene, camera, w, h, ao_rays_per_hit);
+        const ShadingMode shading_modes[] = { ShadingMode::kScalar, ShadingMode::kSimd };
+        AoKernelTimes path_times[3];
+        RayBuffer &ao_rays = g_frame_buffers.ao_rays;
+        HitBuffer &primary_hits = g_frame_buffers.primary_hits;
+        BufferVector<int32_t> &occlusion_hits = g_frame_buffers.occlusion_hits;
+        AccumBuffer &ao_accum = g_frame_buffers.ao_accum;
+        primary_hits.resize(primary_rays.size());
+
+        for (int frame = 0; frame < kernel_frames; ++frame)
+        {
+            renderer.RenderFrame(intersector, frame, path_times[0]);
+
+            for (int mode = 0; mode < 2; ++mode)
+            {
+                AoKernelTimes &times = path_times[1 + mode];
+                ao_accum.assign(primary_rays.size(), Rgba());
+                auto start = std::chrono::high_resolution_clock::now();
+                GenerateCameraRays(camera, w, h, primary_rays);
+                times.camera_ms += ElapsedMs(start);
+                start = std::chrono::high_resolution_clock::now();
+                intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+                times.primary_ms += ElapsedMs(start);
+                start = std::chrono::high_resolution_clock::now();
+                GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, ao_rays, shading_modes[mode]);
+                times.shade_ms += ElapsedMs(start);
+                occlusion_hits.resize(ao_rays.size());
+                start = std::chrono::high_resolution_clock::now();
+                intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), occlusion_hits.data());
+                times.ao_ms += ElapsedMs(start);
+                times.ao_ray_count += ao_rays.size();
+                start = std::chrono::high_resolution_clock::now();
+                AccumulateAo(ao_rays, occlusion_hits.data(), ao_rays_per_hit, ao_accum);
+                times.process_ms += ElapsedMs(start);
+            }
+        }
+
+        std::cout << std::endl << "Host kernels: ambient_occlusion.cl for " << kernel_frames << " frames, "
+            << GetBuildQualityName(options.quality) << " build, ms per frame" << std::endl;
+        std::cout << std::left << std::setw(12) << "path" << std::right << std::setw(10) << "camera" << std::setw(10) << "primary"
+            << std::setw(10) << "shade" << std::setw(10) << "ao" << std::setw(10) << "process" << std::setw(10) << "frame"
+            << std::setw(14) << "ao rays" << std::endl;
+        for (int path = 0; path < 3; ++path)
+        {
+            const AoKernelTimes &times = path_times[path];
+            std::string name = path == 0 ? std::string("kernels") : std::string("port ") + GetShadingModeName(shading_modes[path - 1]);
+            std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+                << std::setprecision(2) << std::setw(10) << times.camera_ms / kernel_frames
+                << std::setw(10) << times.primary_ms / kernel_frames << std::setw(10) << times.shade_ms / kernel_frames
+                << std::setw(10) << times.ao_ms / kernel_frames << std::setw(10) << times.process_ms / kernel_frames
+                << std::setw(10) << (times.camera_ms + times.primary_ms + times.shade_ms + times.ao_ms + times.process_ms) / kernel_frames
+                << std::setw(14) << times.ao_ray_count / kernel_frames << std::endl;
+        }
+    }
+
+    if (tile_frames > 0)
+    {
+        // Whole AO frames as wavefronts, a stage over the full frame at a
+        // time, against the tiled loop at a few tile sizes. The tiled sums
+        // must match the wavefront ones exactly.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        RayBuffer &ao_rays = g_frame_buffers.ao_rays;
+        HitBuffer &primary_hits = g_frame_buffers.primary_hits;
+        BufferVector<int32_t> &occlusion_hits = g_frame_buffers.occlusion_hits;
+        AccumBuffer wavefront_accum((size_t)w * h, Rgba());
+        primary_hits.resize(primary_rays.size());
+
+        double wavefront_ms = 0.0;
+        for (int frame = 0; frame < tile_frames; ++frame)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            GenerateCameraRays(camera, w, h, primary_rays);
+            intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+            GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, ao_rays);
+            occlusion_hits.resize(ao_rays.size());
+            intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), occlusion_hits.data());
+            AccumulateAo(ao_rays, occlusion_hits.data(), ao_rays_per_hit, wavefront_accum);
+            wavefront_ms += ElapsedMs(start);
+        }
+
+        std::cout << std::endl << "Tiled AO: " << tile_frames << " frames, " << GetBuildQualityName(options.quality)
+            << " build" << std::endl;
+        std::cout << std::left << std::setw(12) << "loop" << std::right << std::setw(12) << "frame ms"
+            << std::setw(10) << "speedup" << std::setw(8) << "match" << std::endl;
+        std::cout << std::left << std::setw(12) << "wavefront" << std::right << std::fixed << std::setprecision(2)
+            << std::setw(12) << wavefront_ms / tile_frames << std::setw(10) << 1.0 << std::setw(8) << "-" << std::endl;
+
+        for (int tile_size : { 16, 32, 64 })
+        {
+            AccumBuffer accum((size_t)w * h, Rgba());
+            double tiled_ms = 0.0;
+            for (int frame = 0; frame < tile_frames; ++frame)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                RenderAoTiles(intersector, scene, camera, w, h, ao_rays_per_hit, frame, accum, tile_size);
+                tiled_ms += ElapsedMs(start);
+            }
+
+            bool match = memcmp(accum.data(), wavefront_accum.data(), accum.size() * sizeof(Rgba)) == 0;
+            std::cout << std::left << std::setw(12) << ("tiles " + std::to_string(tile_size)) << std::right << std::fixed
+                << std::setprecision(2) << std::setw(12) << tiled_ms / tile_frames << std::setw(10) << wavefront_ms / tiled_ms
+                << std::setw(8) << (match ? "yes" : "no") << std::endl;
+        }
+    }
+
+    if (queue_frames > 0)
+    {
+        // AO ray emission at 1, 2, 4, ... threads: slots from a serial pass
+        // over the hits, a RayQueue reserving per hit as the kernel's atomic
+        // counter does, and a RayQueue reserving blocks. The block queue
+        // must accumulate the same image as the serial slots.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        RayBuffer &ao_rays = g_frame_buffers.ao_rays;
+        HitBuffer &primary_hits = g_frame_buffers.primary_hits;
+        BufferVector<int32_t> &occlusion_hits = g_frame_buffers.occlusion_hits;
+        primary_hits.resize(primary_rays.size());
+        intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+
+        std::cout << std::endl << "Ray queues: AO rays of " << queue_frames << " frames, ms per frame" << std::endl;
+        std::cout << std::left << std::setw(10) << "threads" << std::right << std::setw(12) << "slots"
+            << std::setw(12) << "per hit" << std::setw(12) << "blocks" << std::setw(14) << "reserves/ray"
+            << std::setw(8) << "match" << std::endl;
+
+        const unsigned max_threads = GetWorkerCount();
+        // One queue per block size, as a renderer keeps its own across frames
+        RayQueue hit_queue;
+        RayQueue queue;
+        for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads))
+        {
+            ThreadPool::SetSharedWorkerCount(threads);
+            double ms[3] = { 0.0, 0.0, 0.0 };
+            for (int frame = 0; frame < queue_frames; ++frame)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, ao_rays);
+                ms[0] += ElapsedMs(start);
+                start = std::chrono::high_resolution_clock::now();
+                GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, hit_queue, (uint32_t)ao_rays_per_hit);
+                ms[1] += ElapsedMs(start);
+                start = std::chrono::high_resolution_clock::now();
+                GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, queue);
+                ms[2] += ElapsedMs(start);
+            }
+
+            // Last frame of both through occlusion into an image
+            AccumBuffer slots_accum(primary_rays.size(), Rgba());
+            AccumBuffer queue_accum(primary_rays.size(), Rgba());
+            occlusion_hits.resize(ao_rays.size());
+            intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), occlusion_hits.data());
+            AccumulateAo(ao_rays, occlusion_hits.data(), ao_rays_per_hit, slots_accum);
+            BufferVector<int32_t> queue_hits((size_t)queue.GetBlockCount() * queue.GetBlockSize());
+            QueryOcclusion(intersector, queue, queue_hits.data());
+            AccumulateAo(queue, queue_hits.data(), ao_rays_per_hit, queue_accum);
+            bool match = queue.GetDroppedRayCount() == 0 && queue.GetRayCount() == ao_rays.size() &&
+                memcmp(slots_accum.data(), queue_accum.data(), slots_accum.size() * sizeof(Rgba)) == 0;
+
+            std::cout << std::left << std::setw(10) << threads << std::right << std::fixed << std::setprecision(2)
+                << std::setw(12) << ms[0] / queue_frames << std::setw(12) << ms[1] / queue_frames
+                << std::setw(12) << ms[2] / queue_frames << std::setprecision(4)
+                << std::setw(14) << (double)queue.GetBlockCount() / std::max<size_t>(ao_rays.size(), 1)
+                << std::setw(8) << (match ? "yes" : "no") << std::endl;
+            if (threads == max_threads)
+                break;
+        }
+        ThreadPool::SetSharedWorkerCount(max_threads);
+    }
+
+    if (pipeline_frames > 0)
+    {
+        // AO and shadow frames through a FramePipeline with 1, 2 and 3
+        // frames in flight: camera rays and primary hits, shading of the
+        // hits into AO and shadow rays, occlusion of both, accumulation.
+        // Accumulation runs in frame order, so the sums must not change
+        // with the depth.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+        intersector.Commit(options);
+
+        struct SlotBuffers
+        {
+            RayBuffer               primary_rays;
+            HitBuffer               primary_hits;
+            RayBuffer               ao_rays;
+            RayBuffer               shadow_rays;
+            BufferVector<int32_t>   ao_hits;
+            BufferVector<int32_t>   shadow_hits;
+        };
+
+        std::cout << std::endl << "Pipelined frames: " << pipeline_frames << " frames of ao and shadow rays, "
+            << GetWorkerCount() << " threads" << std::endl;
+        std::cout << std::left << std::setw(12) << "in flight" << std::right << std::setw(12) << "frame ms"
+            << std::setw(10) << "speedup" << std::setw(8) << "match" << std::endl;
+
+        AccumBuffer sequential_accum;
+        double sequential_ms = 0.0;
+        for (uint32_t depth = 1; depth <= 3; ++depth)
+        {
+            std::vector<SlotBuffers> slots(depth);
+            AccumBuffer accum((size_t)w * h, Rgba());
+
+            FramePipeline pipeline(depth);
+            pipeline.AddStage([&](int, uint32_t slot)
+            {
+                SlotBuffers &buffers = slots[slot];
+                GenerateCameraRays(camera, w, h, buffers.primary_rays);
+                buffers.primary_hits.resize(buffers.primary_rays.size());
+                intersector.QueryIntersection(buffers.primary_rays.data(), buffers.primary_rays.size(),
+                    buffers.primary_hits.data());
+            });
+            pipeline.AddStage([&](int frame, uint32_t slot)
+            {
+                SlotBuffers &buffers = slots[slot];
+                GenerateAoRays(scene, buffers.primary_rays, buffers.primary_hits, ao_rays_per_hit, frame, buffers.ao_rays);
+                GenerateShadowRays(scene, buffers.primary_rays, buffers.primary_hits, lights, frame, buffers.shadow_rays);
+            });
+            pipeline.AddStage([&](int, uint32_t slot)
+            {
+                SlotBuffers &buffers = slots[slot];
+                buffers.ao_hits.resize(buffers.ao_rays.size());
+                intersector.QueryOcclusion(buffers.ao_rays.data(), buffers.ao_rays.size(), buffers.ao_hits.data());
+                buffers.shadow_hits.resize(buffers.shadow_rays.size());
+                intersector.QueryOcclusion(buffers.shadow_rays.data(), buffers.shadow_rays.size(),
+                    buffers.shadow_hits.data());
+            });
+            pipeline.AddStage([&](int, uint32_t slot)
+            {
+                SlotBuffers &buffers = slots[slot];
+                AccumulateAo(buffers.ao_rays, buffers.ao_hits.data(), ao_rays_per_hit, accum);
+            });
+
+            auto start = std::chrono::high_resolution_clock::now();
+            pipeline.Run(pipeline_frames);
+            double ms = ElapsedMs(start);
+
+            if (depth == 1)
+            {
+                sequential_ms = ms;
+                sequential_accum.swap(accum);
+            }
+            bool match = depth == 1 ||
+                memcmp(accum.data(), sequential_accum.data(), accum.size() * sizeof(Rgba)) == 0;
+            std::cout << std::left << std::setw(12) << depth << std::right << std::fixed << std::setprecision(2)
+                << std::setw(12) << ms / pipeline_frames << std::setw(10) << sequential_ms / ms
+                << std::setw(8) << (depth == 1 ? "-" : (match ? "yes" : "no")) << std::endl;
+        }
+    }
+
+    if (!placements.empty())
+    {
+        // Pools pinned to the first 1, 2, ... nodes, one worker per CPU there.
+        // The main thread stays on node 0 so one node is really one socket.
+        unsigned node_count = GetNumaNodeCount();
+        PinThreadToNumaNode(0);
+        std::cout << std::endl << "NUMA scaling: " << node_count << " nodes, " << frame_count << " frames" << std::endl;
+        std::cout << std::left << std::setw(8) << "nodes" << std::right << std::setw(10) << "threads"
+            << std::left << std::setw(2) << "" << std::setw(12) << "placement" << std::right
+            << std::setw(14) << "primary MR/s" << std::setw(10) << "ao MR/s" << std::setw(14) << "shadow MR/s"
+            << std::setw(10) << "speedup" << std::endl;
+
+        std::vector<double> single_node_ms(placements.size(), 0.0);
+        for (unsigned nodes = 1; nodes <= node_count; ++nodes)
+        {
+            unsigned threads = 0;
+            for (unsigned node = 0; node < nodes; ++node)
+                threads += (unsigned)GetNumaNodeCpus(node).size();
+            ThreadPool::SetSharedWorkerCount(threads, nodes);
+
+            for (size_t p = 0; p < placements.size(); ++p)
+            {
+                BvhBuildOptions options;
+                options.quality = qualities.back();
+                options.node_format = formats.back();
+                options.leaf_format = leaf_formats.back();
+                options.duplication_budget = duplication_budget;
+                options.numa_placement = placements[p];
+                intersector.Commit(options);
+
+                // Fresh buffers are first touched by the workers of this pool
+                // in the first frame, which is not timed
+                g_frame_buffers = FrameBuffers();
+                RayBuffer().swap(primary_rays);
+                GenerateCameraRays(camera, w, h, primary_rays);
+                FrameTimes warmup, times;
+                TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, 0, warmup);
+                for (int frame = 0; frame < frame_count; ++frame)
+                    TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, frame, times);
+
+                double total_ms = times.primary_ms + times.ao_ms + times.shadow_ms;
+                if (nodes == 1)
+                    single_node_ms[p] = total_ms;
+                std::cout << std::left << std::setw(8) << nodes << std::right << std::setw(10) << threads
+                    << std::left << std::setw(2) << "" << std::setw(12) << GetNumaPlacementName(placements[p])
+                    << std::right << std::fixed << std::setprecision(2)
+                    << std::setw(14) << (double)primary_rays.size() * frame_count / (times.primary_ms * 1e3)
+                    << std::setw(10) << (double)times.ao_ray_count / (times.ao_ms * 1e3)
+                    << std::setw(14) << (double)times.shadow_ray_count / (times.shadow_ms * 1e3)
+                    << std::setw(10) << single_node_ms[p] / total_ms << std::endl;
+            }
+        }
+        ThreadPool::SetSharedWorkerCount(thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    if (!page_modes.empty())
+    {
+        // The AO workload with the BVH and every frame buffer allocated anew
+        // under each mode. Faults are counted over the first frame, which
+        // touches the buffers, TLB misses over the AO queries that follow.
+        // The pool restarts once the counter is open so workers inherit it.
+        TlbMissCounter tlb_misses;
+        ThreadPool::SetSharedWorkerCount(GetWorkerCount());
+        std::cout << std::endl << "Huge pages: " << frame_count << " frames of ao rays";
+        if (!tlb_misses.IsAvailable())
+            std::cout << ", no dTLB miss counter on this machine";
+        std::cout << std::endl << std::left << std::setw(13) << "pages" << std::right << std::setw(10) << "huge MB"
+            << std::setw(14) << "page faults" << std::setw(18) << "dTLB misses/ray" << std::setw(10) << "ao MR/s"
+            << std::setw(12) << "accum ms" << std::endl;
+
+        const HugePageMode default_mode = GetHugePageMode();
+        for (auto mode : page_modes)
+        {
+            SetHugePageMode(mode);
+            BvhBuildOptions options;
+            options.quality = qualities.back();
+            options.node_format = formats.back();
+            options.leaf_format = leaf_formats.back();
+            options.duplication_budget = duplication_budget;
+            intersector.Commit(options);
+
+            g_frame_buffers = FrameBuffers();
+            RayBuffer().swap(primary_rays);
+            GenerateCameraRays(camera, w, h, primary_rays);
+            uint64_t faults = GetPageFaults();
+            FrameTimes warmup;
+            TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, 0, warmup);
+            faults = GetPageFaults() - faults;
+
+            HitBuffer &primary_hits = g_frame_buffers.primary_hits;
+            RayBuffer &ao_rays = g_frame_buffers.ao_rays;
+            BufferVector<int32_t> &occlusion_hits = g_frame_buffers.occlusion_hits;
+            FrameTimes times;
+            uint64_t misses = 0;
+            for (int frame = 0; frame < frame_count; ++frame)
+            {
+                intersector.QueryIntersection(primary_rays.data(), primary_rays.size(), primary_hits.data());
+                GenerateAoRays(scene, primary_rays, primary_hits, ao_rays_per_hit, frame, ao_rays);
+                occlusion_hits.resize(ao_rays.size());
+
+                tlb_misses.Start();
+                auto start = std::chrono::high_resolution_clock::now();
+                intersector.QueryOcclusion(ao_rays.data(), ao_rays.size(), occlusion_hits.data());
+                times.ao_ms += ElapsedMs(start);
+                misses += tlb_misses.Stop();
+                times.ao_ray_count += ao_rays.size();
+
+                start = std::chrono::high_resolution_clock::now();
+                AccumulateAo(ao_rays, occlusion_hits.data(), ao_rays_per_hit, g_frame_buffers.ao_accum);
+                times.accum_ms += ElapsedMs(start);
+            }
+
+            std::cout << std::left << std::setw(13) << GetHugePageModeName(mode) << std::right << std::fixed
+                << std::setprecision(2) << std::setw(10) << GetHugePageBytes() / double(1 << 20) << std::setw(14) << faults;
+            if (tlb_misses.IsAvailable())
+                std::cout << std::setw(18) << (double)misses / std::max<size_t>(times.ao_ray_count, 1);
+            else
+                std::cout << std::setw(18) << "-";
+            std::cout << std::setw(10) << (double)times.ao_ray_count / (times.ao_ms * 1e3)
+                << std::setw(12) << times.accum_ms / std::max(frame_count, 1) << std::endl;
+        }
+
+        const BufferStats stats = GetBufferStats();
+        std::cout << "Explicit huge page allocations: " << stats.explicit_pages << ", fell back to transparent: "
+            << stats.fallbacks << std::endl;
+        SetHugePageMode(default_mode);
+    }
+
+    if (background_frames > 0)
+    {
+        // The scene is edited every frame. Blocking rebuilds it before the
+        // frame traces, background traces the last finished build while the
+        // next one runs on its own threads. Latency counts the frames from
+        // an edit to the first frame that traces it, per swap and for the
+        // oldest edit the swapped build holds. Edits made while a build is
+        // pending wait for the next one, so this is build time plus a frame
+        // and more. The blocking rebuild has none. Build time and latency
+        // read n/a when no build was swapped in within the frames. Shading
+        // reads the edited vertices either way, the offsets are too small to
+        // matter for timing.
+        BvhBuildOptions options;
+        options.quality = qualities.back();
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+
+        std::cout << std::endl << "Background rebuild: " << background_frames << " frames, "
+            << GetBuildQualityName(options.quality) << " build, scene edited every frame" << std::endl;
+        std::cout << std::left << std::setw(14) << "rebuild" << std::right << std::setw(10) << "workers"
+            << std::setw(12) << "frame ms" << std::setw(12) << "max ms" << std::setw(12) << "build ms"
+            << std::setw(10) << "swaps" << std::setw(10) << "latency" << std::endl;
+
+        SceneAnimator animator(scene, 0.002f, 0.02f);
+        std::vector<unsigned> build_workers = { 0, 1 };
+        if (GetWorkerCount() / 2 > 1)
+            build_workers.push_back(GetWorkerCount() / 2);
+        for (unsigned workers : build_workers)
+        {
+            // 0 stands for the blocking rebuild on the shared pool
+            Intersector blocking;
+            DoubleBufferedIntersector background(options, std::max(workers, 1u));
+            animator.Apply(scene, 0.f);
+            if (workers == 0)
+            {
+                blocking.AttachScene(scene);
+                blocking.Commit(options);
+            }
+            else
+                background.Commit(scene);
+
+            FrameTimes times;
+            double total_ms = 0.0, max_ms = 0.0, build_ms = 0.0;
+            // Frames of the oldest edit no build holds yet, -1 when there is
+            // none, and of the oldest edit the pending build holds
+            int builds = 0, latency = 0, unbuilt_edit = -1, pending_edit = 0;
+            for (int frame = 1; frame <= background_frames; ++frame)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                animator.Apply(scene, 0.1f * frame);
+                if (unbuilt_edit < 0)
+                    unbuilt_edit = frame;
+                if (workers == 0)
+                {
+                    auto build_start_time = std::chrono::high_resolution_clock::now();
+                    blocking.AttachScene(scene);
+                    blocking.Commit(options);
+                    build_ms += ElapsedMs(build_start_time);
+                    ++builds;
+                    TraceFrame(blocking, scene, primary_rays, ao_rays_per_hit, lights, frame, times);
+                }
+                else
+                {
+                    if (background.StartRebuild(scene))
+                    {
+                        pending_edit = unbuilt_edit;
+                        unbuilt_edit = -1;
+                    }
+                    TraceFrame(background.GetCurrent(), scene, primary_rays, ao_rays_per_hit, lights, frame, times);
+                    if (background.Swap())
+                    {
+                        build_ms += background.GetLastBuildMs();
+                        latency += frame + 1 - pending_edit;
+                        ++builds;
+                    }
+                }
+                const double ms = ElapsedMs(start);
+                total_ms += ms;
+                max_ms = std::max(max_ms, ms);
+            }
+
+            std::cout << std::left << std::setw(14) << (workers == 0 ? "blocking" : "background") << std::right
+                << std::setw(10) << (workers == 0 ? GetWorkerCount() : workers) << std::fixed << std::setprecision(2)
+                << std::setw(12) << total_ms / background_frames << std::setw(12) << max_ms;
+            if (builds == 0)
+                std::cout << std::setw(12) << "n/a" << std::setw(10) << builds << std::setw(10) << "n/a" << std::endl;
+            else
+                std::cout << std::setw(12) << build_ms / builds << std::setw(10) << builds
+                    << std::setw(10) << (workers == 0 ? 0.0 : (double)latency / builds) << std::endl;
+        }
+        animator.Apply(scene, 0.f);
+    }
+
+    if (animate_frames <= 0)
+        return 0;
+
+    // Deforming geometry: refit every frame, rebuild once the SAH cost drifts too far
+    std::cout << std::endl << "Animated: " << animate_frames << " frames, rebuild above " << rebuild_threshold << "x build SAH" << std::endl;
+    std::cout << std::left << std::setw(10) << "quality" << std::right
+        << std::setw(12) << "build ms" << std::setw(12) << "update ms" << std::setw(10) << "rebuilds"
+        << std::setw(12) << "SAH drift" << std::setw(12) << "trace ms" << std::endl;
+
+    SceneAnimator animator(scene, 0.002f, 0.02f);
+    for (auto quality : qualities)
+    {
+        BvhBuildOptions options;
+        options.quality = quality;
+        options.node_format = formats.back();
+        options.leaf_format = leaf_formats.back();
+        options.duplication_budget = duplication_budget;
+
+        animator.Apply(scene, 0.f);
+        intersector.UpdateVertices(scene);
+        auto start = std::chrono::high_resolution_clock::now();
+        intersector.Commit(options);
+        double build_ms = ElapsedMs(start);
+
+        double update_ms = 0.0, drift = 0.0;
+        FrameTimes times;
+        int rebuilds = 0;
+        for (int frame = 1; frame <= animate_frames; ++frame)
+        {
+            animator.Apply(scene, 0.1f * frame);
+
+            start = std::chrono::high_resolution_clock::now();
+            intersector.UpdateVertices(scene);
+            rebuilds += intersector.Refit(rebuild_threshold) ? 1 : 0;
+            update_ms += ElapsedMs(start);
+
+            const Bvh &bvh = intersector.GetBvh();
+            drift += bvh.GetSahCost() / bvh.GetBuildSahCost();
+
+            TraceFrame(intersector, scene, primary_rays, ao_rays_per_hit, lights, frame, times);
+        }
+
+        std::cout << std::left << std::setw(10) << GetBuildQualityName(quality) << std::right << std::fixed
+            << std::setprecision(2) << std::setw(12) << build_ms << std::setw(12) << update_ms / animate_frames
+            << std::setw(10) << rebuilds << std::setw(12) << drift / animate_frames
+            << std::setw(12) << (times.primary_ms + times.ao_ms + times.shadow_ms) / animate_frames << std::endl;
+    }
+
+    return 0;
+}
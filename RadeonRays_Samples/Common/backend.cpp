@@ -0,0 +1,328 @@
+#include "backend.h"
+#include "utils.h"
+#include "radeon_rays_cl.h"
+#include "cpu_buffer.h"
+#include "cpu_intersector.h"
+#include "cpu_ray_sort.h"
+
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+using namespace RadeonRays;
+
+static_assert(sizeof(ray) == sizeof(Cpu::Ray), "Cpu::Ray must match the RadeonRays ray");
+static_assert(sizeof(Intersection) == sizeof(Cpu::Intersection), "Cpu::Intersection must match the RadeonRays one");
+
+const char *GetBackendName(Backend backend)
+{
+    switch (backend)
+    {
+    case Backend::kOpenCl:
+        return "opencl";
+    case Backend::kEmbree:
+        return "embree";
+    case Backend::kVulkan:
+        return "vulkan";
+    case Backend::kCpu:
+        return "cpu";
+    }
+    return "unknown";
+}
+
+bool ParseBackend(const char *name, Backend &backend)
+{
+    for (auto b : { Backend::kOpenCl, Backend::kEmbree, Backend::kVulkan, Backend::kCpu })
+    {
+        if (strcmp(name, GetBackendName(b)) == 0)
+        {
+            backend = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ParseBackendOption(int argc, char *argv[], int &a, BackendOptions &options)
+{
+    if (strcmp(argv[a], "-sort-rays") == 0)
+    {
+        options.sort_rays = true;
+        return true;
+    }
+    if (a + 1 >= argc)
+        return false;
+
+    if (strcmp(argv[a], "-backend") == 0)
+    {
+        if (!ParseBackend(argv[a + 1], options.backend))
+            return false;
+        ++a;
+        return true;
+    }
+    if (strcmp(argv[a], "-platform") == 0)
+    {
+        options.platform_index = atoi(argv[++a]);
+        return true;
+    }
+    if (strcmp(argv[a], "-device") == 0)
+    {
+        options.device_index = atoi(argv[++a]);
+        return true;
+    }
+    if (strcmp(argv[a], "-backend-device") == 0)
+    {
+        options.backend_device = atoi(argv[++a]);
+        return true;
+    }
+    return false;
+}
+
+const char *GetBackendUsage()
+{
+    return "[-backend opencl|embree|vulkan|cpu] [-platform <index>] [-device <index>] [-backend-device <index>] [-sort-rays]";
+}
+
+// RadeonRays on the samples' context, queries run on the CLW buffers
+class OpenClRayTracer : public RayTracer
+{
+public:
+    OpenClRayTracer(CLWContext context, const Scene &scene)
+        : api_(InitIntersectorApi(context))
+    {
+        UploadSceneToIntersector(scene, api_);
+        api_->Commit();
+    }
+
+    ~OpenClRayTracer()
+    {
+        for (auto &buffer : buffers_)
+            api_->DeleteBuffer(buffer.second);
+        IntersectionApi::Delete(api_);
+    }
+
+    void QueryIntersection(const CLWBuffer<ray> &rays, int count, CLWBuffer<Intersection> &hits) override
+    {
+        api_->QueryIntersection(getBuffer(rays), count, getBuffer(hits), nullptr, nullptr);
+    }
+
+    void QueryOcclusion(const CLWBuffer<ray> &rays, int count, CLWBuffer<int> &hits) override
+    {
+        api_->QueryOcclusion(getBuffer(rays), count, getBuffer(hits), nullptr, nullptr);
+    }
+
+    bool IsQueued() const override { return true; }
+
+private:
+    // Wraps every CLW buffer once
+    template <typename T>
+    Buffer *getBuffer(const CLWBuffer<T> &buffer)
+    {
+        cl_mem mem = buffer;
+        Buffer *&wrapper = buffers_[mem];
+        if (!wrapper)
+            wrapper = CreateFromOpenClBuffer(api_, mem);
+        return wrapper;
+    }
+
+    IntersectionApi                 *api_;
+    std::map<cl_mem, Buffer *>      buffers_;
+};
+
+// RadeonRays on a device of its own, rays and results go through mapped
+// RadeonRays buffers
+class HostRayTracer : public RayTracer
+{
+public:
+    HostRayTracer(CLWContext context, const Scene &scene, DeviceInfo::Platform platform, int device)
+        : context_(context)
+        , api_(nullptr)
+        , rays_(nullptr)
+        , hits_(nullptr)
+        , capacity_(0)
+    {
+        IntersectionApi::SetPlatform(platform);
+        if (device < 0 || (uint32_t)device >= IntersectionApi::GetDeviceCount())
+        {
+            IntersectionApi::SetPlatform(DeviceInfo::kAny);
+            throw std::runtime_error("No such RadeonRays device for this backend, is it built in?");
+        }
+        api_ = IntersectionApi::Create((uint32_t)device);
+        IntersectionApi::SetPlatform(DeviceInfo::kAny);
+
+        UploadSceneToIntersector(scene, api_);
+        api_->Commit();
+    }
+
+    ~HostRayTracer()
+    {
+        if (rays_)
+            api_->DeleteBuffer(rays_);
+        if (hits_)
+            api_->DeleteBuffer(hits_);
+        IntersectionApi::Delete(api_);
+    }
+
+    void QueryIntersection(const CLWBuffer<ray> &rays, int count, CLWBuffer<Intersection> &hits) override
+    {
+        if (count <= 0)
+            return;
+        upload(rays, count);
+        Event *event = nullptr;
+        api_->QueryIntersection(rays_, count, hits_, nullptr, &event);
+        finish(event);
+        download(hits, count);
+    }
+
+    void QueryOcclusion(const CLWBuffer<ray> &rays, int count, CLWBuffer<int> &hits) override
+    {
+        if (count <= 0)
+            return;
+        upload(rays, count);
+        Event *event = nullptr;
+        api_->QueryOcclusion(rays_, count, hits_, nullptr, &event);
+        finish(event);
+        download(hits, count);
+    }
+
+private:
+    void finish(Event *event)
+    {
+        if (!event)
+            return;
+        event->Wait();
+        api_->DeleteEvent(event);
+    }
+
+    // Grows the RadeonRays buffers to count rays, hits_ holds either result
+    void reserve(int count)
+    {
+        if (count <= capacity_)
+            return;
+        if (rays_)
+            api_->DeleteBuffer(rays_);
+        if (hits_)
+            api_->DeleteBuffer(hits_);
+        rays_ = api_->CreateBuffer(count * sizeof(ray), nullptr);
+        hits_ = api_->CreateBuffer(count * sizeof(Intersection), nullptr);
+        capacity_ = count;
+    }
+
+    void upload(const CLWBuffer<ray> &rays, int count)
+    {
+        reserve(count);
+        ray *mapped = nullptr;
+        Event *event = nullptr;
+        api_->MapBuffer(rays_, kMapWrite, 0, count * sizeof(ray), (void **)&mapped, &event);
+        finish(event);
+        context_.ReadBuffer(0, rays, mapped, count).Wait();
+        event = nullptr;
+        api_->UnmapBuffer(rays_, mapped, &event);
+        finish(event);
+    }
+
+    template <typename T>
+    void download(CLWBuffer<T> &hits, int count)
+    {
+        T *mapped = nullptr;
+        Event *event = nullptr;
+        api_->MapBuffer(hits_, kMapRead, 0, count * sizeof(T), (void **)&mapped, &event);
+        finish(event);
+        context_.WriteBuffer(0, hits, mapped, count).Wait();
+        event = nullptr;
+        api_->UnmapBuffer(hits_, mapped, &event);
+        finish(event);
+    }
+
+    CLWContext          context_;
+    IntersectionApi     *api_;
+    Buffer              *rays_;
+    Buffer              *hits_;
+    int                 capacity_;
+};
+
+// Cpu::Intersector, rays and results go through host buffers
+class CpuRayTracer : public RayTracer
+{
+public:
+    CpuRayTracer(CLWContext context, const Scene &scene, bool sort_rays)
+        : context_(context)
+        , sort_rays_(sort_rays)
+    {
+        intersector_.AttachScene(scene);
+        intersector_.Commit(Cpu::BvhBuildOptions());
+    }
+
+    void QueryIntersection(const CLWBuffer<ray> &rays, int count, CLWBuffer<Intersection> &hits) override
+    {
+        if (count <= 0)
+            return;
+        upload(rays, count);
+        hits_.resize(count);
+        if (sort_rays_)
+            sorter_.QueryIntersection(intersector_, rays_.data(), count, hits_.data());
+        else
+            intersector_.QueryIntersection(rays_.data(), count, hits_.data());
+        context_.WriteBuffer(0, hits, reinterpret_cast<Intersection *>(hits_.data()), count).Wait();
+    }
+
+    void QueryOcclusion(const CLWBuffer<ray> &rays, int count, CLWBuffer<int> &hits) override
+    {
+        if (count <= 0)
+            return;
+        upload(rays, count);
+        occlusion_hits_.resize(count);
+        if (sort_rays_)
+            sorter_.QueryOcclusion(intersector_, rays_.data(), count, occlusion_hits_.data());
+        else
+            intersector_.QueryOcclusion(rays_.data(), count, occlusion_hits_.data());
+        context_.WriteBuffer(0, hits, occlusion_hits_.data(), count).Wait();
+    }
+
+private:
+    void upload(const CLWBuffer<ray> &rays, int count)
+    {
+        rays_.resize(count);
+        context_.ReadBuffer(0, rays, reinterpret_cast<ray *>(rays_.data()), count).Wait();
+    }
+
+    CLWContext                      context_;
+    Cpu::Intersector                intersector_;
+    bool                            sort_rays_;
+    Cpu::RaySorter                  sorter_;
+    Cpu::BufferVector<Cpu::Ray>     rays_;
+    Cpu::BufferVector<Cpu::Intersection> hits_;
+    Cpu::BufferVector<int32_t>      occlusion_hits_;
+};
+
+static std::unique_ptr<RayTracer> createRayTracer(const BackendOptions &options, CLWContext context, const Scene &scene)
+{
+    switch (options.backend)
+    {
+    case Backend::kOpenCl:
+        return std::unique_ptr<RayTracer>(new OpenClRayTracer(context, scene));
+    case Backend::kEmbree:
+        return std::unique_ptr<RayTracer>(new HostRayTracer(context, scene, DeviceInfo::kEmbree, options.backend_device));
+    case Backend::kVulkan:
+        return std::unique_ptr<RayTracer>(new HostRayTracer(context, scene, DeviceInfo::kVulkan, options.backend_device));
+    case Backend::kCpu:
+        return std::unique_ptr<RayTracer>(new CpuRayTracer(context, scene, options.sort_rays));
+    }
+    throw std::runtime_error(std::string("Unknown backend ") + GetBackendName(options.backend));
+}
+
+std::unique_ptr<RayTracer> CreateRayTracer(const BackendOptions &options, CLWContext context, const Scene &scene)
+{
+    try
+    {
+        return createRayTracer(options, context, scene);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Can't start the " << GetBackendName(options.backend) << " backend: " << e.what() << std::endl;
+        std::cerr << "Backend options: " << GetBackendUsage() << std::endl;
+        return nullptr;
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <memory>
+
+#include "radeon_rays.h"
+#include "CLWContext.h"
+#include "CLWBuffer.h"
+#include "scene.h"
+
+// Intersection backends the samples can trace with. Shading always runs as
+// OpenCL kernels on the context InitCLW creates; the backend only answers
+// the ray queries.
+enum class Backend
+{
+    // RadeonRays on the OpenCL device of the samples' context, rays never
+    // leave device memory
+    kOpenCl,
+    // RadeonRays built with RR_USE_EMBREE
+    kEmbree,
+    // RadeonRays built with RR_USE_VULKAN
+    kVulkan,
+    // Cpu::Intersector on the shared thread pool
+    kCpu
+};
+
+const char *GetBackendName(Backend backend);
+bool ParseBackend(const char *name, Backend &backend);
+
+struct BackendOptions
+{
+    Backend backend = Backend::kOpenCl;
+    // OpenCL platform and device for InitCLW, see there for negative values
+    int     platform_index = 0;
+    int     device_index = 0;
+    // Which of the devices RadeonRays lists for kEmbree or kVulkan
+    int     backend_device = 0;
+    // kCpu sorts every ray buffer for coherence before the query and puts
+    // the results back in ray order, see Cpu::RaySorter
+    bool    sort_rays = false;
+};
+
+// Reads a -backend, -platform, -device, -backend-device or -sort-rays option
+// at argv[a] and moves a to its last argument. Returns false for anything
+// else.
+bool ParseBackendOption(int argc, char *argv[], int &a, BackendOptions &options);
+
+// The options ParseBackendOption reads, for usage messages
+const char *GetBackendUsage();
+
+// Ray queries on buffers of the samples' OpenCL context, with the results in
+// the layout of isect.cl whatever the backend. Backends other than kOpenCl
+// copy rays and results through host memory.
+class RayTracer
+{
+public:
+    virtual ~RayTracer() {}
+
+    virtual void QueryIntersection(const CLWBuffer<RadeonRays::ray> &rays, int count,
+        CLWBuffer<RadeonRays::Intersection> &hits) = 0;
+    // 1 for rays that hit something, -1 for the others, as RadeonRays writes them
+    virtual void QueryOcclusion(const CLWBuffer<RadeonRays::ray> &rays, int count, CLWBuffer<int> &hits) = 0;
+
+    // True when queries are only queued on the context's queue 0 and return
+    // before they run. The other backends read rays and write results
+    // through queue 0 and wait for it, so the host waits for everything
+    // queued before a query and frames in flight can't overlap.
+    virtual bool IsQueued() const { return false; }
+};
+
+// Builds the acceleration structure for scene on the backend options pick.
+// Returns null after printing the error and the backend options to
+// std::cerr when that backend is not built in or fails to start.
+std::unique_ptr<RayTracer> CreateRayTracer(const BackendOptions &options, CLWContext context, const Scene &scene);
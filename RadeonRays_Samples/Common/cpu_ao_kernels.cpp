@@ -0,0 +1,233 @@
+#include "cpu_ao_kernels.h"
+#include "cpu_cl_host.h"
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+// ambient_occlusion.cl and the Common/*.cl files it includes, unchanged.
+// Kernel signatures are fixed by the arguments the device host sets, some
+// parameters go unused on either side.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+namespace AoKernels
+{
+    using namespace ClHost;
+#include "ambient_occlusion.cl"
+}
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace Cpu
+{
+    static_assert(sizeof(AoKernels::Ray) == sizeof(Ray), "Ray must match the kernel layout");
+    static_assert(sizeof(AoKernels::Intersection) == sizeof(Intersection), "Intersection must match the kernel layout");
+    static_assert(sizeof(AoKernels::float4) == sizeof(Rgba), "Rgba must match float4");
+
+    struct AoKernelRenderer::Buffers
+    {
+        std::vector<AoKernels::Shape>   shapes;
+        std::vector<AoKernels::Vertex>  vertices;
+        std::vector<uint32_t>           indices;
+        AoKernels::CameraParams         camera;
+        RayBuffer                       primary_rays;
+        HitBuffer                       primary_hits;
+        RayBuffer                       ao_rays;
+        BufferVector<int32_t>           occlusion_hits;
+        AccumBuffer                     color;
+        AccumBuffer                     output;
+    };
+
+    static double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+    {
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    static AoKernels::float4 MakeFloat4(const Vec3 &v, float w)
+    {
+        return AoKernels::float4(v.x, v.y, v.z, w);
+    }
+
+    // Same as BuildSceneBuffers in utils.cpp
+    static void BuildKernelScene(const Scene &scene, std::vector<AoKernels::Shape> &shapes,
+        std::vector<AoKernels::Vertex> &vertices, std::vector<uint32_t> &indices)
+    {
+        size_t vertex_count = 0;
+        size_t index_count = 0;
+        for (auto &mesh : scene.meshes_)
+        {
+            AoKernels::Shape shape;
+            shape.base_vertex = (uint32_t)vertex_count;
+            shape.first_index = (uint32_t)index_count;
+            shape.light_id = -1;
+            shape.index_count = (uint32_t)mesh.indices_.size();
+            shapes.push_back(shape);
+
+            vertex_count += mesh.vertices_.size() / (mesh.vertex_stride_ / 4);
+            index_count += mesh.indices_.size();
+        }
+        vertices.resize(vertex_count);
+        indices.resize(index_count);
+
+        for (size_t m = 0; m < scene.meshes_.size(); ++m)
+        {
+            const Mesh &mesh = scene.meshes_[m];
+            const size_t stride = mesh.vertex_stride_ / 4;
+            std::copy(mesh.indices_.begin(), mesh.indices_.end(), indices.begin() + shapes[m].first_index);
+
+            AoKernels::Vertex *dst = vertices.data() + shapes[m].base_vertex;
+            ParallelFor(0, mesh.vertices_.size() / stride, 16384, [&](size_t begin, size_t end)
+            {
+                for (size_t a = begin; a < end; ++a)
+                {
+                    const float *data = mesh.vertices_.data() + a * stride;
+                    AoKernels::Vertex v;
+                    v.position = AoKernels::float3(data[0], data[1], data[2]);
+                    v.normal = AoKernels::float3(data[3], data[4], data[5]);
+                    v.tex_coords = AoKernels::float2(data[6], data[7]);
+                    v.color = AoKernels::float3(data[9], data[10], data[11]);
+                    v.padding = AoKernels::float2(0.f, 0.f);
+
+                    dst[a] = v;
+                }
+            });
+        }
+    }
+
+    // Only camera ray directions matter to the kernels, so instead of the
+    // inverse projection PrepareCameraParams computes, the matrix maps NDC on
+    // the z = 0 plane to the point one unit along the ray. Rays match
+    // GenerateCameraRays in cpu_workload.cpp.
+    static AoKernels::CameraParams MakeCameraParams(const Camera &camera, int w, int h)
+    {
+        Vec3 forward = Normalize(camera.center - camera.eye);
+        Vec3 right = Normalize(Cross(camera.up, forward));
+        Vec3 up = Cross(forward, right);
+        float tan_half_fovy = std::tan(camera.fovy * 3.14159265358979323846f / 360.f);
+        float aspect = (float)w / (float)h;
+
+        Vec3 c0 = right * (tan_half_fovy * aspect);
+        Vec3 c1 = up * tan_half_fovy;
+        Vec3 c3 = camera.eye + forward;
+
+        AoKernels::CameraParams params;
+        params.eye = MakeFloat4(camera.eye, 1.f);
+        params.near_far = AoKernels::float4(0.01f, 10000.f, 0.f, 0.f);
+        params.screen_dims = AoKernels::float4((float)w, (float)h, 1.f / w, 1.f / h);
+        params.view_proj_inv.m0 = AoKernels::float4(c0.x, c1.x, 0.f, c3.x);
+        params.view_proj_inv.m1 = AoKernels::float4(c0.y, c1.y, 0.f, c3.y);
+        params.view_proj_inv.m2 = AoKernels::float4(c0.z, c1.z, 0.f, c3.z);
+        params.view_proj_inv.m3 = AoKernels::float4(0.f, 0.f, 0.f, 1.f);
+        return params;
+    }
+
+    AoKernelRenderer::AoKernelRenderer(const Scene &scene, const Camera &camera, int w, int h, int rays_per_hit)
+        : buffers_(new Buffers())
+        , w_(w)
+        , h_(h)
+        , rays_per_hit_(rays_per_hit)
+    {
+        Buffers &b = *buffers_;
+        BuildKernelScene(scene, b.shapes, b.vertices, b.indices);
+        b.camera = MakeCameraParams(camera, w, h);
+
+        const size_t pixel_count = (size_t)w * h;
+        b.primary_rays.resize(pixel_count);
+        b.primary_hits.resize(pixel_count);
+        b.ao_rays.resize(pixel_count * rays_per_hit);
+        b.occlusion_hits.resize(pixel_count * rays_per_hit);
+        b.color.resize(pixel_count);
+        b.output.resize(pixel_count);
+        ParallelFor(0, pixel_count, 4096, [&](size_t begin, size_t end)
+        {
+            memset(&b.color[begin], 0, (end - begin) * sizeof(Rgba));
+            memset(&b.output[begin], 0, (end - begin) * sizeof(Rgba));
+        });
+    }
+
+    AoKernelRenderer::~AoKernelRenderer()
+    {
+    }
+
+    void AoKernelRenderer::RenderFrame(const Intersector &intersector, int frame_no, AoKernelTimes &times)
+    {
+        RenderRows(intersector, frame_no, 0, h_, times);
+    }
+
+    void AoKernelRenderer::RenderRows(const Intersector &intersector, int frame_no, int first_row, int row_count,
+        AoKernelTimes &times)
+    {
+        using ClHost::LaunchKernel;
+
+        Buffers &b = *buffers_;
+        const int first_pixel = first_row * w_;
+        const int pixel_count = row_count * w_;
+        if (pixel_count <= 0)
+            return;
+
+        auto *primary_rays = reinterpret_cast<AoKernels::Ray *>(b.primary_rays.data());
+        auto *primary_hits = reinterpret_cast<const AoKernels::Intersection *>(b.primary_hits.data());
+        auto *ao_rays = reinterpret_cast<AoKernels::Ray *>(b.ao_rays.data());
+        auto *color = reinterpret_cast<AoKernels::float4 *>(b.color.data());
+        auto *output = reinterpret_cast<AoKernels::float4 *>(b.output.data());
+
+        // The rows are work items [first_pixel, first_pixel + pixel_count) of
+        // a full frame launch, so every pixel keeps its sampler seed
+        auto start = std::chrono::high_resolution_clock::now();
+        LaunchKernel(first_pixel, pixel_count, 4096, [&]()
+        {
+            AoKernels::GenerateCameraRays(&b.camera, w_, h_, primary_rays);
+        });
+        times.camera_ms += ElapsedMs(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        intersector.QueryIntersection(&b.primary_rays[first_pixel], pixel_count, &b.primary_hits[first_pixel]);
+        times.primary_ms += ElapsedMs(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        uint32_t ao_ray_counter = 0;
+        uint32_t max_ao_rays = (uint32_t)b.ao_rays.size();
+        LaunchKernel(first_pixel, pixel_count, 1024, [&]()
+        {
+            AoKernels::ShadePrimaryRays(b.shapes.data(), b.vertices.data(), b.indices.data(), ao_rays, primary_rays,
+                primary_hits, first_pixel + pixel_count, output, color, &ao_ray_counter, &max_ao_rays, rays_per_hit_,
+                frame_no);
+        });
+        times.shade_ms += ElapsedMs(start);
+
+        // ShadePrimaryRays counted the rays of every hit
+        const int ao_ray_count = (int)ao_ray_counter;
+        start = std::chrono::high_resolution_clock::now();
+        intersector.QueryOcclusion(b.ao_rays.data(), ao_ray_count, b.occlusion_hits.data());
+        times.ao_ms += ElapsedMs(start);
+        times.ao_ray_count += ao_ray_count;
+
+        // ProcessAO reduces the rays of a hit in one work item
+        start = std::chrono::high_resolution_clock::now();
+        const int hit_count = rays_per_hit_ > 0 ? ao_ray_count / rays_per_hit_ : 0;
+        LaunchKernel(hit_count, 256, [&]()
+        {
+            AoKernels::ProcessAO(ao_rays, b.occlusion_hits.data(), ao_ray_count, rays_per_hit_, color, output);
+        });
+        times.process_ms += ElapsedMs(start);
+    }
+
+    const AccumBuffer &AoKernelRenderer::GetOutput() const
+    {
+        return buffers_->output;
+    }
+
+    void AoKernelRenderer::Resolve(AccumBuffer &image) const
+    {
+        image.assign(buffers_->output.begin(), buffers_->output.end());
+        auto *output = reinterpret_cast<AoKernels::float4 *>(image.data());
+        ClHost::LaunchKernel(image.size(), 4096, [&]()
+        {
+            AoKernels::Resolve(output, 0);
+        });
+    }
+}
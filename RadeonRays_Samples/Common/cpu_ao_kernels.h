@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+
+#include "cpu_intersector.h"
+#include "cpu_workload.h"
+#include "scene.h"
+
+namespace Cpu
+{
+    // Milliseconds per stage, summed over the frames rendered
+    struct AoKernelTimes
+    {
+        double camera_ms = 0.0;
+        double primary_ms = 0.0;
+        double shade_ms = 0.0;
+        double ao_ms = 0.0;
+        double process_ms = 0.0;
+        size_t ao_ray_count = 0;
+    };
+
+    // The AmbientOcclusion sample on the CPU: the kernels of
+    // ambient_occlusion.cl, built as C++ through cpu_cl_host.h, run as a
+    // wavefront on the shared pool with the Intersector in place of
+    // RadeonRays. Stages and buffers are the ones the sample uses:
+    // GenerateCameraRays, primary hits, ShadePrimaryRays, occlusion of the AO
+    // rays and ProcessAO every frame, Resolve for the image.
+    class AoKernelRenderer
+    {
+        // Non-copyable
+        AoKernelRenderer(const AoKernelRenderer &) = delete;
+        AoKernelRenderer &operator =(const AoKernelRenderer &) = delete;
+
+    public:
+        AoKernelRenderer(const Scene &scene, const Camera &camera, int w, int h, int rays_per_hit);
+        ~AoKernelRenderer();
+
+        // Adds a frame to the image, frame_no seeds the sampler
+        void RenderFrame(const Intersector &intersector, int frame_no, AoKernelTimes &times);
+        // Same for image rows [first_row, first_row + row_count) only, pixels
+        // get what a full frame would give them
+        void RenderRows(const Intersector &intersector, int frame_no, int first_row, int row_count,
+            AoKernelTimes &times);
+
+        // Sums of the output buffer before Resolve, one per pixel
+        const AccumBuffer &GetOutput() const;
+
+        // Colors averaged over the frames so far, one per pixel
+        void Resolve(AccumBuffer &image) const;
+
+    private:
+        struct Buffers;
+
+        std::unique_ptr<Buffers>    buffers_;
+        int                         w_;
+        int                         h_;
+        int                         rays_per_hit_;
+    };
+}
@@ -0,0 +1,229 @@
+#include "cpu_buffer.h"
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace Cpu
+{
+    static std::atomic<HugePageMode> g_huge_page_mode(HugePageMode::kTransparent);
+    static std::atomic<uint64_t> g_small_page_count(0);
+    static std::atomic<uint64_t> g_transparent_count(0);
+    static std::atomic<uint64_t> g_explicit_count(0);
+    static std::atomic<uint64_t> g_fallback_count(0);
+
+    const char *GetHugePageModeName(HugePageMode mode)
+    {
+        switch (mode)
+        {
+        case HugePageMode::kOff:
+            return "off";
+        case HugePageMode::kTransparent:
+            return "transparent";
+        case HugePageMode::kExplicit:
+            return "explicit";
+        }
+        return "unknown";
+    }
+
+    bool ParseHugePageMode(const char *name, HugePageMode &mode)
+    {
+        for (auto m : { HugePageMode::kOff, HugePageMode::kTransparent, HugePageMode::kExplicit })
+        {
+            if (strcmp(name, GetHugePageModeName(m)) == 0)
+            {
+                mode = m;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void SetHugePageMode(HugePageMode mode)
+    {
+        g_huge_page_mode.store(mode, std::memory_order_relaxed);
+    }
+
+    HugePageMode GetHugePageMode()
+    {
+        return g_huge_page_mode.load(std::memory_order_relaxed);
+    }
+
+    BufferStats GetBufferStats()
+    {
+        BufferStats stats;
+        stats.small_pages = g_small_page_count.load(std::memory_order_relaxed);
+        stats.transparent = g_transparent_count.load(std::memory_order_relaxed);
+        stats.explicit_pages = g_explicit_count.load(std::memory_order_relaxed);
+        stats.fallbacks = g_fallback_count.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    static size_t RoundUpToHugePage(size_t size)
+    {
+        return (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    }
+
+    void *AllocateBuffer(size_t size)
+    {
+        if (size < kHugePageSize)
+            return ::operator new(size);
+
+#if defined(__linux__)
+        const size_t length = RoundUpToHugePage(size);
+        HugePageMode mode = GetHugePageMode();
+#if defined(MAP_HUGETLB)
+        if (mode == HugePageMode::kExplicit)
+        {
+            void *data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data != MAP_FAILED)
+            {
+                g_explicit_count.fetch_add(1, std::memory_order_relaxed);
+                return data;
+            }
+            g_fallback_count.fetch_add(1, std::memory_order_relaxed);
+        }
+#endif
+        if (mode == HugePageMode::kExplicit)
+            mode = HugePageMode::kTransparent;
+
+        // The kernel only puts huge pages on aligned 2MB ranges, so map one
+        // page more and trim the ends to start the buffer on a boundary
+        const size_t mapped = length + kHugePageSize;
+        char *base = static_cast<char *>(mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (base == MAP_FAILED)
+            throw std::bad_alloc();
+        char *data = reinterpret_cast<char *>(((uintptr_t)base + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1));
+        if (data > base)
+            munmap(base, data - base);
+        if (base + mapped > data + length)
+            munmap(data + length, base + mapped - (data + length));
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+        madvise(data, length, mode == HugePageMode::kTransparent ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+        if (mode == HugePageMode::kTransparent)
+            g_transparent_count.fetch_add(1, std::memory_order_relaxed);
+        else
+            g_small_page_count.fetch_add(1, std::memory_order_relaxed);
+        return data;
+#else
+        g_small_page_count.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+#endif
+    }
+
+    void FreeBuffer(void *data, size_t size)
+    {
+        if (!data)
+            return;
+#if defined(__linux__)
+        if (size >= kHugePageSize)
+        {
+            munmap(data, RoundUpToHugePage(size));
+            return;
+        }
+#else
+        (void)size;
+#endif
+        ::operator delete(data);
+    }
+
+    FrameArena::FrameArena(size_t initial_size)
+        : offset_(0)
+        , full_size_(0)
+        , block_allocations_(0)
+    {
+        if (initial_size > 0)
+            addBlock(initial_size);
+    }
+
+    FrameArena::~FrameArena()
+    {
+        freeBlocks();
+    }
+
+    void *FrameArena::Allocate(size_t size)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            if (!blocks_.empty())
+            {
+                const Block &block = blocks_.back();
+                // Blocks under kHugePageSize come from operator new, which
+                // only aligns to 16 bytes, so align the address
+                const uintptr_t base = (uintptr_t)block.data;
+                const size_t offset = ((base + offset_ + kAlignment - 1) & ~(uintptr_t)(kAlignment - 1)) - base;
+                if (offset <= block.size && size <= block.size - offset)
+                {
+                    offset_ = offset + size;
+                    return block.data + offset;
+                }
+                full_size_ += offset_;
+            }
+            // At least double, so a growing frame takes few blocks
+            addBlock(std::max(size + kAlignment, 2 * capacity()));
+        }
+    }
+
+    void FrameArena::Reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (blocks_.size() > 1)
+        {
+            const size_t size = capacity();
+            freeBlocks();
+            addBlock(size);
+        }
+        offset_ = 0;
+        full_size_ = 0;
+    }
+
+    size_t FrameArena::GetUsedSize() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return full_size_ + offset_;
+    }
+
+    size_t FrameArena::GetCapacity() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity();
+    }
+
+    uint64_t FrameArena::GetBlockAllocationCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return block_allocations_;
+    }
+
+    size_t FrameArena::capacity() const
+    {
+        size_t capacity = 0;
+        for (auto &block : blocks_)
+            capacity += block.size;
+        return capacity;
+    }
+
+    void FrameArena::addBlock(size_t size)
+    {
+        Block block;
+        block.data = static_cast<char *>(AllocateBuffer(size));
+        block.size = size;
+        blocks_.push_back(block);
+        offset_ = 0;
+        ++block_allocations_;
+    }
+
+    void FrameArena::freeBlocks()
+    {
+        for (auto &block : blocks_)
+            FreeBuffer(block.data, block.size);
+        blocks_.clear();
+    }
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Cpu
+{
+    // Size of the huge pages large buffers are backed with
+    const size_t kHugePageSize = size_t(2) << 20;
+
+    // Pages behind buffers of at least kHugePageSize bytes. Frame buffers
+    // of hundreds of MB in 4KB pages miss the TLB on most random accesses.
+    enum class HugePageMode
+    {
+        // 4KB pages only, transparent huge pages are turned off for the buffers
+        kOff,
+        // Asks the kernel for transparent 2MB pages, it gives them when it can
+        kTransparent,
+        // 2MB pages from the reserved hugetlbfs pool, kTransparent when the
+        // pool is too small
+        kExplicit
+    };
+
+    const char *GetHugePageModeName(HugePageMode mode);
+    bool ParseHugePageMode(const char *name, HugePageMode &mode);
+
+    // Applies to buffers allocated afterwards, kTransparent by default
+    void SetHugePageMode(HugePageMode mode);
+    HugePageMode GetHugePageMode();
+
+    // Large buffers allocated so far, by the pages they asked for
+    struct BufferStats
+    {
+        uint64_t small_pages = 0;
+        uint64_t transparent = 0;
+        uint64_t explicit_pages = 0;
+        // kExplicit allocations that got transparent pages instead
+        uint64_t fallbacks = 0;
+    };
+
+    BufferStats GetBufferStats();
+
+    // Buffers of kHugePageSize bytes or more are mapped directly with the
+    // pages of the current mode, smaller ones come from operator new. size
+    // must be the same for both calls.
+    void *AllocateBuffer(size_t size);
+    void FreeBuffer(void *data, size_t size);
+
+    // Bump allocator for the transient buffers of a frame: rays, hits,
+    // occlusion results and the scratch of the stages in between. Their
+    // sizes follow the rays that survive each stage, so fresh vectors every
+    // frame would mean fresh heap allocations every frame. Here buffers are
+    // carved from a block one after the other and never freed on their own;
+    // Reset recycles them all at once for the next frame. A frame that
+    // outgrows the block goes on in a new one, and the next Reset replaces
+    // the blocks with a single one of their combined size. Once the largest
+    // frame has been seen, frames do no heap allocations. Allocate is safe
+    // from several workers at once. Reset must not overlap any allocation
+    // and invalidates everything handed out before it.
+    class FrameArena
+    {
+        // Non-copyable
+        FrameArena(const FrameArena &) = delete;
+        FrameArena &operator =(const FrameArena &) = delete;
+
+    public:
+        // Alignment of Allocate, a cache line so buffers filled by different
+        // workers share none
+        static const size_t kAlignment = 64;
+
+        explicit FrameArena(size_t initial_size = 0);
+        ~FrameArena();
+
+        void *Allocate(size_t size);
+        void Reset();
+
+        // Bytes handed out since the last Reset, alignment included
+        size_t GetUsedSize() const;
+        // Bytes of all blocks
+        size_t GetCapacity() const;
+        // Blocks taken from AllocateBuffer since construction
+        uint64_t GetBlockAllocationCount() const;
+
+    private:
+        struct Block
+        {
+            char    *data;
+            size_t  size;
+        };
+
+        size_t capacity() const;
+        void addBlock(size_t size);
+        void freeBlocks();
+
+        mutable std::mutex  mutex_;
+        // The last one is filled, the ones before it are full
+        std::vector<Block>  blocks_;
+        // Bytes used in the last block and in the ones before it
+        size_t              offset_;
+        size_t              full_size_;
+        uint64_t            block_allocations_;
+    };
+
+    // Allocator for large per-frame buffers such as rays and hits, and for
+    // the BVH arrays traversal reads. Memory comes from AllocateBuffer, or
+    // from a FrameArena when one is given; deallocating arena memory does
+    // nothing, it is recycled at the arena's Reset. Resizing leaves
+    // elements of trivially copyable types unwritten, so the pages of a
+    // buffer are first touched by the workers that fill it and are placed
+    // on their NUMA node rather than on the node of the resizing thread.
+    template <typename T>
+    class BufferAllocator : public std::allocator<T>
+    {
+    public:
+        template <typename U>
+        struct rebind
+        {
+            typedef BufferAllocator<U> other;
+        };
+
+        // Allocators of different arenas are not interchangeable
+        typedef std::false_type is_always_equal;
+        typedef std::true_type propagate_on_container_move_assignment;
+
+        BufferAllocator()
+            : arena_(nullptr)
+        {
+        }
+        explicit BufferAllocator(FrameArena *arena)
+            : arena_(arena)
+        {
+        }
+        template <typename U>
+        BufferAllocator(const BufferAllocator<U> &other)
+            : arena_(other.GetArena())
+        {
+        }
+
+        FrameArena *GetArena() const { return arena_; }
+
+        T *allocate(size_t count)
+        {
+            if (count > size_t(-1) / sizeof(T))
+                throw std::bad_alloc();
+            if (arena_)
+                return static_cast<T *>(arena_->Allocate(count * sizeof(T)));
+            return static_cast<T *>(AllocateBuffer(count * sizeof(T)));
+        }
+
+        void deallocate(T *data, size_t count)
+        {
+            if (!arena_)
+                FreeBuffer(data, count * sizeof(T));
+        }
+
+        template <typename U>
+        void construct(U *p)
+        {
+            constructDefault(p, std::is_trivially_copyable<U>());
+        }
+
+        template <typename U, typename... Args>
+        void construct(U *p, Args &&... args)
+        {
+            ::new ((void *)p) U(std::forward<Args>(args)...);
+        }
+
+    private:
+        template <typename U>
+        static void constructDefault(U *, std::true_type)
+        {
+        }
+
+        template <typename U>
+        static void constructDefault(U *p, std::false_type)
+        {
+            ::new ((void *)p) U();
+        }
+
+        FrameArena *arena_;
+    };
+
+    template <typename T, typename U>
+    bool operator ==(const BufferAllocator<T> &a, const BufferAllocator<U> &b) { return a.GetArena() == b.GetArena(); }
+    template <typename T, typename U>
+    bool operator !=(const BufferAllocator<T> &a, const BufferAllocator<U> &b) { return a.GetArena() != b.GetArena(); }
+
+    template <typename T>
+    using BufferVector = std::vector<T, BufferAllocator<T>>;
+}
@@ -0,0 +1,1376 @@
+#include "cpu_bvh.h"
+#include "cpu_parallel.h"
+#include "cpu_radix_sort.h"
+
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Cpu
+{
+    static const uint32_t kInvalidNode = 0xffffffffu;
+
+    static inline int CountLeadingZeros(uint32_t v)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        return _BitScanReverse(&index, v) ? 31 - (int)index : 32;
+#else
+        return v ? __builtin_clz(v) : 32;
+#endif
+    }
+
+    // Spreads the lower 10 bits of v so that there are two zero bits between each
+    static inline uint32_t ExpandBits(uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // 30 bit Morton code of a point in the unit cube
+    static inline uint32_t MortonCode(const Vec3 &p)
+    {
+        uint32_t x = (uint32_t)std::min(std::max(p.x * 1024.f, 0.f), 1023.f);
+        uint32_t y = (uint32_t)std::min(std::max(p.y * 1024.f, 0.f), 1023.f);
+        uint32_t z = (uint32_t)std::min(std::max(p.z * 1024.f, 0.f), 1023.f);
+        return (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+    }
+
+    // Orders the primitives along the Morton curve of their centroids
+    static void SortByMortonCode(const std::vector<Aabb> &prim_bounds, std::vector<uint32_t> &codes, std::vector<uint32_t> &refs)
+    {
+        const size_t count = prim_bounds.size();
+
+        Aabb centroid_bounds;
+        for (auto &bounds : prim_bounds)
+            centroid_bounds.Grow(bounds.Center());
+
+        Vec3 extent = centroid_bounds.Extent();
+        Vec3 scale(extent.x > 0.f ? 1.f / extent.x : 0.f,
+                   extent.y > 0.f ? 1.f / extent.y : 0.f,
+                   extent.z > 0.f ? 1.f / extent.z : 0.f);
+
+        codes.resize(count);
+        refs.resize(count);
+        ParallelFor(0, count, 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                codes[i] = MortonCode((prim_bounds[i].Center() - centroid_bounds.pmin) * scale);
+                refs[i] = (uint32_t)i;
+            }
+        });
+
+        RadixSort(codes, refs, 30);
+    }
+
+    static inline BvhNode MakeLeaf(const Aabb &bounds, uint32_t first, uint32_t count)
+    {
+        BvhNode node;
+        node.bounds = bounds;
+        node.left = first;
+        node.right = BvhNode::kLeafFlag | count;
+        return node;
+    }
+
+    static inline BvhNode MakeInterior(const Aabb &bounds, uint32_t left, uint32_t right)
+    {
+        BvhNode node;
+        node.bounds = bounds;
+        node.left = left;
+        node.right = right;
+        return node;
+    }
+
+    // Part of a primitive inside a node, kSpatial clips these at split planes
+    struct Reference
+    {
+        Aabb     bounds;
+        uint32_t prim;
+    };
+
+    // Clips a reference at an axis aligned plane. Triangles are clipped edge
+    // by edge, other primitives just have their bounds cut.
+    static void SplitReference(const Reference &ref, const Vec3 *positions, const uint32_t *indices,
+        int axis, float plane, Reference &left, Reference &right)
+    {
+        left.prim = right.prim = ref.prim;
+        left.bounds = right.bounds = Aabb();
+        if (positions && indices)
+        {
+            for (int e = 0; e < 3; ++e)
+            {
+                const Vec3 &v0 = positions[indices[3 * ref.prim + e]];
+                const Vec3 &v1 = positions[indices[3 * ref.prim + (e + 1) % 3]];
+                if (v0[axis] <= plane)
+                    left.bounds.Grow(v0);
+                if (v0[axis] >= plane)
+                    right.bounds.Grow(v0);
+                if ((v0[axis] < plane && v1[axis] > plane) || (v0[axis] > plane && v1[axis] < plane))
+                {
+                    Vec3 p = v0 + (v1 - v0) * ((plane - v0[axis]) / (v1[axis] - v0[axis]));
+                    p[axis] = plane;
+                    left.bounds.Grow(p);
+                    right.bounds.Grow(p);
+                }
+            }
+        }
+        else
+        {
+            left.bounds = right.bounds = ref.bounds;
+        }
+
+        left.bounds.pmax[axis] = plane;
+        right.bounds.pmin[axis] = plane;
+        left.bounds = Overlap(left.bounds, ref.bounds);
+        right.bounds = Overlap(right.bounds, ref.bounds);
+    }
+
+    const char *GetBuildQualityName(BvhBuildQuality quality)
+    {
+        switch (quality)
+        {
+        case BvhBuildQuality::kFast:
+            return "fast";
+        case BvhBuildQuality::kBalanced:
+            return "balanced";
+        case BvhBuildQuality::kHigh:
+            return "high";
+        case BvhBuildQuality::kSpatial:
+            return "spatial";
+        }
+        return "unknown";
+    }
+
+    bool ParseBuildQuality(const char *name, BvhBuildQuality &quality)
+    {
+        for (auto q : { BvhBuildQuality::kFast, BvhBuildQuality::kBalanced, BvhBuildQuality::kHigh, BvhBuildQuality::kSpatial })
+        {
+            if (strcmp(name, GetBuildQualityName(q)) == 0)
+            {
+                quality = q;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char *GetNodeFormatName(BvhNodeFormat format)
+    {
+        switch (format)
+        {
+        case BvhNodeFormat::kFull:
+            return "full";
+        case BvhNodeFormat::kQuantized:
+            return "quantized";
+        }
+        return "unknown";
+    }
+
+    bool ParseNodeFormat(const char *name, BvhNodeFormat &format)
+    {
+        for (auto f : { BvhNodeFormat::kFull, BvhNodeFormat::kQuantized })
+        {
+            if (strcmp(name, GetNodeFormatName(f)) == 0)
+            {
+                format = f;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char *GetLeafFormatName(BvhLeafFormat format)
+    {
+        switch (format)
+        {
+        case BvhLeafFormat::kIndexed:
+            return "indexed";
+        case BvhLeafFormat::kBlocks:
+            return "blocks";
+        }
+        return "unknown";
+    }
+
+    bool ParseLeafFormat(const char *name, BvhLeafFormat &format)
+    {
+        for (auto f : { BvhLeafFormat::kIndexed, BvhLeafFormat::kBlocks })
+        {
+            if (strcmp(name, GetLeafFormatName(f)) == 0)
+            {
+                format = f;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char *GetNumaPlacementName(NumaPlacement placement)
+    {
+        switch (placement)
+        {
+        case NumaPlacement::kLocal:
+            return "local";
+        case NumaPlacement::kInterleave:
+            return "interleave";
+        case NumaPlacement::kReplicate:
+            return "replicate";
+        }
+        return "unknown";
+    }
+
+    bool ParseNumaPlacement(const char *name, NumaPlacement &placement)
+    {
+        for (auto p : { NumaPlacement::kLocal, NumaPlacement::kInterleave, NumaPlacement::kReplicate })
+        {
+            if (strcmp(name, GetNumaPlacementName(p)) == 0)
+            {
+                placement = p;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Constructor
+    Bvh::Bvh()
+        : max_depth_(0)
+        , build_sah_cost_(0.f)
+    {
+    }
+
+    // Builds the hierarchy over the given primitive bounds
+    void Bvh::Build(const std::vector<Aabb> &prim_bounds, const BvhBuildOptions &options,
+        const Vec3 *positions, const uint32_t *indices)
+    {
+        options_ = options;
+        nodes_.clear();
+        prim_indices_.clear();
+        max_depth_ = 0;
+        build_sah_cost_ = 0.f;
+        optimize_done_.clear();
+
+        if (prim_bounds.empty())
+            return;
+
+        std::vector<BvhNode> nodes;
+        std::vector<uint32_t> refs;
+        switch (options_.quality)
+        {
+        case BvhBuildQuality::kFast:
+            buildLinear(prim_bounds, nodes, refs);
+            break;
+        case BvhBuildQuality::kBalanced:
+            buildClusters(prim_bounds, nodes, refs);
+            break;
+        case BvhBuildQuality::kHigh:
+            buildBinnedSah(prim_bounds, nodes, refs);
+            break;
+        case BvhBuildQuality::kSpatial:
+            buildSpatialSplits(prim_bounds, positions, indices, nodes, refs);
+            break;
+        }
+
+        finalize(nodes, refs);
+        build_sah_cost_ = GetSahCost();
+    }
+
+    // Recomputes node bounds bottom-up for moved primitives
+    float Bvh::Refit(const std::vector<Aabb> &prim_bounds)
+    {
+        if (nodes_.empty())
+            return 0.f;
+
+        std::vector<uint32_t> top, subtrees;
+        partitionTree(4 * GetWorkerCount(), top, subtrees);
+
+        auto refit_node = [&](uint32_t index) -> double
+        {
+            BvhNode &node = nodes_[index];
+            if (node.IsLeaf())
+            {
+                Aabb bounds;
+                for (uint32_t i = node.left; i < node.left + node.GetPrimCount(); ++i)
+                    bounds.Grow(prim_bounds[prim_indices_[i]]);
+                node.bounds = bounds;
+                return (double)options_.intersection_cost * bounds.SurfaceArea() * node.GetPrimCount();
+            }
+            node.bounds = Union(nodes_[node.left].bounds, nodes_[node.right].bounds);
+            return (double)options_.traversal_cost * node.bounds.SurfaceArea();
+        };
+
+        // Subtrees in reverse pre-order on the workers, children come before parents
+        std::vector<double> costs(subtrees.size(), 0.0);
+        ParallelFor(0, subtrees.size(), 1, [&](size_t begin, size_t end)
+        {
+            for (size_t t = begin; t < end; ++t)
+            {
+                for (uint32_t index = getSubtreeEnd(subtrees[t]); index-- > subtrees[t];)
+                    costs[t] += refit_node(index);
+            }
+        });
+
+        // Top nodes were expanded parents first, reversed they go children first
+        double cost = 0.0;
+        for (auto c : costs)
+            cost += c;
+        for (auto it = top.rbegin(); it != top.rend(); ++it)
+            cost += refit_node(*it);
+
+        double root_area = nodes_[0].bounds.SurfaceArea();
+        return root_area > 0.0 ? (float)(cost / root_area) : 0.f;
+    }
+
+    // Restructures the treelet under root if a better topology exists. The
+    // treelet is grown by expanding its largest interior leaf, then every
+    // subset of its leaves gets its optimal cost by dynamic programming.
+    static void RestructureTreelet(BufferVector<BvhNode> &nodes, std::vector<float> &costs, uint32_t root,
+        uint32_t treelet_size, float traversal_cost)
+    {
+        const uint32_t kMaxTreeletSize = 8;
+        uint32_t leaves[kMaxTreeletSize];
+        uint32_t internals[kMaxTreeletSize - 1];
+        uint32_t leaf_count = 2;
+        uint32_t internal_count = 1;
+        leaves[0] = nodes[root].left;
+        leaves[1] = nodes[root].right;
+        internals[0] = root;
+        while (leaf_count < treelet_size)
+        {
+            int largest = -1;
+            float largest_area = -1.f;
+            for (uint32_t i = 0; i < leaf_count; ++i)
+            {
+                float area = nodes[leaves[i]].bounds.SurfaceArea();
+                if (!nodes[leaves[i]].IsLeaf() && area > largest_area)
+                {
+                    largest = (int)i;
+                    largest_area = area;
+                }
+            }
+            if (largest < 0)
+                break;
+
+            uint32_t expanded = leaves[largest];
+            internals[internal_count++] = expanded;
+            leaves[largest] = nodes[expanded].left;
+            leaves[leaf_count++] = nodes[expanded].right;
+        }
+
+        // Two leaves only have one topology
+        if (leaf_count < 3)
+            return;
+
+        const uint32_t full = (1u << leaf_count) - 1;
+        Aabb bounds[1u << kMaxTreeletSize];
+        float cost[1u << kMaxTreeletSize];
+        uint8_t split[1u << kMaxTreeletSize];
+        for (uint32_t s = 1; s <= full; ++s)
+        {
+            uint32_t low = s & (0u - s);
+            uint32_t leaf = 0;
+            while ((1u << leaf) != low)
+                ++leaf;
+
+            bounds[s] = Union(bounds[s & (s - 1)], nodes[leaves[leaf]].bounds);
+            if (s == low)
+            {
+                cost[s] = costs[leaves[leaf]];
+                continue;
+            }
+
+            // Partitions that keep the lowest leaf on the left, the mirrored ones cost the same
+            float best = std::numeric_limits<float>::max();
+            for (uint32_t p = (s - 1) & s; p; p = (p - 1) & s)
+            {
+                if (!(p & low))
+                    continue;
+                float c = cost[p] + cost[s ^ p];
+                if (c < best)
+                {
+                    best = c;
+                    split[s] = (uint8_t)p;
+                }
+            }
+            cost[s] = traversal_cost * bounds[s].SurfaceArea() + best;
+        }
+
+        float current = traversal_cost * nodes[root].bounds.SurfaceArea() + costs[nodes[root].left] + costs[nodes[root].right];
+        if (!(cost[full] < current * (1.f - 1e-5f)))
+        {
+            costs[root] = current;
+            return;
+        }
+
+        // Reuses the treelet's internal nodes for the new topology, root stays in place
+        struct Emitter
+        {
+            BufferVector<BvhNode> &nodes;
+            std::vector<float>    &costs;
+            const uint32_t        *leaves;
+            const uint32_t        *internals;
+            const Aabb            *bounds;
+            const float           *cost;
+            const uint8_t         *split;
+            uint32_t               next_internal;
+
+            uint32_t Emit(uint32_t s)
+            {
+                if ((s & (s - 1)) == 0)
+                {
+                    uint32_t leaf = 0;
+                    while ((1u << leaf) != s)
+                        ++leaf;
+                    return leaves[leaf];
+                }
+
+                uint32_t index = internals[next_internal++];
+                uint32_t left = Emit(split[s]);
+                uint32_t right = Emit(s ^ split[s]);
+                nodes[index] = MakeInterior(bounds[s], left, right);
+                costs[index] = cost[s];
+                return index;
+            }
+        };
+
+        Emitter emitter = { nodes, costs, leaves, internals, bounds, cost, split, 0 };
+        emitter.Emit(full);
+    }
+
+    // Treelet passes bottom-up, parallel over subtrees like Refit
+    BvhOptimizeResult Bvh::Optimize(const BvhOptimizeOptions &options)
+    {
+        typedef std::chrono::high_resolution_clock Clock;
+        const auto start = Clock::now();
+        const auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::milli>(options.time_budget_ms));
+        auto out_of_time = [&]() { return options.time_budget_ms > 0.0 && Clock::now() >= deadline; };
+
+        BvhOptimizeResult result;
+        result.sah_before = GetSahCost();
+        result.sah_after = result.sah_before;
+        const uint32_t treelet_size = std::min(std::max(options.treelet_size, 3u), 8u);
+
+        while (nodes_.size() > 3 && result.iterations < options.max_iterations && !out_of_time())
+        {
+            // Small subtrees so that a short time budget still finishes some
+            std::vector<uint32_t> top, subtrees;
+            partitionTree(std::max<size_t>(4 * GetWorkerCount(), 256), top, subtrees);
+
+            if (optimize_done_.size() != subtrees.size())
+                optimize_done_.assign(subtrees.size(), 0);
+
+            // Returns false if the node was not optimized
+            std::vector<float> costs(nodes_.size());
+            auto process_node = [&](uint32_t index, bool optimize) -> bool
+            {
+                BvhNode &node = nodes_[index];
+                if (node.IsLeaf())
+                    costs[index] = options_.intersection_cost * node.bounds.SurfaceArea() * node.GetPrimCount();
+                else if (!optimize || out_of_time())
+                {
+                    costs[index] = options_.traversal_cost * node.bounds.SurfaceArea() + costs[node.left] + costs[node.right];
+                    return false;
+                }
+                else
+                    RestructureTreelet(nodes_, costs, index, treelet_size, options_.traversal_cost);
+                return true;
+            };
+
+            // A treelet only reaches into its root's subtree, which is done by then
+            ParallelFor(0, subtrees.size(), 1, [&](size_t begin, size_t end)
+            {
+                for (size_t t = begin; t < end; ++t)
+                {
+                    bool optimize = !optimize_done_[t];
+                    bool complete = true;
+                    for (uint32_t index = getSubtreeEnd(subtrees[t]); index-- > subtrees[t];)
+                        complete &= process_node(index, optimize);
+                    optimize_done_[t] |= complete ? 1 : 0;
+                }
+            });
+
+            bool pass_complete = std::find(optimize_done_.begin(), optimize_done_.end(), 0) == optimize_done_.end();
+            for (auto it = top.rbegin(); it != top.rend(); ++it)
+                pass_complete &= process_node(*it, pass_complete);
+            if (pass_complete)
+                optimize_done_.clear();
+
+            // Restore the pre-order layout, which also re-collapses leaves
+            std::vector<BvhNode> nodes(nodes_.begin(), nodes_.end());
+            std::vector<uint32_t> refs(prim_indices_.begin(), prim_indices_.end());
+            nodes_.clear();
+            prim_indices_.clear();
+            max_depth_ = 0;
+            finalize(nodes, refs);
+
+            float sah = GetSahCost();
+            float gain = (result.sah_after - sah) / result.sah_after;
+            result.sah_after = sah;
+            ++result.iterations;
+            if (pass_complete && gain < options.min_gain)
+            {
+                result.converged = true;
+                break;
+            }
+        }
+
+        build_sah_cost_ = result.sah_after;
+        result.elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        return result;
+    }
+
+    // SAH cost of the hierarchy normalized by the root surface area
+    float Bvh::GetSahCost() const
+    {
+        if (nodes_.empty())
+            return 0.f;
+
+        double cost = 0.0;
+        for (auto &node : nodes_)
+        {
+            double area = node.bounds.SurfaceArea();
+            if (node.IsLeaf())
+                cost += options_.intersection_cost * area * node.GetPrimCount();
+            else
+                cost += options_.traversal_cost * area;
+        }
+
+        double root_area = nodes_[0].bounds.SurfaceArea();
+        return root_area > 0.0 ? (float)(cost / root_area) : 0.f;
+    }
+
+    // Karras 2012: every internal node finds its own key range independently
+    void Bvh::buildLinear(const std::vector<Aabb> &prim_bounds, std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs)
+    {
+        const int count = (int)prim_bounds.size();
+
+        std::vector<uint32_t> codes;
+        SortByMortonCode(prim_bounds, codes, refs);
+
+        // Internal nodes take [0, count - 1), leaves [count - 1, 2 * count - 1)
+        nodes.resize(2 * count - 1);
+        std::vector<uint32_t> parents(2 * count - 1, kInvalidNode);
+        for (int i = 0; i < count; ++i)
+            nodes[count - 1 + i] = MakeLeaf(prim_bounds[refs[i]], i, 1);
+
+        if (count == 1)
+            return;
+
+        // Length of the common key prefix, duplicates are told apart by index
+        auto delta = [&](int i, int j) -> int
+        {
+            if (j < 0 || j >= count)
+                return -1;
+            if (codes[i] == codes[j])
+                return 32 + CountLeadingZeros((uint32_t)i ^ (uint32_t)j);
+            return CountLeadingZeros(codes[i] ^ codes[j]);
+        };
+
+        ParallelFor(0, count - 1, 4096, [&](size_t begin, size_t end)
+        {
+            for (int i = (int)begin; i < (int)end; ++i)
+            {
+                // Direction of the range
+                int d = (delta(i, i + 1) - delta(i, i - 1)) > 0 ? 1 : -1;
+
+                // Upper bound for the range length
+                int delta_min = delta(i, i - d);
+                int lmax = 2;
+                while (delta(i, i + lmax * d) > delta_min)
+                    lmax *= 2;
+
+                // Other end of the range
+                int l = 0;
+                for (int t = lmax / 2; t >= 1; t /= 2)
+                {
+                    if (delta(i, i + (l + t) * d) > delta_min)
+                        l += t;
+                }
+                int j = i + l * d;
+
+                // Split position
+                int delta_node = delta(i, j);
+                int s = 0;
+                int t;
+                int divisor = 2;
+                do
+                {
+                    t = (l + divisor - 1) / divisor;
+                    if (delta(i, i + (s + t) * d) > delta_node)
+                        s += t;
+                    divisor *= 2;
+                } while (t > 1);
+                int gamma = i + s * d + std::min(d, 0);
+
+                uint32_t left = (std::min(i, j) == gamma) ? (uint32_t)(count - 1 + gamma) : (uint32_t)gamma;
+                uint32_t right = (std::max(i, j) == gamma + 1) ? (uint32_t)(count + gamma) : (uint32_t)(gamma + 1);
+                nodes[i].left = left;
+                nodes[i].right = right;
+                parents[left] = (uint32_t)i;
+                parents[right] = (uint32_t)i;
+            }
+        });
+
+        // Bottom-up bounds, the second child to arrive at a node computes it
+        std::unique_ptr<std::atomic<uint32_t>[]> visits(new std::atomic<uint32_t>[count - 1]);
+        for (int i = 0; i < count - 1; ++i)
+            visits[i].store(0, std::memory_order_relaxed);
+
+        ParallelFor(0, count, 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                uint32_t node = parents[count - 1 + i];
+                while (node != kInvalidNode)
+                {
+                    if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                        break;
+                    nodes[node].bounds = Union(nodes[nodes[node].left].bounds, nodes[nodes[node].right].bounds);
+                    node = parents[node];
+                }
+            }
+        });
+    }
+
+    // Meister and Bittner 2018: clusters repeatedly merge with their mutual
+    // nearest neighbour inside a window of the Morton ordered cluster list
+    void Bvh::buildClusters(const std::vector<Aabb> &prim_bounds, std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs)
+    {
+        const uint32_t count = (uint32_t)prim_bounds.size();
+        const int radius = (int)std::max(options_.cluster_radius, 1u);
+
+        std::vector<uint32_t> codes;
+        SortByMortonCode(prim_bounds, codes, refs);
+
+        // Leaves take [count - 1, 2 * count - 1), merges allocate downwards so the root ends at 0
+        nodes.resize(2 * count - 1);
+        std::vector<uint32_t> clusters(count);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            nodes[count - 1 + i] = MakeLeaf(prim_bounds[refs[i]], i, 1);
+            clusters[i] = count - 1 + i;
+        }
+
+        std::vector<int> neighbours(count);
+        int next_node = (int)count - 2;
+        while (clusters.size() > 1)
+        {
+            const int cluster_count = (int)clusters.size();
+
+            // Nearest neighbour by merged surface area. Ties keep the lowest index,
+            // which orders candidate pairs consistently so the best pair is mutual
+            ParallelFor(0, cluster_count, 1024, [&](size_t begin, size_t end)
+            {
+                for (int i = (int)begin; i < (int)end; ++i)
+                {
+                    const Aabb &bounds = nodes[clusters[i]].bounds;
+                    float best_area = std::numeric_limits<float>::max();
+                    int best = -1;
+                    for (int j = std::max(0, i - radius); j <= std::min(cluster_count - 1, i + radius); ++j)
+                    {
+                        if (j == i)
+                            continue;
+                        float area = Union(bounds, nodes[clusters[j]].bounds).SurfaceArea();
+                        if (area < best_area)
+                        {
+                            best_area = area;
+                            best = j;
+                        }
+                    }
+                    neighbours[i] = best;
+                }
+            });
+
+            // Merge mutual neighbours in place of the lower cluster
+            for (int i = 0; i < cluster_count; ++i)
+            {
+                int j = neighbours[i];
+                if (i < j && neighbours[j] == i)
+                {
+                    uint32_t node = (uint32_t)next_node--;
+                    nodes[node] = MakeInterior(Union(nodes[clusters[i]].bounds, nodes[clusters[j]].bounds), clusters[i], clusters[j]);
+                    clusters[i] = node;
+                    clusters[j] = kInvalidNode;
+                }
+            }
+
+            clusters.erase(std::remove(clusters.begin(), clusters.end(), kInvalidNode), clusters.end());
+        }
+
+        assert(next_node == -1 && clusters[0] == 0);
+    }
+
+    // Top-down binned SAH. The upper levels are split on the calling thread until
+    // there are enough subtrees to keep every worker busy.
+    void Bvh::buildBinnedSah(const std::vector<Aabb> &prim_bounds, std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs)
+    {
+        struct Task
+        {
+            uint32_t node;
+            uint32_t begin;
+            uint32_t end;
+        };
+
+        struct Bin
+        {
+            Aabb     bounds;
+            uint32_t count = 0;
+        };
+
+        const uint32_t count = (uint32_t)prim_bounds.size();
+        const uint32_t bin_count = std::max(options_.bin_count, 2u);
+
+        std::vector<Vec3> centroids(count);
+        refs.resize(count);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            centroids[i] = prim_bounds[i].Center();
+            refs[i] = i;
+        }
+
+        nodes.resize(2 * count - 1);
+        std::atomic<uint32_t> node_count(1);
+
+        // Splits one node, returns false if it became a leaf
+        auto split = [&](const Task &task, Task &left_task, Task &right_task) -> bool
+        {
+            Aabb bounds, centroid_bounds;
+            for (uint32_t i = task.begin; i < task.end; ++i)
+            {
+                bounds.Grow(prim_bounds[refs[i]]);
+                centroid_bounds.Grow(centroids[refs[i]]);
+            }
+
+            const uint32_t prim_count = task.end - task.begin;
+            nodes[task.node] = MakeLeaf(bounds, task.begin, prim_count);
+            if (prim_count == 1)
+                return false;
+
+            // Evaluate bin boundaries on every axis
+            float best_cost = std::numeric_limits<float>::max();
+            int best_axis = -1;
+            uint32_t best_bin = 0;
+            Vec3 extent = centroid_bounds.Extent();
+            std::vector<Bin> bins(bin_count);
+            std::vector<float> right_costs(bin_count);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (!(extent[axis] > 0.f))
+                    continue;
+
+                std::fill(bins.begin(), bins.end(), Bin());
+                float scale = bin_count * (1.f - 1e-5f) / extent[axis];
+                for (uint32_t i = task.begin; i < task.end; ++i)
+                {
+                    uint32_t b = std::min(bin_count - 1, (uint32_t)((centroids[refs[i]][axis] - centroid_bounds.pmin[axis]) * scale));
+                    bins[b].bounds.Grow(prim_bounds[refs[i]]);
+                    ++bins[b].count;
+                }
+
+                Aabb right_bounds;
+                uint32_t right_count = 0;
+                for (uint32_t b = bin_count - 1; b > 0; --b)
+                {
+                    right_bounds.Grow(bins[b].bounds);
+                    right_count += bins[b].count;
+                    right_costs[b] = right_bounds.SurfaceArea() * right_count;
+                }
+
+                Aabb left_bounds;
+                uint32_t left_count = 0;
+                for (uint32_t b = 0; b < bin_count - 1; ++b)
+                {
+                    left_bounds.Grow(bins[b].bounds);
+                    left_count += bins[b].count;
+                    float cost = left_bounds.SurfaceArea() * left_count + right_costs[b + 1];
+                    if (left_count > 0 && left_count < prim_count && cost < best_cost)
+                    {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bin = b + 1;
+                    }
+                }
+            }
+
+            float area = bounds.SurfaceArea();
+            float leaf_cost = options_.intersection_cost * prim_count * area;
+            float split_cost = options_.traversal_cost * area + options_.intersection_cost * best_cost;
+            if (prim_count <= options_.max_leaf_size && leaf_cost <= split_cost)
+                return false;
+
+            uint32_t middle;
+            if (best_axis >= 0)
+            {
+                float scale = bin_count * (1.f - 1e-5f) / extent[best_axis];
+                auto it = std::partition(refs.begin() + task.begin, refs.begin() + task.end, [&](uint32_t ref)
+                {
+                    return (uint32_t)((centroids[ref][best_axis] - centroid_bounds.pmin[best_axis]) * scale) < best_bin;
+                });
+                middle = (uint32_t)(it - refs.begin());
+            }
+            else
+            {
+                // All centroids coincide, any split is as good as another
+                if (prim_count <= options_.max_leaf_size)
+                    return false;
+                middle = task.begin + prim_count / 2;
+            }
+
+            uint32_t children = node_count.fetch_add(2);
+            nodes[task.node] = MakeInterior(bounds, children, children + 1);
+            left_task = { children, task.begin, middle };
+            right_task = { children + 1, middle, task.end };
+            return true;
+        };
+
+        // Breadth first on the calling thread
+        const size_t task_target = 4 * GetWorkerCount();
+        std::vector<Task> tasks(1, Task{ 0, 0, count });
+        std::vector<Task> pending;
+        while (!tasks.empty() && tasks.size() + pending.size() < task_target)
+        {
+            std::vector<Task> next;
+            for (auto &task : tasks)
+            {
+                Task left, right;
+                if (task.end - task.begin < 4096)
+                    pending.push_back(task);
+                else if (split(task, left, right))
+                {
+                    next.push_back(left);
+                    next.push_back(right);
+                }
+            }
+            std::swap(tasks, next);
+        }
+        pending.insert(pending.end(), tasks.begin(), tasks.end());
+
+        // Depth first per subtree on the workers
+        ParallelFor(0, pending.size(), 1, [&](size_t begin, size_t end)
+        {
+            std::vector<Task> stack;
+            for (size_t i = begin; i < end; ++i)
+            {
+                stack.push_back(pending[i]);
+                while (!stack.empty())
+                {
+                    Task task = stack.back(), left, right;
+                    stack.pop_back();
+                    if (split(task, left, right))
+                    {
+                        stack.push_back(right);
+                        stack.push_back(left);
+                    }
+                }
+            }
+        });
+
+        nodes.resize(node_count);
+    }
+
+    // Stich et al. 2009: binned object splits, plus binned spatial splits that
+    // clip references at the bin planes where object split children overlap.
+    // Every task gets a share of the duplication budget proportional to its
+    // reference count, so the result does not depend on scheduling.
+    void Bvh::buildSpatialSplits(const std::vector<Aabb> &prim_bounds, const Vec3 *positions, const uint32_t *indices,
+        std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs)
+    {
+        struct Task
+        {
+            uint32_t                node;
+            uint32_t                budget;
+            std::vector<Reference>  refs;
+        };
+
+        struct Bin
+        {
+            Aabb     bounds;
+            uint32_t count = 0;
+            // Spatial bins count references entering and leaving them
+            uint32_t exit = 0;
+        };
+
+        const uint32_t count = (uint32_t)prim_bounds.size();
+        const uint32_t bin_count = std::max(options_.bin_count, 2u);
+        const uint32_t total_budget = (uint32_t)(std::max(options_.duplication_budget, 0.f) * count);
+
+        Task root = { 0, total_budget, std::vector<Reference>(count) };
+        Aabb root_bounds;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            root.refs[i] = { prim_bounds[i], i };
+            root_bounds.Grow(prim_bounds[i]);
+        }
+        const float min_overlap = options_.spatial_split_alpha * root_bounds.SurfaceArea();
+
+        const uint32_t max_refs = count + total_budget;
+        nodes.resize(2 * max_refs - 1);
+        refs.resize(max_refs);
+        std::atomic<uint32_t> node_count(1);
+        std::atomic<uint32_t> ref_count(0);
+
+        auto make_leaf = [&](const Task &task, const Aabb &bounds)
+        {
+            uint32_t first = ref_count.fetch_add((uint32_t)task.refs.size());
+            assert(first + task.refs.size() <= max_refs);
+            for (size_t i = 0; i < task.refs.size(); ++i)
+                refs[first + i] = task.refs[i].prim;
+            nodes[task.node] = MakeLeaf(bounds, first, (uint32_t)task.refs.size());
+        };
+
+        // Splits one node, returns false if it became a leaf
+        auto split = [&](Task &task, Task &left_task, Task &right_task) -> bool
+        {
+            Aabb bounds, centroid_bounds;
+            for (auto &ref : task.refs)
+            {
+                bounds.Grow(ref.bounds);
+                centroid_bounds.Grow(ref.bounds.Center());
+            }
+
+            const uint32_t prim_count = (uint32_t)task.refs.size();
+            if (prim_count == 1)
+            {
+                make_leaf(task, bounds);
+                return false;
+            }
+
+            std::vector<Bin> bins(bin_count);
+            std::vector<float> right_costs(bin_count);
+
+            // Object split over reference centroids, as in buildBinnedSah
+            float object_cost = std::numeric_limits<float>::max();
+            int object_axis = -1;
+            uint32_t object_bin = 0;
+            Aabb object_left, object_right;
+            Vec3 extent = centroid_bounds.Extent();
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (!(extent[axis] > 0.f))
+                    continue;
+
+                std::fill(bins.begin(), bins.end(), Bin());
+                float scale = bin_count * (1.f - 1e-5f) / extent[axis];
+                for (auto &ref : task.refs)
+                {
+                    uint32_t b = std::min(bin_count - 1, (uint32_t)((ref.bounds.Center()[axis] - centroid_bounds.pmin[axis]) * scale));
+                    bins[b].bounds.Grow(ref.bounds);
+                    ++bins[b].count;
+                }
+
+                std::vector<Aabb> right_bounds(bin_count);
+                uint32_t right_count = 0;
+                for (uint32_t b = bin_count - 1; b > 0; --b)
+                {
+                    right_bounds[b] = b + 1 < bin_count ? Union(right_bounds[b + 1], bins[b].bounds) : bins[b].bounds;
+                    right_count += bins[b].count;
+                    right_costs[b] = right_bounds[b].SurfaceArea() * right_count;
+                }
+
+                Aabb left_bounds;
+                uint32_t left_count = 0;
+                for (uint32_t b = 0; b < bin_count - 1; ++b)
+                {
+                    left_bounds.Grow(bins[b].bounds);
+                    left_count += bins[b].count;
+                    float cost = left_bounds.SurfaceArea() * left_count + right_costs[b + 1];
+                    if (left_count > 0 && left_count < prim_count && cost < object_cost)
+                    {
+                        object_cost = cost;
+                        object_axis = axis;
+                        object_bin = b + 1;
+                        object_left = left_bounds;
+                        object_right = right_bounds[b + 1];
+                    }
+                }
+            }
+
+            // Spatial split over the node bounds, only where object split children overlap
+            Vec3 node_extent = bounds.Extent();
+            auto plane = [&](int axis, uint32_t k) { return bounds.pmin[axis] + node_extent[axis] / bin_count * k; };
+            float spatial_cost = std::numeric_limits<float>::max();
+            int spatial_axis = -1;
+            float spatial_plane = 0.f;
+            if (task.budget > 0 && (object_axis < 0 || Overlap(object_left, object_right).SurfaceArea() > min_overlap))
+            {
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    if (!(node_extent[axis] > 0.f))
+                        continue;
+
+                    std::fill(bins.begin(), bins.end(), Bin());
+                    float scale = bin_count / node_extent[axis];
+                    for (auto &ref : task.refs)
+                    {
+                        // Bins from the planes the partition below tests, so
+                        // a reference is counted as straddling a plane
+                        // exactly when the partition would split it there.
+                        // first is the last bin whose lower plane is at or
+                        // below pmin, last the last one whose lower plane is
+                        // below pmax; the scaled guess is off by one at most.
+                        const float pmin = ref.bounds.pmin[axis], pmax = ref.bounds.pmax[axis];
+                        uint32_t first = std::min(bin_count - 1, (uint32_t)std::max((pmin - bounds.pmin[axis]) * scale, 0.f));
+                        uint32_t last = std::min(bin_count - 1, (uint32_t)std::max((pmax - bounds.pmin[axis]) * scale, 0.f));
+                        while (first > 0 && plane(axis, first) > pmin)
+                            --first;
+                        while (first + 1 < bin_count && plane(axis, first + 1) <= pmin)
+                            ++first;
+                        while (last > 0 && !(plane(axis, last) < pmax))
+                            --last;
+                        while (last + 1 < bin_count && plane(axis, last + 1) < pmax)
+                            ++last;
+                        // Flat references on a plane go left, as in the partition
+                        first = std::min(first, last);
+
+                        Reference rest = ref;
+                        for (uint32_t b = first; b < last; ++b)
+                        {
+                            Reference part, whole = rest;
+                            SplitReference(whole, positions, indices, axis, plane(axis, b + 1), part, rest);
+                            bins[b].bounds.Grow(part.bounds);
+                        }
+                        bins[last].bounds.Grow(rest.bounds);
+                        ++bins[first].count;
+                        ++bins[last].exit;
+                    }
+
+                    Aabb right_bounds;
+                    uint32_t right_count = 0;
+                    for (uint32_t b = bin_count - 1; b > 0; --b)
+                    {
+                        right_bounds.Grow(bins[b].bounds);
+                        right_count += bins[b].exit;
+                        right_costs[b] = right_bounds.SurfaceArea() * right_count;
+                    }
+
+                    Aabb left_bounds;
+                    uint32_t left_count = 0;
+                    right_count = prim_count;
+                    for (uint32_t b = 0; b < bin_count - 1; ++b)
+                    {
+                        left_bounds.Grow(bins[b].bounds);
+                        left_count += bins[b].count;
+                        right_count -= bins[b].exit;
+                        float cost = left_bounds.SurfaceArea() * left_count + right_costs[b + 1];
+                        uint32_t duplicates = left_count + right_count - prim_count;
+                        if (left_count > 0 && right_count > 0 && duplicates <= task.budget && cost < spatial_cost)
+                        {
+                            spatial_cost = cost;
+                            spatial_axis = axis;
+                            spatial_plane = plane(axis, b + 1);
+                        }
+                    }
+                }
+            }
+
+            float area = bounds.SurfaceArea();
+            float best_cost = std::min(object_cost, spatial_cost);
+            float leaf_cost = options_.intersection_cost * prim_count * area;
+            float split_cost = options_.traversal_cost * area + options_.intersection_cost * best_cost;
+            if (prim_count <= options_.max_leaf_size && leaf_cost <= split_cost)
+            {
+                make_leaf(task, bounds);
+                return false;
+            }
+
+            left_task.refs.clear();
+            right_task.refs.clear();
+            bool spatial = spatial_axis >= 0 && spatial_cost < object_cost;
+            if (spatial)
+            {
+                const int axis = spatial_axis;
+                Aabb left_bounds, right_bounds;
+                std::vector<Reference> straddling;
+                for (auto &ref : task.refs)
+                {
+                    if (ref.bounds.pmax[axis] <= spatial_plane)
+                    {
+                        left_task.refs.push_back(ref);
+                        left_bounds.Grow(ref.bounds);
+                    }
+                    else if (ref.bounds.pmin[axis] >= spatial_plane)
+                    {
+                        right_task.refs.push_back(ref);
+                        right_bounds.Grow(ref.bounds);
+                    }
+                    else
+                        straddling.push_back(ref);
+                }
+
+                // Reference unsplitting: keep a straddling reference whole on
+                // one side when that is cheaper than duplicating it
+                float left_count = (float)(left_task.refs.size() + straddling.size());
+                float right_count = (float)(right_task.refs.size() + straddling.size());
+                for (auto &ref : straddling)
+                {
+                    Reference left_part, right_part;
+                    SplitReference(ref, positions, indices, axis, spatial_plane, left_part, right_part);
+                    Aabb split_left = Union(left_bounds, left_part.bounds);
+                    Aabb split_right = Union(right_bounds, right_part.bounds);
+                    Aabb whole_left = Union(left_bounds, ref.bounds);
+                    Aabb whole_right = Union(right_bounds, ref.bounds);
+
+                    float cost_split = split_left.SurfaceArea() * left_count + split_right.SurfaceArea() * right_count;
+                    float cost_left = whole_left.SurfaceArea() * left_count + right_bounds.SurfaceArea() * (right_count - 1.f);
+                    float cost_right = left_bounds.SurfaceArea() * (left_count - 1.f) + whole_right.SurfaceArea() * right_count;
+                    if (cost_left < cost_split && cost_left <= cost_right)
+                    {
+                        left_task.refs.push_back(ref);
+                        left_bounds = whole_left;
+                        right_count -= 1.f;
+                    }
+                    else if (cost_right < cost_split)
+                    {
+                        right_task.refs.push_back(ref);
+                        right_bounds = whole_right;
+                        left_count -= 1.f;
+                    }
+                    else
+                    {
+                        if (!left_part.bounds.IsEmpty())
+                            left_task.refs.push_back(left_part);
+                        if (!right_part.bounds.IsEmpty())
+                            right_task.refs.push_back(right_part);
+                        left_bounds = split_left;
+                        right_bounds = split_right;
+                    }
+                }
+
+                // Binning counts duplicates with the same planes and
+                // unsplitting only removes some, so this only guards the
+                // reference and node arrays sized by the budget
+                if (left_task.refs.size() + right_task.refs.size() > (size_t)prim_count + task.budget)
+                {
+                    left_task.refs.clear();
+                    right_task.refs.clear();
+                    spatial = false;
+                }
+            }
+            if (!spatial && object_axis >= 0)
+            {
+                float scale = bin_count * (1.f - 1e-5f) / extent[object_axis];
+                for (auto &ref : task.refs)
+                {
+                    bool left = (uint32_t)((ref.bounds.Center()[object_axis] - centroid_bounds.pmin[object_axis]) * scale) < object_bin;
+                    (left ? left_task.refs : right_task.refs).push_back(ref);
+                }
+            }
+
+            if (left_task.refs.empty() || right_task.refs.empty())
+            {
+                // All centroids coincide, any split is as good as another
+                left_task.refs.clear();
+                right_task.refs.clear();
+                if (prim_count <= options_.max_leaf_size)
+                {
+                    make_leaf(task, bounds);
+                    return false;
+                }
+                left_task.refs.assign(task.refs.begin(), task.refs.begin() + prim_count / 2);
+                right_task.refs.assign(task.refs.begin() + prim_count / 2, task.refs.end());
+            }
+
+            // Whatever the split did not use is shared by the children
+            uint32_t child_refs = (uint32_t)(left_task.refs.size() + right_task.refs.size());
+            uint32_t duplicates = child_refs > prim_count ? child_refs - prim_count : 0;
+            uint32_t budget = task.budget - std::min(task.budget, duplicates);
+            left_task.budget = (uint32_t)((uint64_t)budget * left_task.refs.size() / child_refs);
+            right_task.budget = budget - left_task.budget;
+
+            uint32_t children = node_count.fetch_add(2);
+            assert(children + 2 <= nodes.size());
+            nodes[task.node] = MakeInterior(bounds, children, children + 1);
+            left_task.node = children;
+            right_task.node = children + 1;
+            task.refs = std::vector<Reference>();
+            return true;
+        };
+
+        // Breadth first on the calling thread
+        const size_t task_target = 4 * GetWorkerCount();
+        std::vector<Task> tasks;
+        tasks.push_back(std::move(root));
+        std::vector<Task> pending;
+        while (!tasks.empty() && tasks.size() + pending.size() < task_target)
+        {
+            std::vector<Task> next;
+            for (auto &task : tasks)
+            {
+                Task left, right;
+                if (task.refs.size() < 4096)
+                    pending.push_back(std::move(task));
+                else if (split(task, left, right))
+                {
+                    next.push_back(std::move(left));
+                    next.push_back(std::move(right));
+                }
+            }
+            std::swap(tasks, next);
+        }
+        for (auto &task : tasks)
+            pending.push_back(std::move(task));
+
+        // Depth first per subtree on the workers
+        ParallelFor(0, pending.size(), 1, [&](size_t begin, size_t end)
+        {
+            std::vector<Task> stack;
+            for (size_t i = begin; i < end; ++i)
+            {
+                stack.push_back(std::move(pending[i]));
+                while (!stack.empty())
+                {
+                    Task task = std::move(stack.back()), left, right;
+                    stack.pop_back();
+                    if (split(task, left, right))
+                    {
+                        stack.push_back(std::move(right));
+                        stack.push_back(std::move(left));
+                    }
+                }
+            }
+        });
+
+        nodes.resize(node_count);
+        refs.resize(ref_count);
+    }
+
+    // Splits the tree into a top part and about subtree_count subtrees
+    void Bvh::partitionTree(size_t subtree_count, std::vector<uint32_t> &top, std::vector<uint32_t> &subtrees) const
+    {
+        top.clear();
+        subtrees.assign(1, 0);
+        while (subtrees.size() < subtree_count)
+        {
+            auto it = std::find_if(subtrees.begin(), subtrees.end(), [&](uint32_t index) { return !nodes_[index].IsLeaf(); });
+            if (it == subtrees.end())
+                break;
+            uint32_t index = *it;
+            subtrees.erase(it);
+            top.push_back(index);
+            subtrees.push_back(nodes_[index].left);
+            subtrees.push_back(nodes_[index].right);
+        }
+    }
+
+    // Nodes are in pre-order, so a subtree ends after the end of its rightmost path
+    uint32_t Bvh::getSubtreeEnd(uint32_t root) const
+    {
+        uint32_t last = root;
+        while (!nodes_[last].IsLeaf())
+            last = nodes_[last].right;
+        return last + 1;
+    }
+
+    // Collapses subtrees into leaves by SAH and lays the nodes out depth first
+    void Bvh::finalize(const std::vector<BvhNode> &nodes, const std::vector<uint32_t> &refs)
+    {
+        const size_t node_count = nodes.size();
+
+        // Post-order pass for subtree costs
+        std::vector<float> costs(node_count);
+        std::vector<uint32_t> counts(node_count);
+        std::vector<uint8_t> collapse(node_count, 0);
+        std::vector<std::pair<uint32_t, bool>> stack;
+        stack.emplace_back(0, false);
+        while (!stack.empty())
+        {
+            auto entry = stack.back();
+            stack.pop_back();
+
+            const BvhNode &node = nodes[entry.first];
+            float area = node.bounds.SurfaceArea();
+            if (node.IsLeaf())
+            {
+                counts[entry.first] = node.GetPrimCount();
+                costs[entry.first] = options_.intersection_cost * area * node.GetPrimCount();
+            }
+            else if (!entry.second)
+            {
+                stack.emplace_back(entry.first, true);
+                stack.emplace_back(node.right, false);
+                stack.emplace_back(node.left, false);
+            }
+            else
+            {
+                uint32_t prim_count = counts[node.left] + counts[node.right];
+                float split_cost = options_.traversal_cost * area + costs[node.left] + costs[node.right];
+                float leaf_cost = options_.intersection_cost * area * prim_count;
+                counts[entry.first] = prim_count;
+                if (prim_count <= options_.max_leaf_size && leaf_cost <= split_cost)
+                {
+                    collapse[entry.first] = 1;
+                    costs[entry.first] = leaf_cost;
+                }
+                else
+                    costs[entry.first] = split_cost;
+            }
+        }
+
+        // Pre-order emission, the left child always follows its parent
+        struct Entry
+        {
+            uint32_t node;
+            uint32_t parent;
+            uint32_t depth;
+            bool     right;
+        };
+
+        nodes_.reserve(node_count);
+        prim_indices_.reserve(refs.size());
+        std::vector<Entry> emit_stack(1, Entry{ 0, kInvalidNode, 1, false });
+        std::vector<uint32_t> gather_stack;
+        while (!emit_stack.empty())
+        {
+            Entry entry = emit_stack.back();
+            emit_stack.pop_back();
+
+            uint32_t index = (uint32_t)nodes_.size();
+            nodes_.push_back(nodes[entry.node]);
+            max_depth_ = std::max(max_depth_, entry.depth);
+            if (entry.parent != kInvalidNode)
+                (entry.right ? nodes_[entry.parent].right : nodes_[entry.parent].left) = index;
+
+            const BvhNode &node = nodes[entry.node];
+            if (node.IsLeaf() || collapse[entry.node])
+            {
+                // Gather the primitive references of the whole subtree
+                uint32_t first = (uint32_t)prim_indices_.size();
+                gather_stack.push_back(entry.node);
+                while (!gather_stack.empty())
+                {
+                    const BvhNode &n = nodes[gather_stack.back()];
+                    gather_stack.pop_back();
+                    if (n.IsLeaf())
+                        prim_indices_.insert(prim_indices_.end(), refs.begin() + n.left, refs.begin() + n.left + n.GetPrimCount());
+                    else
+                    {
+                        gather_stack.push_back(n.right);
+                        gather_stack.push_back(n.left);
+                    }
+                }
+                // Spatial splits can put several parts of one primitive into a collapsed subtree
+                if (!node.IsLeaf() && options_.quality == BvhBuildQuality::kSpatial)
+                {
+                    std::sort(prim_indices_.begin() + first, prim_indices_.end());
+                    prim_indices_.erase(std::unique(prim_indices_.begin() + first, prim_indices_.end()), prim_indices_.end());
+                }
+                nodes_[index] = MakeLeaf(node.bounds, first, (uint32_t)prim_indices_.size() - first);
+            }
+            else
+            {
+                emit_stack.push_back(Entry{ node.right, index, entry.depth + 1, true });
+                emit_stack.push_back(Entry{ node.left, index, entry.depth + 1, false });
+            }
+        }
+    }
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_buffer.h"
+
+namespace Cpu
+{
+    // 32 byte node, children are referenced explicitly so that any builder
+    // can emit them in any order. The root is always node 0 and finished
+    // hierarchies are stored in pre-order, so every subtree is a contiguous
+    // index range that starts at its root.
+    struct BvhNode
+    {
+        static const uint32_t kLeafFlag = 0x80000000u;
+
+        Aabb     bounds;
+        // Left child, or the first primitive reference for leaves
+        uint32_t left;
+        // Right child, or kLeafFlag | primitive count for leaves
+        uint32_t right;
+
+        bool     IsLeaf() const { return (right & kLeafFlag) != 0; }
+        uint32_t GetPrimCount() const { return right & ~kLeafFlag; }
+    };
+
+    enum class BvhBuildQuality
+    {
+        // Linear BVH: Morton ordered primitives split at the highest differing bit
+        kFast,
+        // Agglomerative clustering in a window over the Morton order (PLOC)
+        kBalanced,
+        // Top-down binned SAH
+        kHigh,
+        // Binned SAH with spatial splits that duplicate references (SBVH)
+        kSpatial
+    };
+
+    enum class BvhNodeFormat
+    {
+        // 32 byte nodes with full precision bounds
+        kFull,
+        // Child bounds quantized to 8 bits relative to the parent, see QuantizedBvh
+        kQuantized
+    };
+
+    enum class BvhLeafFormat
+    {
+        // Triangles are fetched through the index buffer one at a time
+        kIndexed,
+        // Triangles are copied into SoA blocks tested together, see TriangleBlock
+        kBlocks
+    };
+
+    // Where the intersector keeps the data traversal reads on machines with
+    // several NUMA nodes
+    enum class NumaPlacement
+    {
+        // Pages stay on the nodes of the threads that built them
+        kLocal,
+        // Pages are spread round robin over all nodes
+        kInterleave,
+        // One copy per node, threads read the copy of the node they run on
+        kReplicate
+    };
+
+    struct BvhBuildOptions
+    {
+        BvhBuildQuality quality = BvhBuildQuality::kHigh;
+        // Subtrees up to this many primitives are collapsed into leaves when SAH allows
+        uint32_t max_leaf_size = 4;
+        // SAH cost of a node traversal and of a primitive test
+        float traversal_cost = 1.2f;
+        float intersection_cost = 1.f;
+        // Number of centroid bins per axis for kHigh
+        uint32_t bin_count = 16;
+        // Neighbour search radius for kBalanced
+        uint32_t cluster_radius = 16;
+        // Extra references kSpatial may create, as a fraction of the primitive count
+        float duplication_budget = 0.3f;
+        // kSpatial only tries spatial splits where the children of the best
+        // object split overlap by more than this fraction of the root area
+        float spatial_split_alpha = 1e-5f;
+        // Node layout the intersector traverses
+        BvhNodeFormat node_format = BvhNodeFormat::kFull;
+        // Triangle layout the intersector tests leaves against
+        BvhLeafFormat leaf_format = BvhLeafFormat::kBlocks;
+        // Placement of node and triangle data, see NumaPlacement
+        NumaPlacement numa_placement = NumaPlacement::kLocal;
+    };
+
+    struct BvhOptimizeOptions
+    {
+        // Passes over the whole tree, fewer if a pass gains less than min_gain
+        uint32_t max_iterations = 3;
+        float min_gain = 0.002f;
+        // Wall clock budget in milliseconds, 0 for none
+        double time_budget_ms = 0.0;
+        // Leaves per treelet, from 3 to 8
+        uint32_t treelet_size = 7;
+    };
+
+    struct BvhOptimizeResult
+    {
+        float    sah_before = 0.f;
+        float    sah_after = 0.f;
+        uint32_t iterations = 0;
+        double   elapsed_ms = 0.0;
+        // A complete pass gained less than min_gain
+        bool     converged = false;
+    };
+
+    const char *GetBuildQualityName(BvhBuildQuality quality);
+    bool ParseBuildQuality(const char *name, BvhBuildQuality &quality);
+    const char *GetNodeFormatName(BvhNodeFormat format);
+    bool ParseNodeFormat(const char *name, BvhNodeFormat &format);
+    const char *GetLeafFormatName(BvhLeafFormat format);
+    bool ParseLeafFormat(const char *name, BvhLeafFormat &format);
+    const char *GetNumaPlacementName(NumaPlacement placement);
+    bool ParseNumaPlacement(const char *name, NumaPlacement &placement);
+
+    class Bvh
+    {
+    public:
+        Bvh();
+
+        // Builds the hierarchy over the given primitive bounds. Primitives are
+        // triangles positions[indices[3 * i + k]] if given, kSpatial then clips
+        // them exactly at split planes instead of clipping their bounds.
+        void Build(const std::vector<Aabb> &prim_bounds, const BvhBuildOptions &options,
+            const Vec3 *positions = nullptr, const uint32_t *indices = nullptr);
+
+        // Recomputes node bounds bottom-up for moved primitives, the topology
+        // is kept. Returns the new SAH cost.
+        float Refit(const std::vector<Aabb> &prim_bounds);
+
+        // Restructures small treelets into their SAH optimal topology (Karras
+        // and Aila 2013). Works on any built hierarchy, primitive references
+        // are kept. Becomes the new build SAH cost. A pass cut short by the
+        // time budget is continued by the next call.
+        BvhOptimizeResult Optimize(const BvhOptimizeOptions &options);
+
+        // SAH cost of the hierarchy normalized by the root surface area
+        float GetSahCost() const;
+        // SAH cost right after the last Build
+        float GetBuildSahCost() const { return build_sah_cost_; }
+
+        // Number of nodes on the longest root to leaf path
+        uint32_t GetMaxDepth() const { return max_depth_; }
+
+        const BvhBuildOptions &GetOptions() const { return options_; }
+
+        // Hierarchy data
+        BufferVector<BvhNode>   nodes_;
+        // Leaves reference [left, left + count) of this array. With kSpatial
+        // a primitive can be referenced from several leaves.
+        BufferVector<uint32_t>  prim_indices_;
+
+    protected:
+        void buildLinear(const std::vector<Aabb> &prim_bounds, std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs);
+        void buildClusters(const std::vector<Aabb> &prim_bounds, std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs);
+        void buildBinnedSah(const std::vector<Aabb> &prim_bounds, std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs);
+        void buildSpatialSplits(const std::vector<Aabb> &prim_bounds, const Vec3 *positions, const uint32_t *indices,
+            std::vector<BvhNode> &nodes, std::vector<uint32_t> &refs);
+
+        // Splits the tree into a top part, parents first, and about
+        // subtree_count subtrees. Subtrees are ranges from their root to the
+        // end of their rightmost path, children come after parents in each range.
+        void partitionTree(size_t subtree_count, std::vector<uint32_t> &top, std::vector<uint32_t> &subtrees) const;
+        uint32_t getSubtreeEnd(uint32_t root) const;
+
+        // Collapses subtrees into leaves by SAH and lays the nodes out depth first
+        void finalize(const std::vector<BvhNode> &nodes, const std::vector<uint32_t> &refs);
+
+        BvhBuildOptions         options_;
+        uint32_t                max_depth_;
+        float                   build_sah_cost_;
+        // Subtrees an interrupted Optimize pass already finished. Such a pass
+        // leaves the top of the tree alone, so the next call sees the same subtrees.
+        std::vector<uint8_t>    optimize_done_;
+    };
+}
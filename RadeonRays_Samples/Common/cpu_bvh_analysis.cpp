@@ -0,0 +1,288 @@
+#include "cpu_bvh_analysis.h"
+#include "cpu_parallel.h"
+
+#include <string.h>
+#include <algorithm>
+
+namespace Cpu
+{
+    static const uint32_t kNoStamp = 0xffffffffu;
+
+    static inline float TriangleArea(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2)
+    {
+        Vec3 n = Cross(v1 - v0, v2 - v0);
+        return 0.5f * std::sqrt(Dot(n, n));
+    }
+
+    // Area of the part of a triangle inside a box, Sutherland-Hodgman against the six slabs
+    static float ClippedTriangleArea(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2, const Aabb &box)
+    {
+        // Every plane adds at most one vertex
+        Vec3 polygon[9] = { v0, v1, v2 };
+        Vec3 clipped[9];
+        int count = 3;
+        for (int plane = 0; plane < 6 && count >= 3; ++plane)
+        {
+            int axis = plane >> 1;
+            bool is_max = (plane & 1) != 0;
+            float bound = is_max ? box.pmax[axis] : box.pmin[axis];
+            auto inside = [&](const Vec3 &p) { return is_max ? p[axis] <= bound : p[axis] >= bound; };
+
+            int clipped_count = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                const Vec3 &a = polygon[i];
+                const Vec3 &b = polygon[(i + 1) % count];
+                if (inside(a))
+                    clipped[clipped_count++] = a;
+                if (inside(a) != inside(b))
+                {
+                    Vec3 p = a + (b - a) * ((bound - a[axis]) / (b[axis] - a[axis]));
+                    p[axis] = bound;
+                    clipped[clipped_count++] = p;
+                }
+            }
+
+            count = clipped_count;
+            std::copy(clipped, clipped + count, polygon);
+        }
+
+        if (count < 3)
+            return 0.f;
+
+        Vec3 n;
+        for (int i = 1; i + 1 < count; ++i)
+            n = n + Cross(polygon[i] - polygon[0], polygon[i + 1] - polygon[0]);
+        return 0.5f * std::sqrt(Dot(n, n));
+    }
+
+    void AnalyzeBvh(const Bvh &bvh, const std::vector<Vec3> &positions, const std::vector<uint32_t> &indices,
+        bool end_point_overlap, BvhAnalysis &analysis)
+    {
+        analysis = BvhAnalysis();
+        const BufferVector<BvhNode> &nodes = bvh.nodes_;
+        if (nodes.empty())
+            return;
+
+        const BvhBuildOptions &options = bvh.GetOptions();
+        analysis.sah_cost = bvh.GetSahCost();
+        analysis.node_count = (uint32_t)nodes.size();
+        analysis.triangle_count = (uint32_t)(indices.size() / 3);
+        analysis.reference_count = (uint32_t)bvh.prim_indices_.size();
+
+        // Depth first walk for the shape of the tree
+        struct Entry
+        {
+            uint32_t node;
+            uint32_t depth;
+        };
+
+        std::vector<uint32_t> interior_per_level;
+        std::vector<Entry> stack(1, Entry{ 0, 1 });
+        double depth_sum = 0.0;
+        analysis.min_leaf_depth = 0xffffffffu;
+        while (!stack.empty())
+        {
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            const BvhNode &node = nodes[entry.node];
+            if (analysis.levels.size() < entry.depth)
+            {
+                analysis.levels.resize(entry.depth);
+                interior_per_level.resize(entry.depth, 0);
+            }
+            BvhLevelStats &level = analysis.levels[entry.depth - 1];
+            ++level.nodes;
+
+            if (node.IsLeaf())
+            {
+                ++level.leaves;
+                ++analysis.leaf_count;
+                if (analysis.leaf_sizes.size() <= node.GetPrimCount())
+                    analysis.leaf_sizes.resize(node.GetPrimCount() + 1, 0);
+                ++analysis.leaf_sizes[node.GetPrimCount()];
+                analysis.min_leaf_depth = std::min(analysis.min_leaf_depth, entry.depth);
+                analysis.max_leaf_depth = std::max(analysis.max_leaf_depth, entry.depth);
+                depth_sum += entry.depth;
+                continue;
+            }
+
+            float area = node.bounds.SurfaceArea();
+            if (area > 0.f)
+                level.sibling_overlap += Overlap(nodes[node.left].bounds, nodes[node.right].bounds).SurfaceArea() / area;
+            ++interior_per_level[entry.depth - 1];
+            stack.push_back(Entry{ node.right, entry.depth + 1 });
+            stack.push_back(Entry{ node.left, entry.depth + 1 });
+        }
+
+        analysis.avg_leaf_depth = depth_sum / analysis.leaf_count;
+        for (size_t i = 0; i < analysis.levels.size(); ++i)
+        {
+            if (interior_per_level[i] > 0)
+                analysis.levels[i].sibling_overlap /= interior_per_level[i];
+        }
+
+        if (!end_point_overlap)
+            return;
+
+        // Nodes are in pre-order, a subtree ends where its right child's does
+        std::vector<uint32_t> subtree_end(nodes.size());
+        for (size_t i = nodes.size(); i-- > 0;)
+            subtree_end[i] = nodes[i].IsLeaf() ? (uint32_t)i + 1 : subtree_end[nodes[i].right];
+
+        double total_area = 0.0;
+        for (uint32_t prim = 0; prim < analysis.triangle_count; ++prim)
+            total_area += TriangleArea(positions[indices[3 * prim]], positions[indices[3 * prim + 1]], positions[indices[3 * prim + 2]]);
+        if (!(total_area > 0.0))
+            return;
+
+        // Area of the geometry outside every node's subtree that still lies in
+        // its box, weighted like the SAH terms. The tree itself finds it.
+        std::vector<double> overlaps(nodes.size(), 0.0);
+        const size_t grain = std::max<size_t>(nodes.size() / (8 * GetWorkerCount()), 1);
+        ParallelFor(0, nodes.size(), grain, [&](size_t begin, size_t end)
+        {
+            // Primitives referenced from several leaves are counted once per node
+            std::vector<uint32_t> stamps(analysis.triangle_count, kNoStamp);
+            std::vector<uint32_t> query_stack;
+            for (size_t n = begin; n < end; ++n)
+            {
+                const Aabb &box = nodes[n].bounds;
+                for (uint32_t i = (uint32_t)n; i < subtree_end[n]; ++i)
+                {
+                    if (nodes[i].IsLeaf())
+                    {
+                        for (uint32_t r = nodes[i].left; r < nodes[i].left + nodes[i].GetPrimCount(); ++r)
+                            stamps[bvh.prim_indices_[r]] = (uint32_t)n;
+                    }
+                }
+
+                double area = 0.0;
+                query_stack.assign(1, 0);
+                while (!query_stack.empty())
+                {
+                    uint32_t index = query_stack.back();
+                    query_stack.pop_back();
+                    if ((index >= n && index < subtree_end[n]) || Overlap(nodes[index].bounds, box).IsEmpty())
+                        continue;
+
+                    const BvhNode &node = nodes[index];
+                    if (!node.IsLeaf())
+                    {
+                        query_stack.push_back(node.left);
+                        query_stack.push_back(node.right);
+                        continue;
+                    }
+
+                    for (uint32_t r = node.left; r < node.left + node.GetPrimCount(); ++r)
+                    {
+                        uint32_t prim = bvh.prim_indices_[r];
+                        if (stamps[prim] == n)
+                            continue;
+                        stamps[prim] = (uint32_t)n;
+                        area += ClippedTriangleArea(positions[indices[3 * prim]], positions[indices[3 * prim + 1]],
+                            positions[indices[3 * prim + 2]], box);
+                    }
+                }
+
+                float cost = nodes[n].IsLeaf() ? options.intersection_cost * nodes[n].GetPrimCount() : options.traversal_cost;
+                overlaps[n] = cost * area;
+            }
+        });
+
+        double overlap = 0.0;
+        for (auto o : overlaps)
+            overlap += o;
+        analysis.end_point_overlap = overlap / total_area;
+    }
+
+    const char *GetTraversalMetricName(TraversalMetric metric)
+    {
+        switch (metric)
+        {
+        case TraversalMetric::kNodes:
+            return "nodes";
+        case TraversalMetric::kTriangles:
+            return "triangles";
+        case TraversalMetric::kBoxes:
+            return "boxes";
+        }
+        return "unknown";
+    }
+
+    bool ParseTraversalMetric(const char *name, TraversalMetric &metric)
+    {
+        for (auto m : { TraversalMetric::kNodes, TraversalMetric::kTriangles, TraversalMetric::kBoxes })
+        {
+            if (strcmp(name, GetTraversalMetricName(m)) == 0)
+            {
+                metric = m;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void BuildTraversalHistogram(const TraversalStats *stats, size_t count, TraversalMetric metric,
+        std::vector<uint32_t> &buckets)
+    {
+        buckets.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32_t value = GetTraversalMetric(stats[i], metric);
+            uint32_t bucket = 0;
+            while (value != 0)
+            {
+                value >>= 1;
+                ++bucket;
+            }
+            if (bucket >= buckets.size())
+                buckets.resize(bucket + 1, 0);
+            ++buckets[bucket];
+        }
+    }
+
+    void AccumulatePixelStats(const Ray *rays, const TraversalStats *stats, size_t count,
+        std::vector<TraversalStats> &pixels)
+    {
+        // Several rays can share a pixel, so this stays serial
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32_t pixel = (uint32_t)rays[i].padding[0];
+            if (pixel >= pixels.size())
+                continue;
+            pixels[pixel].nodes += stats[i].nodes;
+            pixels[pixel].triangles += stats[i].triangles;
+            pixels[pixel].boxes += stats[i].boxes;
+        }
+    }
+
+    uint32_t MakeTraversalHeatmap(const std::vector<TraversalStats> &pixels, TraversalMetric metric, float percentile,
+        std::vector<float> &rgba)
+    {
+        rgba.assign(4 * pixels.size(), 1.f);
+        if (pixels.empty())
+            return 0;
+
+        std::vector<uint32_t> values(pixels.size());
+        for (size_t i = 0; i < pixels.size(); ++i)
+            values[i] = GetTraversalMetric(pixels[i], metric);
+        std::vector<uint32_t> sorted = values;
+        percentile = std::min(std::max(percentile, 0.f), 1.f);
+        size_t rank = (size_t)(percentile * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        const uint32_t top = std::max(sorted[rank], 1u);
+
+        static const float kRamp[5][3] = { { 0.f, 0.f, 0.f }, { 0.f, 0.f, 1.f }, { 0.f, 1.f, 0.f }, { 1.f, 1.f, 0.f }, { 1.f, 0.f, 0.f } };
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            float t = 4.f * std::min((float)values[i] / top, 1.f);
+            int stop = std::min((int)t, 3);
+            float f = t - stop;
+            for (int c = 0; c < 3; ++c)
+                rgba[4 * i + c] = kRamp[stop][c] + f * (kRamp[stop + 1][c] - kRamp[stop][c]);
+        }
+        return top;
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_bvh.h"
+#include "cpu_intersector.h"
+
+namespace Cpu
+{
+    // One level of the tree, the root is level 0
+    struct BvhLevelStats
+    {
+        uint32_t nodes = 0;
+        uint32_t leaves = 0;
+        // Average over the interior nodes of the area their children share,
+        // relative to their own area
+        double   sibling_overlap = 0.0;
+    };
+
+    struct BvhAnalysis
+    {
+        float    sah_cost = 0.f;
+        // End-point overlap (Aila et al. 2013), negative if not computed
+        double   end_point_overlap = -1.0;
+
+        uint32_t node_count = 0;
+        uint32_t leaf_count = 0;
+        uint32_t triangle_count = 0;
+        // Primitive references in leaves, more than triangles with spatial splits
+        uint32_t reference_count = 0;
+
+        // Number of leaves by primitive count
+        std::vector<uint32_t> leaf_sizes;
+
+        // Leaf depths count nodes on the path, the root alone has depth 1
+        uint32_t min_leaf_depth = 0;
+        uint32_t max_leaf_depth = 0;
+        double   avg_leaf_depth = 0.0;
+
+        std::vector<BvhLevelStats> levels;
+    };
+
+    // Measures a built hierarchy over the triangles positions[indices[3 * i + k]].
+    // The end-point overlap queries the tree once per node, so it is optional.
+    void AnalyzeBvh(const Bvh &bvh, const std::vector<Vec3> &positions, const std::vector<uint32_t> &indices,
+        bool end_point_overlap, BvhAnalysis &analysis);
+
+    // Counter of TraversalStats that histograms and heatmaps show
+    enum class TraversalMetric
+    {
+        kNodes,
+        kTriangles,
+        kBoxes
+    };
+
+    const char *GetTraversalMetricName(TraversalMetric metric);
+    bool ParseTraversalMetric(const char *name, TraversalMetric &metric);
+
+    inline uint32_t GetTraversalMetric(const TraversalStats &stats, TraversalMetric metric)
+    {
+        return metric == TraversalMetric::kNodes ? stats.nodes
+            : metric == TraversalMetric::kTriangles ? stats.triangles : stats.boxes;
+    }
+
+    // Rays by the work they did. Bucket 0 counts rays with none, bucket
+    // b > 0 rays with [2^(b-1), 2^b).
+    void BuildTraversalHistogram(const TraversalStats *stats, size_t count, TraversalMetric metric,
+        std::vector<uint32_t> &buckets);
+
+    // Adds the work of every ray to its pixel, pixel ids are in padding[0]
+    // as the workload generators write them
+    void AccumulatePixelStats(const Ray *rays, const TraversalStats *stats, size_t count,
+        std::vector<TraversalStats> &pixels);
+
+    // False color RGBA image of a metric per pixel, from black through blue,
+    // green and yellow to red. Values at or above the given percentile of
+    // the pixels map to red, which keeps a few outliers from washing the
+    // image out. Returns the value red stands for.
+    uint32_t MakeTraversalHeatmap(const std::vector<TraversalStats> &pixels, TraversalMetric metric, float percentile,
+        std::vector<float> &rgba);
+}
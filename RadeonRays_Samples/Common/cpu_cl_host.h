@@ -0,0 +1,220 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <cmath>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "cpu_parallel.h"
+
+// Lets the sample kernels (*.cl) compile as ordinary C++ so they run on the
+// CPU and can be stepped through, profiled and tested with the usual tools.
+// Include this header first, then the kernel source inside a namespace of
+// its own, with the sample directory on the include path for payload.cl:
+//
+//     namespace AoKernels
+//     {
+//         using namespace ClHost;
+//     #include "ambient_occlusion.cl"
+//     }
+//
+// Kernels become plain functions that read their work item from
+// get_global_id, see LaunchKernel. Not covered: vector literals such as
+// (float4)(v, 1.f), which the kernels spell with the make_float* helpers of
+// utils.cl instead, swizzles other than .xyz, .xy and .zw, local memory and
+// barriers.
+
+#define __kernel
+#define __global
+#define __constant const
+#define restrict __restrict
+
+namespace ClHost
+{
+    typedef unsigned int uint;
+
+    struct float2
+    {
+        float x, y;
+
+        float2() = default;
+        float2(float x_, float y_) { x = x_; y = y_; }
+
+        float &operator [](int i) { return (&x)[i]; }
+        float operator [](int i) const { return (&x)[i]; }
+    };
+
+    // 16 bytes as in OpenCL, the fourth float is padding
+    struct alignas(16) float3
+    {
+        float x, y, z;
+
+        float3() = default;
+        float3(float x_, float y_, float z_) { x = x_; y = y_; z = z_; }
+
+        float &operator [](int i) { return (&x)[i]; }
+        float operator [](int i) const { return (&x)[i]; }
+    };
+
+    // Two components of a float4 read and written in place. Assigning one
+    // swizzle to another copies all four floats, convert to the vector type
+    // first as in a.xy = (float2)b.zw.
+    template <int A, int B>
+    struct Swizzle2
+    {
+        float v[4];
+
+        operator float2() const { return float2(v[A], v[B]); }
+        Swizzle2 &operator =(const float2 &a) { v[A] = a.x; v[B] = a.y; return *this; }
+    };
+
+    // .xyz of a float4, same caveat as Swizzle2
+    struct Swizzle3
+    {
+        float v[4];
+
+        operator float3() const { return float3(v[0], v[1], v[2]); }
+        Swizzle3 &operator =(const float3 &a) { v[0] = a.x; v[1] = a.y; v[2] = a.z; return *this; }
+        Swizzle3 &operator +=(const float3 &a) { v[0] += a.x; v[1] += a.y; v[2] += a.z; return *this; }
+        Swizzle3 &operator -=(const float3 &a) { v[0] -= a.x; v[1] -= a.y; v[2] -= a.z; return *this; }
+        Swizzle3 &operator *=(float a) { v[0] *= a; v[1] *= a; v[2] *= a; return *this; }
+        Swizzle3 &operator /=(float a) { v[0] /= a; v[1] /= a; v[2] /= a; return *this; }
+    };
+
+    struct alignas(16) float4
+    {
+        union
+        {
+            struct
+            {
+                float x, y, z, w;
+            };
+            Swizzle3        xyz;
+            Swizzle2<0, 1>  xy;
+            Swizzle2<2, 3>  zw;
+        };
+
+        float4() = default;
+        float4(float x_, float y_, float z_, float w_) { x = x_; y = y_; z = z_; w = w_; }
+
+        float &operator [](int i) { return (&x)[i]; }
+        float operator [](int i) const { return (&x)[i]; }
+    };
+
+    struct int2
+    {
+        int x, y;
+    };
+
+    static_assert(sizeof(float3) == 16 && sizeof(float4) == 16, "OpenCL vector sizes");
+
+    // Component-wise arithmetic between vectors and with scalars on either side
+#define CL_HOST_VECTOR_OPERATOR(T, N, OP) \
+    inline T &operator OP##=(T &a, const T &b) { for (int i = 0; i < N; ++i) a[i] OP##= b[i]; return a; } \
+    inline T &operator OP##=(T &a, float b) { for (int i = 0; i < N; ++i) a[i] OP##= b; return a; } \
+    inline T operator OP(T a, const T &b) { return a OP##= b; } \
+    inline T operator OP(T a, float b) { return a OP##= b; } \
+    inline T operator OP(float a, const T &b) { T r; for (int i = 0; i < N; ++i) r[i] = a OP b[i]; return r; }
+
+#define CL_HOST_VECTOR_OPERATORS(T, N) \
+    CL_HOST_VECTOR_OPERATOR(T, N, +) \
+    CL_HOST_VECTOR_OPERATOR(T, N, -) \
+    CL_HOST_VECTOR_OPERATOR(T, N, *) \
+    CL_HOST_VECTOR_OPERATOR(T, N, /) \
+    inline T operator -(T a) { for (int i = 0; i < N; ++i) a[i] = -a[i]; return a; } \
+    inline float dot(const T &a, const T &b) { float d = 0.f; for (int i = 0; i < N; ++i) d += a[i] * b[i]; return d; } \
+    inline float length(const T &a) { return std::sqrt(dot(a, a)); } \
+    inline T normalize(const T &a) { float l = length(a); return l > 0.f ? a / l : a; } \
+    inline T clamp(T a, float lo, float hi) { for (int i = 0; i < N; ++i) a[i] = a[i] < lo ? lo : (a[i] > hi ? hi : a[i]); return a; }
+
+    CL_HOST_VECTOR_OPERATORS(float2, 2)
+    CL_HOST_VECTOR_OPERATORS(float3, 3)
+    CL_HOST_VECTOR_OPERATORS(float4, 4)
+
+#undef CL_HOST_VECTOR_OPERATORS
+#undef CL_HOST_VECTOR_OPERATOR
+
+    inline float3 cross(const float3 &a, const float3 &b)
+    {
+        return float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+
+    // w is zero as in OpenCL
+    inline float4 cross(const float4 &a, const float4 &b)
+    {
+        return float4(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x, 0.f);
+    }
+
+    inline float clamp(float a, float lo, float hi)
+    {
+        return a < lo ? lo : (a > hi ? hi : a);
+    }
+
+    using std::acos;
+    using std::atan2;
+    using std::cos;
+    using std::fabs;
+    using std::pow;
+    using std::sin;
+    using std::sqrt;
+
+    inline float native_sqrt(float a) { return std::sqrt(a); }
+    inline float native_sin(float a) { return std::sin(a); }
+    inline float native_cos(float a) { return std::cos(a); }
+
+    // 32-bit atomics, returning the old value as in OpenCL
+#if defined(_MSC_VER)
+    inline int atomic_add(volatile int *p, int v) { return (int)_InterlockedExchangeAdd((volatile long *)p, (long)v); }
+    inline int atomic_cmpxchg(volatile int *p, int cmp, int v) { return (int)_InterlockedCompareExchange((volatile long *)p, (long)v, (long)cmp); }
+#else
+    inline int atomic_add(volatile int *p, int v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+    inline int atomic_cmpxchg(volatile int *p, int cmp, int v) { __atomic_compare_exchange_n(p, &cmp, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); return cmp; }
+#endif
+    inline uint atomic_add(volatile uint *p, uint v) { return (uint)atomic_add((volatile int *)p, (int)v); }
+    inline uint atomic_cmpxchg(volatile uint *p, uint cmp, uint v) { return (uint)atomic_cmpxchg((volatile int *)p, (int)cmp, (int)v); }
+    inline int atomic_inc(volatile int *p) { return atomic_add(p, 1); }
+    inline uint atomic_inc(volatile uint *p) { return atomic_add(p, 1u); }
+
+    // Work item of the calling thread, set by LaunchKernel
+    inline size_t &CurrentGlobalId()
+    {
+        static thread_local size_t id = 0;
+        return id;
+    }
+
+    // One dimensional launches only
+    inline size_t get_global_id(uint dim)
+    {
+        return dim == 0 ? CurrentGlobalId() : 0;
+    }
+
+    // Calls kernel() for every work item in [global_offset, global_offset +
+    // global_size) on the shared pool, which stands in for an NDRange with a
+    // global work offset. Items within a grain run in order on one thread,
+    // so kernels that update the same pixel from adjacent items without
+    // atomics stay race free when the grain is a multiple of the items per
+    // pixel.
+    template <typename Kernel>
+    void LaunchKernel(size_t global_offset, size_t global_size, size_t grain, const Kernel &kernel)
+    {
+        Cpu::ParallelFor(global_offset, global_offset + global_size, grain, [&](size_t begin, size_t end)
+        {
+            for (size_t id = begin; id < end; ++id)
+            {
+                CurrentGlobalId() = id;
+                kernel();
+            }
+        });
+    }
+
+    // Work items [0, global_size)
+    template <typename Kernel>
+    void LaunchKernel(size_t global_size, size_t grain, const Kernel &kernel)
+    {
+        LaunchKernel(0, global_size, grain, kernel);
+    }
+}
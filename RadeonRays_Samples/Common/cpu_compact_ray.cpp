@@ -0,0 +1,129 @@
+#include "cpu_compact_ray.h"
+#include "cpu_parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Cpu
+{
+    static inline float SignNotZero(float v)
+    {
+        return v >= 0.f ? 1.f : -1.f;
+    }
+
+    static inline uint32_t PackSnorm16(float v)
+    {
+        return (uint16_t)(int16_t)std::lround(std::min(std::max(v, -1.f), 1.f) * 32767.f);
+    }
+
+    static inline float UnpackSnorm16(uint32_t v)
+    {
+        return std::max((float)(int16_t)(uint16_t)v / 32767.f, -1.f);
+    }
+
+    static inline uint32_t PackUnorm16(float v)
+    {
+        return (uint32_t)std::lround(std::min(std::max(v, 0.f), 1.f) * 65535.f);
+    }
+
+    // Projects the sphere onto the octahedron |x| + |y| + |z| = 1 and folds
+    // the lower half over the upper one, so the square [-1, 1]^2 covers all
+    // directions with a bounded stretch
+    uint32_t EncodeDirection(const Vec3 &d)
+    {
+        const float inv_l1 = 1.f / (std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z));
+        float x = d.x * inv_l1;
+        float y = d.y * inv_l1;
+        if (d.z < 0.f)
+        {
+            const float fx = (1.f - std::fabs(y)) * SignNotZero(x);
+            y = (1.f - std::fabs(x)) * SignNotZero(y);
+            x = fx;
+        }
+        return PackSnorm16(x) | (PackSnorm16(y) << 16);
+    }
+
+    Vec3 DecodeDirection(uint32_t d)
+    {
+        Vec3 v(UnpackSnorm16(d & 0xFFFF), UnpackSnorm16(d >> 16), 0.f);
+        v.z = 1.f - std::fabs(v.x) - std::fabs(v.y);
+        if (v.z < 0.f)
+        {
+            const float fx = (1.f - std::fabs(v.y)) * SignNotZero(v.x);
+            v.y = (1.f - std::fabs(v.x)) * SignNotZero(v.y);
+            v.x = fx;
+        }
+        return Normalize(v);
+    }
+
+    CompactRay Compact(const Ray &ray)
+    {
+        CompactRay compact;
+        compact.o = ray.o;
+        compact.maxt = ray.extra[1] != 0 ? ray.maxt * std::sqrt(Dot(ray.d, ray.d)) : 0.f;
+        compact.d = EncodeDirection(ray.d);
+        compact.pixel = ray.padding[0];
+        return compact;
+    }
+
+    Ray Expand(const CompactRay &compact)
+    {
+        Ray ray;
+        ray.o = compact.o;
+        ray.maxt = compact.maxt;
+        ray.d = DecodeDirection(compact.d);
+        ray.time = 0.f;
+        ray.extra[0] = -1;
+        ray.extra[1] = compact.maxt > 0.f ? -1 : 0;
+        ray.padding[0] = compact.pixel;
+        ray.padding[1] = 0;
+        return ray;
+    }
+
+    CompactHit Compact(const Intersection &hit)
+    {
+        CompactHit compact;
+        compact.shapeid = hit.shapeid;
+        compact.primid = hit.primid;
+        compact.uv = 0;
+        compact.t = 0.f;
+        if (hit.primid != kInvalidId)
+        {
+            compact.uv = PackUnorm16(hit.uvwt[0]) | (PackUnorm16(hit.uvwt[1]) << 16);
+            compact.t = hit.uvwt[3];
+        }
+        return compact;
+    }
+
+    Intersection Expand(const CompactHit &compact)
+    {
+        Intersection hit;
+        hit.shapeid = compact.shapeid;
+        hit.primid = compact.primid;
+        hit.padding0 = 0;
+        hit.padding1 = 0;
+        hit.uvwt[0] = (float)(compact.uv & 0xFFFF) / 65535.f;
+        hit.uvwt[1] = (float)(compact.uv >> 16) / 65535.f;
+        hit.uvwt[2] = 0.f;
+        hit.uvwt[3] = compact.t;
+        return hit;
+    }
+
+    void Compact(const Ray *rays, size_t count, CompactRay *compact_rays)
+    {
+        ParallelFor(0, count, 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                compact_rays[i] = Compact(rays[i]);
+        });
+    }
+
+    void Expand(const CompactHit *compact_hits, size_t count, Intersection *hits)
+    {
+        ParallelFor(0, count, 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                hits[i] = Expand(compact_hits[i]);
+        });
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cpu_math.h"
+#include "cpu_intersector.h"
+
+namespace Cpu
+{
+    // Ray in half the bytes of Ray, for ray streams the CPU path keeps in
+    // memory between stages. The origin keeps full floats, offsets along
+    // the normal that keep secondary rays off their surface are far below
+    // any quantization step worth having. The direction is stored unit
+    // length and octahedral encoded in two snorm16, about 1e-4 radians of
+    // error at worst. maxt is in units of length along that direction.
+    // Rays with maxt <= 0 are inactive and return no hit. The mask and time
+    // of Ray are dropped, nothing on the CPU path reads them.
+    struct CompactRay
+    {
+        Vec3        o;
+        float       maxt;
+        uint32_t    d;
+        int32_t     pixel;
+    };
+
+    // Closest hit in half the bytes of Intersection: barycentrics as two
+    // unorm16 and the distance along the unit direction
+    struct CompactHit
+    {
+        int32_t     shapeid;
+        int32_t     primid;
+        uint32_t    uv;
+        float       t;
+    };
+
+    static_assert(sizeof(CompactRay) == 24, "CompactRay must stay half of Ray");
+    static_assert(sizeof(CompactHit) == 16, "CompactHit must stay half of Intersection");
+
+    // What the distance-only occlusion query writes for rays that hit nothing
+    const float kMissDistance = -1.f;
+
+    uint32_t EncodeDirection(const Vec3 &d);
+    // Unit length
+    Vec3 DecodeDirection(uint32_t d);
+
+    // maxt is scaled by the length of ray.d so the ray ends where it did,
+    // padding[0] becomes the pixel id
+    CompactRay Compact(const Ray &ray);
+    // Active with a full mask, padding[0] is the pixel id
+    Ray Expand(const CompactRay &ray);
+
+    CompactHit Compact(const Intersection &hit);
+    Intersection Expand(const CompactHit &hit);
+
+    void Compact(const Ray *rays, size_t count, CompactRay *compact_rays);
+    void Expand(const CompactHit *compact_hits, size_t count, Intersection *hits);
+}
@@ -0,0 +1,72 @@
+#include "cpu_double_buffered_intersector.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace Cpu
+{
+    DoubleBufferedIntersector::DoubleBufferedIntersector(const BvhBuildOptions &options, unsigned build_workers)
+        : options_(options)
+        , build_pool_(new ThreadPool(std::max(build_workers, 1u)))
+        , current_(new Intersector())
+        , next_(new Intersector())
+        , build_done_(false)
+        , build_ms_(0.0)
+        , last_build_ms_(0.0)
+        , swap_count_(0)
+    {
+    }
+
+    DoubleBufferedIntersector::~DoubleBufferedIntersector()
+    {
+        join();
+    }
+
+    void DoubleBufferedIntersector::Commit(const Scene &scene)
+    {
+        join();
+        current_->AttachScene(scene);
+        current_->Commit(options_);
+    }
+
+    bool DoubleBufferedIntersector::StartRebuild(const Scene &scene)
+    {
+        if (IsPending())
+            return false;
+
+        // The copy is what lets the caller edit scene again right away
+        next_->AttachScene(scene);
+        build_done_.store(false, std::memory_order_relaxed);
+        build_thread_ = std::thread(&DoubleBufferedIntersector::build, this);
+        return true;
+    }
+
+    bool DoubleBufferedIntersector::Swap()
+    {
+        if (!IsPending() || !build_done_.load(std::memory_order_acquire))
+            return false;
+
+        join();
+        std::swap(current_, next_);
+        last_build_ms_ = build_ms_;
+        ++swap_count_;
+        return true;
+    }
+
+    void DoubleBufferedIntersector::build()
+    {
+        ThreadPool::BindCurrentThread(build_pool_.get());
+        auto start = std::chrono::high_resolution_clock::now();
+        next_->Commit(options_);
+        auto end = std::chrono::high_resolution_clock::now();
+        build_ms_ = std::chrono::duration<double, std::milli>(end - start).count();
+        ThreadPool::BindCurrentThread(nullptr);
+        build_done_.store(true, std::memory_order_release);
+    }
+
+    void DoubleBufferedIntersector::join()
+    {
+        if (build_thread_.joinable())
+            build_thread_.join();
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "cpu_intersector.h"
+#include "cpu_parallel.h"
+#include "scene.h"
+
+namespace Cpu
+{
+    // Two intersectors, one frames trace against and one being built in the
+    // background, for scenes edited while rendering. Commit makes the caller
+    // wait for the whole build; here StartRebuild copies the geometry and
+    // returns, the build runs on a thread of its own, and the first Swap
+    // after it finished makes the new hierarchy current. Frames keep
+    // tracing the previous hierarchy meanwhile instead of stalling the frame
+    // an edit was made in, which trades the stall for latency: an edit
+    // shows up the frame after its build finished, build time plus one frame
+    // at best. An edit made while a build is pending waits for that build
+    // to finish and for one of its own, up to twice the build time plus a
+    // frame.
+    //
+    // The build gets its own pool of build_workers threads, the build thread
+    // included, so threads of the shared pool waiting for their frame never
+    // run a piece of the build. With fewer build workers than cores the
+    // frames keep most of the machine, at the cost of a longer build.
+    //
+    // StartRebuild and Swap belong to the render loop. Swap must be called
+    // at a frame boundary, when no query on GetCurrent() is running.
+    class DoubleBufferedIntersector
+    {
+        // Non-copyable
+        DoubleBufferedIntersector(const DoubleBufferedIntersector &) = delete;
+        DoubleBufferedIntersector &operator =(const DoubleBufferedIntersector &) = delete;
+
+    public:
+        explicit DoubleBufferedIntersector(const BvhBuildOptions &options, unsigned build_workers = 1);
+        // Waits for a running build
+        ~DoubleBufferedIntersector();
+
+        // Builds the current hierarchy on the calling thread, waits for a
+        // running build and drops it
+        void Commit(const Scene &scene);
+
+        // Starts building a hierarchy over the geometry scene has now.
+        // Returns false without doing anything while the last build is
+        // still running or waits for its Swap; the caller asks again on a
+        // later frame.
+        bool StartRebuild(const Scene &scene);
+        // Makes a finished build current, returns true if it did
+        bool Swap();
+
+        // A build was started and not swapped in yet
+        bool IsPending() const { return build_thread_.joinable(); }
+
+        const Intersector &GetCurrent() const { return *current_; }
+        // Duration of the build Swap made current last
+        double GetLastBuildMs() const { return last_build_ms_; }
+        uint32_t GetSwapCount() const { return swap_count_; }
+
+    private:
+        void build();
+        void join();
+
+        BvhBuildOptions                 options_;
+        std::unique_ptr<ThreadPool>     build_pool_;
+        std::unique_ptr<Intersector>    current_;
+        std::unique_ptr<Intersector>    next_;
+        std::thread                     build_thread_;
+        std::atomic<bool>               build_done_;
+        // Written by the build thread, read after joining it
+        double                          build_ms_;
+        double                          last_build_ms_;
+        uint32_t                        swap_count_;
+    };
+}
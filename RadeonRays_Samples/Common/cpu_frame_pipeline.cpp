@@ -0,0 +1,65 @@
+#include "cpu_frame_pipeline.h"
+
+#include <algorithm>
+
+namespace Cpu
+{
+    FramePipeline::FramePipeline(uint32_t depth)
+        : depth_(std::max(depth, 1u))
+        , frame_count_(0)
+        , group_(nullptr)
+    {
+    }
+
+    void FramePipeline::AddStage(Stage stage)
+    {
+        stages_.push_back(std::move(stage));
+    }
+
+    void FramePipeline::Run(int frame_count)
+    {
+        if (stages_.empty() || frame_count <= 0)
+            return;
+
+        TaskGroup group;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_.assign(stages_.size(), 0);
+            launched_.assign(stages_.size(), 0);
+            frame_count_ = frame_count;
+            group_ = &group;
+            launchReady();
+        }
+        // A stage queues its successors before it returns, so the group
+        // only runs dry after the last stage of the last frame
+        group.Wait();
+        group_ = nullptr;
+    }
+
+    void FramePipeline::launchReady()
+    {
+        for (size_t s = 0; s < stages_.size(); ++s)
+        {
+            const int frame = launched_[s];
+            if (frame >= frame_count_ || frame != done_[s])
+                continue;
+            // The first stage waits for a free buffer set, the others for
+            // the stage before them
+            const bool ready = s == 0 ? frame < done_.back() + (int)depth_ : frame < done_[s - 1];
+            if (!ready)
+                continue;
+
+            ++launched_[s];
+            group_->Run([this, s, frame]() { runStage(s, frame); });
+        }
+    }
+
+    void FramePipeline::runStage(size_t stage, int frame)
+    {
+        stages_[stage](frame, (uint32_t)(frame % depth_));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++done_[stage];
+        launchReady();
+    }
+}
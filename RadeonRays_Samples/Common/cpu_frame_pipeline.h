@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "cpu_parallel.h"
+
+namespace Cpu
+{
+    // Runs a frame loop on the shared pool with up to depth frames in
+    // flight. Every frame goes through the same stages in order. Stage s of
+    // frame f starts once stage s - 1 of f and stage s of f - 1 finished, so
+    // a stage never runs for two frames at once and sees the frames in order,
+    // while different stages of neighbouring frames overlap: one frame is
+    // shaded while the next one is traversed. Frame f works on buffer set
+    // f % depth, which is free again once frame f - depth finished its last
+    // stage. With depth 1 the frames run one after the other.
+    class FramePipeline
+    {
+        // Non-copyable
+        FramePipeline(const FramePipeline &) = delete;
+        FramePipeline &operator =(const FramePipeline &) = delete;
+
+    public:
+        // stage(frame, slot), slot being the buffer set of the frame
+        typedef std::function<void(int, uint32_t)> Stage;
+
+        explicit FramePipeline(uint32_t depth);
+
+        uint32_t GetDepth() const { return depth_; }
+
+        void AddStage(Stage stage);
+
+        // Runs all stages of frames [0, frame_count), returns once they
+        // finished
+        void Run(int frame_count);
+
+    private:
+        // Queues every stage whose inputs are ready, with mutex_ held
+        void launchReady();
+        void runStage(size_t stage, int frame);
+
+        uint32_t            depth_;
+        std::vector<Stage>  stages_;
+        std::mutex          mutex_;
+        // Per stage, frames it finished and frames queued for it
+        std::vector<int>    done_;
+        std::vector<int>    launched_;
+        int                 frame_count_;
+        TaskGroup           *group_;
+    };
+}
@@ -0,0 +1,36 @@
+#include "cpu_hybrid_split.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Cpu
+{
+    HybridSplit::HybridSplit(int rows, float device_share, int min_rows, float smoothing)
+        : rows_(std::max(rows, 0))
+        , min_rows_(std::min(std::max(min_rows, 0), rows_ / 2))
+        , smoothing_(std::min(std::max(smoothing, 0.f), 1.f))
+    {
+        setShare(device_share);
+    }
+
+    void HybridSplit::Update(double device_ms, double cpu_ms)
+    {
+        const int cpu_rows = GetCpuRows();
+        if (device_rows_ <= 0 || cpu_rows <= 0 || device_ms <= 0.0 || cpu_ms <= 0.0)
+            return;
+
+        // Share at which both sides would have taken the same time, blended
+        // with the current one so a noisy frame does not swing the split
+        double device_rate = device_rows_ / device_ms;
+        double cpu_rate = cpu_rows / cpu_ms;
+        float balanced = (float)(device_rate / (device_rate + cpu_rate));
+        setShare(share_ + smoothing_ * (balanced - share_));
+    }
+
+    void HybridSplit::setShare(float share)
+    {
+        share_ = std::min(std::max(share, 0.f), 1.f);
+        device_rows_ = (int)std::lround(share_ * rows_);
+        device_rows_ = std::min(std::max(device_rows_, min_rows_), rows_ - min_rows_);
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+namespace Cpu
+{
+    // Splits the rows of every frame between an OpenCL device and the CPU
+    // tracing together. The device takes rows [0, GetDeviceRows()), the CPU
+    // the rest. After each frame Update moves the split towards the ratio of
+    // the rows per millisecond both sides reached, so they finish at about
+    // the same time. Each side keeps at least min_rows rows so its rate stays
+    // measured when the other one is much faster.
+    class HybridSplit
+    {
+    public:
+        HybridSplit(int rows, float device_share = 0.5f, int min_rows = 8, float smoothing = 0.5f);
+
+        int GetDeviceRows() const { return device_rows_; }
+        int GetCpuRows() const { return rows_ - device_rows_; }
+        // Fraction of the rows the device gets
+        float GetDeviceShare() const { return share_; }
+
+        // Milliseconds each side took for its rows of the last frame
+        void Update(double device_ms, double cpu_ms);
+
+    private:
+        void setShare(float share);
+
+        int     rows_;
+        int     min_rows_;
+        float   smoothing_;
+        float   share_;
+        int     device_rows_;
+    };
+}
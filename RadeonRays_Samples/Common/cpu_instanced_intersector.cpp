@@ -0,0 +1,221 @@
+#include "cpu_instanced_intersector.h"
+#include "cpu_parallel.h"
+
+#include <assert.h>
+
+namespace Cpu
+{
+    // Constructor
+    InstancedIntersector::InstancedIntersector()
+    {
+    }
+
+    // One bottom level and one instance per scene mesh
+    void InstancedIntersector::AttachScene(const Scene &scene)
+    {
+        meshes_.clear();
+        instances_.clear();
+        top_level_ = Bvh();
+        top_level_instances_.clear();
+
+        for (uint32_t mesh = 0; mesh < (uint32_t)scene.meshes_.size(); ++mesh)
+        {
+            meshes_.emplace_back(new Intersector());
+            meshes_.back()->AttachMesh(scene.meshes_[mesh]);
+            AddInstance(mesh, Transform());
+        }
+    }
+
+    int32_t InstancedIntersector::AddInstance(uint32_t mesh, const Transform &transform)
+    {
+        assert(mesh < meshes_.size());
+        Instance instance;
+        instance.mesh = mesh;
+        instance.transform = transform;
+        instance.inverse = Inverse(transform);
+        instances_.push_back(instance);
+        return (int32_t)instances_.size() - 1;
+    }
+
+    void InstancedIntersector::SetTransform(int32_t instance, const Transform &transform)
+    {
+        instances_[instance].transform = transform;
+        instances_[instance].inverse = Inverse(transform);
+    }
+
+    size_t InstancedIntersector::GetTriangleCount() const
+    {
+        size_t count = 0;
+        for (auto &mesh : meshes_)
+            count += mesh->GetTriangleCount();
+        return count;
+    }
+
+    // Builds all bottom levels, then the top level
+    void InstancedIntersector::Commit(const BvhBuildOptions &options)
+    {
+        // Meshes larger than a worker's share are built one after another and
+        // use the builders' own threads, the rest are built side by side
+        size_t share = GetTriangleCount() / GetWorkerCount();
+        std::vector<uint32_t> small_meshes;
+        for (uint32_t mesh = 0; mesh < (uint32_t)meshes_.size(); ++mesh)
+        {
+            if (meshes_[mesh]->GetTriangleCount() > share)
+                meshes_[mesh]->Commit(options);
+            else
+                small_meshes.push_back(mesh);
+        }
+
+        ParallelFor(0, small_meshes.size(), 1, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                meshes_[small_meshes[i]]->Commit(options);
+        });
+
+        CommitTransforms();
+    }
+
+    bool InstancedIntersector::RefitMesh(const Scene &scene, uint32_t mesh, float rebuild_threshold)
+    {
+        meshes_[mesh]->UpdateVertices(scene.meshes_[mesh]);
+        return meshes_[mesh]->Refit(rebuild_threshold);
+    }
+
+    // Rebuilds the top level over the current instance bounds
+    void InstancedIntersector::CommitTransforms()
+    {
+        std::vector<Aabb> bounds;
+        bounds.reserve(instances_.size());
+        top_level_instances_.clear();
+        for (uint32_t i = 0; i < (uint32_t)instances_.size(); ++i)
+        {
+            const Bvh &bottom_level = meshes_[instances_[i].mesh]->GetBvh();
+            if (bottom_level.nodes_.empty())
+                continue;
+            bounds.push_back(TransformBounds(instances_[i].transform, bottom_level.nodes_[0].bounds));
+            top_level_instances_.push_back(i);
+        }
+
+        // Entering an instance costs a whole bottom level traversal, so every
+        // instance gets its own leaf
+        BvhBuildOptions options;
+        options.quality = BvhBuildQuality::kHigh;
+        options.max_leaf_size = 1;
+        top_level_.Build(bounds, options);
+    }
+
+    template <bool kAnyHit>
+    bool InstancedIntersector::traverse(const Ray &ray, Intersection &hit, TraversalStats *stats) const
+    {
+        hit.shapeid = kInvalidId;
+        hit.primid = kInvalidId;
+
+        TraversalStats total = { 0, 0, 0 };
+        bool found = false;
+        const BvhNode *nodes = top_level_.nodes_.data();
+        const Vec3 inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+        const bool active = !top_level_.nodes_.empty() && ray.extra[1] != 0;
+        total.boxes = active ? 1 : 0;
+        if (active && IntersectBox(nodes[0].bounds, ray.o, inv_d, ray.maxt) >= 0.f)
+        {
+            // Transformed directions are not normalized, so distances carry over
+            Ray local_ray = ray;
+            TraversalStack traversal_stack(top_level_.GetMaxDepth());
+            uint32_t *stack = traversal_stack.data();
+            int sp = 0;
+            uint32_t node = 0;
+            for (;;)
+            {
+                const BvhNode &current = nodes[node];
+                ++total.nodes;
+                if (current.IsLeaf())
+                {
+                    for (uint32_t r = current.left; r < current.left + current.GetPrimCount(); ++r)
+                    {
+                        uint32_t index = top_level_instances_[top_level_.prim_indices_[r]];
+                        const Instance &instance = instances_[index];
+                        local_ray.o = TransformPoint(instance.inverse, ray.o);
+                        local_ray.d = TransformVector(instance.inverse, ray.d);
+
+                        TraversalStats bottom_stats;
+                        Intersection bottom_hit;
+                        bool bottom_found = kAnyHit ? meshes_[instance.mesh]->Occluded(local_ray, &bottom_stats)
+                            : meshes_[instance.mesh]->Intersect(local_ray, bottom_hit, &bottom_stats);
+                        total.nodes += bottom_stats.nodes;
+                        total.triangles += bottom_stats.triangles;
+                        total.boxes += bottom_stats.boxes;
+                        if (!bottom_found)
+                            continue;
+
+                        found = true;
+                        if (kAnyHit)
+                            break;
+                        hit = bottom_hit;
+                        hit.shapeid = (int32_t)index;
+                        local_ray.maxt = bottom_hit.uvwt[3];
+                    }
+
+                    if (kAnyHit && found)
+                        break;
+                }
+                else
+                {
+                    total.boxes += 2;
+                    float tl = IntersectBox(nodes[current.left].bounds, ray.o, inv_d, local_ray.maxt);
+                    float tr = IntersectBox(nodes[current.right].bounds, ray.o, inv_d, local_ray.maxt);
+                    if (tl >= 0.f && tr >= 0.f)
+                    {
+                        // Visit the nearer child first
+                        stack[sp++] = tl <= tr ? current.right : current.left;
+                        node = tl <= tr ? current.left : current.right;
+                        continue;
+                    }
+                    if (tl >= 0.f || tr >= 0.f)
+                    {
+                        node = tl >= 0.f ? current.left : current.right;
+                        continue;
+                    }
+                }
+
+                if (sp == 0)
+                    break;
+                node = stack[--sp];
+            }
+        }
+
+        if (stats)
+            *stats = total;
+        return found;
+    }
+
+    bool InstancedIntersector::Intersect(const Ray &ray, Intersection &hit, TraversalStats *stats) const
+    {
+        return traverse<false>(ray, hit, stats);
+    }
+
+    bool InstancedIntersector::Occluded(const Ray &ray, TraversalStats *stats) const
+    {
+        Intersection hit;
+        return traverse<true>(ray, hit, stats);
+    }
+
+    // Closest hit for every ray
+    void InstancedIntersector::QueryIntersection(const Ray *rays, size_t count, Intersection *hits, TraversalStats *stats) const
+    {
+        ParallelFor(0, count, 1024, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                Intersect(rays[i], hits[i], stats ? &stats[i] : nullptr);
+        });
+    }
+
+    // kHitMarker or kMissMarker for every ray
+    void InstancedIntersector::QueryOcclusion(const Ray *rays, size_t count, int32_t *hits, TraversalStats *stats) const
+    {
+        ParallelFor(0, count, 1024, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                hits[i] = Occluded(rays[i], stats ? &stats[i] : nullptr) ? kHitMarker : kMissMarker;
+        });
+    }
+}
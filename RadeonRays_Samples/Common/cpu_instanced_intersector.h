@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_bvh.h"
+#include "cpu_intersector.h"
+#include "scene.h"
+
+namespace Cpu
+{
+    // Two-level counterpart of Intersector. Every mesh gets a bottom-level
+    // hierarchy in object space and instances place meshes with transforms
+    // under a top-level hierarchy. Moving instances only rebuilds the top
+    // level, which is small enough to redo every frame.
+    class InstancedIntersector
+    {
+        // Non-copyable
+        InstancedIntersector(const InstancedIntersector &) = delete;
+        InstancedIntersector &operator =(const InstancedIntersector &) = delete;
+
+    public:
+        InstancedIntersector();
+
+        // One bottom level per scene mesh and one instance of every mesh with
+        // the identity transform, so shape ids are mesh indices as in Intersector
+        void AttachScene(const Scene &scene);
+
+        // Another instance of a mesh, returns its shape id
+        int32_t AddInstance(uint32_t mesh, const Transform &transform);
+        // Object to world transform, takes effect with the next commit
+        void SetTransform(int32_t instance, const Transform &transform);
+        const Transform &GetTransform(int32_t instance) const { return instances_[instance].transform; }
+
+        // Builds all bottom levels in parallel, then the top level
+        void Commit(const BvhBuildOptions &options);
+        // Re-reads one mesh's vertices and refits its bottom level, see
+        // Intersector::Refit. The top level is rebuilt with the next commit.
+        bool RefitMesh(const Scene &scene, uint32_t mesh, float rebuild_threshold);
+        // Rebuilds only the top level over the current transforms
+        void CommitTransforms();
+
+        // Closest hit for every ray, stats receives one entry per ray if given
+        void QueryIntersection(const Ray *rays, size_t count, Intersection *hits, TraversalStats *stats = nullptr) const;
+        // kHitMarker or kMissMarker for every ray
+        void QueryOcclusion(const Ray *rays, size_t count, int32_t *hits, TraversalStats *stats = nullptr) const;
+
+        bool Intersect(const Ray &ray, Intersection &hit, TraversalStats *stats = nullptr) const;
+        bool Occluded(const Ray &ray, TraversalStats *stats = nullptr) const;
+
+        size_t GetMeshCount() const { return meshes_.size(); }
+        size_t GetInstanceCount() const { return instances_.size(); }
+        size_t GetTriangleCount() const;
+        const Intersector &GetBottomLevel(uint32_t mesh) const { return *meshes_[mesh]; }
+        const Bvh &GetTopLevel() const { return top_level_; }
+
+    protected:
+        struct Instance
+        {
+            uint32_t  mesh;
+            // Object to world and back, rays are moved into object space
+            Transform transform;
+            Transform inverse;
+        };
+
+        template <bool kAnyHit>
+        bool traverse(const Ray &ray, Intersection &hit, TraversalStats *stats) const;
+
+        std::vector<std::unique_ptr<Intersector>>   meshes_;
+        std::vector<Instance>                       instances_;
+        // Instances are the primitives of the top level, empty meshes are left out
+        Bvh                                         top_level_;
+        std::vector<uint32_t>                       top_level_instances_;
+    };
+}
@@ -0,0 +1,898 @@
+#include "cpu_intersector.h"
+#include "cpu_compact_ray.h"
+#include "cpu_numa.h"
+#include "cpu_parallel.h"
+
+#include <assert.h>
+#include <string.h>
+
+namespace Cpu
+{
+    static const uint32_t kNoPrim = 0xffffffffu;
+
+    // Decodes both child boxes of a quantized node and slab tests them
+    static inline void IntersectChildren(const QuantizedBvhNode &node, const Vec3 &o, const Vec3 &inv_d, float tmax, float t[2])
+    {
+        Vec3 origin(node.origin[0], node.origin[1], node.origin[2]);
+        Vec3 cell(node.GetCellSize(0), node.GetCellSize(1), node.GetCellSize(2));
+        for (int i = 0; i < 2; ++i)
+        {
+            const uint8_t *qmin = node.qmin[i];
+            const uint8_t *qmax = node.qmax[i];
+            Vec3 pmin = origin + Vec3(kQuantizedSteps[qmin[0]], kQuantizedSteps[qmin[1]], kQuantizedSteps[qmin[2]]) * cell;
+            Vec3 pmax = origin + Vec3(kQuantizedSteps[qmax[0]], kQuantizedSteps[qmax[1]], kQuantizedSteps[qmax[2]]) * cell;
+            t[i] = IntersectBox(pmin, pmax, o, inv_d, tmax);
+        }
+    }
+
+    // Moller-Trumbore, u and v are the weights of v1 and v2 as RadeonRays reports them
+    static inline bool IntersectTriangle(const Ray &ray, const Vec3 &v0, const Vec3 &v1, const Vec3 &v2,
+        float tmax, float &t, float &u, float &v)
+    {
+        Vec3 e1 = v1 - v0;
+        Vec3 e2 = v2 - v0;
+        Vec3 p = Cross(ray.d, e2);
+        float det = Dot(e1, p);
+        if (std::fabs(det) < 1e-12f)
+            return false;
+
+        float inv_det = 1.f / det;
+        Vec3 s = ray.o - v0;
+        u = Dot(s, p) * inv_det;
+        if (u < 0.f || u > 1.f)
+            return false;
+
+        Vec3 q = Cross(s, e1);
+        v = Dot(ray.d, q) * inv_det;
+        if (v < 0.f || u + v > 1.f)
+            return false;
+
+        t = Dot(e2, q) * inv_det;
+        return t > 0.f && t < tmax;
+    }
+
+    // Constructor
+    Intersector::Intersector()
+        : data_()
+    {
+    }
+
+    // Flattens the scene meshes, shape ids are mesh indices as in UploadSceneToIntersector
+    void Intersector::AttachScene(const Scene &scene)
+    {
+        clear();
+        int32_t shape_id = 0;
+        for (auto &mesh : scene.meshes_)
+            appendMesh(mesh, shape_id++);
+    }
+
+    void Intersector::AttachMesh(const Mesh &mesh)
+    {
+        clear();
+        appendMesh(mesh, 0);
+    }
+
+    void Intersector::clear()
+    {
+        // The hierarchy refers to the old geometry until the next commit
+        bvh_ = Bvh();
+        qbvh_ = QuantizedBvh();
+        triangle_blocks_.Clear();
+        replicas_.clear();
+        data_ = TraversalData();
+        positions_.clear();
+        indices_.clear();
+        shape_ids_.clear();
+        prim_ids_.clear();
+    }
+
+    void Intersector::appendMesh(const Mesh &mesh, int32_t shape_id)
+    {
+        uint32_t base_vertex = (uint32_t)positions_.size();
+        uint32_t stride = mesh.vertex_stride_ / sizeof(float);
+        for (size_t a = 0; a + 2 < mesh.vertices_.size(); a += stride)
+            positions_.push_back(Vec3(mesh.vertices_[a], mesh.vertices_[a + 1], mesh.vertices_[a + 2]));
+
+        int32_t prim_count = (int32_t)(mesh.indices_.size() / 3);
+        for (int32_t p = 0; p < prim_count; ++p)
+        {
+            for (int v = 0; v < 3; ++v)
+                indices_.push_back(base_vertex + mesh.indices_[3 * p + v]);
+            shape_ids_.push_back(shape_id);
+            prim_ids_.push_back(p);
+        }
+    }
+
+    void Intersector::computePrimBounds(std::vector<Aabb> &prim_bounds) const
+    {
+        prim_bounds.resize(GetTriangleCount());
+        ParallelFor(0, prim_bounds.size(), 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                Aabb bounds;
+                for (int v = 0; v < 3; ++v)
+                    bounds.Grow(positions_[indices_[3 * i + v]]);
+                prim_bounds[i] = bounds;
+            }
+        });
+    }
+
+    // Builds the hierarchy over the attached geometry
+    void Intersector::Commit(const BvhBuildOptions &options)
+    {
+        std::vector<Aabb> prim_bounds;
+        computePrimBounds(prim_bounds);
+        bvh_.Build(prim_bounds, options, positions_.data(), indices_.data());
+        buildNodeFormat();
+    }
+
+    void Intersector::buildNodeFormat()
+    {
+        if (bvh_.GetOptions().node_format == BvhNodeFormat::kQuantized)
+            qbvh_.Build(bvh_);
+        else
+            qbvh_ = QuantizedBvh();
+
+        if (bvh_.GetOptions().leaf_format != BvhLeafFormat::kBlocks)
+        {
+            triangle_blocks_.Clear();
+            placeNumaData();
+            return;
+        }
+
+        // Blocks follow the leaves traversal sees, quantized nodes split large leaves
+        std::vector<TriangleLeaf> leaves;
+        if (qbvh_.nodes_.empty())
+        {
+            for (auto &node : bvh_.nodes_)
+            {
+                if (node.IsLeaf())
+                    leaves.push_back(TriangleLeaf{ node.left, node.GetPrimCount() });
+            }
+        }
+        else
+        {
+            for (auto &node : qbvh_.nodes_)
+            {
+                for (int i = 0; i < 2; ++i)
+                {
+                    if (node.IsLeaf(i))
+                        leaves.push_back(TriangleLeaf{ node.GetFirstPrim(i), node.GetPrimCount(i) });
+                }
+            }
+        }
+        triangle_blocks_.Build(leaves, bvh_.prim_indices_, positions_, indices_);
+        placeNumaData();
+    }
+
+    template <typename Src, typename Dst>
+    static void CopyToNumaNode(const Src &src, Dst &dst, unsigned node)
+    {
+        dst.assign(src.begin(), src.end());
+        if (!dst.empty())
+            BindMemory(dst.data(), dst.size() * sizeof(dst[0]), node);
+    }
+
+    template <typename Vector>
+    static void Interleave(const Vector &data)
+    {
+        if (!data.empty())
+            InterleaveMemory(data.data(), data.size() * sizeof(data[0]));
+    }
+
+    void Intersector::placeNumaData()
+    {
+        const bool blocks = !triangle_blocks_.IsEmpty();
+        data_.nodes = bvh_.nodes_.data();
+        data_.qnodes = qbvh_.nodes_.empty() ? nullptr : qbvh_.nodes_.data();
+        data_.blocks = blocks ? triangle_blocks_.blocks_.data() : nullptr;
+        data_.leaf_blocks = blocks ? triangle_blocks_.leaf_blocks_.data() : nullptr;
+        data_.prim_indices = bvh_.prim_indices_.data();
+        data_.positions = positions_.data();
+        data_.indices = indices_.data();
+        replicas_.clear();
+
+        const NumaPlacement placement = bvh_.GetOptions().numa_placement;
+        const unsigned node_count = GetNumaNodeCount();
+        if (placement == NumaPlacement::kLocal || node_count < 2)
+            return;
+
+        if (placement == NumaPlacement::kInterleave)
+        {
+            Interleave(bvh_.nodes_);
+            Interleave(qbvh_.nodes_);
+            Interleave(triangle_blocks_.blocks_);
+            Interleave(triangle_blocks_.leaf_blocks_);
+            Interleave(bvh_.prim_indices_);
+            Interleave(positions_);
+            Interleave(indices_);
+            return;
+        }
+
+        // Copies are made here and their pages moved to their node. Only
+        // what traversal reads is copied: leaves in blocks need no indices.
+        replicas_.resize(node_count);
+        for (unsigned node = 0; node < node_count; ++node)
+        {
+            NumaReplica &replica = replicas_[node];
+            replica.data = data_;
+            if (data_.qnodes)
+                CopyToNumaNode(qbvh_.nodes_, replica.qnodes, node);
+            else
+                CopyToNumaNode(bvh_.nodes_, replica.nodes, node);
+            if (blocks)
+            {
+                CopyToNumaNode(triangle_blocks_.blocks_, replica.blocks, node);
+                CopyToNumaNode(triangle_blocks_.leaf_blocks_, replica.leaf_blocks, node);
+            }
+            else
+            {
+                CopyToNumaNode(bvh_.prim_indices_, replica.prim_indices, node);
+                CopyToNumaNode(positions_, replica.positions, node);
+                CopyToNumaNode(indices_, replica.indices, node);
+            }
+
+            replica.data.nodes = replica.nodes.empty() ? data_.nodes : replica.nodes.data();
+            replica.data.qnodes = replica.qnodes.empty() ? data_.qnodes : replica.qnodes.data();
+            replica.data.blocks = replica.blocks.empty() ? data_.blocks : replica.blocks.data();
+            replica.data.leaf_blocks = replica.leaf_blocks.empty() ? data_.leaf_blocks : replica.leaf_blocks.data();
+            replica.data.prim_indices = replica.prim_indices.empty() ? data_.prim_indices : replica.prim_indices.data();
+            replica.data.positions = replica.positions.empty() ? data_.positions : replica.positions.data();
+            replica.data.indices = replica.indices.empty() ? data_.indices : replica.indices.data();
+        }
+    }
+
+    const Intersector::TraversalData &Intersector::getTraversalData() const
+    {
+        if (replicas_.empty())
+            return data_;
+        return replicas_[std::min<size_t>(GetCurrentNumaNode(), replicas_.size() - 1)].data;
+    }
+
+    // Re-reads vertex positions from the scene
+    void Intersector::UpdateVertices(const Scene &scene)
+    {
+        size_t base_vertex = 0;
+        for (auto &mesh : scene.meshes_)
+            base_vertex += updateMesh(mesh, base_vertex);
+    }
+
+    void Intersector::UpdateVertices(const Mesh &mesh)
+    {
+        updateMesh(mesh, 0);
+    }
+
+    size_t Intersector::updateMesh(const Mesh &mesh, size_t base_vertex)
+    {
+        uint32_t stride = mesh.vertex_stride_ / sizeof(float);
+        size_t vertex_count = mesh.vertices_.size() / stride;
+        assert(base_vertex + vertex_count <= positions_.size());
+        ParallelFor(0, vertex_count, 16384, [&](size_t begin, size_t end)
+        {
+            for (size_t v = begin; v < end; ++v)
+            {
+                const float *data = &mesh.vertices_[v * stride];
+                positions_[base_vertex + v] = Vec3(data[0], data[1], data[2]);
+            }
+        });
+        return vertex_count;
+    }
+
+    // Refits the hierarchy, or rebuilds it once the refitted tree got too slow
+    bool Intersector::Refit(float rebuild_threshold)
+    {
+        std::vector<Aabb> prim_bounds;
+        computePrimBounds(prim_bounds);
+
+        bool rebuild = bvh_.Refit(prim_bounds) > rebuild_threshold * bvh_.GetBuildSahCost();
+        if (rebuild)
+            bvh_.Build(prim_bounds, bvh_.GetOptions(), positions_.data(), indices_.data());
+
+        buildNodeFormat();
+        return rebuild;
+    }
+
+    BvhOptimizeResult Intersector::Optimize(const BvhOptimizeOptions &options)
+    {
+        BvhOptimizeResult result = bvh_.Optimize(options);
+        buildNodeFormat();
+        return result;
+    }
+
+    // Tests the primitives of a leaf, returns true when an any-hit query is done
+    template <bool kAnyHit>
+    inline bool Intersector::intersectLeaf(const TraversalData &data, const Ray &ray, const WatertightRay &watertight_ray,
+        uint32_t first, uint32_t count, HitState &state) const
+    {
+        if (data.blocks)
+        {
+            const TriangleBlock *block = data.blocks + data.leaf_blocks[first];
+            for (uint32_t i = 0; i < count; i += kTriangleBlockWidth, ++block)
+            {
+                state.triangles += std::min<uint32_t>(count - i, kTriangleBlockWidth);
+                float t, u, v;
+                int lane = IntersectTriangleBlock(*block, watertight_ray, state.tmax, t, u, v);
+                if (lane >= 0)
+                {
+                    state.tmax = t;
+                    state.prim = block->triangles[lane];
+                    state.u = u;
+                    state.v = v;
+                    if (kAnyHit)
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        for (uint32_t i = first; i < first + count; ++i)
+        {
+            uint32_t prim = data.prim_indices[i];
+            ++state.triangles;
+            float t, u, v;
+            if (IntersectTriangle(ray, data.positions[data.indices[3 * prim]], data.positions[data.indices[3 * prim + 1]],
+                data.positions[data.indices[3 * prim + 2]], state.tmax, t, u, v))
+            {
+                state.tmax = t;
+                state.prim = prim;
+                state.u = u;
+                state.v = v;
+                if (kAnyHit)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    template <bool kAnyHit>
+    bool Intersector::traverseFull(const TraversalData &data, const Ray &ray, HitState &state) const
+    {
+        const BvhNode *nodes = data.nodes;
+        const Vec3 inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+        const WatertightRay watertight_ray = MakeWatertightRay(ray.o, ray.d);
+        ++state.boxes;
+        if (IntersectBox(nodes[0].bounds, ray.o, inv_d, state.tmax) < 0.f)
+            return false;
+
+        TraversalStack traversal_stack(bvh_.GetMaxDepth());
+        uint32_t *stack = traversal_stack.data();
+        int sp = 0;
+        uint32_t node = 0;
+        for (;;)
+        {
+            const BvhNode &current = nodes[node];
+            ++state.nodes;
+            if (current.IsLeaf())
+            {
+                if (intersectLeaf<kAnyHit>(data, ray, watertight_ray, current.left, current.GetPrimCount(), state))
+                    return true;
+            }
+            else
+            {
+                state.boxes += 2;
+                float tl = IntersectBox(nodes[current.left].bounds, ray.o, inv_d, state.tmax);
+                float tr = IntersectBox(nodes[current.right].bounds, ray.o, inv_d, state.tmax);
+                if (tl >= 0.f && tr >= 0.f)
+                {
+                    // Visit the nearer child first
+                    stack[sp++] = tl <= tr ? current.right : current.left;
+                    node = tl <= tr ? current.left : current.right;
+                    continue;
+                }
+                if (tl >= 0.f || tr >= 0.f)
+                {
+                    node = tl >= 0.f ? current.left : current.right;
+                    continue;
+                }
+            }
+
+            if (sp == 0)
+                break;
+            node = stack[--sp];
+        }
+
+        return state.prim != kNoPrim;
+    }
+
+    template <bool kAnyHit>
+    bool Intersector::traverseQuantized(const TraversalData &data, const Ray &ray, HitState &state) const
+    {
+        const QuantizedBvhNode *nodes = data.qnodes;
+        const Vec3 inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+        const WatertightRay watertight_ray = MakeWatertightRay(ray.o, ray.d);
+        ++state.boxes;
+        if (IntersectBox(qbvh_.root_bounds_, ray.o, inv_d, state.tmax) < 0.f)
+            return false;
+
+        TraversalStack traversal_stack(qbvh_.GetMaxDepth());
+        uint32_t *stack = traversal_stack.data();
+        int sp = 0;
+        uint32_t node = 0;
+        for (;;)
+        {
+            const QuantizedBvhNode &current = nodes[node];
+            ++state.nodes;
+            state.boxes += 2;
+
+            float t[2];
+            IntersectChildren(current, ray.o, inv_d, state.tmax, t);
+
+            // Nearer child first, leaf children are tested in place and the
+            // farther one is skipped if a closer hit was found meanwhile
+            int near = (t[1] >= 0.f && (t[0] < 0.f || t[1] < t[0])) ? 1 : 0;
+            uint32_t next = kNoPrim;
+            for (int k = 0; k < 2; ++k)
+            {
+                int i = k == 0 ? near : 1 - near;
+                if (t[i] < 0.f || t[i] > state.tmax)
+                    continue;
+
+                if (current.IsLeaf(i))
+                {
+                    ++state.nodes;
+                    if (intersectLeaf<kAnyHit>(data, ray, watertight_ray, current.GetFirstPrim(i), current.GetPrimCount(i),
+                        state))
+                        return true;
+                }
+                else if (next == kNoPrim)
+                    next = current.children[i];
+                else
+                    stack[sp++] = current.children[i];
+            }
+
+            if (next != kNoPrim)
+            {
+                node = next;
+                continue;
+            }
+
+            if (sp == 0)
+                break;
+            node = stack[--sp];
+        }
+
+        return state.prim != kNoPrim;
+    }
+
+    template <bool kAnyHit>
+    bool Intersector::traverse(const TraversalData &data, const Ray &ray, Intersection &hit, TraversalStats *stats) const
+    {
+        HitState state = { ray.maxt, kNoPrim, 0.f, 0.f, 0, 0, 0 };
+        bool found = false;
+        if (!bvh_.nodes_.empty() && ray.extra[1] != 0)
+            found = data.qnodes ? traverseQuantized<kAnyHit>(data, ray, state) : traverseFull<kAnyHit>(data, ray, state);
+
+        if (stats)
+        {
+            stats->nodes = state.nodes;
+            stats->triangles = state.triangles;
+            stats->boxes = state.boxes;
+        }
+        resolveHit(state, hit);
+        return found;
+    }
+
+    void Intersector::resolveHit(const HitState &state, Intersection &hit) const
+    {
+        if (state.prim == kNoPrim)
+        {
+            hit.shapeid = kInvalidId;
+            hit.primid = kInvalidId;
+            return;
+        }
+
+        hit.shapeid = shape_ids_[state.prim];
+        hit.primid = prim_ids_[state.prim];
+        hit.uvwt[0] = state.u;
+        hit.uvwt[1] = state.v;
+        hit.uvwt[2] = 0.f;
+        hit.uvwt[3] = state.tmax;
+    }
+
+    // Rays per stream, enough that nodes near the root are shared by many
+    // rays and small enough that a stream's rays stay in cache
+    static const uint32_t kStreamSize = 1024;
+
+    // A node waiting for its active rays, or a leaf given by its references
+    struct StreamFrame
+    {
+        uint32_t node;
+        uint32_t prim_count;
+        bool     leaf;
+        // Active rays are ids[first_id, first_id + id_count)
+        uint32_t first_id;
+        uint32_t id_count;
+    };
+
+    struct StreamChild
+    {
+        Aabb     bounds;
+        uint32_t node;
+        uint32_t prim_count;
+        bool     leaf;
+    };
+
+    struct Intersector::StreamScratch
+    {
+        // Origins and reciprocal directions, one array per axis
+        std::vector<float>          o[3];
+        std::vector<float>          inv_d[3];
+        std::vector<WatertightRay>  watertight_rays;
+        // Active ray lists of the pending frames, stacked in frame order
+        std::vector<uint32_t>       ids;
+        std::vector<StreamFrame>    frames;
+    };
+
+    static inline void GetStreamChildren(const BvhNode *nodes, uint32_t index, StreamChild children[2])
+    {
+        const BvhNode &node = nodes[index];
+        uint32_t child_indices[2] = { node.left, node.right };
+        for (int i = 0; i < 2; ++i)
+        {
+            const BvhNode &child = nodes[child_indices[i]];
+            children[i].bounds = child.bounds;
+            children[i].leaf = child.IsLeaf();
+            children[i].node = child.IsLeaf() ? child.left : child_indices[i];
+            children[i].prim_count = child.GetPrimCount();
+        }
+    }
+
+    static inline void GetStreamChildren(const QuantizedBvhNode *nodes, uint32_t index, StreamChild children[2])
+    {
+        const QuantizedBvhNode &node = nodes[index];
+        Aabb bounds[2];
+        node.GetChildBounds(bounds);
+        for (int i = 0; i < 2; ++i)
+        {
+            children[i].bounds = bounds[i];
+            children[i].leaf = node.IsLeaf(i);
+            children[i].node = node.IsLeaf(i) ? node.GetFirstPrim(i) : node.children[i];
+            children[i].prim_count = node.GetPrimCount(i);
+        }
+    }
+
+    // Splits the active rays of a node between its children. Rays entering
+    // both children vote for the one they enter first, the result is positive
+    // when the first child wins.
+    template <typename HitState>
+    static int FilterStream(const float *const o[3], const float *const inv_d[3], const HitState *states,
+        const uint32_t *ids, uint32_t count, const StreamChild children[2], uint32_t *out[2], uint32_t out_counts[2])
+    {
+        int votes = 0;
+        uint32_t n0 = 0, n1 = 0;
+        uint32_t k = 0;
+#if CPU_SSE2
+        __m128 pmin[2][3], pmax[2][3];
+        for (int c = 0; c < 2; ++c)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                pmin[c][axis] = _mm_set1_ps(children[c].bounds.pmin[axis]);
+                pmax[c][axis] = _mm_set1_ps(children[c].bounds.pmax[axis]);
+            }
+        }
+
+        const __m128 zero = _mm_setzero_ps();
+        for (; k + 4 <= count; k += 4)
+        {
+            const uint32_t *lane_ids = ids + k;
+            __m128 ray_o[3], ray_inv_d[3];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                ray_o[axis] = _mm_setr_ps(o[axis][lane_ids[0]], o[axis][lane_ids[1]], o[axis][lane_ids[2]], o[axis][lane_ids[3]]);
+                ray_inv_d[axis] = _mm_setr_ps(inv_d[axis][lane_ids[0]], inv_d[axis][lane_ids[1]],
+                    inv_d[axis][lane_ids[2]], inv_d[axis][lane_ids[3]]);
+            }
+            __m128 tmax = _mm_setr_ps(states[lane_ids[0]].tmax, states[lane_ids[1]].tmax,
+                states[lane_ids[2]].tmax, states[lane_ids[3]].tmax);
+
+            __m128 tnear[2];
+            int masks[2];
+            for (int c = 0; c < 2; ++c)
+            {
+                __m128 tn = zero;
+                __m128 tf = tmax;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    __m128 t0 = _mm_mul_ps(_mm_sub_ps(pmin[c][axis], ray_o[axis]), ray_inv_d[axis]);
+                    __m128 t1 = _mm_mul_ps(_mm_sub_ps(pmax[c][axis], ray_o[axis]), ray_inv_d[axis]);
+                    tn = _mm_max_ps(tn, _mm_min_ps(t0, t1));
+                    tf = _mm_min_ps(tf, _mm_max_ps(t0, t1));
+                }
+                tnear[c] = tn;
+                masks[c] = _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+            }
+
+            int both = masks[0] & masks[1];
+            int first_nearer = _mm_movemask_ps(_mm_cmple_ps(tnear[0], tnear[1])) & both;
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                // Branch free append
+                out[0][n0] = lane_ids[lane];
+                n0 += (masks[0] >> lane) & 1;
+                out[1][n1] = lane_ids[lane];
+                n1 += (masks[1] >> lane) & 1;
+                votes += ((first_nearer >> lane) & 1) - (((both & ~first_nearer) >> lane) & 1);
+            }
+        }
+#endif
+        for (; k < count; ++k)
+        {
+            uint32_t id = ids[k];
+            Vec3 ray_o(o[0][id], o[1][id], o[2][id]);
+            Vec3 ray_inv_d(inv_d[0][id], inv_d[1][id], inv_d[2][id]);
+            float t0 = IntersectBox(children[0].bounds, ray_o, ray_inv_d, states[id].tmax);
+            float t1 = IntersectBox(children[1].bounds, ray_o, ray_inv_d, states[id].tmax);
+            if (t0 >= 0.f)
+                out[0][n0++] = id;
+            if (t1 >= 0.f)
+                out[1][n1++] = id;
+            if (t0 >= 0.f && t1 >= 0.f)
+                votes += t0 <= t1 ? 1 : -1;
+        }
+
+        out_counts[0] = n0;
+        out_counts[1] = n1;
+        return votes;
+    }
+
+    template <bool kAnyHit, bool kQuantized>
+    void Intersector::traverseStream(const TraversalData &data, const Ray *rays, uint32_t count, HitState *states,
+        StreamScratch &scratch) const
+    {
+        const uint32_t max_depth = kQuantized ? qbvh_.GetMaxDepth() : bvh_.GetMaxDepth();
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            scratch.o[axis].resize(count);
+            scratch.inv_d[axis].resize(count);
+        }
+        scratch.watertight_rays.resize(count);
+        // Every level keeps at most one sibling list, plus room for the children of the current one
+        scratch.ids.resize((size_t)count * (max_depth + 3));
+        scratch.frames.clear();
+
+        const float *o[3] = { scratch.o[0].data(), scratch.o[1].data(), scratch.o[2].data() };
+        const float *inv_d[3] = { scratch.inv_d[0].data(), scratch.inv_d[1].data(), scratch.inv_d[2].data() };
+        uint32_t *ids = scratch.ids.data();
+
+        const Aabb &root_bounds = kQuantized ? qbvh_.root_bounds_ : data.nodes[0].bounds;
+        uint32_t active = 0;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const Ray &ray = rays[i];
+            states[i] = { ray.maxt, kNoPrim, 0.f, 0.f, 0, 0, 0 };
+            Vec3 ray_inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                scratch.o[axis][i] = ray.o[axis];
+                scratch.inv_d[axis][i] = ray_inv_d[axis];
+            }
+            scratch.watertight_rays[i] = MakeWatertightRay(ray.o, ray.d);
+            if (ray.extra[1] == 0)
+                continue;
+            ++states[i].boxes;
+            if (IntersectBox(root_bounds, ray.o, ray_inv_d, ray.maxt) >= 0.f)
+                ids[active++] = i;
+        }
+        if (active == 0)
+            return;
+
+        if (!kQuantized && data.nodes[0].IsLeaf())
+            scratch.frames.push_back(StreamFrame{ data.nodes[0].left, data.nodes[0].GetPrimCount(), true, 0, active });
+        else
+            scratch.frames.push_back(StreamFrame{ 0, 0, false, 0, active });
+
+        while (!scratch.frames.empty())
+        {
+            StreamFrame frame = scratch.frames.back();
+            scratch.frames.pop_back();
+            uint32_t *frame_ids = ids + frame.first_id;
+
+            if (frame.leaf)
+            {
+                for (uint32_t k = 0; k < frame.id_count; ++k)
+                {
+                    HitState &state = states[frame_ids[k]];
+                    // Occluded rays are finished
+                    if (kAnyHit && state.tmax < 0.f)
+                        continue;
+                    ++state.nodes;
+                    if (intersectLeaf<kAnyHit>(data, rays[frame_ids[k]], scratch.watertight_rays[frame_ids[k]],
+                        frame.node, frame.prim_count, state))
+                    {
+                        state.tmax = -1.f;
+                    }
+                }
+                continue;
+            }
+
+            for (uint32_t k = 0; k < frame.id_count; ++k)
+            {
+                HitState &state = states[frame_ids[k]];
+                if (!kAnyHit || state.tmax >= 0.f)
+                {
+                    ++state.nodes;
+                    state.boxes += 2;
+                }
+            }
+
+            StreamChild children[2];
+            if (kQuantized)
+                GetStreamChildren(data.qnodes, frame.node, children);
+            else
+                GetStreamChildren(data.nodes, frame.node, children);
+
+            // Children lists go behind the parent's, then move down over it
+            uint32_t *out[2] = { frame_ids + frame.id_count, frame_ids + 2 * frame.id_count };
+            uint32_t out_counts[2];
+            int votes = FilterStream(o, inv_d, states, frame_ids, frame.id_count, children, out, out_counts);
+
+            // The nearer child is pushed last and popped first
+            int near = votes >= 0 ? 0 : 1;
+            uint32_t first_id = frame.first_id;
+            for (int k = 0; k < 2; ++k)
+            {
+                int i = k == 0 ? 1 - near : near;
+                if (out_counts[i] == 0 || (children[i].leaf && children[i].prim_count == 0))
+                    continue;
+                memmove(ids + first_id, out[i], out_counts[i] * sizeof(uint32_t));
+                scratch.frames.push_back(StreamFrame{ children[i].node, children[i].prim_count, children[i].leaf,
+                    first_id, out_counts[i] });
+                first_id += out_counts[i];
+            }
+        }
+    }
+
+    template <bool kAnyHit>
+    void Intersector::queryStream(const Ray *rays, size_t count, Intersection *hits, int32_t *occluded,
+        TraversalStats *stats) const
+    {
+        ParallelFor(0, count, kStreamSize, [&](size_t begin, size_t end)
+        {
+            const TraversalData &data = getTraversalData();
+            // Kept per thread so queries after the first do not allocate. A
+            // body never waits, so no other body runs on the thread meanwhile.
+            static thread_local StreamScratch scratch;
+            HitState states[kStreamSize];
+            for (size_t first = begin; first < end; first += kStreamSize)
+            {
+                uint32_t stream_count = (uint32_t)std::min<size_t>(kStreamSize, end - first);
+                if (data.qnodes)
+                    traverseStream<kAnyHit, true>(data, rays + first, stream_count, states, scratch);
+                else
+                    traverseStream<kAnyHit, false>(data, rays + first, stream_count, states, scratch);
+
+                for (uint32_t i = 0; i < stream_count; ++i)
+                {
+                    if (stats)
+                    {
+                        stats[first + i].nodes = states[i].nodes;
+                        stats[first + i].triangles = states[i].triangles;
+                        stats[first + i].boxes = states[i].boxes;
+                    }
+                    if (kAnyHit)
+                        occluded[first + i] = states[i].prim != kNoPrim ? kHitMarker : kMissMarker;
+                    else
+                        resolveHit(states[i], hits[first + i]);
+                }
+            }
+        });
+    }
+
+    template <bool kAnyHit, typename Store>
+    void Intersector::queryCompact(const CompactRay *rays, size_t count, TraversalMode mode, const Store &store) const
+    {
+        const bool stream = mode == TraversalMode::kStream && !bvh_.nodes_.empty();
+        ParallelFor(0, count, kStreamSize, [&](size_t begin, size_t end)
+        {
+            const TraversalData &data = getTraversalData();
+            static thread_local StreamScratch scratch;
+            // The only full size rays of the query, small enough to stay in cache
+            Ray decoded[kStreamSize];
+            HitState states[kStreamSize];
+            for (size_t first = begin; first < end; first += kStreamSize)
+            {
+                uint32_t stream_count = (uint32_t)std::min<size_t>(kStreamSize, end - first);
+                for (uint32_t i = 0; i < stream_count; ++i)
+                    decoded[i] = Expand(rays[first + i]);
+
+                if (stream && data.qnodes)
+                    traverseStream<kAnyHit, true>(data, decoded, stream_count, states, scratch);
+                else if (stream)
+                    traverseStream<kAnyHit, false>(data, decoded, stream_count, states, scratch);
+                else
+                {
+                    for (uint32_t i = 0; i < stream_count; ++i)
+                    {
+                        states[i] = { decoded[i].maxt, kNoPrim, 0.f, 0.f, 0, 0, 0 };
+                        if (bvh_.nodes_.empty() || decoded[i].extra[1] == 0)
+                            continue;
+                        if (data.qnodes)
+                            traverseQuantized<kAnyHit>(data, decoded[i], states[i]);
+                        else
+                            traverseFull<kAnyHit>(data, decoded[i], states[i]);
+                    }
+                }
+
+                for (uint32_t i = 0; i < stream_count; ++i)
+                    store(first + i, states[i]);
+            }
+        });
+    }
+
+    bool Intersector::Intersect(const Ray &ray, Intersection &hit, TraversalStats *stats) const
+    {
+        return traverse<false>(getTraversalData(), ray, hit, stats);
+    }
+
+    bool Intersector::Occluded(const Ray &ray, TraversalStats *stats) const
+    {
+        Intersection hit;
+        return traverse<true>(getTraversalData(), ray, hit, stats);
+    }
+
+    // Closest hit for every ray
+    void Intersector::QueryIntersection(const Ray *rays, size_t count, Intersection *hits, TraversalStats *stats,
+        TraversalMode mode) const
+    {
+        if (mode == TraversalMode::kStream && !bvh_.nodes_.empty())
+        {
+            queryStream<false>(rays, count, hits, nullptr, stats);
+            return;
+        }
+
+        ParallelFor(0, count, 1024, [&](size_t begin, size_t end)
+        {
+            // Chunks are short enough to stay on one node
+            const TraversalData &data = getTraversalData();
+            for (size_t i = begin; i < end; ++i)
+                traverse<false>(data, rays[i], hits[i], stats ? &stats[i] : nullptr);
+        });
+    }
+
+    // kHitMarker or kMissMarker for every ray
+    void Intersector::QueryOcclusion(const Ray *rays, size_t count, int32_t *hits, TraversalStats *stats,
+        TraversalMode mode) const
+    {
+        if (mode == TraversalMode::kStream && !bvh_.nodes_.empty())
+        {
+            queryStream<true>(rays, count, nullptr, hits, stats);
+            return;
+        }
+
+        ParallelFor(0, count, 1024, [&](size_t begin, size_t end)
+        {
+            const TraversalData &data = getTraversalData();
+            Intersection hit;
+            for (size_t i = begin; i < end; ++i)
+                hits[i] = traverse<true>(data, rays[i], hit, stats ? &stats[i] : nullptr) ? kHitMarker : kMissMarker;
+        });
+    }
+
+    void Intersector::QueryIntersection(const CompactRay *rays, size_t count, CompactHit *hits, TraversalMode mode) const
+    {
+        queryCompact<false>(rays, count, mode, [&](size_t i, const HitState &state)
+        {
+            Intersection hit;
+            resolveHit(state, hit);
+            hits[i] = Compact(hit);
+        });
+    }
+
+    void Intersector::QueryOcclusion(const CompactRay *rays, size_t count, int32_t *hits, TraversalMode mode) const
+    {
+        queryCompact<true>(rays, count, mode, [&](size_t i, const HitState &state)
+        {
+            hits[i] = state.prim != kNoPrim ? kHitMarker : kMissMarker;
+        });
+    }
+
+    void Intersector::QueryDistance(const CompactRay *rays, size_t count, float *distances, TraversalMode mode) const
+    {
+        queryCompact<false>(rays, count, mode, [&](size_t i, const HitState &state)
+        {
+            distances[i] = state.prim != kNoPrim ? state.tmax : kMissDistance;
+        });
+    }
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_bvh.h"
+#include "cpu_quantized_bvh.h"
+#include "cpu_triangle_block.h"
+#include "scene.h"
+
+namespace Cpu
+{
+    // Same layout as RadeonRays::ray and the Ray struct in payload.cl
+    struct Ray
+    {
+        Vec3    o;
+        float   maxt;
+        Vec3    d;
+        float   time;
+        // x - mask, y - active flag
+        int32_t extra[2];
+        // x - pixel id in the samples
+        int32_t padding[2];
+    };
+
+    // Same layout as the Intersection struct in isect.cl
+    struct Intersection
+    {
+        int32_t shapeid;
+        int32_t primid;
+        int32_t padding0;
+        int32_t padding1;
+        // uv - hit barycentrics, w - ray distance
+        float   uvwt[4];
+    };
+
+    static_assert(sizeof(Ray) == 48, "Ray must match the device layout");
+    static_assert(sizeof(Intersection) == 32, "Intersection must match the device layout");
+
+    // Work one ray did during traversal. The counts depend on the
+    // TraversalMode: kStream enters the children of a node in the order
+    // most rays of the batch prefer, so a ray can shrink its maxt at another
+    // point, or stop at another occluder, and visit other nodes than it
+    // would alone. Compare stats of one mode only.
+    struct TraversalStats
+    {
+        // Nodes visited, leaves included
+        uint32_t nodes;
+        uint32_t triangles;
+        // Ray-box tests, the steps taken to decide where to go next
+        uint32_t boxes;
+    };
+
+    // Fixed size traversal stack with a heap fallback for degenerate trees
+    class TraversalStack
+    {
+    public:
+        static const uint32_t kLocalSize = 64;
+
+        explicit TraversalStack(uint32_t max_depth)
+            : data_(local_)
+        {
+            if (max_depth > kLocalSize)
+            {
+                heap_.resize(max_depth);
+                data_ = heap_.data();
+            }
+        }
+
+        uint32_t *data() { return data_; }
+
+    private:
+        uint32_t                local_[kLocalSize];
+        std::vector<uint32_t>   heap_;
+        uint32_t               *data_;
+    };
+
+    // How a query walks the hierarchy
+    enum class TraversalMode
+    {
+        // Every ray depth first on its own
+        kSingleRay,
+        // Batches of rays breadth first through each node: a node is loaded
+        // once per batch and tested against the rays still active in it,
+        // which suits incoherent secondary rays
+        kStream
+    };
+
+    // 24 and 16 byte versions of Ray and Intersection, see cpu_compact_ray.h
+    struct CompactRay;
+    struct CompactHit;
+
+    const int32_t kInvalidId = -1;
+    const int32_t kHitMarker = 1;
+    const int32_t kMissMarker = -1;
+
+    // Host-side counterpart of RadeonRays::IntersectionApi
+    class Intersector
+    {
+        // Non-copyable
+        Intersector(const Intersector &) = delete;
+        Intersector &operator =(const Intersector &) = delete;
+
+    public:
+        Intersector();
+
+        // Flattens the scene meshes, shape ids are mesh indices as in UploadSceneToIntersector
+        void AttachScene(const Scene &scene);
+        // A single mesh with shape id 0, as a bottom level of InstancedIntersector
+        void AttachMesh(const Mesh &mesh);
+
+        // Builds the hierarchy over the attached geometry
+        void Commit(const BvhBuildOptions &options);
+
+        // Re-reads vertex positions, meshes and indices must be the ones
+        // passed to AttachScene or AttachMesh
+        void UpdateVertices(const Scene &scene);
+        void UpdateVertices(const Mesh &mesh);
+
+        // Refits the hierarchy to the current vertices. Rebuilds instead when
+        // the SAH cost after the refit exceeds rebuild_threshold times the cost
+        // of the last build. Returns true if it rebuilt.
+        bool Refit(float rebuild_threshold);
+
+        // Treelet optimization of the committed hierarchy, see Bvh::Optimize
+        BvhOptimizeResult Optimize(const BvhOptimizeOptions &options);
+
+        // Closest hit for every ray, stats receives one entry per ray if given
+        void QueryIntersection(const Ray *rays, size_t count, Intersection *hits, TraversalStats *stats = nullptr,
+            TraversalMode mode = TraversalMode::kSingleRay) const;
+        // kHitMarker or kMissMarker for every ray
+        void QueryOcclusion(const Ray *rays, size_t count, int32_t *hits, TraversalStats *stats = nullptr,
+            TraversalMode mode = TraversalMode::kSingleRay) const;
+
+        // Same queries on compact rays, which are decoded into Rays a stream
+        // at a time on the worker that traverses them
+        void QueryIntersection(const CompactRay *rays, size_t count, CompactHit *hits,
+            TraversalMode mode = TraversalMode::kSingleRay) const;
+        void QueryOcclusion(const CompactRay *rays, size_t count, int32_t *hits,
+            TraversalMode mode = TraversalMode::kSingleRay) const;
+        // Distance to the closest hit of every ray, kMissDistance for rays
+        // that hit nothing. A 4 byte result for occlusion queries that also
+        // need to know how far the occluder is.
+        void QueryDistance(const CompactRay *rays, size_t count, float *distances,
+            TraversalMode mode = TraversalMode::kSingleRay) const;
+
+        bool Intersect(const Ray &ray, Intersection &hit, TraversalStats *stats = nullptr) const;
+        bool Occluded(const Ray &ray, TraversalStats *stats = nullptr) const;
+
+        const Bvh &GetBvh() const { return bvh_; }
+        // Bytes of node data traversal reads from, in the committed node format
+        size_t GetNodeMemorySize() const
+        {
+            return qbvh_.nodes_.empty() ? bvh_.nodes_.size() * sizeof(BvhNode) : qbvh_.GetMemorySize();
+        }
+        // Bytes of triangle data leaf tests read from, in the committed leaf format
+        size_t GetLeafMemorySize() const
+        {
+            if (!triangle_blocks_.IsEmpty())
+                return triangle_blocks_.GetMemorySize();
+            return bvh_.prim_indices_.size() * sizeof(uint32_t) + indices_.size() * sizeof(uint32_t) + positions_.size() * sizeof(Vec3);
+        }
+        size_t GetTriangleCount() const { return indices_.size() / 3; }
+        // Flattened geometry the hierarchy is built over
+        const std::vector<Vec3> &GetPositions() const { return positions_; }
+        const std::vector<uint32_t> &GetIndices() const { return indices_; }
+
+    protected:
+        // Arrays traversal reads, either the intersector's own or the copy
+        // on one NUMA node. qnodes and blocks are null when not built.
+        struct TraversalData
+        {
+            const BvhNode          *nodes;
+            const QuantizedBvhNode *qnodes;
+            const TriangleBlock    *blocks;
+            const uint32_t         *leaf_blocks;
+            const uint32_t         *prim_indices;
+            const Vec3             *positions;
+            const uint32_t         *indices;
+        };
+
+        // Copy of the traversal data bound to one node, see NumaPlacement
+        struct NumaReplica
+        {
+            BufferVector<BvhNode>           nodes;
+            BufferVector<QuantizedBvhNode>  qnodes;
+            BufferVector<TriangleBlock>     blocks;
+            BufferVector<uint32_t>          leaf_blocks;
+            BufferVector<uint32_t>          prim_indices;
+            BufferVector<Vec3>              positions;
+            BufferVector<uint32_t>          indices;
+            TraversalData                   data;
+        };
+
+        struct HitState
+        {
+            float    tmax;
+            uint32_t prim;
+            float    u;
+            float    v;
+            uint32_t nodes;
+            uint32_t triangles;
+            uint32_t boxes;
+        };
+
+        void clear();
+        void appendMesh(const Mesh &mesh, int32_t shape_id);
+        // Returns the number of vertices read
+        size_t updateMesh(const Mesh &mesh, size_t base_vertex);
+        void computePrimBounds(std::vector<Aabb> &prim_bounds) const;
+        // Converts the hierarchy into the node and leaf formats the options ask for
+        void buildNodeFormat();
+        // Interleaves or replicates the traversal data as the options ask for
+        void placeNumaData();
+        // Data for the NUMA node the calling thread runs on
+        const TraversalData &getTraversalData() const;
+
+        template <bool kAnyHit>
+        bool intersectLeaf(const TraversalData &data, const Ray &ray, const WatertightRay &watertight_ray,
+            uint32_t first, uint32_t count, HitState &state) const;
+        template <bool kAnyHit>
+        bool traverseFull(const TraversalData &data, const Ray &ray, HitState &state) const;
+        template <bool kAnyHit>
+        bool traverseQuantized(const TraversalData &data, const Ray &ray, HitState &state) const;
+        template <bool kAnyHit>
+        bool traverse(const TraversalData &data, const Ray &ray, Intersection &hit, TraversalStats *stats) const;
+
+        // Per thread buffers of the stream traversal
+        struct StreamScratch;
+        // Traverses rays [0, count) as one stream, states receive the results
+        template <bool kAnyHit, bool kQuantized>
+        void traverseStream(const TraversalData &data, const Ray *rays, uint32_t count, HitState *states,
+            StreamScratch &scratch) const;
+        template <bool kAnyHit>
+        void queryStream(const Ray *rays, size_t count, Intersection *hits, int32_t *occluded, TraversalStats *stats) const;
+        // Decodes the compact rays a stream at a time and passes every
+        // finished state to store(index, state)
+        template <bool kAnyHit, typename Store>
+        void queryCompact(const CompactRay *rays, size_t count, TraversalMode mode, const Store &store) const;
+        // Fills hit from a finished state
+        void resolveHit(const HitState &state, Intersection &hit) const;
+
+        Bvh                     bvh_;
+        // Only populated for BvhNodeFormat::kQuantized
+        QuantizedBvh            qbvh_;
+        // Only populated for BvhLeafFormat::kBlocks
+        TriangleBlocks          triangle_blocks_;
+        std::vector<Vec3>       positions_;
+        // Three entries per triangle into positions_
+        std::vector<uint32_t>   indices_;
+        std::vector<int32_t>    shape_ids_;
+        std::vector<int32_t>    prim_ids_;
+        TraversalData           data_;
+        // One per node with NumaPlacement::kReplicate on NUMA machines
+        std::vector<NumaReplica> replicas_;
+    };
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// SSE2 is part of every x86-64 target, SIMD paths fall back to loops elsewhere
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPU_SSE2 1
+#include <emmintrin.h>
+#else
+#define CPU_SSE2 0
+#endif
+
+// Minimal vector math for the host-side tracer. Kept free of RadeonRays
+// headers so that the CPU path builds without the SDK.
+namespace Cpu
+{
+    struct Vec3
+    {
+        float x, y, z;
+
+        Vec3() : x(0.f), y(0.f), z(0.f) {}
+        Vec3(float v) : x(v), y(v), z(v) {}
+        Vec3(float x_, float y_, float z_) : x(x_), y(y_), z(z_) {}
+
+        float  operator[](int i) const { return (&x)[i]; }
+        float &operator[](int i) { return (&x)[i]; }
+    };
+
+    inline Vec3 operator +(const Vec3 &a, const Vec3 &b) { return Vec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+    inline Vec3 operator -(const Vec3 &a, const Vec3 &b) { return Vec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+    inline Vec3 operator *(const Vec3 &a, const Vec3 &b) { return Vec3(a.x * b.x, a.y * b.y, a.z * b.z); }
+    inline Vec3 operator *(const Vec3 &a, float s) { return Vec3(a.x * s, a.y * s, a.z * s); }
+    inline Vec3 operator *(float s, const Vec3 &a) { return Vec3(a.x * s, a.y * s, a.z * s); }
+    inline Vec3 operator -(const Vec3 &a) { return Vec3(-a.x, -a.y, -a.z); }
+
+    inline float Dot(const Vec3 &a, const Vec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    inline Vec3 Cross(const Vec3 &a, const Vec3 &b)
+    {
+        return Vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+    inline Vec3 Min(const Vec3 &a, const Vec3 &b) { return Vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)); }
+    inline Vec3 Max(const Vec3 &a, const Vec3 &b) { return Vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)); }
+    inline Vec3 Normalize(const Vec3 &a) { return a * (1.f / std::sqrt(Dot(a, a))); }
+
+    /// Axis aligned bounding box, empty on construction
+    struct Aabb
+    {
+        Vec3 pmin;
+        Vec3 pmax;
+
+        Aabb()
+            : pmin(std::numeric_limits<float>::max())
+            , pmax(-std::numeric_limits<float>::max())
+        {
+        }
+        Aabb(const Vec3 &p0, const Vec3 &p1) : pmin(Min(p0, p1)), pmax(Max(p0, p1)) {}
+
+        void Grow(const Vec3 &p) { pmin = Min(pmin, p); pmax = Max(pmax, p); }
+        void Grow(const Aabb &b) { pmin = Min(pmin, b.pmin); pmax = Max(pmax, b.pmax); }
+
+        bool  IsEmpty() const { return pmin.x > pmax.x || pmin.y > pmax.y || pmin.z > pmax.z; }
+        Vec3  Center() const { return (pmin + pmax) * 0.5f; }
+        Vec3  Extent() const { return pmax - pmin; }
+
+        int MaxAxis() const
+        {
+            Vec3 e = Extent();
+            return (e.x >= e.y && e.x >= e.z) ? 0 : (e.y >= e.z ? 1 : 2);
+        }
+
+        float SurfaceArea() const
+        {
+            if (IsEmpty())
+                return 0.f;
+            Vec3 e = Extent();
+            return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+        }
+    };
+
+    inline Aabb Union(const Aabb &a, const Aabb &b)
+    {
+        Aabb r = a;
+        r.Grow(b);
+        return r;
+    }
+
+    inline Aabb Overlap(const Aabb &a, const Aabb &b)
+    {
+        Aabb r;
+        r.pmin = Max(a.pmin, b.pmin);
+        r.pmax = Min(a.pmax, b.pmax);
+        return r;
+    }
+
+    // Slab test, returns the entry distance or a negative value on a miss
+    inline float IntersectBox(const Vec3 &pmin, const Vec3 &pmax, const Vec3 &o, const Vec3 &inv_d, float tmax)
+    {
+        Vec3 t0 = (pmin - o) * inv_d;
+        Vec3 t1 = (pmax - o) * inv_d;
+        Vec3 tn = Min(t0, t1);
+        Vec3 tf = Max(t0, t1);
+        float tnear = std::max(std::max(tn.x, tn.y), std::max(tn.z, 0.f));
+        float tfar = std::min(std::min(tf.x, tf.y), std::min(tf.z, tmax));
+        return tnear <= tfar ? tnear : -1.f;
+    }
+
+    inline float IntersectBox(const Aabb &box, const Vec3 &o, const Vec3 &inv_d, float tmax)
+    {
+        return IntersectBox(box.pmin, box.pmax, o, inv_d, tmax);
+    }
+
+    /// Affine transform, the rows of a 3x4 matrix
+    struct Transform
+    {
+        float m[3][4];
+
+        Transform()
+        {
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 4; ++c)
+                    m[r][c] = r == c ? 1.f : 0.f;
+            }
+        }
+
+        static Transform Translation(const Vec3 &t)
+        {
+            Transform result;
+            result.m[0][3] = t.x;
+            result.m[1][3] = t.y;
+            result.m[2][3] = t.z;
+            return result;
+        }
+    };
+
+    inline Vec3 TransformVector(const Transform &t, const Vec3 &v)
+    {
+        return Vec3(t.m[0][0] * v.x + t.m[0][1] * v.y + t.m[0][2] * v.z,
+                    t.m[1][0] * v.x + t.m[1][1] * v.y + t.m[1][2] * v.z,
+                    t.m[2][0] * v.x + t.m[2][1] * v.y + t.m[2][2] * v.z);
+    }
+
+    inline Vec3 TransformPoint(const Transform &t, const Vec3 &p)
+    {
+        return TransformVector(t, p) + Vec3(t.m[0][3], t.m[1][3], t.m[2][3]);
+    }
+
+    // Bounds of a transformed box, Arvo's method
+    inline Aabb TransformBounds(const Transform &t, const Aabb &b)
+    {
+        if (b.IsEmpty())
+            return b;
+
+        Aabb result;
+        for (int r = 0; r < 3; ++r)
+        {
+            result.pmin[r] = result.pmax[r] = t.m[r][3];
+            for (int c = 0; c < 3; ++c)
+            {
+                float e0 = t.m[r][c] * b.pmin[c];
+                float e1 = t.m[r][c] * b.pmax[c];
+                result.pmin[r] += std::min(e0, e1);
+                result.pmax[r] += std::max(e0, e1);
+            }
+        }
+        return result;
+    }
+
+    // Inverse of an invertible affine transform
+    inline Transform Inverse(const Transform &t)
+    {
+        const float (*m)[4] = t.m;
+        float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        float inv_det = 1.f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+        Transform result;
+        result.m[0][0] = c00 * inv_det;
+        result.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        result.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        result.m[1][0] = c01 * inv_det;
+        result.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        result.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        result.m[2][0] = c02 * inv_det;
+        result.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        result.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+        Vec3 translation = TransformVector(result, Vec3(m[0][3], m[1][3], m[2][3]));
+        for (int r = 0; r < 3; ++r)
+            result.m[r][3] = -translation[r];
+        return result;
+    }
+}
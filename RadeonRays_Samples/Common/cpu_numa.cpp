@@ -0,0 +1,204 @@
+#include "cpu_numa.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace Cpu
+{
+    struct NumaTopology
+    {
+        std::vector<std::vector<unsigned>> node_cpus;
+        // Kernel id of every node, ids can have gaps
+        std::vector<unsigned>              node_ids;
+        // Node of every logical CPU
+        std::vector<unsigned>              cpu_nodes;
+    };
+
+    // Node the current thread was pinned to, ~0u if none
+    static thread_local unsigned t_pinned_node = ~0u;
+
+#if defined(__linux__)
+    // Same values as linux/mempolicy.h
+    static const int kMpolBind = 2;
+    static const int kMpolInterleave = 3;
+    static const unsigned kMpolMfMove = 1u << 1;
+    static const unsigned kMaxNodes = 1024;
+
+    // Parses a sysfs CPU list such as "0-3,8-11"
+    static void ParseCpuList(const char *text, std::vector<unsigned> &cpus)
+    {
+        while (*text)
+        {
+            unsigned first, last;
+            int length = 0;
+            if (sscanf(text, "%u-%u%n", &first, &last, &length) != 2)
+            {
+                if (sscanf(text, "%u%n", &first, &length) != 1)
+                    return;
+                last = first;
+            }
+            for (unsigned cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+            text += length;
+            if (*text == ',')
+                ++text;
+            else
+                return;
+        }
+    }
+
+    static void ReadTopology(NumaTopology &topology)
+    {
+        for (unsigned node = 0; node < kMaxNodes; ++node)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            FILE *file = fopen(path, "r");
+            if (!file)
+            {
+                // Node ids can have gaps, stop at the first run of misses
+                if (node > topology.node_ids.size() + 8)
+                    break;
+                continue;
+            }
+
+            char text[4096] = {};
+            std::vector<unsigned> cpus;
+            if (fgets(text, sizeof(text), file))
+                ParseCpuList(text, cpus);
+            fclose(file);
+            // Memory-only nodes take no threads
+            if (!cpus.empty())
+            {
+                topology.node_cpus.push_back(cpus);
+                topology.node_ids.push_back(node);
+            }
+        }
+    }
+
+    static bool SetMemoryPolicy(const void *data, size_t size, int mode, const unsigned long *mask)
+    {
+        const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t begin = ((uintptr_t)data + page - 1) & ~(page - 1);
+        uintptr_t end = ((uintptr_t)data + size) & ~(page - 1);
+        if (end <= begin)
+            return true;
+        return syscall(SYS_mbind, begin, end - begin, mode, mask, kMaxNodes + 1, kMpolMfMove) == 0;
+    }
+#else
+    static void ReadTopology(NumaTopology &)
+    {
+    }
+#endif
+
+    static const NumaTopology &GetTopology()
+    {
+        static const NumaTopology topology = []()
+        {
+            NumaTopology result;
+            ReadTopology(result);
+            if (result.node_cpus.empty())
+            {
+                result.node_ids.assign(1, 0);
+                result.node_cpus.resize(1);
+                for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                    result.node_cpus[0].push_back(cpu);
+            }
+            for (unsigned node = 0; node < (unsigned)result.node_cpus.size(); ++node)
+            {
+                for (unsigned cpu : result.node_cpus[node])
+                {
+                    if (cpu >= result.cpu_nodes.size())
+                        result.cpu_nodes.resize(cpu + 1, 0);
+                    result.cpu_nodes[cpu] = node;
+                }
+            }
+            return result;
+        }();
+        return topology;
+    }
+
+    unsigned GetNumaNodeCount()
+    {
+        return (unsigned)GetTopology().node_cpus.size();
+    }
+
+    const std::vector<unsigned> &GetNumaNodeCpus(unsigned node)
+    {
+        return GetTopology().node_cpus[node];
+    }
+
+    unsigned GetCurrentNumaNode()
+    {
+        if (t_pinned_node != ~0u)
+            return t_pinned_node;
+#if defined(__linux__)
+        const NumaTopology &topology = GetTopology();
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && (size_t)cpu < topology.cpu_nodes.size())
+            return topology.cpu_nodes[cpu];
+#endif
+        return 0;
+    }
+
+    bool PinThreadToNumaNode(unsigned node)
+    {
+        if (node >= GetNumaNodeCount())
+            return false;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu : GetNumaNodeCpus(node))
+        {
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            return false;
+#endif
+        t_pinned_node = node;
+        return true;
+    }
+
+    bool InterleaveMemory(const void *data, size_t size)
+    {
+#if defined(__linux__)
+        // Over the nodes with CPUs, memory-only nodes are usually slower
+        unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {};
+        const unsigned bits = 8 * sizeof(unsigned long);
+        for (unsigned id : GetTopology().node_ids)
+            mask[id / bits] |= 1ul << (id % bits);
+        return SetMemoryPolicy(data, size, kMpolInterleave, mask);
+#else
+        (void)data;
+        (void)size;
+        return false;
+#endif
+    }
+
+    bool BindMemory(const void *data, size_t size, unsigned node)
+    {
+#if defined(__linux__)
+        if (node >= GetNumaNodeCount())
+            return false;
+        unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {};
+        const unsigned bits = 8 * sizeof(unsigned long);
+        unsigned id = GetTopology().node_ids[node];
+        mask[id / bits] |= 1ul << (id % bits);
+        return SetMemoryPolicy(data, size, kMpolBind, mask);
+#else
+        (void)data;
+        (void)size;
+        (void)node;
+        return false;
+#endif
+    }
+}
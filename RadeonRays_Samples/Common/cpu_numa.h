@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// NUMA topology and placement for the CPU paths. Only Linux is supported,
+// elsewhere the machine reads as one node and placement calls do nothing.
+namespace Cpu
+{
+    // Nodes with CPUs, at least one. Nodes are numbered 0 to count - 1 here,
+    // whatever ids the system gives them.
+    unsigned GetNumaNodeCount();
+    // Logical CPUs of a node
+    const std::vector<unsigned> &GetNumaNodeCpus(unsigned node);
+    // Node the calling thread is pinned to, or the node of the CPU it runs
+    // on right now if it is not pinned
+    unsigned GetCurrentNumaNode();
+
+    // Restricts the calling thread to the CPUs of a node
+    bool PinThreadToNumaNode(unsigned node);
+
+    // Memory policies for the whole pages inside [data, data + size), pages
+    // already touched are migrated. Return false when the system refuses.
+    bool InterleaveMemory(const void *data, size_t size);
+    bool BindMemory(const void *data, size_t size, unsigned node);
+}
@@ -0,0 +1,369 @@
+#include "cpu_parallel.h"
+#include "cpu_numa.h"
+
+#include <chrono>
+
+namespace Cpu
+{
+    // Rounds of looking for work before a pool thread goes to sleep
+    static const int kSpinCount = 64;
+
+    struct ThreadPool::Worker
+    {
+        TaskDeque             deque;
+        std::thread           thread;
+        std::atomic<uint64_t> tasks;
+        std::atomic<uint64_t> steals;
+        std::atomic<uint64_t> busy_ns;
+        uint32_t              random;
+        unsigned              node;
+        // Keeps the next worker's counters off this cache line
+        char                  padding[64];
+    };
+
+    // Pool and worker slot of the current thread, null outside of pools
+    static thread_local ThreadPool *t_pool = nullptr;
+    static thread_local unsigned t_worker = 0;
+    // Tasks running on the current thread, only the outermost one is timed
+    static thread_local int t_depth = 0;
+    static thread_local uint32_t t_random = 0x9e3779b9u;
+    // Pool of an outside thread, see BindCurrentThread
+    static thread_local ThreadPool *t_bound_pool = nullptr;
+
+    static std::mutex g_shared_mutex;
+    static std::unique_ptr<ThreadPool> g_shared_pool;
+    static std::atomic<ThreadPool *> g_shared(nullptr);
+
+    static inline int64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static inline uint32_t NextRandom(uint32_t &state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    void ThreadPool::TaskDeque::PushBack(const Task &task)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size_ == tasks_.size())
+        {
+            std::vector<Task> tasks(std::max<size_t>(64, 2 * tasks_.size()));
+            for (size_t i = 0; i < size_; ++i)
+                tasks[i] = tasks_[(head_ + i) % tasks_.size()];
+            tasks_.swap(tasks);
+            head_ = 0;
+        }
+        tasks_[(head_ + size_++) % tasks_.size()] = task;
+    }
+
+    bool ThreadPool::TaskDeque::PopBack(Task &task)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size_ == 0)
+            return false;
+        task = tasks_[(head_ + --size_) % tasks_.size()];
+        return true;
+    }
+
+    bool ThreadPool::TaskDeque::PopFront(Task &task)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size_ == 0)
+            return false;
+        task = tasks_[head_];
+        head_ = (head_ + 1) % tasks_.size();
+        --size_;
+        return true;
+    }
+
+    ThreadPool::ThreadPool(unsigned worker_count, unsigned pin_node_count)
+        : worker_count_(std::max(1u, worker_count))
+        , pin_node_count_(std::min(pin_node_count, GetNumaNodeCount()))
+        , workers_(new Worker[std::max(1u, worker_count)])
+        , queued_(0)
+        , sleeping_(0)
+        , group_waiters_(0)
+        , stop_(false)
+        , stats_start_(NowNs())
+    {
+        for (unsigned i = 0; i < worker_count_; ++i)
+        {
+            workers_[i].tasks = 0;
+            workers_[i].steals = 0;
+            workers_[i].busy_ns = 0;
+            workers_[i].random = 0x9e3779b9u * (i + 1);
+            // The calling thread counts towards the first node, outside
+            // threads share the last slot
+            workers_[i].node = pin_node_count_ > 0 && i + 1 < worker_count_ ? (i + 1) * pin_node_count_ / worker_count_ : 0;
+        }
+
+        // The last slot belongs to threads from outside
+        for (unsigned i = 0; i + 1 < worker_count_; ++i)
+            workers_[i].thread = std::thread(&ThreadPool::workerLoop, this, i);
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (unsigned i = 0; i + 1 < worker_count_; ++i)
+            workers_[i].thread.join();
+    }
+
+    ThreadPool &ThreadPool::Get()
+    {
+        if (t_pool)
+            return *t_pool;
+        if (t_bound_pool)
+            return *t_bound_pool;
+
+        ThreadPool *pool = g_shared.load(std::memory_order_acquire);
+        if (pool)
+            return *pool;
+
+        std::lock_guard<std::mutex> lock(g_shared_mutex);
+        if (!g_shared_pool)
+        {
+            g_shared_pool.reset(new ThreadPool(std::max(1u, std::thread::hardware_concurrency())));
+            g_shared.store(g_shared_pool.get(), std::memory_order_release);
+        }
+        return *g_shared_pool;
+    }
+
+    void ThreadPool::BindCurrentThread(ThreadPool *pool)
+    {
+        t_bound_pool = pool;
+    }
+
+    void ThreadPool::SetSharedWorkerCount(unsigned worker_count, unsigned pin_node_count)
+    {
+        std::lock_guard<std::mutex> lock(g_shared_mutex);
+        g_shared.store(nullptr, std::memory_order_release);
+        g_shared_pool.reset();
+        g_shared_pool.reset(new ThreadPool(worker_count, pin_node_count));
+        g_shared.store(g_shared_pool.get(), std::memory_order_release);
+    }
+
+    unsigned ThreadPool::GetWorkerNode(unsigned worker) const
+    {
+        return workers_[worker].node;
+    }
+
+    void ThreadPool::GetWorkerStats(std::vector<WorkerStats> &stats) const
+    {
+        stats.resize(worker_count_);
+        for (unsigned i = 0; i < worker_count_; ++i)
+        {
+            stats[i].tasks = workers_[i].tasks.load(std::memory_order_relaxed);
+            stats[i].steals = workers_[i].steals.load(std::memory_order_relaxed);
+            stats[i].busy_seconds = workers_[i].busy_ns.load(std::memory_order_relaxed) * 1e-9;
+        }
+    }
+
+    double ThreadPool::GetStatsSeconds() const
+    {
+        return (NowNs() - stats_start_.load(std::memory_order_relaxed)) * 1e-9;
+    }
+
+    void ThreadPool::ResetWorkerStats()
+    {
+        for (unsigned i = 0; i < worker_count_; ++i)
+        {
+            workers_[i].tasks.store(0, std::memory_order_relaxed);
+            workers_[i].steals.store(0, std::memory_order_relaxed);
+            workers_[i].busy_ns.store(0, std::memory_order_relaxed);
+        }
+        stats_start_.store(NowNs(), std::memory_order_relaxed);
+    }
+
+    void ThreadPool::Submit(const Task &task)
+    {
+        // Counted before it is visible so the count never drops below zero.
+        // Pairs with the sleeping count raised before the queued count is
+        // checked in workerLoop, one side always sees the other.
+        queued_.fetch_add(1);
+        if (t_pool == this)
+            workers_[t_worker].deque.PushBack(task);
+        else
+            shared_queue_.PushBack(task);
+
+        if (sleeping_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    bool ThreadPool::RunOne()
+    {
+        unsigned index = t_pool == this ? t_worker : worker_count_ - 1;
+        Task task;
+        bool stolen;
+        if (!findTask(index, task, stolen))
+            return false;
+        execute(index, task);
+        return true;
+    }
+
+    void ThreadPool::WaitForWork(const std::atomic<size_t> &pending)
+    {
+        // Counted before pending is checked, pairs with the count Finish
+        // drops before execute checks for group waiters
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        sleeping_.fetch_add(1);
+        group_waiters_.fetch_add(1);
+        while (queued_.load() == 0 && pending.load() != 0 && !stop_.load())
+            wake_.wait(lock);
+        group_waiters_.fetch_sub(1);
+        sleeping_.fetch_sub(1);
+    }
+
+    // Own deque first, newest task first, then the shared queue and the
+    // other workers, oldest task first and workers on the same node first
+    bool ThreadPool::findTask(unsigned index, Task &task, bool &stolen)
+    {
+        const bool pool_thread = index + 1 < worker_count_;
+        stolen = false;
+        bool found = pool_thread ? workers_[index].deque.PopBack(task) : shared_queue_.PopBack(task);
+        if (!found && pool_thread)
+            found = stolen = shared_queue_.PopFront(task);
+
+        const unsigned thread_count = worker_count_ - 1;
+        if (!found && thread_count > 0)
+        {
+            uint32_t &random = pool_thread ? workers_[index].random : t_random;
+            unsigned start = NextRandom(random) % thread_count;
+            unsigned node = workers_[index].node;
+            for (int pass = pin_node_count_ > 1 ? 0 : 1; pass < 2 && !found; ++pass)
+            {
+                for (unsigned i = 0; i < thread_count && !found; ++i)
+                {
+                    unsigned victim = (start + i) % thread_count;
+                    if (victim != index && (pass == 1 || workers_[victim].node == node))
+                        found = stolen = workers_[victim].deque.PopFront(task);
+                }
+            }
+        }
+
+        if (!found)
+            return false;
+
+        queued_.fetch_sub(1);
+        if (stolen)
+        {
+            // Stealing means some workers ran dry, make the rest of this
+            // range easier to share
+            task.split_size = std::max(task.grain, task.split_size / 2);
+            workers_[index].steals.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    void ThreadPool::execute(unsigned index, Task &task)
+    {
+        TaskGroup *group = task.group;
+        int64_t start = t_depth == 0 ? NowNs() : 0;
+        ++t_depth;
+        task.run(task);
+        --t_depth;
+        if (t_depth == 0)
+            workers_[index].busy_ns.fetch_add(NowNs() - start, std::memory_order_relaxed);
+        workers_[index].tasks.fetch_add(1, std::memory_order_relaxed);
+        if (group->Finish() && group_waiters_.load() > 0)
+        {
+            // Wakes the sleeping workers too, they find nothing and sleep again
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_all();
+        }
+    }
+
+    void ThreadPool::workerLoop(unsigned index)
+    {
+        t_pool = this;
+        t_worker = index;
+        if (pin_node_count_ > 0)
+            PinThreadToNumaNode(workers_[index].node);
+
+        int spins = 0;
+        for (;;)
+        {
+            Task task;
+            bool stolen;
+            if (findTask(index, task, stolen))
+            {
+                execute(index, task);
+                spins = 0;
+                continue;
+            }
+
+            if (stop_.load())
+                break;
+            if (++spins < kSpinCount)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleeping_.fetch_add(1);
+            while (queued_.load() == 0 && !stop_.load())
+                wake_.wait(lock);
+            sleeping_.fetch_sub(1);
+            spins = 0;
+        }
+    }
+
+    static void RunFunction(Task &task)
+    {
+        std::unique_ptr<std::function<void()>> func((std::function<void()> *)task.context);
+        (*func)();
+    }
+
+    void TaskGroup::Run(std::function<void()> func)
+    {
+        Task task = {};
+        task.run = &RunFunction;
+        task.context = new std::function<void()>(std::move(func));
+        task.grain = 1;
+        Submit(task);
+    }
+
+    void TaskGroup::Submit(Task task)
+    {
+        task.group = this;
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        pool_.Submit(task);
+    }
+
+    // Helps with queued tasks, which may belong to other groups, until the
+    // group's own tasks are done. With nothing to run it spins like an idle
+    // worker and then sleeps until a task is queued or the group finished.
+    void TaskGroup::Wait()
+    {
+        int spins = 0;
+        while (pending_.load(std::memory_order_acquire) != 0)
+        {
+            if (pool_.RunOne())
+            {
+                spins = 0;
+                continue;
+            }
+            if (++spins < kSpinCount)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            pool_.WaitForWork(pending_);
+            spins = 0;
+        }
+    }
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Cpu
+{
+    class TaskGroup;
+
+    // Unit of work. Ranges are split lazily: a range task hands its upper
+    // half to the deque while it is larger than split_size.
+    struct Task
+    {
+        void      (*run)(Task &task);
+        void      *context;
+        TaskGroup *group;
+        size_t    begin;
+        size_t    end;
+        size_t    grain;
+        size_t    split_size;
+    };
+
+    // Per worker counters since the last reset
+    struct WorkerStats
+    {
+        uint64_t tasks;
+        // Tasks taken from another worker's deque or the shared queue
+        uint64_t steals;
+        double   busy_seconds;
+    };
+
+    // Work stealing pool. Every worker owns a deque it pushes and pops at
+    // the back, idle workers steal from the front of the others, which holds
+    // the oldest and largest pieces of work. Threads from outside the pool
+    // submit to a shared queue, and every thread waiting on a task group runs
+    // tasks until the group is done, so nested parallel loops never block.
+    // Pool threads can be pinned to NUMA nodes, they then steal from workers
+    // of their own node first.
+    class ThreadPool
+    {
+        // Non-copyable
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator =(const ThreadPool &) = delete;
+
+    public:
+        // worker_count includes the calling thread, so worker_count - 1
+        // threads are started. With pin_node_count > 0 the threads are spread
+        // evenly over NUMA nodes [0, pin_node_count) and pinned there.
+        explicit ThreadPool(unsigned worker_count, unsigned pin_node_count = 0);
+        ~ThreadPool();
+
+        // Pool parallel loops of the calling thread go to: the thread's own
+        // pool for pool threads, the one bound with BindCurrentThread, else
+        // the pool shared by all CPU stages with one worker per hardware
+        // thread
+        static ThreadPool &Get();
+        // Sends the parallel loops of the calling thread, which must not be
+        // a pool thread, to pool instead of the shared one. Null unbinds.
+        // Lets a background job run on threads of its own, so threads
+        // waiting for work of the shared pool never pick up its tasks.
+        static void BindCurrentThread(ThreadPool *pool);
+        // Replaces the shared pool, only while no work is running on it
+        static void SetSharedWorkerCount(unsigned worker_count, unsigned pin_node_count = 0);
+
+        unsigned GetWorkerCount() const { return worker_count_; }
+        // Node a pool thread is pinned to, 0 when the pool is not pinned
+        unsigned GetWorkerNode(unsigned worker) const;
+        unsigned GetPinNodeCount() const { return pin_node_count_; }
+
+        // One entry per pool thread, the last one counts all threads from
+        // outside the pool while they help
+        void GetWorkerStats(std::vector<WorkerStats> &stats) const;
+        // Seconds since the last reset, busy_seconds / this is the utilization
+        double GetStatsSeconds() const;
+        void ResetWorkerStats();
+
+        // Queues a task, on the calling worker's deque if it belongs to this
+        // pool and on the shared queue otherwise
+        void Submit(const Task &task);
+        // Runs one queued task if there is any
+        bool RunOne();
+        // Sleeps until a task is queued or pending drops to 0, for threads
+        // waiting on a task group that found nothing to run
+        void WaitForWork(const std::atomic<size_t> &pending);
+
+    protected:
+        struct Worker;
+
+        // Deque of tasks under a lock, a ring buffer that only grows
+        class TaskDeque
+        {
+        public:
+            void PushBack(const Task &task);
+            bool PopBack(Task &task);
+            bool PopFront(Task &task);
+
+        protected:
+            std::mutex        mutex_;
+            std::vector<Task> tasks_;
+            size_t            head_ = 0;
+            size_t            size_ = 0;
+        };
+
+        void workerLoop(unsigned index);
+        bool findTask(unsigned index, Task &task, bool &stolen);
+        void execute(unsigned index, Task &task);
+
+        unsigned                    worker_count_;
+        unsigned                    pin_node_count_;
+        // worker_count_ - 1 pool threads and the slot of outside threads
+        std::unique_ptr<Worker[]>   workers_;
+        TaskDeque                   shared_queue_;
+        // Tasks in all deques, lets idle workers sleep
+        std::atomic<size_t>         queued_;
+        std::atomic<unsigned>       sleeping_;
+        // Sleeping threads that wait on a task group, woken when a group
+        // finishes
+        std::atomic<unsigned>       group_waiters_;
+        std::atomic<bool>           stop_;
+        std::mutex                  sleep_mutex_;
+        std::condition_variable     wake_;
+        std::atomic<int64_t>        stats_start_;
+    };
+
+    // Tasks that are waited for together. Wait runs queued tasks until all
+    // tasks of the group finished and sleeps while there are none to run,
+    // the destructor waits as well.
+    class TaskGroup
+    {
+        // Non-copyable
+        TaskGroup(const TaskGroup &) = delete;
+        TaskGroup &operator =(const TaskGroup &) = delete;
+
+    public:
+        explicit TaskGroup(ThreadPool &pool = ThreadPool::Get())
+            : pool_(pool)
+            , pending_(0)
+        {
+        }
+        ~TaskGroup() { Wait(); }
+
+        ThreadPool &GetPool() const { return pool_; }
+
+        // Runs func() on some worker
+        void Run(std::function<void()> func);
+        // Queues a task, group is filled in
+        void Submit(Task task);
+        void Wait();
+
+        // Called by the pool when one of the group's tasks finished, true
+        // for the last one. The group may be gone once it returned.
+        bool Finish() { return pending_.fetch_sub(1) == 1; }
+
+    protected:
+        ThreadPool              &pool_;
+        std::atomic<size_t>     pending_;
+    };
+
+    inline unsigned GetWorkerCount()
+    {
+        return ThreadPool::Get().GetWorkerCount();
+    }
+
+    // Splits off upper halves of the range, aligned to the grain, until the
+    // rest fits the split size, then runs the body over it
+    template <typename Func>
+    void RunParallelForRange(Task &task)
+    {
+        Func &func = *(Func *)task.context;
+        while (task.end - task.begin > task.split_size)
+        {
+            size_t grains = (task.end - task.begin + task.grain - 1) / task.grain;
+            Task upper = task;
+            upper.begin = task.begin + grains / 2 * task.grain;
+            task.end = upper.begin;
+            task.group->Submit(upper);
+        }
+        func(task.begin, task.end);
+    }
+
+    // Runs func(chunk_begin, chunk_end) over [begin, end) split into chunks of
+    // at least grain elements. Chunking adapts to the load: the range starts
+    // out as a few chunks per worker and every stolen chunk is split finer,
+    // so uneven loops end up with small chunks where the work is.
+    template <typename Func>
+    void ParallelFor(size_t begin, size_t end, size_t grain, Func func)
+    {
+        if (end <= begin)
+            return;
+
+        ThreadPool &pool = ThreadPool::Get();
+        grain = std::max<size_t>(grain, 1);
+        size_t count = end - begin;
+        if (count <= grain || pool.GetWorkerCount() == 1)
+        {
+            func(begin, end);
+            return;
+        }
+
+        TaskGroup group(pool);
+        Task task;
+        task.run = &RunParallelForRange<Func>;
+        task.context = &func;
+        task.group = &group;
+        task.begin = begin;
+        task.end = end;
+        task.grain = grain;
+        task.split_size = std::max(grain, count / (4 * pool.GetWorkerCount()));
+        group.Submit(task);
+        group.Wait();
+    }
+}
@@ -0,0 +1,187 @@
+#include "cpu_quantized_bvh.h"
+
+#include <assert.h>
+
+namespace Cpu
+{
+    static const uint32_t kInvalidNode = 0xffffffffu;
+
+    static std::array<float, 256> MakeQuantizedSteps()
+    {
+        std::array<float, 256> steps;
+        for (int i = 0; i < 256; ++i)
+            steps[i] = (float)i;
+        return steps;
+    }
+
+    const std::array<float, 256> kQuantizedSteps = MakeQuantizedSteps();
+
+    // A child to encode: a Bvh node, or a range of references when a leaf is
+    // too large for the 4 bit count and has to be split
+    struct Source
+    {
+        uint32_t node;
+        uint32_t first;
+        uint32_t count;
+        Aabb     bounds;
+    };
+
+    static inline bool FitsInLeaf(const Bvh &bvh, const Source &source)
+    {
+        if (source.node != kInvalidNode && !bvh.nodes_[source.node].IsLeaf())
+            return false;
+        return source.count <= QuantizedBvhNode::kMaxLeafSize;
+    }
+
+    static inline Source MakeSource(const Bvh &bvh, uint32_t index)
+    {
+        const BvhNode &node = bvh.nodes_[index];
+        Source source = { index, 0, 0, node.bounds };
+        if (node.IsLeaf())
+        {
+            source.first = node.left;
+            source.count = node.GetPrimCount();
+        }
+        return source;
+    }
+
+    // Children of a source that does not fit into a leaf. Oversized leaves are
+    // halved and both halves keep the leaf bounds, which is conservative.
+    static inline void Expand(const Bvh &bvh, const Source &source, Source children[2])
+    {
+        if (source.node != kInvalidNode && !bvh.nodes_[source.node].IsLeaf())
+        {
+            children[0] = MakeSource(bvh, bvh.nodes_[source.node].left);
+            children[1] = MakeSource(bvh, bvh.nodes_[source.node].right);
+            return;
+        }
+
+        uint32_t half = source.count / 2;
+        children[0] = { kInvalidNode, source.first, half, source.bounds };
+        children[1] = { kInvalidNode, source.first + half, source.count - half, source.bounds };
+    }
+
+    // Rounds one axis of the child boxes outwards into the smallest cell that
+    // keeps them conservative after decoding
+    static void QuantizeAxis(QuantizedBvhNode &node, int axis, const Aabb &frame, const Source children[2])
+    {
+        float extent = frame.pmax[axis] - frame.pmin[axis];
+        int exponent = -126;
+        if (extent > 0.f)
+        {
+            std::frexp(extent / 255.f, &exponent);
+            exponent = std::max(exponent, -126);
+        }
+
+        node.origin[axis] = frame.pmin[axis];
+        for (;; ++exponent)
+        {
+            node.exponent[axis] = (int8_t)exponent;
+            float cell = node.GetCellSize(axis);
+
+            bool conservative = true;
+            for (int i = 0; i < 2; ++i)
+            {
+                if (children[i].bounds.IsEmpty())
+                {
+                    node.qmin[i][axis] = 255;
+                    node.qmax[i][axis] = 0;
+                    continue;
+                }
+
+                float lo = std::floor((children[i].bounds.pmin[axis] - node.origin[axis]) / cell);
+                float hi = std::ceil((children[i].bounds.pmax[axis] - node.origin[axis]) / cell);
+                int qmin = (int)std::min(std::max(lo, 0.f), 255.f);
+                int qmax = (int)std::min(std::max(hi, 0.f), 255.f);
+
+                // The subtraction above rounds, step outwards until decoding is exact enough
+                while (qmin > 0 && node.origin[axis] + (float)qmin * cell > children[i].bounds.pmin[axis])
+                    --qmin;
+                while (qmax < 255 && node.origin[axis] + (float)qmax * cell < children[i].bounds.pmax[axis])
+                    ++qmax;
+
+                node.qmin[i][axis] = (uint8_t)qmin;
+                node.qmax[i][axis] = (uint8_t)qmax;
+                conservative = conservative &&
+                    node.origin[axis] + (float)qmin * cell <= children[i].bounds.pmin[axis] &&
+                    node.origin[axis] + (float)qmax * cell >= children[i].bounds.pmax[axis];
+            }
+
+            if (conservative)
+                break;
+        }
+    }
+
+    // Constructor
+    QuantizedBvh::QuantizedBvh()
+        : max_depth_(0)
+    {
+    }
+
+    void QuantizedBvh::Build(const Bvh &bvh)
+    {
+        nodes_.clear();
+        root_bounds_ = Aabb();
+        max_depth_ = 0;
+        if (bvh.nodes_.empty())
+            return;
+
+        root_bounds_ = bvh.nodes_[0].bounds;
+
+        struct Entry
+        {
+            Source   source;
+            uint32_t parent;
+            int      slot;
+            uint32_t depth;
+        };
+
+        // A root leaf that fits still needs one node, its second child stays empty
+        Source root = MakeSource(bvh, 0);
+        std::vector<Entry> stack;
+        stack.push_back(Entry{ root, kInvalidNode, 0, 1 });
+        nodes_.reserve(bvh.nodes_.size() / 2 + 1);
+
+        while (!stack.empty())
+        {
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            // Pre-order, the first interior child follows its parent
+            uint32_t index = (uint32_t)nodes_.size();
+            nodes_.push_back(QuantizedBvhNode());
+            if (entry.parent != kInvalidNode)
+                nodes_[entry.parent].children[entry.slot] = index;
+            max_depth_ = std::max(max_depth_, entry.depth);
+
+            Source children[2];
+            if (entry.parent == kInvalidNode && FitsInLeaf(bvh, entry.source))
+            {
+                children[0] = entry.source;
+                children[1] = { kInvalidNode, 0, 0, Aabb() };
+            }
+            else
+                Expand(bvh, entry.source, children);
+
+            QuantizedBvhNode &node = nodes_[index];
+            Aabb frame = Union(children[0].bounds, children[1].bounds);
+            for (int axis = 0; axis < 3; ++axis)
+                QuantizeAxis(node, axis, frame, children);
+
+            node.counts = 0;
+            for (int i = 1; i >= 0; --i)
+            {
+                if (FitsInLeaf(bvh, children[i]))
+                {
+                    node.children[i] = QuantizedBvhNode::kLeafFlag | children[i].first;
+                    node.counts |= (uint8_t)(children[i].count << (4 * i));
+                }
+                else
+                {
+                    node.children[i] = kInvalidNode;
+                    stack.push_back(Entry{ children[i], index, i, entry.depth + 1 });
+                }
+            }
+        }
+    }
+}
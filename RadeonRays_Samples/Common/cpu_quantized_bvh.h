@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <string.h>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_buffer.h"
+#include "cpu_bvh.h"
+
+namespace Cpu
+{
+    // (float)i for every byte value, cheaper than the int to float conversion
+    // when decoding in the traversal loop
+    extern const std::array<float, 256> kQuantizedSteps;
+
+    // Interior node holding both child boxes as 8 bit offsets into a frame
+    // spanning the node's own bounds. Cells are powers of two so that
+    // origin + q * cell is exact up to the final rounding, and the stored
+    // integers are rounded outwards, so the decoded boxes always contain the
+    // full precision ones and traversal finds the same hits.
+    struct QuantizedBvhNode
+    {
+        static const uint32_t kLeafFlag = 0x80000000u;
+        static const uint32_t kMaxLeafSize = 15;
+
+        float    origin[3];
+        // Cell size per axis is 2^exponent
+        int8_t   exponent[3];
+        // Primitive count of a leaf child, low nibble for child 0
+        uint8_t  counts;
+        uint8_t  qmin[2][3];
+        uint8_t  qmax[2][3];
+        // Interior child node, or kLeafFlag | first primitive reference
+        uint32_t children[2];
+
+        bool     IsLeaf(int i) const { return (children[i] & kLeafFlag) != 0; }
+        uint32_t GetFirstPrim(int i) const { return children[i] & ~kLeafFlag; }
+        uint32_t GetPrimCount(int i) const { return (counts >> (4 * i)) & 0xf; }
+
+        // Exponents are kept in the normal float range, so the cell size is
+        // assembled directly from the exponent bits
+        float GetCellSize(int axis) const
+        {
+            uint32_t bits = (uint32_t)(exponent[axis] + 127) << 23;
+            float cell;
+            memcpy(&cell, &bits, sizeof(cell));
+            return cell;
+        }
+
+        // Decodes both child boxes
+        void GetChildBounds(Aabb bounds[2]) const
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float cell = GetCellSize(axis);
+                for (int i = 0; i < 2; ++i)
+                {
+                    bounds[i].pmin[axis] = origin[axis] + kQuantizedSteps[qmin[i][axis]] * cell;
+                    bounds[i].pmax[axis] = origin[axis] + kQuantizedSteps[qmax[i][axis]] * cell;
+                }
+            }
+        }
+    };
+
+    // Compressed copy of a Bvh. Leaves are folded into their parents, so only
+    // interior nodes are stored. Primitive references stay in the source Bvh.
+    class QuantizedBvh
+    {
+    public:
+        QuantizedBvh();
+
+        void Build(const Bvh &bvh);
+
+        size_t GetMemorySize() const { return nodes_.size() * sizeof(QuantizedBvhNode); }
+        uint32_t GetMaxDepth() const { return max_depth_; }
+
+        BufferVector<QuantizedBvhNode>  nodes_;
+        // Bounds of node 0 in full precision, tested before traversal starts
+        Aabb                            root_bounds_;
+
+    protected:
+        uint32_t                        max_depth_;
+    };
+}
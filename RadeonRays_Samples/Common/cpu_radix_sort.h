@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "cpu_parallel.h"
+
+namespace Cpu
+{
+    // Parallel LSD radix sort of (key, value) pairs, 8 bits per pass.
+    // Only the lowest key_bits bits of the keys take part in the ordering.
+    // The sort is stable, so equal keys keep their input order.
+    template <typename Key, typename Value>
+    void RadixSort(std::vector<Key> &keys, std::vector<Value> &values, int key_bits = int(sizeof(Key) * 8))
+    {
+        const size_t count = keys.size();
+        const size_t kRadix = 256;
+        const size_t chunk_count = std::max<size_t>(1, std::min<size_t>(GetWorkerCount(), count / 4096));
+        const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+        std::vector<Key> keys_tmp(count);
+        std::vector<Value> values_tmp(count);
+        std::vector<size_t> offsets(kRadix * chunk_count);
+
+        for (int shift = 0; shift < key_bits; shift += 8)
+        {
+            // Per chunk digit histograms
+            std::fill(offsets.begin(), offsets.end(), 0);
+            ParallelFor(0, chunk_count, 1, [&](size_t chunk_begin, size_t chunk_end)
+            {
+                for (size_t c = chunk_begin; c < chunk_end; ++c)
+                {
+                    size_t *histogram = &offsets[c * kRadix];
+                    size_t end = std::min(count, (c + 1) * chunk_size);
+                    for (size_t i = c * chunk_size; i < end; ++i)
+                        ++histogram[(keys[i] >> shift) & 0xff];
+                }
+            });
+
+            // Exclusive scan in (digit, chunk) order keeps the sort stable
+            size_t sum = 0;
+            for (size_t digit = 0; digit < kRadix; ++digit)
+            {
+                for (size_t c = 0; c < chunk_count; ++c)
+                {
+                    size_t value = offsets[c * kRadix + digit];
+                    offsets[c * kRadix + digit] = sum;
+                    sum += value;
+                }
+            }
+
+            // Scatter
+            ParallelFor(0, chunk_count, 1, [&](size_t chunk_begin, size_t chunk_end)
+            {
+                for (size_t c = chunk_begin; c < chunk_end; ++c)
+                {
+                    size_t *offset = &offsets[c * kRadix];
+                    size_t end = std::min(count, (c + 1) * chunk_size);
+                    for (size_t i = c * chunk_size; i < end; ++i)
+                    {
+                        size_t dst = offset[(keys[i] >> shift) & 0xff]++;
+                        keys_tmp[dst] = keys[i];
+                        values_tmp[dst] = values[i];
+                    }
+                }
+            });
+
+            std::swap(keys, keys_tmp);
+            std::swap(values, values_tmp);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#include "cpu_ray_queue.h"
+
+#include <algorithm>
+
+namespace Cpu
+{
+    static const uint32_t kNoBlock = ~0u;
+
+    RayQueue::RayQueue()
+        : block_size_(0)
+        , capacity_(0)
+        , next_block_(0)
+        , dropped_(0)
+    {
+    }
+
+    void RayQueue::Reset(uint32_t block_size, uint32_t block_count)
+    {
+        block_size_ = std::max(block_size, 1u);
+        capacity_ = block_count;
+        rays_.resize((size_t)block_size_ * block_count);
+        counts_.assign(block_count, 0);
+        next_block_.store(0, std::memory_order_relaxed);
+        dropped_.store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t RayQueue::GetBlockCount() const
+    {
+        return std::min(next_block_.load(std::memory_order_relaxed), capacity_);
+    }
+
+    size_t RayQueue::GetRayCount() const
+    {
+        size_t count = 0;
+        for (uint32_t b = 0; b < GetBlockCount(); ++b)
+            count += counts_[b];
+        return count;
+    }
+
+    RayQueue::Producer::Producer(RayQueue &queue)
+        : queue_(queue)
+        , block_(kNoBlock)
+        , size_(0)
+    {
+    }
+
+    Ray *RayQueue::Producer::Append(uint32_t count)
+    {
+        const uint32_t block_size = queue_.block_size_;
+        if (block_ == kNoBlock || size_ + count > block_size)
+        {
+            Flush();
+            // Past the capacity the counter only grows, GetBlockCount clamps it
+            uint32_t block = count <= block_size ? queue_.next_block_.fetch_add(1, std::memory_order_relaxed) : kNoBlock;
+            if (block >= queue_.capacity_)
+            {
+                queue_.dropped_.fetch_add(count, std::memory_order_relaxed);
+                return nullptr;
+            }
+            block_ = block;
+        }
+
+        Ray *rays = queue_.GetBlock(block_) + size_;
+        size_ += count;
+        return rays;
+    }
+
+    void RayQueue::Producer::Flush()
+    {
+        if (block_ != kNoBlock)
+            queue_.counts_[block_] = size_;
+        block_ = kNoBlock;
+        size_ = 0;
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "cpu_buffer.h"
+#include "cpu_intersector.h"
+
+namespace Cpu
+{
+    // Rays per block when nothing else is asked for, a few hundred keep the
+    // reservations rare and the partly filled blocks small
+    const uint32_t kRayQueueBlockSize = 256;
+
+    // Bounded queue of rays between two wavefront stages. ShadePrimaryRays
+    // appends through one atomic counter per hit, which has every thread
+    // fight over a single cache line. Here a producer reserves a whole block
+    // of rays with one atomic add and fills it without any further
+    // synchronization. Rays appended together stay adjacent in one block.
+    // The consuming stage runs after the producing one finished and reads
+    // whole blocks, rays [0, GetBlockRayCount(b)) of each.
+    class RayQueue
+    {
+        // Non-copyable
+        RayQueue(const RayQueue &) = delete;
+        RayQueue &operator =(const RayQueue &) = delete;
+
+    public:
+        RayQueue();
+
+        // Empties the queue and makes room for block_count blocks of
+        // block_size rays
+        void Reset(uint32_t block_size, uint32_t block_count);
+
+        // Appends for one thread, keeps the block it is filling. Flush, or
+        // destroy it, before the queue is read.
+        class Producer
+        {
+            // Non-copyable
+            Producer(const Producer &) = delete;
+            Producer &operator =(const Producer &) = delete;
+
+        public:
+            explicit Producer(RayQueue &queue);
+            ~Producer() { Flush(); }
+
+            // Room for count adjacent rays, reserves a new block when the
+            // current one has too little left. nullptr when the queue is
+            // full or count exceeds the block size, the rays are then
+            // counted as dropped.
+            Ray *Append(uint32_t count);
+
+            // Publishes the rays of the current block
+            void Flush();
+
+        private:
+            RayQueue    &queue_;
+            uint32_t    block_;
+            uint32_t    size_;
+        };
+
+        uint32_t GetBlockSize() const { return block_size_; }
+        // Blocks producers reserved
+        uint32_t GetBlockCount() const;
+        uint32_t GetBlockRayCount(uint32_t block) const { return counts_[block]; }
+        const Ray *GetBlock(uint32_t block) const { return &rays_[(size_t)block * block_size_]; }
+        Ray *GetBlock(uint32_t block) { return &rays_[(size_t)block * block_size_]; }
+        // Storage the blocks live in, block b starts at b * GetBlockSize()
+        const Ray *GetData() const { return rays_.data(); }
+        Ray *GetData() { return rays_.data(); }
+
+        // Rays in all blocks
+        size_t GetRayCount() const;
+        uint64_t GetDroppedRayCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+        BufferVector<Ray>       rays_;
+        std::vector<uint32_t>   counts_;
+        uint32_t                block_size_;
+        uint32_t                capacity_;
+        std::atomic<uint32_t>   next_block_;
+        std::atomic<uint64_t>   dropped_;
+    };
+}
@@ -0,0 +1,97 @@
+#include "cpu_ray_sort.h"
+#include "cpu_radix_sort.h"
+
+#include <algorithm>
+
+namespace Cpu
+{
+    // Spreads the lowest 10 bits of v three bits apart
+    static inline uint32_t ExpandBits(uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    static inline uint32_t Quantize(float v, float levels)
+    {
+        return (uint32_t)std::min(std::max(v * levels, 0.f), levels - 1.f);
+    }
+
+    RaySorter::RaySorter(int origin_bits)
+        : origin_bits_(std::min(std::max(origin_bits, 1), 9))
+    {
+    }
+
+    void RaySorter::Sort(const Ray *rays, size_t count)
+    {
+        // Bounds of the origins, a chunk per worker
+        const size_t chunk_count = std::max<size_t>(1, std::min<size_t>(GetWorkerCount(), count / 4096));
+        const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+        std::vector<Aabb> chunk_bounds(chunk_count);
+        ParallelFor(0, chunk_count, 1, [&](size_t chunk_begin, size_t chunk_end)
+        {
+            for (size_t c = chunk_begin; c < chunk_end; ++c)
+            {
+                const size_t end = std::min(count, (c + 1) * chunk_size);
+                for (size_t i = c * chunk_size; i < end; ++i)
+                    chunk_bounds[c].Grow(rays[i].o);
+            }
+        });
+        Aabb bounds;
+        for (auto &b : chunk_bounds)
+            bounds.Grow(b);
+
+        const Vec3 extent = bounds.Extent();
+        const Vec3 scale(extent.x > 0.f ? 1.f / extent.x : 0.f,
+                         extent.y > 0.f ? 1.f / extent.y : 0.f,
+                         extent.z > 0.f ? 1.f / extent.z : 0.f);
+        const float levels = (float)(1u << origin_bits_);
+        const int octant_shift = 3 * origin_bits_;
+
+        keys_.resize(count);
+        order_.resize(count);
+        ParallelFor(0, count, 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const Ray &ray = rays[i];
+                const Vec3 p = (ray.o - bounds.pmin) * scale;
+                const uint32_t code = (ExpandBits(Quantize(p.x, levels)) << 2) |
+                    (ExpandBits(Quantize(p.y, levels)) << 1) | ExpandBits(Quantize(p.z, levels));
+                const uint32_t octant = (ray.d.x < 0.f ? 4u : 0u) | (ray.d.y < 0.f ? 2u : 0u) | (ray.d.z < 0.f ? 1u : 0u);
+                keys_[i] = (octant << octant_shift) | code;
+                order_[i] = (uint32_t)i;
+            }
+        });
+
+        RadixSort(keys_, order_, octant_shift + 3);
+
+        rays_.resize(count);
+        ParallelFor(0, count, 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                rays_[i] = rays[order_[i]];
+        });
+    }
+
+    void RaySorter::QueryIntersection(const Intersector &intersector, const Ray *rays, size_t count, Intersection *hits,
+        TraversalMode mode)
+    {
+        Sort(rays, count);
+        hits_.resize(count);
+        intersector.QueryIntersection(rays_.data(), count, hits_.data(), nullptr, mode);
+        Scatter(hits_.data(), hits);
+    }
+
+    void RaySorter::QueryOcclusion(const Intersector &intersector, const Ray *rays, size_t count, int32_t *hits,
+        TraversalMode mode)
+    {
+        Sort(rays, count);
+        occlusion_hits_.resize(count);
+        intersector.QueryOcclusion(rays_.data(), count, occlusion_hits_.data(), nullptr, mode);
+        Scatter(occlusion_hits_.data(), hits);
+    }
+}
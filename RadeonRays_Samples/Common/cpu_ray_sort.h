@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "cpu_buffer.h"
+#include "cpu_intersector.h"
+#include "cpu_parallel.h"
+
+namespace Cpu
+{
+    // Reorders rays for coherent traversal before a query. Shading emits
+    // secondary rays in pixel order with random directions, so neighbouring
+    // rays visit unrelated parts of the tree. The sort key is the octant of
+    // the direction above the Morton code of the origin, quantized to
+    // origin_bits per axis within the bounds of all origins: rays next to
+    // each other in the sorted buffer start close together and point the
+    // same way. Results go back to the unsorted order through the sort's
+    // permutation, not padding[0], which only names the pixel, so the rays
+    // of a hit stay adjacent for the stages after the query.
+    class RaySorter
+    {
+    public:
+        // origin_bits is clamped to [1, 9], the key then fits 30 bits
+        explicit RaySorter(int origin_bits = 9);
+
+        int GetOriginBits() const { return origin_bits_; }
+
+        void Sort(const Ray *rays, size_t count);
+
+        const Ray *GetRays() const { return rays_.data(); }
+        size_t GetRayCount() const { return rays_.size(); }
+        // Unsorted index of every sorted ray
+        const uint32_t *GetOrder() const { return order_.data(); }
+
+        // results[GetOrder()[i]] = sorted_results[i]
+        template <typename T>
+        void Scatter(const T *sorted_results, T *results) const
+        {
+            ParallelFor(0, order_.size(), 4096, [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                    results[order_[i]] = sorted_results[i];
+            });
+        }
+
+        // Sort, query the sorted rays, scatter the results
+        void QueryIntersection(const Intersector &intersector, const Ray *rays, size_t count, Intersection *hits,
+            TraversalMode mode = TraversalMode::kSingleRay);
+        void QueryOcclusion(const Intersector &intersector, const Ray *rays, size_t count, int32_t *hits,
+            TraversalMode mode = TraversalMode::kSingleRay);
+
+    private:
+        int                         origin_bits_;
+        std::vector<uint32_t>       keys_;
+        std::vector<uint32_t>       order_;
+        BufferVector<Ray>           rays_;
+        // Results in sorted order
+        BufferVector<Intersection>  hits_;
+        BufferVector<int32_t>       occlusion_hits_;
+    };
+}
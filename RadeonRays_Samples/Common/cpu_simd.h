@@ -0,0 +1,330 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+
+#include "cpu_math.h"
+
+// AVX2 builds use one register per vector, SSE2 ones a pair
+#if defined(__AVX2__)
+#define CPU_AVX2 1
+#include <immintrin.h>
+#else
+#define CPU_AVX2 0
+#endif
+
+// Eight lane float and uint32 vectors for the shading code. Lanes follow the
+// IEEE single precision operations of the scalar code one for one, so a
+// vectorized routine written in the same order gives the same bits.
+namespace Cpu
+{
+    const int kSimdWidth = 8;
+
+    struct Vec8u;
+
+    struct Vec8f
+    {
+#if CPU_AVX2
+        __m256 v;
+#elif CPU_SSE2
+        __m128 lo, hi;
+#else
+        float v[8];
+#endif
+
+        Vec8f() {}
+        Vec8f(float s)
+        {
+#if CPU_AVX2
+            v = _mm256_set1_ps(s);
+#elif CPU_SSE2
+            lo = hi = _mm_set1_ps(s);
+#else
+            for (int i = 0; i < 8; ++i)
+                v[i] = s;
+#endif
+        }
+
+        static Vec8f Load(const float *p)
+        {
+            Vec8f r;
+#if CPU_AVX2
+            r.v = _mm256_loadu_ps(p);
+#elif CPU_SSE2
+            r.lo = _mm_loadu_ps(p);
+            r.hi = _mm_loadu_ps(p + 4);
+#else
+            memcpy(r.v, p, sizeof(r.v));
+#endif
+            return r;
+        }
+
+        void Store(float *p) const
+        {
+#if CPU_AVX2
+            _mm256_storeu_ps(p, v);
+#elif CPU_SSE2
+            _mm_storeu_ps(p, lo);
+            _mm_storeu_ps(p + 4, hi);
+#else
+            memcpy(p, v, sizeof(v));
+#endif
+        }
+    };
+
+    struct Vec8u
+    {
+#if CPU_AVX2
+        __m256i v;
+#elif CPU_SSE2
+        __m128i lo, hi;
+#else
+        uint32_t v[8];
+#endif
+
+        Vec8u() {}
+        Vec8u(uint32_t s)
+        {
+#if CPU_AVX2
+            v = _mm256_set1_epi32((int)s);
+#elif CPU_SSE2
+            lo = hi = _mm_set1_epi32((int)s);
+#else
+            for (int i = 0; i < 8; ++i)
+                v[i] = s;
+#endif
+        }
+
+        static Vec8u Load(const uint32_t *p)
+        {
+            Vec8u r;
+#if CPU_AVX2
+            r.v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+#elif CPU_SSE2
+            r.lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            r.hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 4));
+#else
+            memcpy(r.v, p, sizeof(r.v));
+#endif
+            return r;
+        }
+
+        void Store(uint32_t *p) const
+        {
+#if CPU_AVX2
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+#elif CPU_SSE2
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(p), lo);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(p + 4), hi);
+#else
+            memcpy(p, v, sizeof(v));
+#endif
+        }
+    };
+
+    // Lane-wise float arithmetic
+#if CPU_AVX2
+    inline Vec8f operator +(const Vec8f &a, const Vec8f &b) { Vec8f r; r.v = _mm256_add_ps(a.v, b.v); return r; }
+    inline Vec8f operator -(const Vec8f &a, const Vec8f &b) { Vec8f r; r.v = _mm256_sub_ps(a.v, b.v); return r; }
+    inline Vec8f operator *(const Vec8f &a, const Vec8f &b) { Vec8f r; r.v = _mm256_mul_ps(a.v, b.v); return r; }
+    inline Vec8f operator /(const Vec8f &a, const Vec8f &b) { Vec8f r; r.v = _mm256_div_ps(a.v, b.v); return r; }
+    inline Vec8f Sqrt(const Vec8f &a) { Vec8f r; r.v = _mm256_sqrt_ps(a.v); return r; }
+#elif CPU_SSE2
+    inline Vec8f operator +(const Vec8f &a, const Vec8f &b) { Vec8f r; r.lo = _mm_add_ps(a.lo, b.lo); r.hi = _mm_add_ps(a.hi, b.hi); return r; }
+    inline Vec8f operator -(const Vec8f &a, const Vec8f &b) { Vec8f r; r.lo = _mm_sub_ps(a.lo, b.lo); r.hi = _mm_sub_ps(a.hi, b.hi); return r; }
+    inline Vec8f operator *(const Vec8f &a, const Vec8f &b) { Vec8f r; r.lo = _mm_mul_ps(a.lo, b.lo); r.hi = _mm_mul_ps(a.hi, b.hi); return r; }
+    inline Vec8f operator /(const Vec8f &a, const Vec8f &b) { Vec8f r; r.lo = _mm_div_ps(a.lo, b.lo); r.hi = _mm_div_ps(a.hi, b.hi); return r; }
+    inline Vec8f Sqrt(const Vec8f &a) { Vec8f r; r.lo = _mm_sqrt_ps(a.lo); r.hi = _mm_sqrt_ps(a.hi); return r; }
+#else
+    inline Vec8f operator +(const Vec8f &a, const Vec8f &b) { Vec8f r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+    inline Vec8f operator -(const Vec8f &a, const Vec8f &b) { Vec8f r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+    inline Vec8f operator *(const Vec8f &a, const Vec8f &b) { Vec8f r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+    inline Vec8f operator /(const Vec8f &a, const Vec8f &b) { Vec8f r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] / b.v[i]; return r; }
+    inline Vec8f Sqrt(const Vec8f &a) { Vec8f r; for (int i = 0; i < 8; ++i) r.v[i] = std::sqrt(a.v[i]); return r; }
+#endif
+
+    // Flips the sign bit as scalar negation does, zeros included
+    inline Vec8f operator -(const Vec8f &a)
+    {
+        Vec8f r;
+#if CPU_AVX2
+        r.v = _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f));
+#elif CPU_SSE2
+        r.lo = _mm_xor_ps(a.lo, _mm_set1_ps(-0.f));
+        r.hi = _mm_xor_ps(a.hi, _mm_set1_ps(-0.f));
+#else
+        for (int i = 0; i < 8; ++i)
+            r.v[i] = -a.v[i];
+#endif
+        return r;
+    }
+
+    // Lane-wise uint32 arithmetic, wrapping like the scalar types
+#if CPU_AVX2
+    inline Vec8u operator +(const Vec8u &a, const Vec8u &b) { Vec8u r; r.v = _mm256_add_epi32(a.v, b.v); return r; }
+    inline Vec8u operator *(const Vec8u &a, const Vec8u &b) { Vec8u r; r.v = _mm256_mullo_epi32(a.v, b.v); return r; }
+    inline Vec8u operator ^(const Vec8u &a, const Vec8u &b) { Vec8u r; r.v = _mm256_xor_si256(a.v, b.v); return r; }
+    inline Vec8u operator &(const Vec8u &a, const Vec8u &b) { Vec8u r; r.v = _mm256_and_si256(a.v, b.v); return r; }
+    inline Vec8u operator >>(const Vec8u &a, int n) { Vec8u r; r.v = _mm256_srli_epi32(a.v, n); return r; }
+#elif CPU_SSE2
+    // SSE2 has no 32-bit low multiply, the even and odd lanes go through
+    // 32x32->64 multiplies
+    inline __m128i MulLo32(__m128i a, __m128i b)
+    {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+
+    inline Vec8u operator +(const Vec8u &a, const Vec8u &b) { Vec8u r; r.lo = _mm_add_epi32(a.lo, b.lo); r.hi = _mm_add_epi32(a.hi, b.hi); return r; }
+    inline Vec8u operator *(const Vec8u &a, const Vec8u &b) { Vec8u r; r.lo = MulLo32(a.lo, b.lo); r.hi = MulLo32(a.hi, b.hi); return r; }
+    inline Vec8u operator ^(const Vec8u &a, const Vec8u &b) { Vec8u r; r.lo = _mm_xor_si128(a.lo, b.lo); r.hi = _mm_xor_si128(a.hi, b.hi); return r; }
+    inline Vec8u operator &(const Vec8u &a, const Vec8u &b) { Vec8u r; r.lo = _mm_and_si128(a.lo, b.lo); r.hi = _mm_and_si128(a.hi, b.hi); return r; }
+    inline Vec8u operator >>(const Vec8u &a, int n) { Vec8u r; r.lo = _mm_srli_epi32(a.lo, n); r.hi = _mm_srli_epi32(a.hi, n); return r; }
+#else
+    inline Vec8u operator +(const Vec8u &a, const Vec8u &b) { Vec8u r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+    inline Vec8u operator *(const Vec8u &a, const Vec8u &b) { Vec8u r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+    inline Vec8u operator ^(const Vec8u &a, const Vec8u &b) { Vec8u r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] ^ b.v[i]; return r; }
+    inline Vec8u operator &(const Vec8u &a, const Vec8u &b) { Vec8u r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] & b.v[i]; return r; }
+    inline Vec8u operator >>(const Vec8u &a, int n) { Vec8u r; for (int i = 0; i < 8; ++i) r.v[i] = a.v[i] >> n; return r; }
+#endif
+
+    // Same rounding as the (float) cast of a uint32_t: both 16-bit halves
+    // convert exactly and the sum rounds once
+    inline Vec8f ToFloat(const Vec8u &a)
+    {
+        Vec8u lo = a & Vec8u(0xffffu);
+        Vec8u hi = a >> 16;
+        Vec8f r_lo, r_hi;
+#if CPU_AVX2
+        r_lo.v = _mm256_cvtepi32_ps(lo.v);
+        r_hi.v = _mm256_cvtepi32_ps(hi.v);
+#elif CPU_SSE2
+        r_lo.lo = _mm_cvtepi32_ps(lo.lo);
+        r_lo.hi = _mm_cvtepi32_ps(lo.hi);
+        r_hi.lo = _mm_cvtepi32_ps(hi.lo);
+        r_hi.hi = _mm_cvtepi32_ps(hi.hi);
+#else
+        for (int i = 0; i < 8; ++i)
+        {
+            r_lo.v[i] = (float)(int32_t)lo.v[i];
+            r_hi.v[i] = (float)(int32_t)hi.v[i];
+        }
+#endif
+        return r_hi * Vec8f(65536.f) + r_lo;
+    }
+
+    // Nearest integer of lanes in [0, 2^31), ties to even
+    inline Vec8u RoundToUint(const Vec8f &a)
+    {
+        Vec8u r;
+#if CPU_AVX2
+        r.v = _mm256_cvtps_epi32(a.v);
+#elif CPU_SSE2
+        r.lo = _mm_cvtps_epi32(a.lo);
+        r.hi = _mm_cvtps_epi32(a.hi);
+#else
+        for (int i = 0; i < 8; ++i)
+            r.v[i] = (uint32_t)std::nearbyint(a.v[i]);
+#endif
+        return r;
+    }
+
+    // Per lane a where mask is all ones, b where it is zero. Masks come from
+    // the comparisons below.
+    inline Vec8f Select(const Vec8u &mask, const Vec8f &a, const Vec8f &b)
+    {
+        Vec8f r;
+#if CPU_AVX2
+        __m256 m = _mm256_castsi256_ps(mask.v);
+        r.v = _mm256_or_ps(_mm256_and_ps(m, a.v), _mm256_andnot_ps(m, b.v));
+#elif CPU_SSE2
+        __m128 m_lo = _mm_castsi128_ps(mask.lo);
+        __m128 m_hi = _mm_castsi128_ps(mask.hi);
+        r.lo = _mm_or_ps(_mm_and_ps(m_lo, a.lo), _mm_andnot_ps(m_lo, b.lo));
+        r.hi = _mm_or_ps(_mm_and_ps(m_hi, a.hi), _mm_andnot_ps(m_hi, b.hi));
+#else
+        for (int i = 0; i < 8; ++i)
+            r.v[i] = mask.v[i] ? a.v[i] : b.v[i];
+#endif
+        return r;
+    }
+
+    // All ones in lanes where a > b
+    inline Vec8u operator >(const Vec8f &a, const Vec8f &b)
+    {
+        Vec8u r;
+#if CPU_AVX2
+        r.v = _mm256_castps_si256(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ));
+#elif CPU_SSE2
+        r.lo = _mm_castps_si128(_mm_cmpgt_ps(a.lo, b.lo));
+        r.hi = _mm_castps_si128(_mm_cmpgt_ps(a.hi, b.hi));
+#else
+        for (int i = 0; i < 8; ++i)
+            r.v[i] = a.v[i] > b.v[i] ? ~0u : 0u;
+#endif
+        return r;
+    }
+
+    // All ones in lanes where a is not zero
+    inline Vec8u NonZero(const Vec8u &a)
+    {
+        Vec8u r;
+#if CPU_AVX2
+        r.v = _mm256_xor_si256(_mm256_cmpeq_epi32(a.v, _mm256_setzero_si256()), _mm256_set1_epi32(-1));
+#elif CPU_SSE2
+        r.lo = _mm_xor_si128(_mm_cmpeq_epi32(a.lo, _mm_setzero_si128()), _mm_set1_epi32(-1));
+        r.hi = _mm_xor_si128(_mm_cmpeq_epi32(a.hi, _mm_setzero_si128()), _mm_set1_epi32(-1));
+#else
+        for (int i = 0; i < 8; ++i)
+            r.v[i] = a.v[i] ? ~0u : 0u;
+#endif
+        return r;
+    }
+
+    inline Vec8f Abs(const Vec8f &a)
+    {
+        return Select(Vec8f(0.f) > a, -a, a);
+    }
+
+    // Three component vectors of eight lanes each
+    struct Vec3x8
+    {
+        Vec8f x, y, z;
+
+        Vec3x8() {}
+        Vec3x8(const Vec8f &x_, const Vec8f &y_, const Vec8f &z_) : x(x_), y(y_), z(z_) {}
+    };
+
+    inline Vec3x8 operator +(const Vec3x8 &a, const Vec3x8 &b) { return Vec3x8(a.x + b.x, a.y + b.y, a.z + b.z); }
+    inline Vec3x8 operator *(const Vec3x8 &a, const Vec8f &s) { return Vec3x8(a.x * s, a.y * s, a.z * s); }
+    inline Vec8f Dot(const Vec3x8 &a, const Vec3x8 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    inline Vec3x8 Cross(const Vec3x8 &a, const Vec3x8 &b)
+    {
+        return Vec3x8(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+    inline Vec3x8 Normalize(const Vec3x8 &a) { return a * (Vec8f(1.f) / Sqrt(Dot(a, a))); }
+
+    // sin and cos of 2 pi t for t in [0, 1]. The argument is reduced in
+    // turns, which is exact, to a quarter turn around a multiple of pi / 2
+    // and evaluated with the single precision minimax polynomials of Cephes,
+    // within two ulp of std::sin and std::cos.
+    inline void SinCos2Pi(const Vec8f &t, Vec8f &s, Vec8f &c)
+    {
+        Vec8u quadrant = RoundToUint(t * Vec8f(4.f));
+        Vec8f x = (t - ToFloat(quadrant) * Vec8f(0.25f)) * Vec8f(6.28318530717958647692f);
+        Vec8f x2 = x * x;
+
+        Vec8f sin_x = x + x * x2 * (Vec8f(-1.6666654611e-1f) + x2 * (Vec8f(8.3321608736e-3f) + x2 * Vec8f(-1.9515295891e-4f)));
+        Vec8f cos_x = Vec8f(1.f) - Vec8f(0.5f) * x2 +
+            x2 * x2 * (Vec8f(4.166664568298827e-2f) + x2 * (Vec8f(-1.388731625493765e-3f) + x2 * Vec8f(2.443315711809948e-5f)));
+
+        // Quadrants 0 to 3 give (s, c), (c, -s), (-s, -c), (-c, s)
+        Vec8u swap = NonZero(quadrant & Vec8u(1u));
+        Vec8f sin_r = Select(swap, cos_x, sin_x);
+        Vec8f cos_r = Select(swap, sin_x, cos_x);
+        s = Select(NonZero(quadrant & Vec8u(2u)), -sin_r, sin_r);
+        c = Select(NonZero((quadrant + Vec8u(1u)) & Vec8u(2u)), -cos_r, cos_r);
+    }
+}
@@ -0,0 +1,64 @@
+#include "cpu_triangle_block.h"
+#include "cpu_parallel.h"
+
+#include <string.h>
+
+namespace Cpu
+{
+    void TriangleBlocks::Build(const std::vector<TriangleLeaf> &leaves, const BufferVector<uint32_t> &prim_indices,
+        const std::vector<Vec3> &positions, const std::vector<uint32_t> &indices)
+    {
+        Clear();
+        leaf_blocks_.resize(prim_indices.size(), 0);
+
+        // Block offsets first, then every leaf fills its own blocks
+        uint32_t block_count = 0;
+        for (auto &leaf : leaves)
+        {
+            if (leaf.count == 0)
+                continue;
+            leaf_blocks_[leaf.first] = block_count;
+            block_count += (leaf.count + kTriangleBlockWidth - 1) / kTriangleBlockWidth;
+        }
+        blocks_.resize(block_count);
+
+        ParallelFor(0, leaves.size(), 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t l = begin; l < end; ++l)
+            {
+                const TriangleLeaf &leaf = leaves[l];
+                if (leaf.count == 0)
+                    continue;
+
+                TriangleBlock *block = &blocks_[leaf_blocks_[leaf.first]];
+                for (uint32_t i = 0; i < leaf.count; i += kTriangleBlockWidth, ++block)
+                {
+                    memset(block, 0, sizeof(TriangleBlock));
+                    for (int lane = 0; lane < kTriangleBlockWidth; ++lane)
+                    {
+                        if (i + lane >= leaf.count)
+                        {
+                            block->triangles[lane] = kNoTriangle;
+                            continue;
+                        }
+
+                        uint32_t triangle = prim_indices[leaf.first + i + lane];
+                        block->triangles[lane] = triangle;
+                        for (int k = 0; k < 3; ++k)
+                        {
+                            const Vec3 &p = positions[indices[3 * triangle + k]];
+                            for (int axis = 0; axis < 3; ++axis)
+                                block->v[k][axis][lane] = p[axis];
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    void TriangleBlocks::Clear()
+    {
+        blocks_.clear();
+        leaf_blocks_.clear();
+    }
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_buffer.h"
+
+namespace Cpu
+{
+    // Triangles tested together, four matches SSE2
+    const int kTriangleBlockWidth = 4;
+    const uint32_t kNoTriangle = 0xffffffffu;
+
+    // Vertices of up to kTriangleBlockWidth triangles, one lane per triangle.
+    // Unused lanes are degenerate and never hit.
+    struct TriangleBlock
+    {
+        // Vertex k of lane i is (v[k][0][i], v[k][1][i], v[k][2][i])
+        float    v[3][3][kTriangleBlockWidth];
+        // Triangle index per lane, kNoTriangle for unused lanes
+        uint32_t triangles[kTriangleBlockWidth];
+    };
+
+    // Ray setup for the watertight test of Woop et al. 2013: vertices are moved
+    // to the ray origin and sheared so the ray runs along +z, edge functions
+    // are then evaluated in 2D and neighbouring triangles share them exactly.
+    struct WatertightRay
+    {
+        Vec3  o;
+        // Axis the direction is largest along, and the two others
+        int   kx;
+        int   ky;
+        int   kz;
+        // Shear and scale taking the direction to +z
+        float sx;
+        float sy;
+        float sz;
+    };
+
+    inline WatertightRay MakeWatertightRay(const Vec3 &o, const Vec3 &d)
+    {
+        WatertightRay ray;
+        ray.o = o;
+        Vec3 a(std::fabs(d.x), std::fabs(d.y), std::fabs(d.z));
+        ray.kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        ray.kx = ray.kz == 2 ? 0 : ray.kz + 1;
+        ray.ky = ray.kx == 2 ? 0 : ray.kx + 1;
+        // Keep the winding
+        if (d[ray.kz] < 0.f)
+            std::swap(ray.kx, ray.ky);
+        ray.sx = d[ray.kx] / d[ray.kz];
+        ray.sy = d[ray.ky] / d[ray.kz];
+        ray.sz = 1.f / d[ray.kz];
+        return ray;
+    }
+
+    // Tests all lanes, returns the lane of the closest hit in (0, tmax) or -1.
+    // u and v are the weights of the second and third vertex.
+    inline int IntersectTriangleBlock(const TriangleBlock &block, const WatertightRay &ray, float tmax,
+        float &t, float &u, float &v)
+    {
+#if CPU_SSE2
+        const __m128 ox = _mm_set1_ps(ray.o[ray.kx]);
+        const __m128 oy = _mm_set1_ps(ray.o[ray.ky]);
+        const __m128 oz = _mm_set1_ps(ray.o[ray.kz]);
+        const __m128 sx = _mm_set1_ps(ray.sx);
+        const __m128 sy = _mm_set1_ps(ray.sy);
+        const __m128 sz = _mm_set1_ps(ray.sz);
+
+        // Vertices relative to the origin, sheared
+        __m128 x[3], y[3], z[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128 vz = _mm_sub_ps(_mm_loadu_ps(block.v[k][ray.kz]), oz);
+            x[k] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(block.v[k][ray.kx]), ox), _mm_mul_ps(sx, vz));
+            y[k] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(block.v[k][ray.ky]), oy), _mm_mul_ps(sy, vz));
+            z[k] = _mm_mul_ps(sz, vz);
+        }
+
+        // Edge functions, each one is the weight of the opposite vertex
+        __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+        __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+        __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+        // Inside when no edge function has the opposite sign of another, zero
+        // counts as inside so a ray through an edge hits both neighbours
+        const __m128 zero = _mm_setzero_ps();
+        __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+        __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+        __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+        __m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+        if (_mm_movemask_ps(valid) == 0)
+            return -1;
+
+        // Distance scaled by det, compared with the sign of det removed
+        __m128 scaled_t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])), _mm_mul_ps(e2, z[2]));
+        const __m128 sign_mask = _mm_set1_ps(-0.f);
+        __m128 det_sign = _mm_and_ps(det, sign_mask);
+        __m128 abs_det = _mm_xor_ps(det, det_sign);
+        __m128 signed_t = _mm_xor_ps(scaled_t, det_sign);
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(signed_t, zero));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(signed_t, _mm_mul_ps(_mm_set1_ps(tmax), abs_det)));
+        int mask = _mm_movemask_ps(valid);
+        if (mask == 0)
+            return -1;
+
+        // Closest valid lane, the others are pushed to infinity
+        __m128 lane_t = _mm_div_ps(scaled_t, det);
+        lane_t = _mm_or_ps(_mm_and_ps(valid, lane_t), _mm_andnot_ps(valid, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+        __m128 closest = _mm_min_ps(lane_t, _mm_shuffle_ps(lane_t, lane_t, _MM_SHUFFLE(2, 3, 0, 1)));
+        closest = _mm_min_ps(closest, _mm_shuffle_ps(closest, closest, _MM_SHUFFLE(1, 0, 3, 2)));
+        mask &= _mm_movemask_ps(_mm_cmpeq_ps(lane_t, closest));
+        int hit = 0;
+        while ((mask & (1 << hit)) == 0)
+            ++hit;
+
+        float lane_det[kTriangleBlockWidth], lane_e1[kTriangleBlockWidth], lane_e2[kTriangleBlockWidth];
+        _mm_storeu_ps(lane_det, det);
+        _mm_storeu_ps(lane_e1, e1);
+        _mm_storeu_ps(lane_e2, e2);
+        t = _mm_cvtss_f32(closest);
+        float inv_det = 1.f / lane_det[hit];
+        u = lane_e1[hit] * inv_det;
+        v = lane_e2[hit] * inv_det;
+        return hit;
+#else
+        int hit = -1;
+        for (int i = 0; i < kTriangleBlockWidth; ++i)
+        {
+            float x[3], y[3], z[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                float vz = block.v[k][ray.kz][i] - ray.o[ray.kz];
+                x[k] = block.v[k][ray.kx][i] - ray.o[ray.kx] - ray.sx * vz;
+                y[k] = block.v[k][ray.ky][i] - ray.o[ray.ky] - ray.sy * vz;
+                z[k] = ray.sz * vz;
+            }
+
+            float e0 = x[2] * y[1] - y[2] * x[1];
+            float e1 = x[0] * y[2] - y[0] * x[2];
+            float e2 = x[1] * y[0] - y[1] * x[0];
+            if ((e0 < 0.f || e1 < 0.f || e2 < 0.f) && (e0 > 0.f || e1 > 0.f || e2 > 0.f))
+                continue;
+
+            float det = e0 + e1 + e2;
+            if (det == 0.f)
+                continue;
+
+            float scaled_t = e0 * z[0] + e1 * z[1] + e2 * z[2];
+            float abs_det = std::fabs(det);
+            float signed_t = det < 0.f ? -scaled_t : scaled_t;
+            if (signed_t <= 0.f || signed_t >= tmax * abs_det)
+                continue;
+
+            float inv_det = 1.f / det;
+            hit = i;
+            tmax = t = scaled_t * inv_det;
+            u = e1 * inv_det;
+            v = e2 * inv_det;
+        }
+        return hit;
+#endif
+    }
+
+    // Leaf given as a range of primitive references
+    struct TriangleLeaf
+    {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // Copy of the leaf triangles in blocks. Every leaf owns whole blocks, so
+    // a leaf test reads consecutive memory and no indices.
+    class TriangleBlocks
+    {
+    public:
+        // Triangles are positions[indices[3 * i + k]] for i = prim_indices[r]
+        // and r in a leaf's range. Ranges may not overlap.
+        void Build(const std::vector<TriangleLeaf> &leaves, const BufferVector<uint32_t> &prim_indices,
+            const std::vector<Vec3> &positions, const std::vector<uint32_t> &indices);
+
+        void Clear();
+        bool IsEmpty() const { return blocks_.empty(); }
+        size_t GetMemorySize() const
+        {
+            return blocks_.size() * sizeof(TriangleBlock) + leaf_blocks_.size() * sizeof(uint32_t);
+        }
+
+        // Blocks of the leaf whose references start at first
+        const TriangleBlock *GetLeafBlocks(uint32_t first) const { return &blocks_[leaf_blocks_[first]]; }
+
+        BufferVector<TriangleBlock> blocks_;
+        // First block of a leaf, indexed by the leaf's first reference
+        BufferVector<uint32_t>      leaf_blocks_;
+    };
+}
@@ -0,0 +1,753 @@
+#include "cpu_workload.h"
+#include "cpu_parallel.h"
+#include "cpu_simd.h"
+
+#include <random>
+
+namespace Cpu
+{
+    static const float kPi = 3.14159265358979323846f;
+
+    // Sampler from sampler.cl
+    static inline uint32_t WangHash(uint32_t seed)
+    {
+        seed = (seed ^ 61) ^ (seed >> 16);
+        seed *= 9;
+        seed = seed ^ (seed >> 4);
+        seed *= 0x27d4eb2d;
+        seed = seed ^ (seed >> 15);
+        return seed;
+    }
+
+    static inline float Sample1D(uint32_t &index)
+    {
+        index = WangHash(1664525U * index + 1013904223U);
+        return (float)index / 0xffffffffU;
+    }
+
+    // GetOrthoVector from utils.cl
+    static inline Vec3 GetOrthoVector(const Vec3 &n)
+    {
+        Vec3 p;
+        if (std::fabs(n.z) > 0.f)
+        {
+            float k = std::sqrt(n.y * n.y + n.z * n.z);
+            p = Vec3(0.f, -n.z / k, n.y / k);
+        }
+        else
+        {
+            float k = std::sqrt(n.x * n.x + n.y * n.y);
+            p = Vec3(n.y / k, -n.x / k, 0.f);
+        }
+        return Normalize(p);
+    }
+
+    // Sample_MapToHemisphere from sampler.cl with a zero cos power
+    static inline Vec3 MapToHemisphere(float r1, float r2, const Vec3 &n)
+    {
+        Vec3 u = GetOrthoVector(n);
+        Vec3 v = Cross(u, n);
+        u = Cross(n, v);
+
+        float sinpsi = std::sin(2.f * kPi * r1);
+        float cospsi = std::cos(2.f * kPi * r1);
+        float costheta = 1.f - r2;
+        float sintheta = std::sqrt(1.f - costheta * costheta);
+
+        return Normalize(u * sintheta * cospsi + v * sintheta * sinpsi + n * costheta);
+    }
+
+    // Barycentric position and normal of a hit, as the shading kernels compute them
+    static inline void InterpolateHit(const Scene &scene, const Intersection &hit, Vec3 &pos, Vec3 &normal)
+    {
+        const Mesh &mesh = scene.meshes_[hit.shapeid];
+        const uint32_t stride = mesh.vertex_stride_ / sizeof(float);
+        const float *v0 = &mesh.vertices_[stride * mesh.indices_[3 * hit.primid + 0]];
+        const float *v1 = &mesh.vertices_[stride * mesh.indices_[3 * hit.primid + 1]];
+        const float *v2 = &mesh.vertices_[stride * mesh.indices_[3 * hit.primid + 2]];
+
+        float w0 = 1.f - hit.uvwt[0] - hit.uvwt[1];
+        float w1 = hit.uvwt[0];
+        float w2 = hit.uvwt[1];
+        pos = Vec3(w0 * v0[0] + w1 * v1[0] + w2 * v2[0],
+                   w0 * v0[1] + w1 * v1[1] + w2 * v2[1],
+                   w0 * v0[2] + w1 * v1[2] + w2 * v2[2]);
+        normal = Vec3(w0 * v0[3] + w1 * v1[3] + w2 * v2[3],
+                      w0 * v0[4] + w1 * v1[4] + w2 * v2[4],
+                      w0 * v0[5] + w1 * v1[5] + w2 * v2[5]);
+    }
+
+    Camera GetSponzaCamera()
+    {
+        Camera camera;
+        camera.eye = Vec3(-11.f, 111.f, -54.f);
+        camera.center = Vec3(-9.f, 111.f, -54.f);
+        camera.up = Vec3(0.f, 1.f, 0.f);
+        return camera;
+    }
+
+    Camera GetProceduralCamera()
+    {
+        Camera camera;
+        camera.eye = Vec3(0.f, 40.f, -160.f);
+        camera.center = Vec3(0.f, 5.f, 0.f);
+        camera.up = Vec3(0.f, 1.f, 0.f);
+        return camera;
+    }
+
+    // Camera basis and image size, shared by the frame and tile ray generators
+    struct CameraFrame
+    {
+        Vec3    eye;
+        Vec3    forward;
+        Vec3    right;
+        Vec3    up;
+        float   tan_half_fovy;
+        float   aspect;
+        int     w;
+        int     h;
+    };
+
+    static CameraFrame MakeCameraFrame(const Camera &camera, int w, int h)
+    {
+        // Left handed basis as in lookat_lh_dx
+        CameraFrame frame;
+        frame.eye = camera.eye;
+        frame.forward = Normalize(camera.center - camera.eye);
+        frame.right = Normalize(Cross(camera.up, frame.forward));
+        frame.up = Cross(frame.forward, frame.right);
+        frame.tan_half_fovy = std::tan(camera.fovy * kPi / 360.f);
+        frame.aspect = (float)w / (float)h;
+        frame.w = w;
+        frame.h = h;
+        return frame;
+    }
+
+    static inline void MakeCameraRay(const CameraFrame &frame, size_t gid, Ray &ray)
+    {
+        float ndc_x = 2.f * ((float)(gid % frame.w) + 0.5f) / frame.w - 1.f;
+        float ndc_y = 1.f - 2.f * ((float)(gid / frame.w) + 0.5f) / frame.h;
+
+        ray.o = frame.eye;
+        ray.maxt = 100000.f;
+        ray.d = Normalize(frame.forward + frame.right * (ndc_x * frame.tan_half_fovy * frame.aspect) +
+            frame.up * (ndc_y * frame.tan_half_fovy));
+        ray.time = 0.f;
+        ray.extra[0] = -1;
+        ray.extra[1] = -1;
+        ray.padding[0] = (int32_t)gid;
+        ray.padding[1] = 0;
+    }
+
+    // Same as the GenerateCameraRays kernel, pixel id goes to padding[0]
+    void GenerateCameraRays(const Camera &camera, int w, int h, RayBuffer &rays)
+    {
+        const CameraFrame frame = MakeCameraFrame(camera, w, h);
+        rays.resize((size_t)w * h);
+        ParallelFor(0, rays.size(), 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t gid = begin; gid < end; ++gid)
+                MakeCameraRay(frame, gid, rays[gid]);
+        });
+    }
+
+    // Hits shaded together by ShadingMode::kSimd, one per lane. Vertices are
+    // gathered lane by lane, everything after runs kSimdWidth wide.
+    struct HitBatch
+    {
+        // Position and normal of the three vertices, component by lane
+        float       vertices[3][6][kSimdWidth];
+        float       barycentrics[2][kSimdWidth];
+        uint32_t    sampler[kSimdWidth];
+        int32_t     pixel[kSimdWidth];
+        uint32_t    first_ray[kSimdWidth];
+        int         count;
+        // Scratch for ShadeAoBatch
+        BufferVector<float> directions;
+
+        explicit HitBatch(const BufferAllocator<float> &allocator = BufferAllocator<float>())
+            : count(0)
+            , directions(allocator)
+        {
+        }
+    };
+
+    static inline void AddToBatch(const Scene &scene, const Intersection &hit, uint32_t sampler, int32_t pixel,
+        uint32_t first_ray, HitBatch &batch)
+    {
+        const Mesh &mesh = scene.meshes_[hit.shapeid];
+        const uint32_t stride = mesh.vertex_stride_ / sizeof(float);
+        const int lane = batch.count++;
+        for (int v = 0; v < 3; ++v)
+        {
+            const float *vertex = &mesh.vertices_[stride * mesh.indices_[3 * hit.primid + v]];
+            for (int c = 0; c < 6; ++c)
+                batch.vertices[v][c][lane] = vertex[c];
+        }
+        batch.barycentrics[0][lane] = hit.uvwt[0];
+        batch.barycentrics[1][lane] = hit.uvwt[1];
+        batch.sampler[lane] = sampler;
+        batch.pixel[lane] = pixel;
+        batch.first_ray[lane] = first_ray;
+    }
+
+    static inline Vec8u WangHash(const Vec8u &seed)
+    {
+        Vec8u s = (seed ^ Vec8u(61u)) ^ (seed >> 16);
+        s = s * Vec8u(9u);
+        s = s ^ (s >> 4);
+        s = s * Vec8u(0x27d4eb2du);
+        return s ^ (s >> 15);
+    }
+
+    static inline Vec8f Sample1D(Vec8u &index)
+    {
+        index = WangHash(Vec8u(1664525u) * index + Vec8u(1013904223u));
+        return ToFloat(index) / Vec8f((float)0xffffffffU);
+    }
+
+    // InterpolateHit, GetOrthoVector and MapToHemisphere over a batch, in the
+    // operation order of the scalar code. Unused lanes repeat lane 0.
+    static void ShadeAoBatch(HitBatch &batch, int rays_per_hit, Ray *ao_rays)
+    {
+        for (int lane = batch.count; lane < kSimdWidth; ++lane)
+        {
+            for (int v = 0; v < 3; ++v)
+                for (int c = 0; c < 6; ++c)
+                    batch.vertices[v][c][lane] = batch.vertices[v][c][0];
+            batch.barycentrics[0][lane] = batch.barycentrics[0][0];
+            batch.barycentrics[1][lane] = batch.barycentrics[1][0];
+            batch.sampler[lane] = batch.sampler[0];
+        }
+
+        Vec8f w1 = Vec8f::Load(batch.barycentrics[0]);
+        Vec8f w2 = Vec8f::Load(batch.barycentrics[1]);
+        Vec8f w0 = Vec8f(1.f) - w1 - w2;
+        Vec8f attributes[6];
+        for (int c = 0; c < 6; ++c)
+        {
+            attributes[c] = w0 * Vec8f::Load(batch.vertices[0][c]) + w1 * Vec8f::Load(batch.vertices[1][c]) +
+                w2 * Vec8f::Load(batch.vertices[2][c]);
+        }
+        Vec3x8 pos(attributes[0], attributes[1], attributes[2]);
+        Vec3x8 n(attributes[3], attributes[4], attributes[5]);
+
+        // Both branches of GetOrthoVector, the one not taken is discarded
+        Vec8u use_z = Abs(n.z) > Vec8f(0.f);
+        Vec8f k_z = Sqrt(n.y * n.y + n.z * n.z);
+        Vec8f k_x = Sqrt(n.x * n.x + n.y * n.y);
+        Vec3x8 p(Select(use_z, Vec8f(0.f), n.y / k_x),
+                 Select(use_z, -n.z / k_z, -n.x / k_x),
+                 Select(use_z, n.y / k_z, Vec8f(0.f)));
+        Vec3x8 u = Normalize(p);
+        Vec3x8 v = Cross(u, n);
+        u = Cross(n, v);
+
+        float origin[3][kSimdWidth];
+        Vec3x8 o = pos + n * Vec8f(0.001f);
+        o.x.Store(origin[0]);
+        o.y.Store(origin[1]);
+        o.z.Store(origin[2]);
+
+        // Directions by ray and lane, written out hit by hit so the rays of
+        // a hit go to memory in order
+        batch.directions.resize((size_t)rays_per_hit * 3 * kSimdWidth);
+        Vec8u sampler = Vec8u::Load(batch.sampler);
+        for (int a = 0; a < rays_per_hit; ++a)
+        {
+            Vec8f r1 = Sample1D(sampler);
+            Vec8f r2 = Sample1D(sampler);
+
+            Vec8f sinpsi, cospsi;
+            SinCos2Pi(r1, sinpsi, cospsi);
+            Vec8f costheta = Vec8f(1.f) - r2;
+            Vec8f sintheta = Sqrt(Vec8f(1.f) - costheta * costheta);
+            Vec3x8 d = Normalize(u * sintheta * cospsi + v * sintheta * sinpsi + n * costheta);
+
+            float *direction = &batch.directions[(size_t)a * 3 * kSimdWidth];
+            d.x.Store(direction);
+            d.y.Store(direction + kSimdWidth);
+            d.z.Store(direction + 2 * kSimdWidth);
+        }
+
+        for (int lane = 0; lane < batch.count; ++lane)
+        {
+            Ray *rays = ao_rays + batch.first_ray[lane];
+            for (int a = 0; a < rays_per_hit; ++a)
+            {
+                const float *direction = &batch.directions[(size_t)a * 3 * kSimdWidth];
+                Ray &ray = rays[a];
+                ray.o = Vec3(origin[0][lane], origin[1][lane], origin[2][lane]);
+                ray.maxt = 100.f;
+                ray.d = Vec3(direction[lane], direction[kSimdWidth + lane], direction[2 * kSimdWidth + lane]);
+                ray.time = 0.f;
+                ray.extra[0] = -1;
+                ray.extra[1] = -1;
+                ray.padding[0] = batch.pixel[lane];
+                ray.padding[1] = 0;
+            }
+        }
+        batch.count = 0;
+    }
+
+    const char *GetShadingModeName(ShadingMode mode)
+    {
+        switch (mode)
+        {
+        case ShadingMode::kScalar:
+            return "scalar";
+        case ShadingMode::kSimd:
+            return "simd";
+        }
+        return "unknown";
+    }
+
+    bool ParseShadingMode(const char *name, ShadingMode &mode)
+    {
+        for (auto m : { ShadingMode::kScalar, ShadingMode::kSimd })
+        {
+            if (strcmp(name, GetShadingModeName(m)) == 0)
+            {
+                mode = m;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const uint32_t kNoSlot = ~0u;
+
+    // AO rays of hits [begin, end) to ao_rays + slot(i), hit i being work
+    // item gid_base + i of ShadePrimaryRays. Empty hits have no rays, hits
+    // whose slot is kNoSlot are skipped.
+    template <typename SlotFunc>
+    static void ShadeAoHits(const Scene &scene, const Ray *primary_rays, const Intersection *hits,
+        SlotFunc slot, size_t begin, size_t end, size_t gid_base, int rays_per_hit, int frame_no,
+        Ray *ao_rays, ShadingMode mode, HitBatch &batch)
+    {
+        if (mode == ShadingMode::kSimd)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const Intersection &hit = hits[i];
+                if (hit.shapeid == kInvalidId)
+                    continue;
+                const uint32_t first_ray = slot(i);
+                if (first_ray == kNoSlot)
+                    continue;
+
+                AddToBatch(scene, hit, (uint32_t)(gid_base + i) + (uint32_t)frame_no, primary_rays[i].padding[0],
+                    first_ray, batch);
+                if (batch.count == kSimdWidth)
+                    ShadeAoBatch(batch, rays_per_hit, ao_rays);
+            }
+            if (batch.count > 0)
+                ShadeAoBatch(batch, rays_per_hit, ao_rays);
+            return;
+        }
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            const Intersection &hit = hits[i];
+            if (hit.shapeid == kInvalidId)
+                continue;
+            const uint32_t first_ray = slot(i);
+            if (first_ray == kNoSlot)
+                continue;
+
+            Vec3 pos, normal;
+            InterpolateHit(scene, hit, pos, normal);
+
+            uint32_t sampler = (uint32_t)(gid_base + i) + (uint32_t)frame_no;
+            for (int a = 0; a < rays_per_hit; ++a)
+            {
+                float r1 = Sample1D(sampler);
+                float r2 = Sample1D(sampler);
+
+                Ray &ray = ao_rays[first_ray + a];
+                ray.o = pos + normal * 0.001f;
+                ray.maxt = 100.f;
+                ray.d = MapToHemisphere(r1, r2, normal);
+                ray.time = 0.f;
+                ray.extra[0] = -1;
+                ray.extra[1] = -1;
+                ray.padding[0] = primary_rays[i].padding[0];
+                ray.padding[1] = 0;
+            }
+        }
+    }
+
+    // Output slots in hit order, where the kernel uses an atomic counter.
+    // Returns the number of rays.
+    static uint32_t CountAoRays(const Intersection *hits, size_t count, int rays_per_hit, uint32_t *offsets)
+    {
+        uint32_t ray_count = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            offsets[i] = ray_count;
+            if (hits[i].shapeid != kInvalidId)
+                ray_count += rays_per_hit;
+        }
+        return ray_count;
+    }
+
+    // Same as ShadePrimaryRays in ambient_occlusion.cl
+    void GenerateAoRays(const Scene &scene, const RayBuffer &primary_rays, const HitBuffer &hits,
+        int rays_per_hit, int frame_no, RayBuffer &ao_rays, ShadingMode mode)
+    {
+        // Scratch comes from where ao_rays does, a FrameArena if it has one
+        BufferVector<uint32_t> offsets(hits.size(), ao_rays.get_allocator());
+        ao_rays.resize(CountAoRays(hits.data(), hits.size(), rays_per_hit, offsets.data()));
+        ParallelFor(0, hits.size(), 4096, [&](size_t begin, size_t end)
+        {
+            HitBatch batch(ao_rays.get_allocator());
+            ShadeAoHits(scene, primary_rays.data(), hits.data(), [&](size_t i) { return offsets[i]; }, begin, end, 0,
+                rays_per_hit, frame_no, ao_rays.data(), mode, batch);
+        });
+    }
+
+    void GenerateAoRays(const Scene &scene, const RayBuffer &primary_rays, const HitBuffer &hits,
+        int rays_per_hit, int frame_no, RayQueue &ao_rays, uint32_t block_size, ShadingMode mode)
+    {
+        if (rays_per_hit <= 0)
+            return;
+
+        // Every chunk leaves at most one block partly filled, past the ones
+        // packed with whole hits
+        const size_t kGrain = 4096;
+        block_size = std::max(block_size, (uint32_t)rays_per_hit);
+        const size_t hits_per_block = block_size / rays_per_hit;
+        const size_t block_count = (hits.size() + hits_per_block - 1) / hits_per_block + (hits.size() + kGrain - 1) / kGrain;
+        ao_rays.Reset(block_size, (uint32_t)block_count);
+
+        Ray *storage = ao_rays.GetData();
+        ParallelFor(0, hits.size(), kGrain, [&](size_t begin, size_t end)
+        {
+            RayQueue::Producer producer(ao_rays);
+            HitBatch batch;
+            auto slot = [&](size_t)
+            {
+                Ray *rays = producer.Append((uint32_t)rays_per_hit);
+                return rays ? (uint32_t)(rays - storage) : kNoSlot;
+            };
+            ShadeAoHits(scene, primary_rays.data(), hits.data(), slot, begin, end, 0, rays_per_hit, frame_no, storage,
+                mode, batch);
+        });
+    }
+
+    void QueryOcclusion(const Intersector &intersector, const RayQueue &rays, int32_t *hits, TraversalMode mode)
+    {
+        const uint32_t block_size = rays.GetBlockSize();
+        ParallelFor(0, rays.GetBlockCount(), std::max<uint32_t>(1, 1024 / std::max(block_size, 1u)), [&](size_t begin, size_t end)
+        {
+            for (size_t b = begin; b < end; ++b)
+            {
+                intersector.QueryOcclusion(rays.GetBlock((uint32_t)b), rays.GetBlockRayCount((uint32_t)b),
+                    hits + b * block_size, nullptr, mode);
+            }
+        });
+    }
+
+    // ProcessAO for the rays of hits [begin, end)
+    static void AccumulateAoHits(const Ray *ao_rays, const int32_t *occlusion_hits, size_t begin, size_t end,
+        int rays_per_hit, Rgba *accum)
+    {
+        for (size_t h = begin; h < end; ++h)
+        {
+            // Integer counts vectorize and are exact, as the float sums were
+            const size_t first = h * rays_per_hit;
+            int32_t unoccluded = 0;
+            for (int a = 0; a < rays_per_hit; ++a)
+                unoccluded += occlusion_hits[first + a] == kMissMarker ? 1 : 0;
+
+            Rgba &pixel = accum[ao_rays[first].padding[0]];
+#if CPU_SSE2
+            __m128 sample = _mm_setr_ps((float)unoccluded, (float)unoccluded, (float)unoccluded, (float)rays_per_hit);
+            _mm_storeu_ps(&pixel.r, _mm_add_ps(_mm_loadu_ps(&pixel.r), sample));
+#else
+            pixel.r += (float)unoccluded;
+            pixel.g += (float)unoccluded;
+            pixel.b += (float)unoccluded;
+            pixel.a += (float)rays_per_hit;
+#endif
+        }
+    }
+
+    void AccumulateAo(const RayBuffer &ao_rays, const int32_t *occlusion_hits, int rays_per_hit, AccumBuffer &accum)
+    {
+        if (rays_per_hit <= 0)
+            return;
+        const size_t hit_count = ao_rays.size() / rays_per_hit;
+        ParallelFor(0, hit_count, 4096, [&](size_t begin, size_t end)
+        {
+            AccumulateAoHits(ao_rays.data(), occlusion_hits, begin, end, rays_per_hit, accum.data());
+        });
+    }
+
+    void AccumulateAo(const RayQueue &ao_rays, const int32_t *occlusion_hits, int rays_per_hit, AccumBuffer &accum)
+    {
+        if (rays_per_hit <= 0)
+            return;
+        const uint32_t block_size = ao_rays.GetBlockSize();
+        ParallelFor(0, ao_rays.GetBlockCount(), std::max<uint32_t>(1, 4096 / std::max(block_size, 1u)), [&](size_t begin, size_t end)
+        {
+            for (size_t b = begin; b < end; ++b)
+            {
+                AccumulateAoHits(ao_rays.GetBlock((uint32_t)b), occlusion_hits + b * block_size, 0,
+                    ao_rays.GetBlockRayCount((uint32_t)b) / rays_per_hit, rays_per_hit, accum.data());
+            }
+        });
+    }
+
+    // Buffers of one tile, reused for the tiles of a chunk
+    struct TileBuffers
+    {
+        std::vector<Ray>            primary_rays;
+        std::vector<Intersection>   primary_hits;
+        std::vector<uint32_t>       offsets;
+        std::vector<Ray>            ao_rays;
+        std::vector<int32_t>        occlusion_hits;
+        HitBatch                    batch;
+    };
+
+    static void RenderAoTile(const Intersector &intersector, const Scene &scene, const CameraFrame &frame,
+        int x0, int y0, int tile_w, int tile_h, int rays_per_hit, int frame_no, TraversalMode traversal,
+        ShadingMode mode, TileBuffers &tile, Rgba *accum)
+    {
+        const size_t pixel_count = (size_t)tile_w * tile_h;
+        tile.primary_rays.resize(pixel_count);
+        tile.primary_hits.resize(pixel_count);
+        tile.offsets.resize(pixel_count);
+        for (int y = 0; y < tile_h; ++y)
+        {
+            const size_t gid = (size_t)(y0 + y) * frame.w + x0;
+            for (int x = 0; x < tile_w; ++x)
+                MakeCameraRay(frame, gid + x, tile.primary_rays[(size_t)y * tile_w + x]);
+        }
+        intersector.QueryIntersection(tile.primary_rays.data(), pixel_count, tile.primary_hits.data(), nullptr, traversal);
+
+        const uint32_t ray_count = CountAoRays(tile.primary_hits.data(), pixel_count, rays_per_hit, tile.offsets.data());
+        tile.ao_rays.resize(ray_count);
+        tile.occlusion_hits.resize(ray_count);
+        // Row by row, the work items of a row are contiguous in the frame
+        for (int y = 0; y < tile_h; ++y)
+        {
+            const size_t first = (size_t)y * tile_w;
+            ShadeAoHits(scene, tile.primary_rays.data(), tile.primary_hits.data(),
+                [&](size_t i) { return tile.offsets[i]; }, first, first + tile_w,
+                (size_t)(y0 + y) * frame.w + x0 - first, rays_per_hit, frame_no, tile.ao_rays.data(), mode, tile.batch);
+        }
+        intersector.QueryOcclusion(tile.ao_rays.data(), ray_count, tile.occlusion_hits.data(), nullptr, traversal);
+
+        // Tiles own their pixels, no two threads add to the same one
+        AccumulateAoHits(tile.ao_rays.data(), tile.occlusion_hits.data(), 0, ray_count / rays_per_hit, rays_per_hit,
+            accum);
+    }
+
+    void RenderAoTiles(const Intersector &intersector, const Scene &scene, const Camera &camera, int w, int h,
+        int rays_per_hit, int frame_no, AccumBuffer &accum, int tile_size, TraversalMode traversal, ShadingMode mode)
+    {
+        if (rays_per_hit <= 0 || tile_size <= 0)
+            return;
+
+        const CameraFrame frame = MakeCameraFrame(camera, w, h);
+        const int tiles_x = (w + tile_size - 1) / tile_size;
+        const int tiles_y = (h + tile_size - 1) / tile_size;
+        ParallelFor(0, (size_t)tiles_x * tiles_y, 1, [&](size_t begin, size_t end)
+        {
+            TileBuffers tile;
+            for (size_t t = begin; t < end; ++t)
+            {
+                const int x0 = (int)(t % tiles_x) * tile_size;
+                const int y0 = (int)(t / tiles_x) * tile_size;
+                RenderAoTile(intersector, scene, frame, x0, y0, std::min(tile_size, w - x0), std::min(tile_size, h - y0),
+                    rays_per_hit, frame_no, traversal, mode, tile, accum.data());
+            }
+        });
+    }
+
+    std::vector<Vec3> GetPointLights(int count)
+    {
+        std::vector<Vec3> lights;
+        for (int a = -count / 2; a <= count / 2; ++a)
+            lights.push_back(Vec3(a * 10.f, 800.f, 0.f));
+        return lights;
+    }
+
+    // Same as ShadePrimaryRays in shadows_point_light.cl
+    void GenerateShadowRays(const Scene &scene, const RayBuffer &primary_rays, const HitBuffer &hits,
+        const std::vector<Vec3> &lights, int frame_no, RayBuffer &shadow_rays)
+    {
+        BufferVector<uint32_t> offsets(hits.size(), shadow_rays.get_allocator());
+        uint32_t ray_count = 0;
+        for (size_t i = 0; i < hits.size(); ++i)
+        {
+            offsets[i] = ray_count;
+            if (hits[i].shapeid != kInvalidId)
+                ++ray_count;
+        }
+
+        shadow_rays.resize(ray_count);
+        ParallelFor(0, hits.size(), 4096, [&](size_t begin, size_t end)
+        {
+            for (size_t gid = begin; gid < end; ++gid)
+            {
+                const Intersection &hit = hits[gid];
+                if (hit.shapeid == kInvalidId)
+                    continue;
+
+                Vec3 pos, normal;
+                InterpolateHit(scene, hit, pos, normal);
+
+                uint32_t sampler = (uint32_t)gid + (uint32_t)frame_no;
+                float r1 = Sample1D(sampler);
+                size_t light_id = std::min((size_t)(r1 * lights.size()), lights.size() - 1);
+
+                Ray &ray = shadow_rays[offsets[gid]];
+                ray.o = pos + normal * 0.001f;
+                Vec3 to_light = lights[light_id] - ray.o;
+                ray.maxt = std::sqrt(Dot(to_light, to_light));
+                ray.d = Normalize(to_light);
+                ray.time = 0.f;
+                ray.extra[0] = -1;
+                ray.extra[1] = -1;
+                ray.padding[0] = primary_rays[gid].padding[0];
+                ray.padding[1] = 0;
+            }
+        });
+    }
+
+    // Appends a mesh in the 12 float vertex layout Scene::parseObj produces
+    static void AddMesh(Scene &scene, const std::string &name, const std::vector<float> &vertices, const std::vector<uint32_t> &indices)
+    {
+        scene.meshes_.push_back(Mesh());
+        Mesh &mesh = scene.meshes_.back();
+        mesh.name_ = name;
+        mesh.vertices_ = vertices;
+        mesh.vertex_stride_ = 12 * sizeof(float);
+        mesh.indices_ = indices;
+        mesh.index_stride_ = sizeof(uint32_t);
+    }
+
+    // Scatters tessellated spheres over a ground plane
+    void BuildProceduralScene(Scene &scene, uint32_t object_count, uint32_t seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> uniform(0.f, 1.f);
+
+        // Ground grid
+        {
+            const int kGridSize = 64;
+            const float kExtent = 200.f;
+            std::vector<float> vertices;
+            std::vector<uint32_t> indices;
+            for (int z = 0; z <= kGridSize; ++z)
+            {
+                for (int x = 0; x <= kGridSize; ++x)
+                {
+                    float vertex[12] = {
+                        kExtent * ((float)x / kGridSize - 0.5f), 0.f, kExtent * ((float)z / kGridSize - 0.5f),
+                        0.f, 1.f, 0.f,
+                        (float)x / kGridSize, (float)z / kGridSize, 0.f,
+                        0.8f, 0.8f, 0.8f };
+                    vertices.insert(vertices.end(), vertex, vertex + 12);
+                }
+            }
+            for (int z = 0; z < kGridSize; ++z)
+            {
+                for (int x = 0; x < kGridSize; ++x)
+                {
+                    uint32_t i0 = z * (kGridSize + 1) + x;
+                    uint32_t i1 = i0 + 1;
+                    uint32_t i2 = i0 + kGridSize + 1;
+                    uint32_t i3 = i2 + 1;
+                    indices.insert(indices.end(), { i0, i2, i1, i1, i2, i3 });
+                }
+            }
+            AddMesh(scene, "ground", vertices, indices);
+        }
+
+        // Spheres
+        const int kRings = 24;
+        const int kSegments = 48;
+        for (uint32_t object = 0; object < object_count; ++object)
+        {
+            float radius = 2.f + 8.f * uniform(rng);
+            Vec3 center(200.f * (uniform(rng) - 0.5f), radius + 20.f * uniform(rng), 200.f * (uniform(rng) - 0.5f));
+            Vec3 color(uniform(rng), uniform(rng), uniform(rng));
+
+            std::vector<float> vertices;
+            std::vector<uint32_t> indices;
+            for (int ring = 0; ring <= kRings; ++ring)
+            {
+                float theta = kPi * ring / kRings;
+                for (int segment = 0; segment <= kSegments; ++segment)
+                {
+                    float phi = 2.f * kPi * segment / kSegments;
+                    Vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+                    Vec3 p = center + n * radius;
+                    float vertex[12] = {
+                        p.x, p.y, p.z,
+                        n.x, n.y, n.z,
+                        (float)segment / kSegments, (float)ring / kRings, 0.f,
+                        color.x, color.y, color.z };
+                    vertices.insert(vertices.end(), vertex, vertex + 12);
+                }
+            }
+            for (int ring = 0; ring < kRings; ++ring)
+            {
+                for (int segment = 0; segment < kSegments; ++segment)
+                {
+                    uint32_t i0 = ring * (kSegments + 1) + segment;
+                    uint32_t i1 = i0 + 1;
+                    uint32_t i2 = i0 + kSegments + 1;
+                    uint32_t i3 = i2 + 1;
+                    indices.insert(indices.end(), { i0, i1, i2, i1, i3, i2 });
+                }
+            }
+            AddMesh(scene, "sphere" + std::to_string(object), vertices, indices);
+        }
+    }
+
+    SceneAnimator::SceneAnimator(const Scene &scene, float ripple, float sway)
+        : ripple_(ripple)
+        , sway_(sway)
+    {
+        Aabb bounds;
+        for (auto &mesh : scene.meshes_)
+        {
+            rest_vertices_.push_back(mesh.vertices_);
+            uint32_t stride = mesh.vertex_stride_ / sizeof(float);
+            for (size_t a = 0; a + 2 < mesh.vertices_.size(); a += stride)
+                bounds.Grow(Vec3(mesh.vertices_[a], mesh.vertices_[a + 1], mesh.vertices_[a + 2]));
+        }
+        diagonal_ = bounds.IsEmpty() ? 0.f : std::sqrt(Dot(bounds.Extent(), bounds.Extent()));
+    }
+
+    void SceneAnimator::Apply(Scene &scene, float time) const
+    {
+        const float ripple = ripple_ * diagonal_;
+        const float wavelength = 0.05f * diagonal_;
+        for (size_t m = 0; m < scene.meshes_.size(); ++m)
+        {
+            Mesh &mesh = scene.meshes_[m];
+            const std::vector<float> &rest = rest_vertices_[m];
+            const uint32_t stride = mesh.vertex_stride_ / sizeof(float);
+            const float sway = sway_ * diagonal_ * std::sin(time + (float)m);
+
+            ParallelFor(0, rest.size() / stride, 16384, [&](size_t begin, size_t end)
+            {
+                for (size_t v = begin; v < end; ++v)
+                {
+                    const float *src = &rest[v * stride];
+                    float *dst = &mesh.vertices_[v * stride];
+                    float phase = 2.f * kPi * (src[0] + src[2]) / wavelength + 4.f * time;
+                    float offset = ripple * std::sin(phase);
+                    dst[0] = src[0] + src[3] * offset + sway;
+                    dst[1] = src[1] + src[4] * offset;
+                    dst[2] = src[2] + src[5] * offset;
+                }
+            });
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cpu_math.h"
+#include "cpu_buffer.h"
+#include "cpu_intersector.h"
+#include "cpu_ray_queue.h"
+#include "scene.h"
+
+// Host-side versions of the sample kernels that produce ray workloads, used
+// by the CPU benchmarks and tools to replay what the samples trace.
+namespace Cpu
+{
+    // Ray and hit arrays of a frame, see BufferAllocator
+    typedef BufferVector<Ray>          RayBuffer;
+    typedef BufferVector<Intersection> HitBuffer;
+
+    // Same layout as the float4 output buffer of the AmbientOcclusion sample
+    struct Rgba
+    {
+        float r, g, b, a;
+    };
+
+    // Per pixel sums over frames, see AccumulateAo
+    typedef BufferVector<Rgba> AccumBuffer;
+
+    struct Camera
+    {
+        Vec3    eye;
+        Vec3    center;
+        Vec3    up;
+        // Vertical field of view in degrees
+        float   fovy = 60.f;
+    };
+
+    // Camera used by the samples for Sponza
+    Camera GetSponzaCamera();
+
+    // Same as the GenerateCameraRays kernel, pixel id goes to padding[0]
+    void GenerateCameraRays(const Camera &camera, int w, int h, RayBuffer &rays);
+
+    // How GenerateAoRays shades hits
+    enum class ShadingMode
+    {
+        // One hit at a time, as a work item of the kernel does
+        kScalar,
+        // Hits gathered into SoA batches and shaded kSimdWidth at a time. Same
+        // rays as kScalar but for sin and cos, which differ by an ulp or two.
+        kSimd
+    };
+
+    const char *GetShadingModeName(ShadingMode mode);
+    bool ParseShadingMode(const char *name, ShadingMode &mode);
+
+    // Same as ShadePrimaryRays in ambient_occlusion.cl: cosine weighted
+    // hemisphere rays over the hit points, frame_no seeds the sampler
+    void GenerateAoRays(const Scene &scene, const RayBuffer &primary_rays, const HitBuffer &hits,
+        int rays_per_hit, int frame_no, RayBuffer &ao_rays, ShadingMode mode = ShadingMode::kSimd);
+
+    // Same rays through a RayQueue: every chunk of hits appends to blocks of
+    // block_size rays it reserves, where the other overload has a serial pass
+    // over all hits to find output slots. Rays of a hit stay adjacent, the
+    // order of the hits differs from run to run.
+    void GenerateAoRays(const Scene &scene, const RayBuffer &primary_rays, const HitBuffer &hits,
+        int rays_per_hit, int frame_no, RayQueue &ao_rays, uint32_t block_size = kRayQueueBlockSize,
+        ShadingMode mode = ShadingMode::kSimd);
+
+    // Occlusion of the rays of every block, hits has GetBlockSize() entries
+    // per block, those past the rays of a block are left as they are
+    void QueryOcclusion(const Intersector &intersector, const RayQueue &rays, int32_t *hits,
+        TraversalMode mode = TraversalMode::kSingleRay);
+
+    // Same as ProcessAO in ambient_occlusion.cl with a white color buffer:
+    // unoccluded rays add (1, 1, 1, 1) to their pixel, occluded ones add
+    // (0, 0, 0, 1). The rays of a hit are adjacent as GenerateAoRays writes
+    // them, so every pixel is summed by one thread without atomics.
+    // accum must hold one entry per pixel.
+    void AccumulateAo(const RayBuffer &ao_rays, const int32_t *occlusion_hits, int rays_per_hit, AccumBuffer &accum);
+    // Same for rays from a RayQueue, with occlusion_hits as QueryOcclusion
+    // above fills it
+    void AccumulateAo(const RayQueue &ao_rays, const int32_t *occlusion_hits, int rays_per_hit, AccumBuffer &accum);
+
+    // An AO frame a tile at a time: camera rays, primary hits, AO rays,
+    // occlusion and accumulation of a tile_size x tile_size tile all run on
+    // one worker, in buffers small enough to stay in its cache, instead of
+    // each stage streaming the whole frame through memory. Tiles are handed
+    // out dynamically by the pool. accum gets the same sums as
+    // GenerateCameraRays, QueryIntersection, GenerateAoRays, QueryOcclusion
+    // and AccumulateAo over the frame, bit for bit.
+    void RenderAoTiles(const Intersector &intersector, const Scene &scene, const Camera &camera, int w, int h,
+        int rays_per_hit, int frame_no, AccumBuffer &accum, int tile_size = 32,
+        TraversalMode traversal = TraversalMode::kSingleRay, ShadingMode mode = ShadingMode::kSimd);
+
+    // Same as PrepareLights in the ShadowsPointLight sample
+    std::vector<Vec3> GetPointLights(int count);
+
+    // Same as ShadePrimaryRays in shadows_point_light.cl: one ray per hit
+    // towards a light the sampler picks, maxt is the distance to the light
+    void GenerateShadowRays(const Scene &scene, const RayBuffer &primary_rays, const HitBuffer &hits,
+        const std::vector<Vec3> &lights, int frame_no, RayBuffer &shadow_rays);
+
+    // Scatters tessellated spheres over a ground plane, for scenes other than Sponza
+    void BuildProceduralScene(Scene &scene, uint32_t object_count, uint32_t seed);
+
+    // Camera looking at the scene BuildProceduralScene generates
+    Camera GetProceduralCamera();
+
+    // Deforms the scene in place with fixed topology, like skinning or cloth
+    // would: vertices ripple along their normals and every mesh sways sideways.
+    // Amplitudes are fractions of the scene diagonal.
+    class SceneAnimator
+    {
+    public:
+        SceneAnimator(const Scene &scene, float ripple, float sway);
+
+        void Apply(Scene &scene, float time) const;
+
+    private:
+        std::vector<std::vector<float>> rest_vertices_;
+        float                           diagonal_;
+        float                           ripple_;
+        float                           sway_;
+    };
+}
@@ -21,6 +21,7 @@ THE SOFTWARE.
 ********************************************************************/
 
 #include "scene.h"
+#include "cpu_parallel.h"
 
 #include <tiny_obj_loader.h>
 
@@ -94,73 +95,79 @@ bool Scene::parseObj(const char *filename)
     if (!result)
         return false;
 
-    // Create the scene data
-    for (auto &shape : shapes)
+    // Create the scene data, shapes are independent and built in parallel
+    const size_t first_mesh = meshes_.size();
+    meshes_.resize(first_mesh + shapes.size());
+    Cpu::ParallelFor(0, shapes.size(), 1, [&](size_t shape_begin, size_t shape_end)
     {
-        // Gather the vertices
-        ObjKey objKey;
-        std::vector<float> vertices;
-        std::vector<uint32_t> indices;
-        std::map<ObjKey, uint32_t> objMap;
-
-        uint32_t i = 0, material_id = 0;
-        for (auto face = shape.mesh.num_face_vertices.begin(); face != shape.mesh.num_face_vertices.end(); i += *face, ++material_id, ++face)
+        for (size_t s = shape_begin; s < shape_end; ++s)
         {
-            // We only support triangle primitives
-            if (*face != 3)
-                continue;
+            const shape_t &shape = shapes[s];
 
-            // Load the material information
-            auto material_idx = (!shape.mesh.material_ids.empty() ? shape.mesh.material_ids[material_id] : 0xffffffffu);
-            auto material = (material_idx != 0xffffffffu ? &materials[material_idx] : nullptr);
+            // Gather the vertices
+            ObjKey objKey;
+            std::vector<float> vertices;
+            std::vector<uint32_t> indices;
+            std::map<ObjKey, uint32_t> objMap;
 
-            for (auto v = 0u; v < 3u; ++v)
+            uint32_t i = 0, material_id = 0;
+            for (auto face = shape.mesh.num_face_vertices.begin(); face != shape.mesh.num_face_vertices.end(); i += *face, ++material_id, ++face)
             {
-                // Construct the lookup key
-                objKey.position_index_  = shape.mesh.indices[i + v].vertex_index;
-                objKey.normal_index_    = shape.mesh.indices[i + v].normal_index;
-                objKey.texcoords_index_ = shape.mesh.indices[i + v].texcoord_index;
-
-                // Look up the vertex map
-                uint32_t index;
-                auto it = objMap.find(objKey);
-                if (it != objMap.end())
-                    index = (*it).second;
-                else
+                // We only support triangle primitives
+                if (*face != 3)
+                    continue;
+
+                // Load the material information
+                auto material_idx = (!shape.mesh.material_ids.empty() ? shape.mesh.material_ids[material_id] : 0xffffffffu);
+                auto material = (material_idx != 0xffffffffu ? &materials[material_idx] : nullptr);
+
+                for (auto v = 0u; v < 3u; ++v)
                 {
-                    // Push the vertex into memory
-                    ObjVertex vertex = {};
-                    for (auto p = 0u; p < 3u; ++p)
-                        vertex[p] = attrib.vertices[3 * objKey.position_index_ + p];
-                    if (objKey.normal_index_ != 0xffffffffu)
-                        for (auto n = 0u; n < 3u; ++n)
-                            vertex[n + 3] = attrib.normals[3 * objKey.normal_index_ + n];
-                    if (objKey.texcoords_index_ != 0xffffffffu)
-                        for (auto t = 0u; t < 2u; ++t)
-                            vertex[t + 6] = attrib.texcoords[2 * objKey.texcoords_index_ + t];
-                    if (material != nullptr)
-                        for (auto c = 0u; c < 3u; ++c)
-                            vertex[c + 9] = material->diffuse[c];
-                    for (auto value : vertex)
-                        vertices.push_back(value);
-                    index = static_cast<uint32_t>(vertices.size() / (sizeof(vertex) / sizeof(*vertex))) - 1;
-                    objMap[objKey] = index;
+                    // Construct the lookup key
+                    objKey.position_index_  = shape.mesh.indices[i + v].vertex_index;
+                    objKey.normal_index_    = shape.mesh.indices[i + v].normal_index;
+                    objKey.texcoords_index_ = shape.mesh.indices[i + v].texcoord_index;
+
+                    // Look up the vertex map
+                    uint32_t index;
+                    auto it = objMap.find(objKey);
+                    if (it != objMap.end())
+                        index = (*it).second;
+                    else
+                    {
+                        // Push the vertex into memory
+                        ObjVertex vertex = {};
+                        for (auto p = 0u; p < 3u; ++p)
+                            vertex[p] = attrib.vertices[3 * objKey.position_index_ + p];
+                        if (objKey.normal_index_ != 0xffffffffu)
+                            for (auto n = 0u; n < 3u; ++n)
+                                vertex[n + 3] = attrib.normals[3 * objKey.normal_index_ + n];
+                        if (objKey.texcoords_index_ != 0xffffffffu)
+                            for (auto t = 0u; t < 2u; ++t)
+                                vertex[t + 6] = attrib.texcoords[2 * objKey.texcoords_index_ + t];
+                        if (material != nullptr)
+                            for (auto c = 0u; c < 3u; ++c)
+                                vertex[c + 9] = material->diffuse[c];
+                        for (auto value : vertex)
+                            vertices.push_back(value);
+                        index = static_cast<uint32_t>(vertices.size() / (sizeof(vertex) / sizeof(*vertex))) - 1;
+                        objMap[objKey] = index;
+                    }
+
+                    // Push the index into memory
+                    indices.push_back(index);
                 }
-
-                // Push the index into memory
-                indices.push_back(index);
             }
-        }
 
-        // Create the mesh object
-        meshes_.push_back(Mesh());
-        Mesh &mesh = meshes_.back();
-        mesh.name_ = shape.name;
-        std::swap(mesh.vertices_, vertices);
-        mesh.vertex_stride_ = sizeof(ObjVertex);
-        std::swap(mesh.indices_, indices);
-        mesh.index_stride_ = sizeof(uint32_t);
-    }
+            // Create the mesh object
+            Mesh &mesh = meshes_[first_mesh + s];
+            mesh.name_ = shape.name;
+            std::swap(mesh.vertices_, vertices);
+            mesh.vertex_stride_ = sizeof(ObjVertex);
+            std::swap(mesh.indices_, indices);
+            mesh.index_stride_ = sizeof(uint32_t);
+        }
+    });
 
     return true;
 }
@@ -23,6 +23,8 @@ THE SOFTWARE.
 #pragma once
 
 #include <stdint.h>
+#include <cstring>
+#include <string>
 #include <vector>
 
 // Forward declarations
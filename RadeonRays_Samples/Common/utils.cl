@@ -62,6 +62,17 @@ int2 make_int2(int x, int y)
 }
 #endif
 
+/// Same as (float4)(v, w), spelled as a call so the kernels also build as C++
+float4 make_float4_from_float3(float3 v, float w)
+{
+    float4 res;
+    res.x = v.x;
+    res.y = v.y;
+    res.z = v.z;
+    res.w = w;
+    return res;
+}
+
 matrix4x4 matrix_from_cols(float4 c0, float4 c1, float4 c2, float4 c3)
 {
     matrix4x4 m;
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "cpu_parallel.h"
 #include <assert.h>
 #include "CLWPlatform.h"
 #include "radeon_rays_cl.h"
@@ -88,29 +89,45 @@ void BuildSceneBuffers(CLWContext context, const Scene& scene, CLWBuffer<::Shape
     std::vector<Vertex> vertices_array;
     std::vector<uint32_t> indices_array;
 
-    int id = 0;
-    for (auto mesh : scene.meshes_)
+    // Offsets first, then the vertices of every mesh are converted in parallel
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+    for (auto &mesh : scene.meshes_)
     {
         ::Shape shape;
-        shape.base_vertex = (uint32_t)(vertices_array.size());
-        shape.first_index = (uint32_t)(indices_array.size());
+        shape.base_vertex = (uint32_t)vertex_count;
+        shape.first_index = (uint32_t)index_count;
         shape.light_id = -1;
         shape.index_count = (uint32_t)mesh.indices_.size();
         shapes_array.push_back(shape);
 
-        indices_array.insert(indices_array.end(), mesh.indices_.begin(), mesh.indices_.end());
+        vertex_count += mesh.vertices_.size() / (mesh.vertex_stride_ / 4);
+        index_count += mesh.indices_.size();
+    }
+    vertices_array.resize(vertex_count);
+    indices_array.resize(index_count);
+
+    for (size_t m = 0; m < scene.meshes_.size(); ++m)
+    {
+        const Mesh &mesh = scene.meshes_[m];
+        const size_t stride = mesh.vertex_stride_ / 4;
+        std::copy(mesh.indices_.begin(), mesh.indices_.end(), indices_array.begin() + shapes_array[m].first_index);
 
-        for (size_t a = 0; a < mesh.vertices_.size(); a+=mesh.vertex_stride_/4)
+        Vertex *dst = vertices_array.data() + shapes_array[m].base_vertex;
+        Cpu::ParallelFor(0, mesh.vertices_.size() / stride, 16384, [&](size_t begin, size_t end)
         {
-            float *data = mesh.vertices_.data() + a;
-            Vertex v;
-            v.position = float3(data[0], data[1], data[2]);
-            v.normal = float3(data[3], data[4], data[5]);
-            v.tex_coords = float2(data[6], data[7]);
-            v.color = float3(data[9], data[10], data[11]);
-
-            vertices_array.push_back(v);
-        }
+            for (size_t a = begin; a < end; ++a)
+            {
+                const float *data = mesh.vertices_.data() + a * stride;
+                Vertex v;
+                v.position = float3(data[0], data[1], data[2]);
+                v.normal = float3(data[3], data[4], data[5]);
+                v.tex_coords = float2(data[6], data[7]);
+                v.color = float3(data[9], data[10], data[11]);
+
+                dst[a] = v;
+            }
+        });
     }
 
     shapes = context.CreateBuffer<::Shape>(shapes_array.size(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, shapes_array.data());
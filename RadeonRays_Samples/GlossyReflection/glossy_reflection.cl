@@ -40,19 +40,19 @@ void GenerateCameraRays(
     // Get hold of the pixel
     const int gid = get_global_id(0);
 
-    float2 pixelPos = (float2)(gid % output_width, gid / output_width);
+    float2 pixelPos = make_float2(gid % output_width, gid / output_width);
 
     // Convert to world space position
     float2 ndc = 2.0f * (pixelPos + 0.5f) * camera_params->screen_dims.zw - 1.0f;
 
-    float4 homogeneous = matrix_mul_vector4(camera_params->view_proj_inv, (float4)(ndc * (float2)(1.0f, -1.0f), 0.0f, 1.0f));
+    float4 homogeneous = matrix_mul_vector4(camera_params->view_proj_inv, make_float4(ndc.x, -ndc.y, 0.0f, 1.0f));
     homogeneous.xyz /= homogeneous.w; // projection divide
 
 
                                       // Create the camera ray
     Ray ray;
 
-    ray.d = (float4)(normalize(homogeneous.xyz - camera_params->eye.xyz), 0.0f);
+    ray.d = make_float4_from_float3(normalize(homogeneous.xyz - camera_params->eye.xyz), 0.0f);
     ray.o = camera_params->eye;
     ray.o.w = 100000.f;
     ray.extra.x = 0xffffffff;
@@ -90,7 +90,7 @@ void ShadePrimaryRays(
         // Miss
         if (hit.shapeid == INVALID_IDX)
         {
-            output[pixel_id] = (float4)(0.0f, 0.0f, 0.0f, 1.0f);
+            output[pixel_id] = make_float4(0.0f, 0.0f, 0.0f, 1.0f);
             return;
         }
 
@@ -104,7 +104,7 @@ void ShadePrimaryRays(
         float3 normal = (1.0f - hit.uvwt.x - hit.uvwt.y) * v0.normal + hit.uvwt.x * v1.normal + hit.uvwt.y * v2.normal;
 
         // Write color to output buffer
-        color_buffer[pixel_id] = (float4)(color, 1.0f);
+        color_buffer[pixel_id] = make_float4_from_float3(color, 1.0f);
 
         Sampler sampler;
         Sampler_Init(&sampler, gid + frame_no);
@@ -119,14 +119,14 @@ void ShadePrimaryRays(
         bxdf = MicrofacetGGX_Sample(ROUGHNESS, color, wi, sample, normal, &wo, &pdf);
 
         Ray shadow_ray;
-        shadow_ray.o = (float4)(pos + normal * 0.001f, 100000.f);
-        shadow_ray.d = normalize((float4)(wo, 0.f));
+        shadow_ray.o = make_float4_from_float3(pos + normal * 0.001f, 100000.f);
+        shadow_ray.d = normalize(make_float4_from_float3(wo, 0.f));
         shadow_ray.extra.x = 0xffffffff;
         shadow_ray.extra.y = 0xffffffff;
         shadow_ray.padding.x = pixel_id;
         output_rays[gid] = shadow_ray;
 
-        color_buffer[pixel_id] = (float4)(bxdf / pdf, 1.0f);
+        color_buffer[pixel_id] = make_float4_from_float3(bxdf / pdf, 1.0f);
     }
 }
 
@@ -157,7 +157,7 @@ void ShadeIndirectRays(
         // Miss
         if (hit.shapeid == INVALID_IDX)
         {
-            output[pixel_id] = (float4)(0.0f, 0.0f, 0.0f, 1.0f);
+            output[pixel_id] = make_float4(0.0f, 0.0f, 0.0f, 1.0f);
             return;
         }
 
@@ -183,7 +183,7 @@ void ShadeIndirectRays(
 
         bxdf = MicrofacetGGX_Sample(ROUGHNESS, color, wi, sample, normal, &wo, &pdf);
 
-        color_buffer[pixel_id] *= (float4)(bxdf / pdf, 2.0f);
+        color_buffer[pixel_id] *= make_float4_from_float3(bxdf / pdf, 2.0f);
 
     }
 }
@@ -212,7 +212,7 @@ void ProcessShadowRays(
         /*}
         else
         {
-            output[pixel_id] += (float4)(0.0f, 0.0f, 0.0f, 1.0f);
+            output[pixel_id] += make_float4(0.0f, 0.0f, 0.0f, 1.0f);
             return;
         }*/
     }
@@ -5,6 +5,7 @@
 #include "math/matrix.h"
 #include "math/mathutils.h"
 #include "utils.h"
+#include "backend.h"
 #include "tiny_obj_loader.h"
 #include "scene.h"
 #include "radeon_rays_cl.h"
@@ -80,21 +81,31 @@ int main(int argc, char* argv[])
         std::cerr << "Usage: " << argv[0] << " <light count>"<< std::endl;
         return -1;
     }*/
+    BackendOptions backend_options;
+    backend_options.platform_index = 1;
+    bool valid_args = true;
+    for (int a = 1; a < argc && valid_args; ++a)
+        valid_args = ParseBackendOption(argc, argv, a, backend_options);
+    if (!valid_args)
+    {
+        std::cerr << "Usage: " << argv[0] << " " << GetBackendUsage() << std::endl;
+        return -1;
+    }
 
-    CLWContext context = InitCLW(1, 0);
-    IntersectionApi* intersection_api = InitIntersectorApi(context);
+    CLWContext context = InitCLW(backend_options.platform_index, backend_options.device_index);
 
     Scene scene;
     scene.loadFile("../../Resources/Sponza/sponza.obj");
     //scene.loadFile("../../Resources/orig.obj");
 
-    UploadSceneToIntersector(scene, intersection_api);
     CLWBuffer<::Shape> shapes_buffer;
     CLWBuffer<Vertex> vertex_buffer;
     CLWBuffer<uint32_t> index_buffer;
     BuildSceneBuffers(context, scene, shapes_buffer, vertex_buffer, index_buffer);
 
-    intersection_api->Commit();
+    std::unique_ptr<RayTracer> tracer = CreateRayTracer(backend_options, context, scene);
+    if (!tracer)
+        return -1;
 
     int light_count = 1;// atoi(argv[1]);
     int w = 1920;
@@ -136,10 +147,6 @@ int main(int argc, char* argv[])
     //Clear output buffer
     context.FillBuffer<float4>(0, output_buffer, float4(), output_buffer.GetElementCount());
     
-    Buffer *ray_buffer = CreateFromOpenClBuffer(intersection_api, primary_rays_buffer);
-    Buffer *isect_buffer = CreateFromOpenClBuffer(intersection_api, primary_intersection_buffer);
-    Buffer *shadow_ray_buffer = CreateFromOpenClBuffer(intersection_api, shadow_rays_buffer);
-    Buffer *shadow_isect_buffer = CreateFromOpenClBuffer(intersection_api, shadow_intersection_buffer);
 
 
 
@@ -154,7 +161,7 @@ int main(int argc, char* argv[])
         //Gen camera rays
         GenCameraRays(context, program, camera_params_buffer, primary_rays_buffer, w, h);
         //Run intersector
-        intersection_api->QueryIntersection(ray_buffer, initial_rays_count, isect_buffer, nullptr, nullptr);
+        tracer->QueryIntersection(primary_rays_buffer, initial_rays_count, primary_intersection_buffer);
         {
             //Shade and generate new rays
             CLWKernel kernel = program.GetKernel("ShadePrimaryRays");
@@ -180,7 +187,7 @@ int main(int argc, char* argv[])
         //Trace shadow rays
         uint32_t shadow_rays_count = primary_rays_buffer.GetElementCount();
         //context.ReadBuffer<uint32_t>(0, shadow_rays_counter, &shadow_rays_count, 1).Wait();
-        intersection_api->QueryIntersection(shadow_ray_buffer, shadow_rays_count, shadow_isect_buffer, nullptr, nullptr);
+        tracer->QueryIntersection(shadow_rays_buffer, shadow_rays_count, shadow_intersection_buffer);
 
         {
             //Shade and generate new rays
@@ -103,7 +103,7 @@ float3 MicrofacetGGX_Evaluate(
 
     float denom = (4.f * costhetao * costhetai);
 
-    return denom > DENOM_EPS ? color * MicrofacetDistribution_GGX_G(roughness, wi, wo, wh) * MicrofacetDistribution_GGX_D(roughness, wh) / denom : 0.f;
+    return denom > DENOM_EPS ? color * MicrofacetDistribution_GGX_G(roughness, wi, wo, wh) * MicrofacetDistribution_GGX_D(roughness, wh) / denom : make_float3(0.f, 0.f, 0.f);
 }
 
 
@@ -25,7 +25,7 @@ float3 IdealReflect_Sample(
     float coswo = fabs(dot(*wo, normal));
 
     // Return reflectance value
-    return coswo > DENOM_EPS ? (color * (1.f / coswo)) : 0.f;
+    return coswo > DENOM_EPS ? (color * (1.f / coswo)) : make_float3(0.f, 0.f, 0.f);
 }
 
 
@@ -37,19 +37,19 @@ void GenerateCameraRays(
     // Get hold of the pixel
     const int gid = get_global_id(0);
 
-    float2 pixelPos = (float2)(gid % output_width, gid / output_width);
+    float2 pixelPos = make_float2(gid % output_width, gid / output_width);
 
     // Convert to world space position
     float2 ndc = 2.0f * (pixelPos + 0.5f) * camera_params->screen_dims.zw - 1.0f;
 
-    float4 homogeneous = matrix_mul_vector4(camera_params->view_proj_inv, (float4)(ndc * (float2)(1.0f, -1.0f), 0.0f, 1.0f));
+    float4 homogeneous = matrix_mul_vector4(camera_params->view_proj_inv, make_float4(ndc.x, -ndc.y, 0.0f, 1.0f));
     homogeneous.xyz /= homogeneous.w; // projection divide
 
 
                                       // Create the camera ray
     Ray ray;
 
-    ray.d = (float4)(normalize(homogeneous.xyz - camera_params->eye.xyz), 0.0f);
+    ray.d = make_float4_from_float3(normalize(homogeneous.xyz - camera_params->eye.xyz), 0.0f);
     ray.o = camera_params->eye;
     ray.o.w = 100000.f;
     ray.extra.x = 0xffffffff;
@@ -88,7 +88,7 @@ void ShadePrimaryRays(
         // Miss
         if (hit.shapeid == INVALID_IDX)
         {
-            output[pixel_id] = (float4)(0.0f, 0.0f, 0.0f, 1.0f);
+            output[pixel_id] = make_float4(0.0f, 0.0f, 0.0f, 1.0f);
             return;
         }
 
@@ -123,8 +123,8 @@ void ShadePrimaryRays(
             float3 ray_direction = target_point - ray_origin;
 
             Ray shadow_ray;
-            shadow_ray.o = (float4)(ray_origin, 100000.f);
-            shadow_ray.d = normalize((float4)(ray_direction, 0.f));
+            shadow_ray.o = make_float4_from_float3(ray_origin, 100000.f);
+            shadow_ray.d = normalize(make_float4_from_float3(ray_direction, 0.f));
             shadow_ray.extra.x = 0xffffffff;
             shadow_ray.extra.y = 0xffffffff;
             shadow_ray.padding.x = pixel_id;
@@ -136,7 +136,7 @@ void ShadePrimaryRays(
             float ndotv = dot(light_vertex.normal, v);
 
             float light_pdf = 0.0f;
-            float3 light_intencity = (float3)(0.0f);
+            float3 light_intencity = make_float3(0.0f, 0.0f, 0.0f);
             if (ndotv > 0.f)
             {
                 float dist2 = dot(ray_direction, ray_direction);
@@ -149,38 +149,43 @@ void ShadePrimaryRays(
 
             float3 radiance = light_intencity * ndotwo * color / light_pdf;
 
-            color_buffer[ray_idx + a] = (float4)(radiance, 1.0f);
+            color_buffer[ray_idx + a] = make_float4_from_float3(radiance, 1.0f);
         }
     }
 }
 
+// One work item per hit: ShadePrimaryRays writes the rays of a hit as one
+// run of rays_per_frame_per_light rays, the work item sums the run in order
+// and adds it to the pixel once. No two work items touch the same pixel, so
+// the float atomics are gone and the sums are the same from run to run.
 KERNEL
 void ProcessShadowRays(
     GLOBAL Ray* restrict input_rays,
     GLOBAL Intersection const* restrict isects,
     int intersection_count,
+    int rays_per_frame_per_light,
     GLOBAL float4* restrict color_buffer,
-    volatile GLOBAL float4* restrict output
+    GLOBAL float4* restrict output
 )
 {
-    // Get hold of the pixel
+    // Get hold of the run
     const int gid = get_global_id(0);
-    const int pixel_id = input_rays[gid].padding.x;
+    const int first = gid * rays_per_frame_per_light;
 
-    const Intersection hit = isects[gid];
-    if (gid < intersection_count)
+    if (first < intersection_count)
     {
-        // Miss
-        if (hit.shapeid == input_rays[gid].padding.y)
-        {
-            atomic_add_float4(output + pixel_id, color_buffer[gid]);
-            return;
-        }
-        else
+        const int pixel_id = input_rays[first].padding.x;
+
+        // Rays reaching the light add their radiance, the others (0, 0, 0, 1)
+        float4 sum = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+        for (int a = first; a < first + rays_per_frame_per_light; ++a)
         {
-            atomic_add_float4(output + pixel_id, (float4)(0.0f, 0.0f, 0.0f, 1.0f));
-            return;
+            if (isects[a].shapeid == input_rays[a].padding.y)
+                sum += color_buffer[a];
+            else
+                sum += make_float4(0.0f, 0.0f, 0.0f, 1.0f);
         }
+        output[pixel_id] += sum;
     }
 }
 
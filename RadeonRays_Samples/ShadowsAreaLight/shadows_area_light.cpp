@@ -5,6 +5,7 @@
 #include "math/matrix.h"
 #include "math/mathutils.h"
 #include "utils.h"
+#include "backend.h"
 #include "tiny_obj_loader.h"
 #include "scene.h"
 #include "radeon_rays_cl.h"
@@ -14,6 +15,7 @@
 #include "OpenImageIO/imageio.h"
 
 #include <chrono>
+#include <vector>
 
 using namespace RadeonRays;
 using namespace tinyobj;
@@ -42,6 +44,25 @@ void GenCameraRays(CLWContext context, CLWProgram program, CLWBuffer<Params> cam
     context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, genkernel);
 }
 
+// Buffers of one frame in flight. The host queues the next frames up to
+// their shading before it waits for the shadow ray count of the oldest one,
+// so the device always has work queued behind that read. Only the opencl
+// backend gains from this, see RayTracer::IsQueued; host tracers wait for
+// that queued work before they trace, so they run one frame at a time.
+struct FrameSlot
+{
+    CLWBuffer<ray>          primary_rays;
+    CLWBuffer<Intersection> primary_hits;
+    CLWBuffer<ray>          shadow_rays;
+    CLWBuffer<Intersection> shadow_hits;
+    CLWBuffer<uint32_t>     shadow_rays_counter;
+    CLWBuffer<float4>       color;
+    uint32_t                shadow_rays_count;
+    // Read of shadow_rays_counter into shadow_rays_count, queued after
+    // ShadePrimaryRays
+    CLWEvent                count_read;
+};
+
 void SaveImage(const std::string &fname, float *data, int w, int h)
 {
     OIIO_NAMESPACE_USING;
@@ -98,31 +119,41 @@ std::vector<Light> PrepareLights(int count, Scene &scene)
 
 int main(int argc, char* argv[])
 {
-    if (argc != 5)
-    {
-        std::cerr << "Usage: " << argv[0] << " -lc <light count> -rc <ray count per frame per light>"<< std::endl;
-        return -1;
-    }
-
     int light_count = 1;
     int rays_per_frame_per_light = 1;
-    for (int a = 1; a < 5; ++a)
+    // -inflight sets how many frames are queued at once, see FrameSlot.
+    // Each one has its own ray and hit buffers, so it is off by default.
+    int frames_in_flight = 1;
+    BackendOptions backend_options;
+    bool valid_args = true;
+    for (int a = 1; a < argc && valid_args; ++a)
     {
-        if (strcmp(argv[a], "-lc") == 0)
+        if (strcmp(argv[a], "-lc") == 0 && a + 1 < argc)
         {
             light_count = atoi(argv[++a]);
             continue;
         }
-        if (strcmp(argv[a], "-rc") == 0)
+        if (strcmp(argv[a], "-rc") == 0 && a + 1 < argc)
         {
             rays_per_frame_per_light = atoi(argv[++a]);
             continue;
         }
+        if (strcmp(argv[a], "-inflight") == 0 && a + 1 < argc)
+        {
+            frames_in_flight = atoi(argv[++a]);
+            continue;
+        }
+        valid_args = ParseBackendOption(argc, argv, a, backend_options);
+    }
+    if (!valid_args || rays_per_frame_per_light < 1 || frames_in_flight < 1 || frames_in_flight > 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " -lc <light count> -rc <ray count per frame per light> [-inflight 1|2|3] "
+            << GetBackendUsage() << std::endl;
+        return -1;
     }
 
 
-    CLWContext context = InitCLW(0, 0);
-    IntersectionApi* intersection_api = InitIntersectorApi(context);
+    CLWContext context = InitCLW(backend_options.platform_index, backend_options.device_index);
 
     Scene scene;
     scene.loadFile("../../Resources/Sponza/sponza.obj");
@@ -130,13 +161,20 @@ int main(int argc, char* argv[])
 
     std::vector<Light> lights = PrepareLights(light_count, scene);
 
-    UploadSceneToIntersector(scene, intersection_api);
     CLWBuffer<::Shape> shapes_buffer;
     CLWBuffer<Vertex> vertex_buffer;
     CLWBuffer<uint32_t> index_buffer;
     BuildSceneBuffers(context, scene, shapes_buffer, vertex_buffer, index_buffer);
 
-    intersection_api->Commit();
+    std::unique_ptr<RayTracer> tracer = CreateRayTracer(backend_options, context, scene);
+    if (!tracer)
+        return -1;
+    if (frames_in_flight > 1 && !tracer->IsQueued())
+    {
+        std::cout << "-inflight needs the opencl backend, " << GetBackendName(backend_options.backend)
+            << " runs one frame at a time" << std::endl;
+        frames_in_flight = 1;
+    }
 
     int w = 1920;
     int h = 1080;
@@ -157,82 +195,98 @@ int main(int argc, char* argv[])
     std::string options("-cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I .");
     CLWProgram program = CLWProgram::CreateFromFile("shadows_area_light.cl", options.c_str(), context);
 
-    CLWBuffer<ray> primary_rays_buffer = context.CreateBuffer<ray>(initial_rays_count, CL_MEM_READ_WRITE);
-    CLWBuffer<Intersection> primary_intersection_buffer = context.CreateBuffer<Intersection>(initial_rays_count, CL_MEM_READ_WRITE);
+    std::vector<FrameSlot> slots(frames_in_flight);
+    for (FrameSlot &slot : slots)
+    {
+        slot.primary_rays = context.CreateBuffer<ray>(initial_rays_count, CL_MEM_READ_WRITE);
+        slot.primary_hits = context.CreateBuffer<Intersection>(initial_rays_count, CL_MEM_READ_WRITE);
+        slot.shadow_rays = context.CreateBuffer<ray>(shadow_rays_per_frame, CL_MEM_READ_WRITE);
+        slot.shadow_hits = context.CreateBuffer<Intersection>(shadow_rays_per_frame, CL_MEM_READ_WRITE);
+        slot.shadow_rays_counter = context.CreateBuffer<uint32_t>(1, CL_MEM_READ_WRITE);
+        slot.color = context.CreateBuffer<float4>(w * h * rays_per_frame_per_light, CL_MEM_READ_WRITE);
+        slot.shadow_rays_count = 0;
+    }
 
     CLWBuffer<float4> output_buffer = context.CreateBuffer<float4>(w*h, CL_MEM_READ_WRITE);
     
     CLWBuffer<Params> camera_params_buffer = context.CreateBuffer<Params>(1, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &camera_params);
 
-    CLWBuffer<float4> color_buffer = context.CreateBuffer<float4>(w * h * rays_per_frame_per_light, CL_MEM_READ_WRITE);
-
     CLWBuffer<Light> lights_buffer = context.CreateBuffer<Light>(light_count, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, lights.data());
 
-    CLWBuffer<uint32_t> shadow_rays_counter = context.CreateBuffer<uint32_t>(1, CL_MEM_READ_WRITE);
-    CLWBuffer<ray> shadow_rays_buffer = context.CreateBuffer<ray>(shadow_rays_per_frame, CL_MEM_READ_WRITE);
-    CLWBuffer<Intersection> shadow_intersection_buffer = context.CreateBuffer<Intersection>(shadow_rays_per_frame, CL_MEM_READ_WRITE);
-
     //Clear output buffer
     context.FillBuffer<float4>(0, output_buffer, float4(), output_buffer.GetElementCount());
     
-    Buffer *ray_buffer = CreateFromOpenClBuffer(intersection_api, primary_rays_buffer);
-    Buffer *isect_buffer = CreateFromOpenClBuffer(intersection_api, primary_intersection_buffer);
-    Buffer *shadow_ray_buffer = CreateFromOpenClBuffer(intersection_api, shadow_rays_buffer);
-    Buffer *shadow_isect_buffer = CreateFromOpenClBuffer(intersection_api, shadow_intersection_buffer);
     
     int frame_count = 100;
 
     std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
     start = std::chrono::high_resolution_clock::now();
 
-    for (int a = 0; a < frame_count; ++a)
+    // Iteration a queues frame a up to its shading and then traces and
+    // accumulates frame a - frames_in_flight + 1
+    for (int a = 0; a < frame_count + frames_in_flight - 1; ++a)
     {
-        context.FillBuffer<uint32_t>(0, shadow_rays_counter, 0, 1);
-
-        //Gen camera rays
-        GenCameraRays(context, program, camera_params_buffer, primary_rays_buffer, w, h);
-        //Run intersector
-        intersection_api->QueryIntersection(ray_buffer, initial_rays_count, isect_buffer, nullptr, nullptr);
+        if (a < frame_count)
         {
-            //Shade and generate new rays
-            CLWKernel kernel = program.GetKernel("ShadePrimaryRays");
-            int argid = 0;
-            kernel.SetArg(argid++, shapes_buffer);
-            kernel.SetArg(argid++, vertex_buffer);
-            kernel.SetArg(argid++, index_buffer);
-            kernel.SetArg(argid++, shadow_rays_buffer);
-            kernel.SetArg(argid++, primary_rays_buffer);
-            kernel.SetArg(argid++, primary_intersection_buffer);
-            kernel.SetArg(argid++, (cl_int)primary_intersection_buffer.GetElementCount());
-            kernel.SetArg(argid++, output_buffer);
-            kernel.SetArg(argid++, color_buffer);
-            kernel.SetArg(argid++, light_count);
-            kernel.SetArg(argid++, lights_buffer);
-            kernel.SetArg(argid++, shadow_rays_counter);
-            kernel.SetArg(argid++, rays_per_frame_per_light);
-            kernel.SetArg(argid++, a);
-
-            int globalsize = primary_rays_buffer.GetElementCount();
-            context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+            FrameSlot &slot = slots[a % frames_in_flight];
+            context.FillBuffer<uint32_t>(0, slot.shadow_rays_counter, 0, 1);
+
+            //Gen camera rays
+            GenCameraRays(context, program, camera_params_buffer, slot.primary_rays, w, h);
+            //Run intersector
+            tracer->QueryIntersection(slot.primary_rays, initial_rays_count, slot.primary_hits);
+            {
+                //Shade and generate new rays
+                CLWKernel kernel = program.GetKernel("ShadePrimaryRays");
+                int argid = 0;
+                kernel.SetArg(argid++, shapes_buffer);
+                kernel.SetArg(argid++, vertex_buffer);
+                kernel.SetArg(argid++, index_buffer);
+                kernel.SetArg(argid++, slot.shadow_rays);
+                kernel.SetArg(argid++, slot.primary_rays);
+                kernel.SetArg(argid++, slot.primary_hits);
+                kernel.SetArg(argid++, (cl_int)slot.primary_hits.GetElementCount());
+                kernel.SetArg(argid++, output_buffer);
+                kernel.SetArg(argid++, slot.color);
+                kernel.SetArg(argid++, light_count);
+                kernel.SetArg(argid++, lights_buffer);
+                kernel.SetArg(argid++, slot.shadow_rays_counter);
+                kernel.SetArg(argid++, rays_per_frame_per_light);
+                kernel.SetArg(argid++, a);
+
+                int globalsize = slot.primary_rays.GetElementCount();
+                context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+            }
+
+            // Waited for once the frame is traced
+            slot.count_read = context.ReadBuffer<uint32_t>(0, slot.shadow_rays_counter, &slot.shadow_rays_count, 1);
         }
 
-        //Trace shadow rays
-        uint32_t shadow_rays_count;
-        context.ReadBuffer<uint32_t>(0, shadow_rays_counter, &shadow_rays_count, 1).Wait();
-        intersection_api->QueryIntersection(shadow_ray_buffer, shadow_rays_count, shadow_isect_buffer, nullptr, nullptr);
-
-        //Process shadow rays
+        const int traced = a - (frames_in_flight - 1);
+        if (traced >= 0)
         {
-            CLWKernel kernel = program.GetKernel("ProcessShadowRays");
-            int argid = 0;
-            kernel.SetArg(argid++, shadow_rays_buffer);
-            kernel.SetArg(argid++, shadow_intersection_buffer);
-            kernel.SetArg(argid++, shadow_rays_count);
-            kernel.SetArg(argid++, color_buffer);
-            kernel.SetArg(argid++, output_buffer);
-
-            int globalsize = shadow_rays_count;
-            context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+            FrameSlot &slot = slots[traced % frames_in_flight];
+
+            //Trace shadow rays
+            slot.count_read.Wait();
+            uint32_t shadow_rays_count = slot.shadow_rays_count;
+            tracer->QueryIntersection(slot.shadow_rays, shadow_rays_count, slot.shadow_hits);
+
+            //Process shadow rays
+            {
+                CLWKernel kernel = program.GetKernel("ProcessShadowRays");
+                int argid = 0;
+                kernel.SetArg(argid++, slot.shadow_rays);
+                kernel.SetArg(argid++, slot.shadow_hits);
+                kernel.SetArg(argid++, shadow_rays_count);
+                kernel.SetArg(argid++, rays_per_frame_per_light);
+                kernel.SetArg(argid++, slot.color);
+                kernel.SetArg(argid++, output_buffer);
+
+                // A work item per hit
+                int globalsize = shadow_rays_count / rays_per_frame_per_light;
+                context.Launch1D(0, ((globalsize + 63) / 64) * 64, 64, kernel);
+            }
         }
     }
 